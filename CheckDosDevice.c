@@ -17,10 +17,110 @@
  *   CheckDosDevice IHD101
  *   CheckDosDevice IMG0
  *   CheckDosDevice DISKIMAGE5
+ *   CheckDosDevice IHD101 FIELDS=name
+ *   CheckDosDevice 101 FIELDS=name,unit,status,volume
+ *
+ * FIELDS limits the work to what the requested fields need. Fields name,
+ * unit, driver and handler come straight from the DOS list; status, volume
+ * and space additionally ask the handler for its disk info, bounded by
+ * TIMEOUT=<n> like a scan.
+ * The device driver is only opened when a unit number lookup misses, to
+ * tell "not mounted" (ERROR) from "driver missing" (FAIL).
+ *
+ * PATTERN=IHD* checks every matching device. PRI=<n> runs the whole
+ * command at task priority n and yields a tick between probes;
+ * MAXINFLIGHT=<n> limits how many ACTION_DISK_INFO packets are
+ * outstanding at once (default 1), so background health checks do not
+ * disturb foreground work.
+ *
+ * METRICS=<file> writes the scan results (devices per driver and state,
+ * free space, probe latency histogram, timeouts) as Prometheus style
+ * text for a collector. Without PATTERN every device is scanned.
+ *
+ * Every run keeps the last 64 phase changes and device probes, with
+ * E clock timestamps, in a fixed ring. TRACE=<file> writes it on exit.
+ * While a handler is asked for its disk info, by a scan or for a single
+ * device, Ctrl-D prints it, and TIMEOUT=<n> abandons handlers that have
+ * not replied n seconds after their packet went out and prints it.
+ *
+ * PREWARM starts the handlers of the devices selected by DEVICE,
+ * PATTERN and DRIVER (all devices if none is given) and sends each an
+ * ACTION_DISK_INFO packet without waiting, so their disk validation
+ * overlaps. It reports each device's time to ready. MAXINFLIGHT limits
+ * how many run at once (default: all).
+ *
+ * CACHE shows the buffer count each running handler uses now
+ * (ACTION_MORE_CACHE 0) next to the mounted de_NumBuffers.
+ * REBALANCE=<KB> shares that much cache between the handlers matching
+ * PATTERN, in proportion to WEIGHTS=DH0=3,... or to partition size.
+ *
+ * FSBENCH writes and reads back a temporary file in the root of DEVICE
+ * for each of RECSIZES, and times creating and deleting empty files, to
+ * show what applications get through the handler. The files are always
+ * deleted again.
+ *
+ * SURFACE reads the whole partition of DEVICE, LowCyl to HighCyl,
+ * straight from the driver with several reads of up to MaxTransfer
+ * outstanding. It lists unreadable blocks and reports throughput and a
+ * CRC-32 of the contents, to check a copied HDF or medium without
+ * copying it to NIL:. DUMP=<file> does the same and writes the
+ * partition to an image file, each write overlapping the reads still
+ * queued; SPARSE skips over zero blocks instead of writing them.
+ *
+ * ALIGN checks that each partition (DEVICE, PATTERN or all) starts on a
+ * 4 KiB boundary and uses 4 KiB file system blocks, reads the RDB of
+ * each unit when there is one, and prints an aligned geometry in
+ * mountlist form for partitions that are not.
+ *
+ * CAPS lists which of NSD, TD64, NSD 64 bit, HD_SCSICMD and
+ * TD_GETGEOMETRY each driver unit in the DOS list supports. Results are
+ * cached in ENV: per driver, unit and driver version; GetDriverCaps()
+ * gives other modes the same answer without probing again.
+ *
+ * Whether a unit exists, has a disk in and which unit is free are asked
+ * through a probe backend chosen by driver name. trackdisk.device,
+ * scsi.device, diskimage.device and uaehf.device answer the disk
+ * question with TD_CHANGESTATE and the DOS list instead of a handler
+ * packet; other drivers ask the handler. BENCH times each backend.
+ *
+ * IDENTIFY sends SCSI INQUIRY and READ CAPACITY to every unit with
+ * HD_SCSICMD at once and lists vendor, product, revision and size next
+ * to the DOS devices on each unit. Fixed drives are cached in ENV:.
+ *
+ * PROBEUNITS=FROM-TO opens every unit of DRIVER in the range, asks each
+ * one that opens whether a disk is in, and lists them next to the DOS
+ * devices using them, so a unit nobody mounted shows up as well as one
+ * that is mounted but gone.
+ *
+ * Started from Workbench as the default tool of a disk image icon, it
+ * mounts the image on the first free unit of DRIVER from FROM up by
+ * running MOUNTER (MountHDF), taking ACTION, DRIVER, FROM and MOUNTER
+ * from the tooltypes of the tool and project icons.
+ *
+ * CONFIGURED lists the mount files in DEVS:DOSDrivers and
+ * SYS:Storage/DOSDrivers as mounted or mountable, plus live devices no
+ * mount file describes. The parsed files are cached in ENV: until either
+ * directory changes. DRIVER=<name> limits the list to one driver.
+ *
+ * SNAPSHOT=<file> writes the whole device, volume and assign list with
+ * environment vectors, handler names and probe results to a versioned
+ * binary file. host/simdos.c loads it into a simulated DOS list so the
+ * lookup modes can be measured offline against real configurations.
  *
  * Compile with SAS/C:
  *   sc link startup=cres smalldata smallcode nostackcheck CheckDosDevice.c
  *
+ * CPU specific builds (68000 with dispatcher, 68020+, 68060):
+ *   smake all                           (SAS/C)
+ *   make -f Makefile.gcc all            (m68k-amigaos-gcc)
+ *
+ * The 68000 build runs CheckDosDevice.060 or CheckDosDevice.020 from
+ * its own directory when AttnFlags show a matching CPU. BENCH=<n> times
+ * the lookup modes and probe backends so the variants can be compared.
+ *
+ * Debug build (reports per-run pool allocations on exit):
+ *   sc link startup=cres smalldata smallcode nostackcheck def=DEBUG CheckDosDevice.c
+ *
  * Set Pure and Hold bits:
  *   protect CheckDosDevice RWEDPH
  *
@@ -34,12 +134,25 @@
 #include <exec/types.h>
 #include <exec/memory.h>
 #include <exec/io.h>
+#include <exec/execbase.h>
+#include <devices/timer.h>
+#include <devices/hardblocks.h>
+#include <devices/trackdisk.h>
+#include <devices/newstyle.h>
+#include <devices/scsidisk.h>
 #include <dos/dos.h>
 #include <dos/dosextens.h>
 #include <dos/filehandler.h>
 #include <dos/rdargs.h>
+#include <dos/dostags.h>
+#include <intuition/intuition.h>
+#include <workbench/startup.h>
+#include <workbench/workbench.h>
 #include <proto/exec.h>
 #include <proto/dos.h>
+#include <proto/timer.h>
+#include <proto/icon.h>
+#include <proto/intuition.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,8 +164,23 @@ const char * const version =
   "$VER: CheckDosDevice 1.2 (29.06.2025) "
   "Brielle Harrison";
 
+/* CPU variant this binary was built for (see smakefile and Makefile.gcc) */
+#ifndef CPU_VARIANT
+#if defined(__mc68060__) || defined(_M68060)
+#define CPU_VARIANT 60
+#elif defined(__mc68020__) || defined(_M68020)
+#define CPU_VARIANT 20
+#else
+#define CPU_VARIANT 0
+#endif
+#endif
+
 /* Template for ReadArgs */
-#define TEMPLATE "DEVICE/A,QUIET/S,DRIVER/K,INFO/S,MOUNTLIST/S"
+#define TEMPLATE "DEVICE,QUIET/S,DRIVER/K,INFO/S,MOUNTLIST/S,FIELDS/K,SNAPSHOT/K," \
+  "PATTERN/K,PRI/N,MAXINFLIGHT/N,BENCH/N,TRACE/K,TIMEOUT/N,METRICS/K," \
+  "CONFIGURED/S,PREWARM/S,CACHE/S,REBALANCE/K/N,WEIGHTS/K,FSBENCH/S," \
+  "FSSIZE/K/N,RECSIZES/K,ALIGN/S,CAPS/S,IDENTIFY/S,PROBEUNITS/K," \
+  "SURFACE/S,DUMP/K,SPARSE/S"
 
 /* Magic value to determine if thread local context is ours */
 #define CONTEXT_MAGIC 0x434B4456 /* 'CKDV' */
@@ -63,10 +191,205 @@ const char * const version =
 #define RC_ERROR      10   /* Device doesn't exist */
 #define RC_FAIL       20   /* Driver not available */
 
+/* Field bits for FIELDS=name,unit,driver,status,volume,space,handler */
+#define FIELD_NAME     (1L << 0)
+#define FIELD_UNIT     (1L << 1)
+#define FIELD_DRIVER   (1L << 2)
+#define FIELD_STATUS   (1L << 3)
+#define FIELD_VOLUME   (1L << 4)
+#define FIELD_SPACE    (1L << 5)
+#define FIELD_HANDLER  (1L << 6)
+
+/* Operations a field plan may require */
+#define OP_LISTWALK    (1L << 0)   /* Find the node in the DOS list */
+#define OP_STARTUP     (1L << 1)   /* Read the FileSysStartupMsg */
+#define OP_HANDLER     (1L << 2)   /* Read dn_Handler */
+#define OP_LOCK        (1L << 3)   /* Ask the handler for its disk info */
+#define OP_MEDIA       (1L << 4)   /* Ask the driver's probe backend */
+
+/* Public device list snapshot shared between invocations */
+#define SNAPSHOT_SEMAPHORE    "CheckDosDevice.snapshot"
+#define SNAPSHOT_VERSION      2
+#define SNAPSHOT_MAX_ENTRIES  128
+#define SNAPSHOT_NAME_SIZE    32     /* Longer names: no snapshot, walk */
+#define SNAPSHOT_MAX_AGE      (2 * TICKS_PER_SECOND)
+#define SNAPSHOT_READ_RETRIES 4
+
+/* SNAPSHOT=<file> capture format, all values big endian */
+#define CAPTURE_MAGIC         0x43444453 /* 'CDDS' */
+#define CAPTURE_VERSION       1
+#define CAPTURE_HEADER_SIZE   24
+#define CAPTURE_RECORD_MAX    1280
+#define CAPTURE_ENVEC_LONGS   (DE_BOOTBLOCKS + 1)
+
+/* Record flags */
+#define CAPF_STARTUP          0x01   /* Driver, unit, flags and envec follow */
+#define CAPF_PROBED           0x02   /* Lock/Info results follow */
+
+/* Mount file index cached in ENV: */
+#define DOSDRIVERS_ACTIVE     "DEVS:DOSDrivers"
+#define DOSDRIVERS_STORAGE    "SYS:Storage/DOSDrivers"
+#define CONFIG_CACHE_FILE     "ENV:CheckDosDevice.dosdrivers"
+#define CONFIG_CACHE_MAGIC    0x4344444D /* 'CDDM' */
+#define CONFIG_CACHE_VERSION  1
+#define CONFIG_MAX_ENTRIES    SNAPSHOT_MAX_ENTRIES
+#define CONFIG_FILE_MAX       4096   /* Mount files are read whole */
+
+/* Where a mount file was found */
+#define CONF_ACTIVE           0      /* DEVS:DOSDrivers, mounted at boot */
+#define CONF_STORAGE          1      /* SYS:Storage/DOSDrivers */
+
+/* Smallest buffer count REBALANCE leaves a handler with */
+#define CACHE_MIN_BUFFERS     5
+
+/* File system benchmark */
+#define FSBENCH_FILE          "CheckDosDevice.fsbench" /* .<task> added */
+#define FSBENCH_DEFAULT_KB    1024
+#define FSBENCH_MAX_KB        65536
+#define FSBENCH_DEFAULT_SIZES "512,4096,32768"
+#define FSBENCH_MAX_SIZES     8
+#define FSBENCH_MAX_RECORD    262144
+#define FSBENCH_FILES         32     /* Files created for the create rate */
+
+/* Partition alignment */
+#define ALIGN_BYTES           4096   /* Host page and flash write unit */
+#define ALIGN_CYL_BYTES       65536  /* Cylinder size proposed by ALIGN */
+#define RDB_BLOCK_SIZE        512    /* When TD_GETGEOMETRY gives none */
+#define RDB_MAX_BLOCK_SIZE    32768
+
+/* Driver capabilities cached in ENV: */
+#define CAPS_CACHE_FILE       "ENV:CheckDosDevice.caps"
+#define CAPS_CACHE_MAGIC      0x43444443 /* 'CDDC' */
+#define CAPS_CACHE_VERSION    1
+#define CAPS_MAX_ENTRIES      32
+#define CAPS_SENSE_SIZE       18
+
+/* Capability bits */
+#define CAPS_NSD              (1L << 0)   /* NSCMD_DEVICEQUERY answered */
+#define CAPS_TD64             (1L << 1)   /* TD_READ64 */
+#define CAPS_NSD64            (1L << 2)   /* NSCMD_TD_READ64 */
+#define CAPS_SCSI             (1L << 3)   /* HD_SCSICMD */
+#define CAPS_GEOMETRY         (1L << 4)   /* TD_GETGEOMETRY */
+#define CAPS_CHANGE           (1L << 5)   /* TD_CHANGESTATE */
+
+/* SCSI identity cached in ENV: */
+#define IDENTIFY_CACHE_FILE   "ENV:CheckDosDevice.identity"
+#define IDENTIFY_CACHE_MAGIC  0x43444449 /* 'CDDI' */
+#define IDENTIFY_CACHE_VERSION 1
+#define IDENTIFY_MAX_ENTRIES  32
+#define SCSI_INQUIRY          0x12
+#define SCSI_INQUIRY_LENGTH   36
+#define SCSI_READ_CAPACITY    0x25
+#define SCSI_CAPACITY_MAX     0xFFFFFFFF /* Last block: drive is larger */
+
+/* Surface scan */
+#define SURFACE_REQUESTS      4      /* Reads kept outstanding */
+#define SURFACE_CHUNK_MAX     131072 /* Largest read, if MaxTransfer allows */
+#define SURFACE_MAX_LISTED    32     /* Unreadable blocks listed by number */
+#define DUMP_SPARSE_LIMIT     0x7FFFFFFF /* Seek() offsets are signed */
+
+/* PROBEUNITS */
+#define PROBEUNITS_MAX        256    /* Units one run opens at most */
+#define UNIT_MEDIA_NONE       0      /* Unit did not open */
+#define UNIT_MEDIA_EMPTY      1
+#define UNIT_MEDIA_PRESENT    2
+#define UNIT_MEDIA_UNKNOWN    3      /* TD_CHANGESTATE failed */
+#define UNIT_MEDIA_TIMEOUT    4
+
+/* Workbench launch defaults, overridden by tooltypes */
+#define WB_DEFAULT_FROM       100
+#define WB_DEFAULT_MOUNTER    "MountHDF"
+#define WB_MOUNTER_SIZE       128
+#define WB_PATH_SIZE          256
+#define WB_MOUNTER_STACK      8192   /* Stack RunCommand() gives MOUNTER */
+
+/* CPU variant lookups that found nothing, remembered in ENV: */
+#define VARIANT_MISS_FILE     "ENV:CheckDosDevice.novariant"
+#define VARIANT_MISS_MAGIC    0x43444456 /* 'CDDV' */
+#define VARIANT_MISS_VERSION  1
+
+/* Probe backends */
+#define PROBE_QUERIES         3      /* exists, media, free unit */
+#define PROBE_MAX_UNITS       256    /* Units a free unit search tries */
+#define SCSI_MAX_TARGET       7      /* Highest target and LUN digit */
+
+/* Trace ring buffer */
+#define TRACE_ENTRIES         64
+#define TRACE_NAME_SIZE       12
+
+/* Trace events */
+#define TRACE_ENTER           1   /* Phase entered */
+#define TRACE_EXIT            2   /* Phase left, status = result */
+#define TRACE_PROBE           3   /* Device probe started */
+#define TRACE_REPLY           4   /* Device probe answered, status = result */
+#define TRACE_TIMEOUT         5   /* Device probe abandoned */
+
+/* Trace phases */
+#define PHASE_NONE            0
+#define PHASE_ARGS            1
+#define PHASE_DRIVER          2
+#define PHASE_LOOKUP          3
+#define PHASE_STATUS          4
+#define PHASE_FIELDS          5
+#define PHASE_SCAN            6
+#define PHASE_SNAPSHOT        7
+#define PHASE_BENCH           8
+#define PHASE_CACHE           9
+#define PHASE_COUNT           10
+
+/* Scan result for a probe abandoned by TIMEOUT or Ctrl-C */
+#define STATUS_TIMEOUT        2
+/* Scan result for a device whose handler could not be started */
+#define STATUS_NOHANDLER      3
+/* Status when the run's InfoData could not be allocated */
+#define STATUS_NOMEMORY       (-2)
+
+/* Metrics export */
+#define METRICS_MAX_DRIVERS   16
+#define METRICS_BUCKETS       6
+#define METRICS_STATES        4   /* mounted, empty, timeout, absent */
+#define AMIGA_EPOCH_OFFSET    252460800 /* 1978-01-01 - 1970-01-01, seconds */
+
+/* Per-run memory pool sizing (CreatePool puddle size and threshold) */
+#define POOL_PUDDLE_SIZE   4096
+#define POOL_THRESH_SIZE   1024
+
+/**
+ * One trace ring entry
+ */
+typedef struct TraceRecord {
+  struct EClockVal time;
+  UBYTE event;                  /* TRACE_* */
+  UBYTE phase;                  /* PHASE_* */
+  BYTE status;
+  UBYTE pad;
+  char name[TRACE_NAME_SIZE];   /* Device, truncated */
+} TraceRecord;
+
 typedef struct Context {
   ULONG magic;
   BOOL quiet;
+  BOOL allocated;               /* Context itself came from AllocVec */
   APTR oldContext;
+  APTR pool;                    /* All per-run allocations come from here */
+  struct InfoData *infoData;    /* Shared, longword aligned InfoData */
+  struct DeviceSnapshot *snapshot; /* Device list view for this run */
+  struct MsgPort *timerPort;    /* timer.device, opened on demand */
+  struct timerequest *timerReq;
+  struct Device *timerBase;     /* For ReadEClock() */
+  ULONG eclockFreq;             /* E clock ticks per second */
+  struct MsgPort *timeoutPort;  /* UNIT_VBLANK request for scan timeouts */
+  struct timerequest *timeoutReq;
+  ULONG probeTimeout;           /* TIMEOUT= for single device probes */
+  TraceRecord *trace;           /* Ring of TRACE_ENTRIES, allocated once */
+  ULONG traceCount;             /* Events recorded so far */
+  char *traceFile;              /* TRACE=<file>, copied into the pool */
+  BOOL priSet;                  /* oldPri must be restored on exit */
+  BYTE oldPri;                  /* Task priority before PRI */
+#ifdef DEBUG
+  ULONG allocCount;             /* Number of RunAlloc() calls */
+  ULONG allocBytes;             /* Bytes requested through RunAlloc() */
+#endif
 } Context;
 
 /**
@@ -78,24 +401,492 @@ struct Arguments {
   STRPTR driver;    /* Device driver name (default: diskimage.device) */
   LONG info;        /* Show device information */
   LONG mountlist;   /* Generate mountlist entry */
+  STRPTR fields;    /* Comma separated list of fields to report */
+  STRPTR snapshot;  /* Capture the DOS list to this file */
+  STRPTR pattern;   /* Scan all devices matching this pattern */
+  LONG *pri;        /* Task priority while running */
+  LONG *maxInFlight; /* Handler packets outstanding during a scan */
+  LONG *bench;      /* Lookup benchmark iterations */
+  STRPTR trace;     /* Write the trace ring to this file on exit */
+  LONG *timeout;    /* Seconds a scan waits for a handler reply */
+  STRPTR metrics;   /* Write scan metrics to this file */
+  LONG configured;  /* List DOSDrivers mount files with live status */
+  LONG prewarm;     /* Start dormant handlers concurrently */
+  LONG cache;       /* Report handler buffer counts */
+  LONG *rebalance;  /* Redistribute this many KB of buffers */
+  STRPTR weights;   /* REBALANCE weights, e.g. DH0=3,DH1=1 */
+  LONG fsbench;     /* Benchmark the file system on DEVICE */
+  LONG *fsSize;     /* FSBENCH file size in KB */
+  STRPTR recSizes;  /* FSBENCH record sizes, e.g. 512,4096 */
+  LONG align;       /* Check partition alignment */
+  LONG caps;        /* Report driver command capabilities */
+  LONG identify;    /* SCSI INQUIRY every unit */
+  STRPTR probeUnits; /* Open units FROM-TO of DRIVER */
+  LONG surface;     /* Read all of DEVICE's partition */
+  STRPTR dump;      /* Copy DEVICE's partition to this file */
+  LONG sparse;      /* DUMP leaves zero blocks as holes */
 };
 
+/**
+ * Facts gathered about a single DOS device for FIELDS output. Only the
+ * members covered by the executed plan are filled in.
+ */
+typedef struct DeviceFacts {
+  char name[108];         /* DOS device name without colon */
+  LONG unit;              /* fssm_Unit */
+  char driver[108];       /* fssm_Device */
+  char handler[108];      /* dn_Handler, empty if none */
+  int status;             /* 0 = volume, 1 = no disk, -1 = not found,
+                             STATUS_NOMEMORY */
+  char volume[64];        /* Volume name when mounted */
+  ULONG blocksTotal;      /* id_NumBlocks */
+  ULONG blocksUsed;       /* id_NumBlocksUsed */
+  ULONG bytesPerBlock;    /* id_BytesPerBlock */
+} DeviceFacts;
+
+/**
+ * One DOS list entry as captured in a device list snapshot
+ */
+typedef struct SnapshotEntry {
+  ULONG nameKey[SNAPSHOT_NAME_SIZE / 4]; /* Upper cased, zero padded name */
+  char name[SNAPSHOT_NAME_SIZE];      /* dn_Name */
+  char driver[SNAPSHOT_NAME_SIZE];    /* fssm_Device, devices only */
+  char handler[SNAPSHOT_NAME_SIZE];   /* dn_Handler, devices only */
+  LONG unit;                          /* fssm_Unit, -1 if none */
+  ULONG type;                         /* dn_Type */
+} SnapshotEntry;
+
+/**
+ * Copy of the DOS list names, identified by the list fingerprint
+ */
+typedef struct DeviceSnapshot {
+  ULONG fingerprint;                  /* See DosListFingerprint() */
+  struct DateStamp stamp;             /* When the list was captured */
+  ULONG count;
+  SnapshotEntry entries[SNAPSHOT_MAX_ENTRIES];
+} DeviceSnapshot;
+
+/**
+ * Public memory block holding the latest published snapshot
+ *
+ * Found by name with FindSemaphore(). Writers serialize on the semaphore
+ * and make the sequence odd while they update; readers never take the
+ * semaphore, they copy the data and retry if the sequence moved. The
+ * block is never freed once published.
+ */
+typedef struct SharedSnapshot {
+  struct SignalSemaphore semaphore;
+  char semaphoreName[sizeof(SNAPSHOT_SEMAPHORE)];
+  UWORD version;                      /* SNAPSHOT_VERSION */
+  ULONG size;                         /* sizeof(SharedSnapshot) */
+  volatile ULONG sequence;            /* Odd while a write is in progress */
+  DeviceSnapshot data;
+} SharedSnapshot;
+
+/**
+ * Everything SNAPSHOT=<file> records about one DOS list entry
+ */
+typedef struct CapturedEntry {
+  struct CapturedEntry *next;
+  ULONG type;                         /* dn_Type */
+  UBYTE flags;                        /* CAPF_* */
+  char name[108];
+  /* Devices */
+  char handler[108];
+  LONG stackSize;
+  LONG priority;
+  BOOL running;                       /* dn_Task set; not saved */
+  char driver[108];
+  LONG unit;
+  ULONG startupFlags;
+  UBYTE envecLongs;
+  ULONG envec[CAPTURE_ENVEC_LONGS];
+  BYTE status;                        /* ProbeMountedVolume() result */
+  LONG diskType;
+  ULONG numBlocks;
+  ULONG numBlocksUsed;
+  ULONG bytesPerBlock;
+  char volume[108];
+  /* Volumes */
+  struct DateStamp volumeDate;
+  /* Assigns */
+  char target[256];
+} CapturedEntry;
+
+/**
+ * One DOSDrivers mount file, as stored in the ENV: index
+ */
+typedef struct ConfiguredEntry {
+  char name[SNAPSHOT_NAME_SIZE];      /* DOS name, from the file name */
+  char driver[SNAPSHOT_NAME_SIZE];    /* Device = ..., "" if none */
+  LONG unit;                          /* Unit = ..., 0 if not given */
+  UBYTE source;                       /* CONF_* */
+  UBYTE pad[3];
+} ConfiguredEntry;
+
+/**
+ * One running handler's buffer cache, for CACHE and REBALANCE
+ */
+typedef struct CacheItem {
+  char name[108];
+  char handler[SNAPSHOT_NAME_SIZE];
+  ULONG blockSize;                    /* Bytes, from de_SizeBlock */
+  ULONG configured;                   /* de_NumBuffers at mount time */
+  ULONG sizeKB;                       /* Partition size from the geometry */
+  LONG current;                       /* ACTION_MORE_CACHE 0 */
+  ULONG weight;
+  LONG target;                        /* Buffers REBALANCE asks for */
+  LONG after;                         /* Buffers the handler reported */
+} CacheItem;
+
+/**
+ * Commands one driver unit supports, as stored in the ENV: cache
+ */
+typedef struct CapsEntry {
+  char driver[SNAPSHOT_NAME_SIZE];
+  LONG unit;
+  ULONG version;                      /* lib_Version << 16 | lib_Revision */
+  ULONG caps;                         /* CAPS_* */
+} CapsEntry;
+
+/**
+ * What one driver unit said about itself, as stored in the ENV: cache
+ */
+typedef struct IdentifyEntry {
+  char driver[SNAPSHOT_NAME_SIZE];
+  LONG unit;
+  ULONG version;                      /* Driver version, see CapsEntry */
+  char vendor[9];
+  char product[17];
+  char revision[5];
+  UBYTE type;                         /* SCSI peripheral device type */
+  BOOL valid;                         /* INQUIRY answered */
+  BOOL removable;
+  ULONG blocks;                       /* READ CAPACITY, 0 if unknown */
+  ULONG blockSize;
+} IdentifyEntry;
+
+/**
+ * One unit being identified, with both of its requests in flight
+ */
+typedef struct IdentifyItem {
+  IdentifyEntry entry;
+  ULONG flags;                        /* fssm_Flags */
+  struct IOStdReq *inquiryIO;
+  struct IOStdReq *capacityIO;
+  struct SCSICmd inquiryCmd;
+  struct SCSICmd capacityCmd;
+  UBYTE inquiryCdb[6];
+  UBYTE capacityCdb[10];
+  UBYTE inquiryData[SCSI_INQUIRY_LENGTH];
+  UBYTE capacityData[8];
+  UBYTE inquirySense[CAPS_SENSE_SIZE];
+  UBYTE capacitySense[CAPS_SENSE_SIZE];
+  BOOL opened;
+  BOOL cached;                        /* Answer taken from ENV: */
+  BOOL timedOut;
+  BOOL inquiryDone;                   /* Reply taken off the port */
+  BOOL capacityDone;
+  UBYTE pending;                      /* Requests not yet returned */
+} IdentifyItem;
+
+/**
+ * One read of a surface scan
+ */
+typedef struct SurfaceSlot {
+  struct IOStdReq *io;
+  UBYTE *buffer;                      /* AllocVec() of de_BufMemType */
+  ULONG block;                        /* First block, from start of disk */
+  ULONG blocks;
+  BOOL sent;                          /* Read is out */
+} SurfaceSlot;
+
+/**
+ * Image file written by DUMP
+ */
+typedef struct DumpFile {
+  BPTR file;
+  BOOL sparse;                        /* Zero blocks become holes */
+  ULONG blockBytes;
+  UBYTE *zeros;                       /* One block of zeros */
+  UBYTE *check;                       /* One block read back from a hole */
+  BOOL noHoles;                       /* A hole read back as non-zero */
+  ULONG position;                     /* Bytes so far, holes included */
+  ULONG hole;                         /* Zero bytes not written yet */
+  ULONG dataBlocks;                   /* Blocks written */
+  ULONG holeBlocks;                   /* Blocks left as holes */
+} DumpFile;
+
+/**
+ * One driver unit opened by PROBEUNITS
+ */
+typedef struct UnitProbeItem {
+  LONG unit;
+  struct IOStdReq *io;                /* TD_CHANGESTATE */
+  BYTE openError;                     /* OpenDevice() result */
+  UBYTE media;                        /* UNIT_MEDIA_* */
+  BOOL tried;                         /* OpenDevice() was called */
+  BOOL sent;                          /* TD_CHANGESTATE is out */
+  BOOL done;                          /* Reply taken off the port */
+} UnitProbeItem;
+
+/**
+ * Tooltypes of a Workbench launch
+ */
+typedef struct WorkbenchOptions {
+  char action[16];                    /* ACTION=MOUNT */
+  char driver[SNAPSHOT_NAME_SIZE];    /* DRIVER=diskimage.device */
+  LONG from;                          /* FROM=100, first unit to try */
+  char mounter[WB_MOUNTER_SIZE];      /* MOUNTER=MountHDF */
+} WorkbenchOptions;
+
+/**
+ * One MOUNTER run, handed to the process that loads and runs it
+ */
+typedef struct MountMessage {
+  struct Message message;
+  struct DosLibrary *dosBase;         /* The child has no globals */
+  char mounter[WB_MOUNTER_SIZE];
+  char args[WB_PATH_SIZE * 2 + 32];   /* Quoted path, ends in newline */
+  LONG argsLength;
+  LONG result;                        /* Return code, -1 if not loaded */
+  LONG error;                         /* IoErr() of the load or run */
+} MountMessage;
+
+/**
+ * How one driver answers the questions asked most: does a unit exist,
+ * is a disk in, which unit is free. Drivers without their own entry use
+ * the generic backend, which asks the DOS list and the handler.
+ */
+typedef struct ProbeBackend {
+  const char *driver;                 /* NULL for the generic backend */
+  BOOL (*exists)(const char *driverName, LONG unit, char *foundName,
+    int nameSize);
+  int (*media)(const char *cleanName, struct DeviceNode *deviceNode,
+    char *volumeName, int volumeNameSize);
+  LONG (*freeUnit)(const char *driverName, LONG from);
+} ProbeBackend;
+
+/**
+ * A CPU variant lookup that found nothing; the key describes the
+ * directory searched and the CPU
+ */
+typedef struct VariantMiss {
+  ULONG magic;
+  ULONG version;
+  ULONG key;
+} VariantMiss;
+
+/**
+ * Header of the ENV: index; the keys describe both directories
+ */
+typedef struct ConfiguredHeader {
+  ULONG magic;
+  ULONG version;
+  ULONG keys[2];                      /* DosDriversKey() of each directory */
+  ULONG count;
+} ConfiguredHeader;
+
+/**
+ * Options for PATTERN scans
+ */
+typedef struct ScanOptions {
+  ULONG maxInFlight;                  /* Outstanding handler packets */
+  BOOL yield;                         /* Delay(1) between probes */
+  ULONG timeout;                      /* Seconds without a reply, 0 = none */
+  const char *metricsFile;            /* METRICS=<file>, NULL = none */
+} ScanOptions;
+
+/**
+ * One device being probed by a PATTERN scan
+ */
+typedef struct ScanItem {
+  char name[108];
+  char driver[SNAPSHOT_NAME_SIZE];    /* fssm_Device, "" if none */
+  int status;                         /* 0 = volume, 1 = no disk, */
+                                      /* STATUS_*, -1 = n/a */
+  char volume[64];
+  ULONG freeKB;                       /* Valid when status is 0 */
+  ULONG totalKB;
+  BOOL dormant;                       /* Handler not started before the scan */
+  struct EClockVal sent;              /* When the probe started */
+  ULONG micros;                       /* Handler start and packet round trip */
+  struct StandardPacket *packet;      /* ACTION_DISK_INFO, AllocMem() */
+  struct InfoData *infoData;          /* Filled in by the handler */
+  struct InfoData info;               /* Copy of the reply */
+  struct DevProc *devProc;            /* Non-NULL while a packet is out */
+} ScanItem;
+
 /* Function prototypes */
 Context *GetContext(void);
+Context *InstallContext(Context *context);
 void FreeContext(void);
 int exitWith(int rc);
+APTR RunAlloc(ULONG size);
+void RunFree(APTR memory, ULONG size);
+struct InfoData *GetRunInfoData(void);
 
 void OPrintf(const char *format, ...);
 BOOL CheckDeviceDriver(const char *driverName);
 BOOL IsNumber(const char *str);
 BOOL FindDeviceByDriverAndUnit(const char *driverName, LONG unitNum, char *foundName, int nameSize);
+BOOL WalkDeviceByDriverAndUnit(const char *driverName, LONG unitNum, char *foundName, int nameSize);
 struct DeviceNode *FindDosDevice(const char *deviceName);
 void StripDeviceName(const char *deviceName, char *cleanName, int bufSize);
 int CheckDeviceStatus(const char *deviceName, char *volumeName, int volumeNameSize);
 void ShowDeviceInfo(const char *deviceName, struct DeviceNode *deviceNode);
 void GenerateMountlist(const char *deviceName, struct DeviceNode *deviceNode);
-void FindMatchingDevices(const char *pattern);
+int FindMatchingDevices(const char *pattern, ScanOptions *options);
+BOOL MatchDevicePattern(const char *pattern, const char *name);
+ScanItem *CollectScanItems(const char *pattern, ULONG *count);
+BOOL SendDiskInfo(ScanItem *item, struct MsgPort *replyPort);
+void FreeDiskInfo(ScanItem *item);
+void CompleteDiskInfo(ScanItem *item);
+BOOL WaitDiskInfo(ScanItem *items, ULONG count, struct MsgPort *replyPort, ScanOptions *options);
+void AbandonDiskInfo(ScanItem *items, ULONG count, struct MsgPort *replyPort);
+BOOL ProbeScanItems(ScanItem *items, ULONG count, ScanOptions *options);
+void PutMetricsLabel(BPTR file, const char *value);
+void MarkDormantItems(ScanItem *items, ULONG count);
+int PrewarmDevices(const char *pattern, const char *driverFilter, ScanOptions *options);
+LONG SendMoreCache(const char *deviceName, LONG delta);
+CacheItem *CollectCacheItems(const char *pattern, ULONG *count);
+ULONG FindCacheWeight(const char *weights, const char *name);
+int ManageCache(const char *pattern, ULONG budgetKB, const char *weights);
+ULONG TimeFileTransfer(const char *fileName, UBYTE *buffer, ULONG recordSize, ULONG totalBytes, BOOL writing);
+ULONG KBPerSecond(ULONG bytes, ULONG micros);
+int RunFsBenchmark(const char *cleanName, ULONG sizeKB, const char *recordSizes);
+BOOL ReadRigidDiskBlock(const char *driverName, LONG unit, ULONG flags, struct RigidDiskBlock *rdb);
+int AnalyzeAlignment(const char *pattern);
+BOOL FindDriverVersion(const char *driverName, ULONG *version);
+BOOL ProbeDriverCaps(CapsEntry *entry, ULONG flags);
+CapsEntry *LoadCapsCache(ULONG *count);
+void SaveCapsCache(CapsEntry *entries, ULONG count);
+CapsEntry *LookupDriverCaps(CapsEntry *entries, ULONG *count, const char *driverName, LONG unit, ULONG flags, BOOL *cached);
+ULONG GetDriverCaps(const char *driverName, LONG unit, ULONG flags);
+int ReportDriverCaps(const char *driverFilter);
+void SetupScsiCommand(struct IOStdReq *io, struct SCSICmd *scsi, UBYTE *cdb, UWORD cdbLength, UBYTE *data, ULONG dataLength, UBYTE *sense);
+BOOL SendIdentify(IdentifyItem *item, struct MsgPort *replyPort);
+void CompleteIdentify(IdentifyItem *item);
+IdentifyEntry *LoadIdentifyCache(ULONG *count);
+void SaveIdentifyCache(IdentifyEntry *entries, ULONG count);
+void MergeIdentifyCache(IdentifyEntry *entries, ULONG *count, IdentifyItem *items, ULONG itemCount);
+int IdentifyUnits(const char *driverFilter, ULONG timeout);
+BOOL ParseUnitRange(const char *text, LONG *from, LONG *to);
+int ProbeDriverUnits(const char *driverName, LONG from, LONG to, ULONG timeout);
+void MakeCrc32Table(ULONG *table);
+ULONG UpdateCrc32(ULONG crc, ULONG *table, UBYTE *data, ULONG length);
+void SetSurfaceRead(SurfaceSlot *slot, ULONG block, ULONG blocks, UWORD shift, UWORD command);
+BOOL IsPathOnDevice(const char *path, struct DeviceNode *deviceNode);
+int SurfaceScan(const char *cleanName, const char *dumpName, BOOL sparse);
+BOOL FillDumpHole(DumpFile *dump);
+BOOL FlushDumpHole(DumpFile *dump);
+BOOL WriteDumpRun(DumpFile *dump, UBYTE *data, ULONG blocks);
+void ShowWorkbenchMessage(const char *text);
+void ReadWorkbenchToolTypes(struct WBArg *arg, WorkbenchOptions *options);
+LONG FindFreeUnit(const char *driverName, LONG from);
+BOOL QuoteArgument(const char *text, char *buffer, int bufSize);
+void MountProcess(void);
+LONG RunMounter(const char *mounter, const char *path, LONG unit, LONG *error);
+int MountFromWorkbench(struct WBStartup *startup);
+int WriteMetricsFile(const char *fileName, ScanItem *items, ULONG count, ULONG scanMicros);
 const char *GetHandlerFromDosType(ULONG dosType);
+BOOL CopyBSTR(BSTR bstr, char *buffer, int bufSize);
+int ProbeMountedVolume(const char *cleanName, struct InfoData *infoData, char *volumeName, int volumeNameSize);
+ULONG BlocksToKB(ULONG blocks, ULONG bytesPerBlock);
+LONG ParseFields(const char *fieldList, ULONG *fields);
+ULONG PlanFieldOps(ULONG fields);
+BOOL GatherDeviceFacts(const char *cleanName, ULONG ops, DeviceFacts *facts);
+BOOL WalkDeviceFacts(const char *cleanName, ULONG ops, DeviceFacts *facts);
+void PrintDeviceFacts(DeviceFacts *facts, ULONG fields);
+ULONG HashDosNode(ULONG key, struct DeviceNode *deviceNode);
+ULONG DosListFingerprint(void);
+BOOL CaptureDeviceList(DeviceSnapshot *snapshot);
+BOOL ReadSharedSnapshot(DeviceSnapshot *snapshot);
+void PublishSnapshot(DeviceSnapshot *snapshot);
+DeviceSnapshot *GetDeviceSnapshot(void);
+SnapshotEntry *SnapshotFindName(DeviceSnapshot *snapshot, const char *name);
+BOOL MakeNameKey(const char *name, ULONG *key);
+SnapshotEntry *SnapshotFindUnit(DeviceSnapshot *snapshot, const char *driverName, LONG unitNum);
+CapturedEntry *CaptureFullList(ULONG *count);
+void ProbeCapturedEntries(CapturedEntry *entries);
+int PutString(UBYTE *buffer, int pos, const char *str);
+int PackCapturedEntry(CapturedEntry *entry, UBYTE *buffer);
+int WriteSnapshotFile(const char *fileName);
+ULONG DosDriversKey(const char *dirName);
+BOOL ParseMountFile(const char *path, ConfiguredEntry *entry);
+ULONG ScanDosDrivers(const char *dirName, UBYTE source, ConfiguredEntry *entries, ULONG count);
+ConfiguredEntry *GetConfiguredIndex(ULONG *count);
+int ListConfiguredDevices(const char *driverFilter);
+void PrintUsage(void);
+BOOL OpenRunTimer(void);
+void CloseRunTimer(Context *context);
+ULONG StartTimeout(ULONG seconds, ULONG micros);
+void StopTimeout(void);
+void TraceEvent(UBYTE event, UBYTE phase, const char *name, LONG status);
+void DumpTrace(BPTR file);
+void DumpStallTrace(void);
+void WriteTraceFile(void);
+void ReadRunClock(struct EClockVal *clock);
+ULONG ElapsedMicros(struct EClockVal *start, struct EClockVal *end);
+const char *BuildCpuName(void);
+const char *RunningCpuName(void);
+int RunLookupBenchmark(LONG iterations);
+int RunProbeBenchmark(DeviceSnapshot *snapshot, LONG iterations);
+BOOL GetStartupDriver(struct DeviceNode *deviceNode, char *driver, int driverSize, LONG *unit, ULONG *flags);
+const ProbeBackend *FindProbeBackend(const char *driverName);
+int ProbeGenericMedia(const char *cleanName, struct DeviceNode *deviceNode, char *volumeName, int volumeNameSize);
+BOOL FindHandlerVolume(struct DeviceNode *deviceNode, char *volumeName, int volumeNameSize);
+int ProbeChangeStateMedia(const char *cleanName, struct DeviceNode *deviceNode, char *volumeName, int volumeNameSize);
+LONG ProbeGenericFreeUnit(const char *driverName, LONG from);
+BOOL ProbeTrackdiskExists(const char *driverName, LONG unit, char *foundName, int nameSize);
+LONG ProbeTrackdiskFreeUnit(const char *driverName, LONG from);
+BOOL IsScsiUnit(LONG unit);
+BOOL ProbeScsiExists(const char *driverName, LONG unit, char *foundName, int nameSize);
+LONG ProbeScsiFreeUnit(const char *driverName, LONG from);
+#if CPU_VARIANT == 0
+BOOL DispatchCpuVariant(LONG *rc);
+#endif
+
+/* Probe backends by driver name; the generic backend must stay last */
+static const ProbeBackend probeBackends[] = {
+  { "trackdisk.device", ProbeTrackdiskExists, ProbeChangeStateMedia,
+    ProbeTrackdiskFreeUnit },
+  { "scsi.device", ProbeScsiExists, ProbeChangeStateMedia,
+    ProbeScsiFreeUnit },
+  { "diskimage.device", FindDeviceByDriverAndUnit, ProbeChangeStateMedia,
+    ProbeGenericFreeUnit },
+  { "uaehf.device", FindDeviceByDriverAndUnit, ProbeChangeStateMedia,
+    ProbeGenericFreeUnit },
+  { NULL, FindDeviceByDriverAndUnit, ProbeGenericMedia,
+    ProbeGenericFreeUnit }
+};
+
+#define PROBE_BACKEND_COUNT (sizeof(probeBackends) / sizeof(probeBackends[0]))
+
+/**
+ * Install caller supplied storage as this task's context
+ *
+ * main() passes a Context on its own stack so a normal run never calls
+ * AllocVec() for it. The per-run memory pool is created here.
+ *
+ * @param context Storage for the context
+ * @return The installed context
+ */
+Context *InstallContext(Context *context) {
+  struct Task *task = FindTask(NULL);
+
+  memset(context, 0, sizeof(Context));
+  context->magic = CONTEXT_MAGIC;
+  context->quiet = FALSE;
+  context->oldContext = task->tc_UserData;
+  context->pool = CreatePool(MEMF_ANY, POOL_PUDDLE_SIZE, POOL_THRESH_SIZE);
+  task->tc_UserData = (APTR)context;
+
+  /* The trace ring is the only allocation tracing ever makes */
+  context->trace = RunAlloc(TRACE_ENTRIES * sizeof(TraceRecord));
+
+  return context;
+}
 
 Context *GetContext(void) {
   struct Task *task = FindTask(NULL);
@@ -112,20 +903,97 @@ Context *GetContext(void) {
     return NULL;  /* Handle allocation failure */
   }
 
-  context->magic = CONTEXT_MAGIC;
-  context->quiet = FALSE;
-  context->oldContext = task->tc_UserData;
-  task->tc_UserData = (APTR)context;
+  InstallContext(context);
+  context->allocated = TRUE;
 
   return context;
 }
 
 void FreeContext(void) {
   struct Task *task = FindTask(NULL);
-  if (task->tc_UserData != NULL) {
-    FreeVec(task->tc_UserData);
-    task->tc_UserData = NULL;
+  Context *context = (Context *)task->tc_UserData;
+
+  if (context && context->magic == CONTEXT_MAGIC) {
+    task->tc_UserData = context->oldContext;
+    if (context->priSet) {
+      SetTaskPri(task, context->oldPri);
+    }
+    CloseRunTimer(context);
+
+    /* Abandoned packets are not in the pool; see SendDiskInfo() */
+    if (context->pool) {
+      DeletePool(context->pool);
+    }
+    context->magic = 0;
+    if (context->allocated) {
+      FreeVec(context);
+    }
+  }
+}
+
+/**
+ * Allocate cleared memory from the per-run pool
+ *
+ * Everything allocated here is released in one go when the pool is
+ * deleted at exit, so scans never fragment the system free list.
+ *
+ * @param size Number of bytes
+ * @return Longword aligned memory or NULL
+ */
+APTR RunAlloc(ULONG size) {
+  Context *context = GetContext();
+  APTR memory;
+
+  if (!context || !context->pool) {
+    return NULL;
+  }
+
+  memory = AllocPooled(context->pool, size);
+  if (memory) {
+    memset(memory, 0, size);
+#ifdef DEBUG
+    context->allocCount++;
+    context->allocBytes += size;
+#endif
+  }
+
+  return memory;
+}
+
+/**
+ * Return memory to the per-run pool early
+ *
+ * @param memory Memory from RunAlloc() (may be NULL)
+ * @param size Size passed to RunAlloc()
+ */
+void RunFree(APTR memory, ULONG size) {
+  Context *context = GetContext();
+
+  if (memory && context && context->pool) {
+    FreePooled(context->pool, memory, size);
+  }
+}
+
+/**
+ * Get the InfoData shared by every probe in this run
+ *
+ * @return Cleared InfoData or NULL if the pool is unavailable
+ */
+struct InfoData *GetRunInfoData(void) {
+  Context *context = GetContext();
+
+  if (!context) {
+    return NULL;
+  }
+
+  if (!context->infoData) {
+    context->infoData = RunAlloc(sizeof(struct InfoData));
   }
+  else {
+    memset(context->infoData, 0, sizeof(struct InfoData));
+  }
+
+  return context->infoData;
 }
 
 /**
@@ -178,7 +1046,9 @@ BOOL CheckDeviceDriver(const char *driverName) {
   }
 
   /* Try to open the device driver unit 0 just to test availability */
+  TraceEvent(TRACE_PROBE, PHASE_DRIVER, driverName, 0);
   error = OpenDevice((STRPTR)driverName, 0, (struct IORequest *)ioReq, 0);
+  TraceEvent(TRACE_REPLY, PHASE_DRIVER, driverName, error);
 
   if (error == 0) {
     /* Device opened successfully - it's available */
@@ -273,7 +1143,9 @@ const char *GetHandlerFromDosType(ULONG dosType) {
  * Find a device by unit number and driver name
  *
  * Searches the DOS device list for any device using the specified
- * device driver with the specified unit number.
+ * device driver with the specified unit number. A current shared
+ * snapshot answers without walking the list, unless the driver name is
+ * longer than a snapshot can hold.
  *
  * @param driverName Device driver name (e.g., "diskimage.device")
  * @param unitNum Unit number to search for
@@ -286,6 +1158,41 @@ BOOL FindDeviceByDriverAndUnit(
   LONG unitNum,
   char *foundName,
   int nameSize
+) {
+  DeviceSnapshot *snapshot;
+  SnapshotEntry *entry;
+
+  if (foundName && nameSize > 0) {
+    foundName[0] = '\0';
+  }
+
+  snapshot = strlen(driverName) < SNAPSHOT_NAME_SIZE ?
+    GetDeviceSnapshot() : NULL;
+  if (snapshot) {
+    entry = SnapshotFindUnit(snapshot, driverName, unitNum);
+    if (entry && foundName && strlen(entry->name) < nameSize) {
+      strcpy(foundName, entry->name);
+    }
+    return (entry != NULL);
+  }
+
+  return WalkDeviceByDriverAndUnit(driverName, unitNum, foundName, nameSize);
+}
+
+/**
+ * Find a device by unit number and driver name by walking the DOS list
+ *
+ * @param driverName Device driver name (e.g., "diskimage.device")
+ * @param unitNum Unit number to search for
+ * @param foundName Buffer to store the found device name (optional)
+ * @param nameSize Size of foundName buffer
+ * @return TRUE if found, FALSE otherwise
+ */
+BOOL WalkDeviceByDriverAndUnit(
+  const char *driverName,
+  LONG unitNum,
+  char *foundName,
+  int nameSize
 ) {
   struct RootNode *rootNode;
   struct DosInfo *dosInfo;
@@ -648,12 +1555,118 @@ void StripDeviceName(const char *deviceName, char *cleanName, int bufSize) {
 }
 
 /**
- * Check device status
+ * Copy a BCPL string into a C string buffer
+ *
+ * @param bstr BCPL pointer to a length-prefixed string
+ * @param buffer Output buffer
+ * @param bufSize Size of output buffer
+ * @return TRUE if the string was copied, FALSE if empty or too long
+ */
+BOOL CopyBSTR(BSTR bstr, char *buffer, int bufSize) {
+  char *bstrName;
+  int len;
+
+  if (bufSize > 0) {
+    buffer[0] = '\0';
+  }
+
+  if (!bstr) {
+    return FALSE;
+  }
+
+  bstrName = (char *)BADDR(bstr);
+  len = (UBYTE)bstrName[0];
+  if (len == 0 || len >= bufSize) {
+    return FALSE;
+  }
+
+  memcpy(buffer, &bstrName[1], len);
+  buffer[len] = '\0';
+
+  return TRUE;
+}
+
+/**
+ * Ask the handler of a device that is known to exist for its disk info
+ *
+ * Does not walk the DOS list; callers are expected to have found the
+ * device already. The packet goes out like a one device scan, so the
+ * run's TIMEOUT bounds the wait and Ctrl-D dumps the trace ring while
+ * the handler has not replied.
+ *
+ * @param cleanName Device name without colon
+ * @param infoData Caller supplied InfoData, filled in when a volume is in
+ * @param volumeName Buffer to store volume name (optional, can be NULL)
+ * @param volumeNameSize Size of volume name buffer
+ * @return 0 = has volume, 1 = no disk, STATUS_TIMEOUT = no reply in time
+ *         or Ctrl-C, STATUS_NOMEMORY = no memory for the packet
+ */
+int ProbeMountedVolume(
+  const char *cleanName,
+  struct InfoData *infoData,
+  char *volumeName,
+  int volumeNameSize
+) {
+  Context *context = GetContext();
+  ScanOptions options;
+  ScanItem *item;
+  struct MsgPort *replyPort;
+  int status;
+
+  if (volumeName && volumeNameSize > 0) {
+    volumeName[0] = '\0';
+  }
+
+  item = RunAlloc(sizeof(ScanItem));
+  replyPort = CreateMsgPort();
+  if (!item || !replyPort) {
+    RunFree(item, sizeof(ScanItem));
+    if (replyPort) {
+      DeleteMsgPort(replyPort);
+    }
+    return STATUS_NOMEMORY;
+  }
+  strncpy(item->name, cleanName, sizeof(item->name) - 1);
+  item->status = -1;
+
+  options.maxInFlight = 1;
+  options.yield = FALSE;
+  options.timeout = context ? context->probeTimeout : 0;
+  options.metricsFile = NULL;
+
+  if (SendDiskInfo(item, replyPort) &&
+      !WaitDiskInfo(item, 1, replyPort, &options)) {
+    /* The handler still owns the packet, its InfoData and the port */
+    AbandonDiskInfo(item, 1, replyPort);
+    RunFree(item, sizeof(ScanItem));
+    return STATUS_TIMEOUT;
+  }
+  DeleteMsgPort(replyPort);
+
+  /* A handler that cannot be started fails like Lock() would */
+  status = item->status == 0 ? 0 : 1;
+  if (status == 0) {
+    memcpy(infoData, &item->info, sizeof(struct InfoData));
+    if (volumeName && volumeNameSize > 0) {
+      strncpy(volumeName, item->volume, volumeNameSize - 1);
+      volumeName[volumeNameSize - 1] = '\0';
+    }
+  }
+
+  RunFree(item, sizeof(ScanItem));
+
+  return status;
+}
+
+/**
+ * Check device status through the probe backend of the device's driver
  *
  * @param deviceName The device name (with or without colon)
  * @param volumeName Buffer to store volume name (optional, can be NULL)
  * @param volumeNameSize Size of volume name buffer
- * @return 0 = has volume, 1 = no disk, -1 = device not found
+ * @return 0 = has volume, 1 = no disk, -1 = device not found,
+ *         STATUS_TIMEOUT if the driver or handler did not answer,
+ *         STATUS_NOMEMORY if no InfoData could be allocated
  */
 int CheckDeviceStatus(
   const char *deviceName,
@@ -661,13 +1674,8 @@ int CheckDeviceStatus(
   int volumeNameSize
 ) {
   char cleanName[108];
-  char fullName[110];
+  char driver[SNAPSHOT_NAME_SIZE];
   struct DeviceNode *deviceNode;
-  BPTR lock = 0;
-  struct InfoData *infoData = NULL;
-  struct DeviceList *volumeNode;
-  char *bstrName;
-  int status = -1;  /* Default: device not found */
 
   /* Clean the device name */
   StripDeviceName(deviceName, cleanName, sizeof(cleanName));
@@ -678,280 +1686,6504 @@ int CheckDeviceStatus(
     return -1;  /* Device not found */
   }
 
-  /* Device exists, now check if volume is mounted */
-  sprintf(fullName, "%s:", cleanName);
-  lock = Lock(fullName, ACCESS_READ);
-
-  if (lock) {
-    /* Allocate InfoData structure */
-    infoData = AllocMem(sizeof(struct InfoData), MEMF_CLEAR);
-    if (infoData) {
-      /* Get information about the device */
-      if (Info(lock, infoData)) {
-        /* Check if there's a disk in the device */
-        if (infoData->id_DiskType != ID_NO_DISK_PRESENT) {
-          status = 0;  /* Volume is mounted */
-
-          /* Get volume name if buffer provided */
-          if (volumeName && volumeNameSize > 0) {
-            volumeName[0] = '\0';
-            volumeNode = BADDR(infoData->id_VolumeNode);
-            if (volumeNode && volumeNode->dl_Name) {
-              bstrName = (char *)BADDR(volumeNode->dl_Name);
-              if (bstrName && bstrName[0] > 0) {
-                int len = bstrName[0];
-                if (len < volumeNameSize - 1) {
-                  memcpy(volumeName, &bstrName[1], len);
-                  volumeName[len] = '\0';
-                }
-              }
-            }
-          }
-        }
-        else {
-          status = 1;  /* No disk present */
-        }
-      }
-      FreeMem(infoData, sizeof(struct InfoData));
-    }
-    UnLock(lock);
-  }
-  else {
-    /* Couldn't lock - device exists but no handler/disk */
-    status = 1;  /* No disk present */
-  }
+  GetStartupDriver(deviceNode, driver, sizeof(driver), NULL, NULL);
 
-  return status;
+  return FindProbeBackend(driver)->media(cleanName, deviceNode, volumeName,
+    volumeNameSize);
 }
 
-int exitWith(int rc) {
-  struct Task *task = FindTask(NULL);
+/**
+ * Read the driver, unit and flags a DOS device was mounted with
+ *
+ * @param deviceNode DOS device
+ * @param driver Buffer for fssm_Device
+ * @param driverSize Size of driver buffer
+ * @param unit Receives fssm_Unit (optional)
+ * @param flags Receives fssm_Flags (optional)
+ * @return TRUE if the device has a FileSysStartupMsg naming a driver
+ */
+BOOL GetStartupDriver(
+  struct DeviceNode *deviceNode,
+  char *driver,
+  int driverSize,
+  LONG *unit,
+  ULONG *flags
+) {
+  struct FileSysStartupMsg *startup;
+
+  driver[0] = '\0';
+
+  /* Only treat dn_Startup as a FileSysStartupMsg if it looks like one */
+  if (deviceNode->dn_Startup <= 64) {
+    return FALSE;
+  }
+
+  startup = (struct FileSysStartupMsg *)BADDR(deviceNode->dn_Startup);
+  if (!startup->fssm_Device ||
+      !CopyBSTR(startup->fssm_Device, driver, driverSize) || !driver[0]) {
+    return FALSE;
+  }
+
+  if (unit) {
+    *unit = (LONG)startup->fssm_Unit;
+  }
+  if (flags) {
+    *flags = startup->fssm_Flags;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Find the probe backend for a device driver
+ *
+ * @param driverName Device driver, NULL or empty for the generic backend
+ * @return The driver's own backend, else the generic one
+ */
+const ProbeBackend *FindProbeBackend(const char *driverName) {
+  ULONG i;
+
+  if (driverName && driverName[0]) {
+    for (i = 0; i < PROBE_BACKEND_COUNT - 1; i++) {
+      if (stricmp(probeBackends[i].driver, driverName) == 0) {
+        return &probeBackends[i];
+      }
+    }
+  }
+
+  return &probeBackends[PROBE_BACKEND_COUNT - 1];
+}
+
+/**
+ * Generic media query: ask the device's handler for its disk info
+ *
+ * @param cleanName Device name without colon
+ * @param deviceNode The device's DOS list node
+ * @param volumeName Buffer for the volume name (optional)
+ * @param volumeNameSize Size of volumeName buffer
+ * @return 0 = volume mounted, 1 = no disk, STATUS_NOMEMORY = no InfoData
+ */
+int ProbeGenericMedia(
+  const char *cleanName,
+  struct DeviceNode *deviceNode,
+  char *volumeName,
+  int volumeNameSize
+) {
+  struct InfoData *infoData;
+
+  /* Reuse the run's InfoData structure */
+  infoData = GetRunInfoData();
+  if (!infoData) {
+    return STATUS_NOMEMORY;
+  }
+
+  return ProbeMountedVolume(cleanName, infoData, volumeName, volumeNameSize);
+}
+
+/**
+ * Find the volume a device's handler has mounted, without a packet
+ *
+ * @param deviceNode DOS device
+ * @param volumeName Buffer for the volume name (optional)
+ * @param volumeNameSize Size of volumeName buffer
+ * @return TRUE if a volume in the DOS list belongs to the handler
+ */
+BOOL FindHandlerVolume(
+  struct DeviceNode *deviceNode,
+  char *volumeName,
+  int volumeNameSize
+) {
+  struct RootNode *rootNode;
+  struct DosInfo *dosInfo;
+  struct DeviceList *volume;
+  BOOL found = FALSE;
+
+  if (volumeName && volumeNameSize > 0) {
+    volumeName[0] = '\0';
+  }
+
+  rootNode = (struct RootNode *)DOSBase->dl_Root;
+  dosInfo = (struct DosInfo *)BADDR(rootNode->rn_Info);
+
+  /* dn_Task and dl_Task are only stable under Forbid() */
+  Forbid();
+
+  if (deviceNode->dn_Task) {
+    volume = (struct DeviceList *)BADDR(dosInfo->di_DevInfo);
+    while (volume) {
+      if (volume->dl_Type == DLT_VOLUME &&
+          volume->dl_Task == deviceNode->dn_Task) {
+        if (volumeName && volumeNameSize > 0) {
+          CopyBSTR(volume->dl_Name, volumeName, volumeNameSize);
+        }
+        found = TRUE;
+        break;
+      }
+      volume = (struct DeviceList *)BADDR(volume->dl_Next);
+    }
+  }
+
+  Permit();
+
+  return found;
+}
+
+/**
+ * Media query for drivers that answer TD_CHANGESTATE
+ *
+ * The driver says whether a disk is in without involving the handler.
+ * An empty unit needs nothing more. With a disk in, the volume the
+ * handler has mounted is found in the DOS list. Only a handler that is
+ * not running yet, or has not read the disk, is still asked for its disk
+ * info, as is a unit that cannot be opened or has no TD_CHANGESTATE.
+ * The request is taken back after TIMEOUT seconds or on Ctrl-C.
+ *
+ * @param cleanName Device name without colon
+ * @param deviceNode The device's DOS list node
+ * @param volumeName Buffer for the volume name (optional)
+ * @param volumeNameSize Size of volumeName buffer
+ * @return 0 = volume mounted, 1 = no disk, STATUS_TIMEOUT = driver did
+ *         not answer, STATUS_NOMEMORY = no InfoData
+ */
+int ProbeChangeStateMedia(
+  const char *cleanName,
+  struct DeviceNode *deviceNode,
+  char *volumeName,
+  int volumeNameSize
+) {
+  Context *context = GetContext();
+  struct MsgPort *port;
+  struct IOStdReq *io = NULL;
+  char driver[SNAPSHOT_NAME_SIZE];
+  LONG unit;
+  ULONG flags;
+  ULONG timeoutMask = 0;
+  ULONG signals;
+  LONG error = IOERR_OPENFAIL;
+  BOOL present = FALSE;
+  BOOL timedOut = FALSE;
+  int status;
+
+  if (!GetStartupDriver(deviceNode, driver, sizeof(driver), &unit, &flags)) {
+    return ProbeGenericMedia(cleanName, deviceNode, volumeName,
+      volumeNameSize);
+  }
+
+  TraceEvent(TRACE_PROBE, PHASE_STATUS, cleanName, 0);
+
+  port = CreateMsgPort();
+  if (port) {
+    io = (struct IOStdReq *)CreateIORequest(port, sizeof(struct IOStdReq));
+  }
+  if (io && OpenDevice((STRPTR)driver, unit, (struct IORequest *)io,
+      flags) == 0) {
+    io->io_Command = TD_CHANGESTATE;
+    io->io_Actual = 0;
+    SendIO((struct IORequest *)io);
+
+    if (context && context->probeTimeout) {
+      timeoutMask = StartTimeout(context->probeTimeout, 0);
+    }
+    while (!CheckIO((struct IORequest *)io)) {
+      signals = Wait((1L << port->mp_SigBit) | timeoutMask |
+        SIGBREAKF_CTRL_C);
+      if (signals & (timeoutMask | SIGBREAKF_CTRL_C)) {
+        /* A reply may have raced the timer */
+        if (!CheckIO((struct IORequest *)io)) {
+          AbortIO((struct IORequest *)io);
+          timedOut = TRUE;
+        }
+        if (signals & SIGBREAKF_CTRL_C) {
+          SetSignal(SIGBREAKF_CTRL_C, SIGBREAKF_CTRL_C);  /* For the caller */
+        }
+        break;
+      }
+    }
+    if (timeoutMask) {
+      StopTimeout();
+    }
+
+    error = WaitIO((struct IORequest *)io);
+    present = (BOOL)(io->io_Actual == 0);
+    CloseDevice((struct IORequest *)io);
+  }
+  if (io) {
+    DeleteIORequest((struct IORequest *)io);
+  }
+  if (port) {
+    DeleteMsgPort(port);
+  }
+
+  if (timedOut) {
+    TraceEvent(TRACE_TIMEOUT, PHASE_STATUS, cleanName, 0);
+    DumpStallTrace();
+    return STATUS_TIMEOUT;
+  }
+
+  if (error != 0) {
+    status = ProbeGenericMedia(cleanName, deviceNode, volumeName,
+      volumeNameSize);
+  }
+  else if (!present) {
+    if (volumeName && volumeNameSize > 0) {
+      volumeName[0] = '\0';
+    }
+    status = 1;
+  }
+  else if (FindHandlerVolume(deviceNode, volumeName, volumeNameSize)) {
+    status = 0;
+  }
+  else {
+    status = ProbeGenericMedia(cleanName, deviceNode, volumeName,
+      volumeNameSize);
+  }
+
+  TraceEvent(TRACE_REPLY, PHASE_STATUS, cleanName, status);
+  return status;
+}
+
+/**
+ * Generic free unit query: the first unit no DOS device uses
+ *
+ * @param driverName Device driver
+ * @param from First unit to try
+ * @return Free unit, -1 if PROBE_MAX_UNITS units are all taken
+ */
+LONG ProbeGenericFreeUnit(const char *driverName, LONG from) {
+  LONG unit;
+
+  for (unit = from; unit < from + PROBE_MAX_UNITS; unit++) {
+    if (!FindDeviceByDriverAndUnit(driverName, unit, NULL, 0)) {
+      return unit;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * trackdisk.device has units 0 to NUMUNITS - 1 and no others
+ *
+ * @param driverName Device driver
+ * @param unit Unit number
+ * @param foundName Buffer for the DOS device name (optional)
+ * @param nameSize Size of foundName buffer
+ * @return TRUE if a DOS device uses the unit
+ */
+BOOL ProbeTrackdiskExists(
+  const char *driverName,
+  LONG unit,
+  char *foundName,
+  int nameSize
+) {
+  if (unit < 0 || unit >= NUMUNITS) {
+    if (foundName && nameSize > 0) {
+      foundName[0] = '\0';
+    }
+    return FALSE;
+  }
+
+  return FindDeviceByDriverAndUnit(driverName, unit, foundName, nameSize);
+}
+
+/**
+ * First floppy drive unit, from a given one up, that no DOS device uses
+ *
+ * @param driverName Device driver
+ * @param from First unit to try
+ * @return Free unit, -1 if none
+ */
+LONG ProbeTrackdiskFreeUnit(const char *driverName, LONG from) {
+  LONG unit;
+
+  for (unit = from > 0 ? from : 0; unit < NUMUNITS; unit++) {
+    if (!FindDeviceByDriverAndUnit(driverName, unit, NULL, 0)) {
+      return unit;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Check that a scsi.device unit number is board * 100 + LUN * 10 +
+ * target, with target and LUN 0 to 7
+ *
+ * @param unit Unit number
+ * @return TRUE if the number can address a drive
+ */
+BOOL IsScsiUnit(LONG unit) {
+  return (BOOL)(unit >= 0 && unit % 10 <= SCSI_MAX_TARGET &&
+    (unit / 10) % 10 <= SCSI_MAX_TARGET);
+}
+
+/**
+ * scsi.device units that cannot address a drive never exist
+ *
+ * @param driverName Device driver
+ * @param unit Unit number
+ * @param foundName Buffer for the DOS device name (optional)
+ * @param nameSize Size of foundName buffer
+ * @return TRUE if a DOS device uses the unit
+ */
+BOOL ProbeScsiExists(
+  const char *driverName,
+  LONG unit,
+  char *foundName,
+  int nameSize
+) {
+  if (!IsScsiUnit(unit)) {
+    if (foundName && nameSize > 0) {
+      foundName[0] = '\0';
+    }
+    return FALSE;
+  }
+
+  return FindDeviceByDriverAndUnit(driverName, unit, foundName, nameSize);
+}
+
+/**
+ * First addressable scsi.device unit, from a given one up, that no DOS
+ * device uses
+ *
+ * @param driverName Device driver
+ * @param from First unit to try
+ * @return Free unit, -1 if PROBE_MAX_UNITS units are all taken
+ */
+LONG ProbeScsiFreeUnit(const char *driverName, LONG from) {
+  LONG unit;
+  LONG tried = 0;
+
+  for (unit = from > 0 ? from : 0; tried < PROBE_MAX_UNITS; unit++) {
+    if (!IsScsiUnit(unit)) {
+      continue;
+    }
+    tried++;
+    if (!FindDeviceByDriverAndUnit(driverName, unit, NULL, 0)) {
+      return unit;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Convert a block count to kilobytes without overflowing 32 bits
+ *
+ * @param blocks Number of blocks
+ * @param bytesPerBlock Block size in bytes
+ * @return Size in KB
+ */
+ULONG BlocksToKB(ULONG blocks, ULONG bytesPerBlock) {
+  return (blocks / 1024) * bytesPerBlock +
+    ((blocks % 1024) * bytesPerBlock) / 1024;
+}
+
+/**
+ * Parse a FIELDS argument into field bits
+ *
+ * @param fieldList Comma separated field names (case insensitive)
+ * @param fields Receives the FIELD_* bits
+ * @return 0 on success, otherwise the offset + 1 of the unknown field
+ */
+LONG ParseFields(const char *fieldList, ULONG *fields) {
+  static const struct {
+    const char *name;
+    ULONG bit;
+  } fieldNames[] = {
+    { "name",    FIELD_NAME },
+    { "unit",    FIELD_UNIT },
+    { "driver",  FIELD_DRIVER },
+    { "status",  FIELD_STATUS },
+    { "volume",  FIELD_VOLUME },
+    { "space",   FIELD_SPACE },
+    { "handler", FIELD_HANDLER }
+  };
+  const char *p = fieldList;
+  const char *start;
+  int len;
+  int i;
+  BOOL known;
+
+  *fields = 0;
+
+  while (*p) {
+    /* Skip separators */
+    while (*p == ',' || *p == ' ') {
+      p++;
+    }
+    if (!*p) {
+      break;
+    }
+
+    start = p;
+    while (*p && *p != ',' && *p != ' ') {
+      p++;
+    }
+    len = p - start;
+
+    known = FALSE;
+    for (i = 0; i < sizeof(fieldNames) / sizeof(fieldNames[0]); i++) {
+      if (strlen(fieldNames[i].name) == len &&
+          strnicmp(start, fieldNames[i].name, len) == 0) {
+        *fields |= fieldNames[i].bit;
+        known = TRUE;
+        break;
+      }
+    }
+
+    if (!known) {
+      return (start - fieldList) + 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Build the operation plan needed to answer a set of fields
+ *
+ * @param fields FIELD_* bits
+ * @return OP_* bits
+ */
+ULONG PlanFieldOps(ULONG fields) {
+  ULONG ops = OP_LISTWALK;
+
+  if (fields & (FIELD_UNIT | FIELD_DRIVER)) {
+    ops |= OP_STARTUP;
+  }
+  if (fields & FIELD_HANDLER) {
+    ops |= OP_HANDLER;
+  }
+  if (fields & (FIELD_STATUS | FIELD_VOLUME)) {
+    ops |= OP_MEDIA;
+  }
+  if (fields & FIELD_SPACE) {
+    ops |= OP_MEDIA | OP_LOCK;  /* Only the handler knows the space */
+  }
+
+  return ops;
+}
+
+/**
+ * Gather facts about a device, performing only the planned operations
+ *
+ * Status and volume come from the probe backend of the device's driver,
+ * as for a plain check. When the space is wanted too, the generic
+ * backend is used, as only the handler's disk info holds it.
+ *
+ * @param cleanName Device name without colon
+ * @param ops OP_* bits from PlanFieldOps()
+ * @param facts Receives the results
+ * @return TRUE if the device exists, FALSE otherwise
+ */
+BOOL GatherDeviceFacts(const char *cleanName, ULONG ops, DeviceFacts *facts) {
+  DeviceSnapshot *snapshot;
+  SnapshotEntry *entry;
+  struct DeviceNode *deviceNode;
+  struct InfoData *infoData;
+  char driver[SNAPSHOT_NAME_SIZE];
+  BOOL found = FALSE;
+
+  memset(facts, 0, sizeof(DeviceFacts));
+  facts->unit = -1;
+  facts->status = -1;
+
+  /* Everything but Lock/Info can be answered from the snapshot, which
+     holds no name that does not fit SNAPSHOT_NAME_SIZE */
+  snapshot = strlen(cleanName) < SNAPSHOT_NAME_SIZE ?
+    GetDeviceSnapshot() : NULL;
+  if (snapshot) {
+    entry = SnapshotFindName(snapshot, cleanName);
+    if (!entry) {
+      return FALSE;
+    }
+
+    strcpy(facts->name, entry->name);
+    if (ops & OP_STARTUP) {
+      facts->unit = entry->unit;
+      strcpy(facts->driver, entry->driver);
+    }
+    if (ops & OP_HANDLER) {
+      strcpy(facts->handler, entry->handler);
+    }
+    found = TRUE;
+  }
+  else {
+    found = WalkDeviceFacts(cleanName, ops, facts);
+  }
+
+  if (!found) {
+    return FALSE;
+  }
+
+  if (ops & OP_MEDIA) {
+    deviceNode = FindDosDevice(facts->name);
+    if (!deviceNode) {
+      return TRUE;  /* Removed since the walk; status stays -1 */
+    }
+    driver[0] = '\0';
+    if (!(ops & OP_LOCK)) {
+      GetStartupDriver(deviceNode, driver, sizeof(driver), NULL, NULL);
+    }
+    facts->status = FindProbeBackend(driver)->media(
+      facts->name,
+      deviceNode,
+      facts->volume,
+      sizeof(facts->volume)
+    );
+
+    /* The generic backend left the reply in the run's InfoData */
+    if ((ops & OP_LOCK) && facts->status == 0) {
+      infoData = GetRunInfoData();
+      facts->blocksTotal = infoData->id_NumBlocks;
+      facts->blocksUsed = infoData->id_NumBlocksUsed;
+      facts->bytesPerBlock = infoData->id_BytesPerBlock;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * Gather list facts by walking the DOS list directly
+ *
+ * All DOS list reads happen while the list is held, so the node is
+ * never dereferenced after Permit().
+ *
+ * @param cleanName Device name without colon
+ * @param ops OP_* bits from PlanFieldOps()
+ * @param facts Receives the results
+ * @return TRUE if the device exists, FALSE otherwise
+ */
+BOOL WalkDeviceFacts(const char *cleanName, ULONG ops, DeviceFacts *facts) {
+  struct RootNode *rootNode;
+  struct DosInfo *dosInfo;
+  struct DeviceNode *deviceNode;
+  struct FileSysStartupMsg *startup;
+  char devName[108];
+  BOOL found = FALSE;
+
+  rootNode = (struct RootNode *)DOSBase->dl_Root;
+  dosInfo = (struct DosInfo *)BADDR(rootNode->rn_Info);
+
+  Forbid();
+
+  deviceNode = (struct DeviceNode *)BADDR(dosInfo->di_DevInfo);
+  while (deviceNode) {
+    if (CopyBSTR(deviceNode->dn_Name, devName, sizeof(devName)) &&
+        stricmp(devName, cleanName) == 0) {
+      found = TRUE;
+      strcpy(facts->name, devName);
+
+      if ((ops & OP_STARTUP) && deviceNode->dn_Type == DLT_DEVICE &&
+          deviceNode->dn_Startup) {
+        startup = (struct FileSysStartupMsg *)BADDR(deviceNode->dn_Startup);
+        facts->unit = (LONG)startup->fssm_Unit;
+        CopyBSTR(startup->fssm_Device, facts->driver, sizeof(facts->driver));
+      }
+
+      if ((ops & OP_HANDLER) && deviceNode->dn_Type == DLT_DEVICE) {
+        CopyBSTR(deviceNode->dn_Handler, facts->handler,
+          sizeof(facts->handler));
+      }
+      break;
+    }
+
+    deviceNode = (struct DeviceNode *)BADDR(deviceNode->dn_Next);
+  }
+
+  Permit();
+
+  return found;
+}
+
+/**
+ * Print the requested fields as NAME=value pairs on a single line
+ *
+ * @param facts Gathered device facts
+ * @param fields FIELD_* bits to print
+ */
+void PrintDeviceFacts(DeviceFacts *facts, ULONG fields) {
+  const char *sep = "";
+
+  if (fields & FIELD_NAME) {
+    OPrintf("%sname=%s:", sep, facts->name);
+    sep = " ";
+  }
+  if (fields & FIELD_UNIT) {
+    OPrintf("%sunit=%ld", sep, facts->unit);
+    sep = " ";
+  }
+  if (fields & FIELD_DRIVER) {
+    OPrintf("%sdriver=%s", sep, facts->driver[0] ? facts->driver : "-");
+    sep = " ";
+  }
+  if (fields & FIELD_STATUS) {
+    OPrintf("%sstatus=%s", sep,
+      facts->status == 0 ? "mounted" :
+      facts->status == 1 ? "nodisk" :
+      facts->status == STATUS_TIMEOUT ? "timeout" : "unknown");
+    sep = " ";
+  }
+  if (fields & FIELD_VOLUME) {
+    OPrintf("%svolume=\"%s\"", sep, facts->volume);
+    sep = " ";
+  }
+  if (fields & FIELD_SPACE) {
+    if (facts->status == 0) {
+      OPrintf("%sspace=%luK/%luK", sep,
+        BlocksToKB(facts->blocksTotal - facts->blocksUsed, facts->bytesPerBlock),
+        BlocksToKB(facts->blocksTotal, facts->bytesPerBlock));
+    }
+    else {
+      OPrintf("%sspace=-", sep);
+    }
+    sep = " ";
+  }
+  if (fields & FIELD_HANDLER) {
+    OPrintf("%shandler=%s", sep, facts->handler[0] ? facts->handler : "-");
+  }
+  OPrintf("\n");
+}
+
+/**
+ * Add one DOS list node to a list fingerprint
+ *
+ * The node address changes when an entry is removed or replaced, the
+ * startup and task when a device is remounted or its handler started.
+ *
+ * @param key Fingerprint so far
+ * @param deviceNode Node to add
+ * @return Updated fingerprint
+ */
+ULONG HashDosNode(ULONG key, struct DeviceNode *deviceNode) {
+  key = key * 31 + (ULONG)deviceNode;
+  key = key * 31 + (ULONG)deviceNode->dn_Startup;
+  key = key * 31 + (ULONG)deviceNode->dn_Task;
+
+  return key;
+}
+
+/**
+ * Fingerprint of the DOS list, far cheaper than capturing it
+ *
+ * Walks the list under Forbid() but copies no names, hashing each node
+ * with HashDosNode() and then the node count, so a node added, removed
+ * or replaced anywhere in the list changes it. CaptureDeviceList()
+ * computes the same value during its own walk.
+ *
+ * @return Fingerprint of the current list
+ */
+ULONG DosListFingerprint(void) {
+  struct RootNode *rootNode = (struct RootNode *)DOSBase->dl_Root;
+  struct DosInfo *dosInfo = (struct DosInfo *)BADDR(rootNode->rn_Info);
+  struct DeviceNode *deviceNode;
+  ULONG key = 0;
+  ULONG count = 0;
+
+  Forbid();
+  for (deviceNode = (struct DeviceNode *)BADDR(dosInfo->di_DevInfo);
+       deviceNode;
+       deviceNode = (struct DeviceNode *)BADDR(deviceNode->dn_Next)) {
+    key = HashDosNode(key, deviceNode);
+    count++;
+  }
+  Permit();
+
+  return key * 31 + count;
+}
+
+/**
+ * Capture the names of every DOS list entry in a single walk
+ *
+ * @param snapshot Receives the entries
+ * @return FALSE if the list does not fit the snapshot limits
+ */
+BOOL CaptureDeviceList(DeviceSnapshot *snapshot) {
+  struct RootNode *rootNode;
+  struct DosInfo *dosInfo;
+  struct DeviceNode *deviceNode;
+  struct FileSysStartupMsg *startup;
+  SnapshotEntry *entry;
+  BOOL fits = TRUE;
+
+  rootNode = (struct RootNode *)DOSBase->dl_Root;
+  dosInfo = (struct DosInfo *)BADDR(rootNode->rn_Info);
+
+  snapshot->count = 0;
+
+  Forbid();
+
+  snapshot->fingerprint = 0;
+  deviceNode = (struct DeviceNode *)BADDR(dosInfo->di_DevInfo);
+
+  while (deviceNode && fits) {
+    snapshot->fingerprint = HashDosNode(snapshot->fingerprint, deviceNode);
+
+    if (snapshot->count >= SNAPSHOT_MAX_ENTRIES) {
+      fits = FALSE;
+      break;
+    }
+
+    entry = &snapshot->entries[snapshot->count];
+    memset(entry, 0, sizeof(SnapshotEntry));
+    entry->type = deviceNode->dn_Type;
+    entry->unit = -1;
+
+    if (!CopyBSTR(deviceNode->dn_Name, entry->name, sizeof(entry->name))) {
+      fits = FALSE;
+      break;
+    }
+    MakeNameKey(entry->name, entry->nameKey);
+
+    if (deviceNode->dn_Type == DLT_DEVICE) {
+      if (deviceNode->dn_Handler &&
+          !CopyBSTR(deviceNode->dn_Handler, entry->handler,
+            sizeof(entry->handler))) {
+        fits = FALSE;
+        break;
+      }
+
+      /* Only treat dn_Startup as a FileSysStartupMsg if it looks like one */
+      if (deviceNode->dn_Startup > 64) {
+        startup = (struct FileSysStartupMsg *)BADDR(deviceNode->dn_Startup);
+        entry->unit = (LONG)startup->fssm_Unit;
+        if (startup->fssm_Device &&
+            !CopyBSTR(startup->fssm_Device, entry->driver,
+              sizeof(entry->driver))) {
+          fits = FALSE;
+          break;
+        }
+      }
+    }
+
+    snapshot->count++;
+    deviceNode = (struct DeviceNode *)BADDR(deviceNode->dn_Next);
+  }
+  snapshot->fingerprint = snapshot->fingerprint * 31 + snapshot->count;
+
+  Permit();
+
+  DateStamp(&snapshot->stamp);
+
+  return fits;
+}
+
+/**
+ * Copy the published snapshot without blocking writers or the DOS list
+ *
+ * @param snapshot Receives a consistent copy
+ * @return TRUE if a current snapshot was copied
+ */
+BOOL ReadSharedSnapshot(DeviceSnapshot *snapshot) {
+  SharedSnapshot *shared;
+  struct DateStamp now;
+  ULONG sequence;
+  LONG age;
+  int attempt;
+
+  Forbid();
+  shared = (SharedSnapshot *)FindSemaphore((STRPTR)SNAPSHOT_SEMAPHORE);
+  Permit();
+
+  if (!shared || shared->version != SNAPSHOT_VERSION ||
+      shared->size != sizeof(SharedSnapshot)) {
+    return FALSE;
+  }
+
+  for (attempt = 0; attempt < SNAPSHOT_READ_RETRIES; attempt++) {
+    sequence = shared->sequence;
+    if (sequence & 1) {
+      continue;  /* Writer in progress */
+    }
+
+    snapshot->fingerprint = shared->data.fingerprint;
+    snapshot->stamp = shared->data.stamp;
+    snapshot->count = shared->data.count;
+    if (snapshot->count > SNAPSHOT_MAX_ENTRIES) {
+      continue;
+    }
+    memcpy(snapshot->entries, shared->data.entries,
+      snapshot->count * sizeof(SnapshotEntry));
+
+    if (shared->sequence == sequence) {
+      break;
+    }
+  }
+
+  if (attempt == SNAPSHOT_READ_RETRIES) {
+    return FALSE;
+  }
+
+  /* Only usable if the list has not changed since it was published */
+  if (snapshot->fingerprint != DosListFingerprint()) {
+    return FALSE;
+  }
+
+  DateStamp(&now);
+  age = (now.ds_Days - snapshot->stamp.ds_Days) * 24 * 60 * 60 * TICKS_PER_SECOND
+    + (now.ds_Minute - snapshot->stamp.ds_Minute) * 60 * TICKS_PER_SECOND
+    + (now.ds_Tick - snapshot->stamp.ds_Tick);
+
+  return (age >= 0 && age <= SNAPSHOT_MAX_AGE);
+}
+
+/**
+ * Publish a freshly captured snapshot for later invocations
+ *
+ * Never waits: if another writer holds the semaphore this run simply
+ * does not publish.
+ *
+ * @param snapshot Snapshot from CaptureDeviceList()
+ */
+void PublishSnapshot(DeviceSnapshot *snapshot) {
+  SharedSnapshot *shared;
+  SharedSnapshot *created = NULL;
+
+  /* Allocate outside Forbid(); freed again if someone else won the race */
+  Forbid();
+  shared = (SharedSnapshot *)FindSemaphore((STRPTR)SNAPSHOT_SEMAPHORE);
+  Permit();
+
+  if (!shared) {
+    created = AllocMem(sizeof(SharedSnapshot), MEMF_PUBLIC | MEMF_CLEAR);
+    if (!created) {
+      return;
+    }
+
+    strcpy(created->semaphoreName, SNAPSHOT_SEMAPHORE);
+    created->semaphore.ss_Link.ln_Name = created->semaphoreName;
+    created->semaphore.ss_Link.ln_Pri = 0;
+    created->version = SNAPSHOT_VERSION;
+    created->size = sizeof(SharedSnapshot);
+
+    Forbid();
+    shared = (SharedSnapshot *)FindSemaphore((STRPTR)SNAPSHOT_SEMAPHORE);
+    if (!shared) {
+      AddSemaphore(&created->semaphore);
+      shared = created;
+      created = NULL;
+    }
+    Permit();
+
+    if (created) {
+      FreeMem(created, sizeof(SharedSnapshot));
+    }
+  }
+
+  if (shared->version != SNAPSHOT_VERSION ||
+      shared->size != sizeof(SharedSnapshot)) {
+    return;  /* Published by an incompatible version */
+  }
+
+  if (!AttemptSemaphore(&shared->semaphore)) {
+    return;
+  }
+
+  shared->sequence++;  /* Odd: readers will retry */
+  shared->data.fingerprint = snapshot->fingerprint;
+  shared->data.stamp = snapshot->stamp;
+  shared->data.count = snapshot->count;
+  memcpy(shared->data.entries, snapshot->entries,
+    snapshot->count * sizeof(SnapshotEntry));
+  shared->sequence++;  /* Even: consistent again */
+
+  ReleaseSemaphore(&shared->semaphore);
+}
+
+/**
+ * Get the device list view for this run
+ *
+ * Uses the published snapshot when it is still current, otherwise walks
+ * the list once and publishes the result.
+ *
+ * @return Snapshot or NULL if the list does not fit a snapshot
+ */
+DeviceSnapshot *GetDeviceSnapshot(void) {
+  Context *context = GetContext();
+  DeviceSnapshot *snapshot;
+
+  if (!context) {
+    return NULL;
+  }
+
+  if (context->snapshot) {
+    return context->snapshot;
+  }
+
+  snapshot = RunAlloc(sizeof(DeviceSnapshot));
+  if (!snapshot) {
+    return NULL;
+  }
+
+  if (!ReadSharedSnapshot(snapshot)) {
+    if (!CaptureDeviceList(snapshot)) {
+      RunFree(snapshot, sizeof(DeviceSnapshot));
+      return NULL;
+    }
+    PublishSnapshot(snapshot);
+  }
+
+  context->snapshot = snapshot;
+
+  return snapshot;
+}
+
+/**
+ * Find an entry by DOS name
+ *
+ * @param snapshot Snapshot to search
+ * @param name Name without colon
+ * @return Entry or NULL
+ */
+SnapshotEntry *SnapshotFindName(DeviceSnapshot *snapshot, const char *name) {
+  ULONG key[SNAPSHOT_NAME_SIZE / 4];
+  const ULONG *entryKey;
+  ULONG i;
+  int w;
+
+  if (!MakeNameKey(name, key)) {
+    return NULL;  /* Longer than any name a snapshot can hold */
+  }
+
+  for (i = 0; i < snapshot->count; i++) {
+    entryKey = snapshot->entries[i].nameKey;
+
+    /* Most names differ in their first longword */
+    if (entryKey[0] != key[0]) {
+      continue;
+    }
+    for (w = 1; w < SNAPSHOT_NAME_SIZE / 4; w++) {
+      if (entryKey[w] != key[w]) {
+        break;
+      }
+    }
+    if (w == SNAPSHOT_NAME_SIZE / 4) {
+      return &snapshot->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Build the comparison key for a DOS name
+ *
+ * Keys are upper cased (ASCII and Latin-1) and zero padded to a whole
+ * number of longwords, so lookups compare 32 bits at a time instead of
+ * calling stricmp() per entry.
+ *
+ * @param name Name to fold
+ * @param key Receives SNAPSHOT_NAME_SIZE bytes
+ * @return FALSE if the name does not fit
+ */
+BOOL MakeNameKey(const char *name, ULONG *key) {
+  UBYTE *out = (UBYTE *)key;
+  UBYTE c;
+  int i;
+
+  memset(key, 0, SNAPSHOT_NAME_SIZE);
+
+  for (i = 0; name[i]; i++) {
+    if (i >= SNAPSHOT_NAME_SIZE - 1) {
+      return FALSE;
+    }
+    c = (UBYTE)name[i];
+    if ((c >= 'a' && c <= 'z') || (c >= 0xE0 && c <= 0xFE && c != 0xF7)) {
+      c -= 0x20;
+    }
+    out[i] = c;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Find a device entry by driver name and unit number
+ *
+ * @param snapshot Snapshot to search
+ * @param driverName Device driver name
+ * @param unitNum Unit number
+ * @return Entry or NULL
+ */
+SnapshotEntry *SnapshotFindUnit(
+  DeviceSnapshot *snapshot,
+  const char *driverName,
+  LONG unitNum
+) {
+  ULONG i;
+  SnapshotEntry *entry;
+
+  for (i = 0; i < snapshot->count; i++) {
+    entry = &snapshot->entries[i];
+    if (entry->type == DLT_DEVICE && entry->unit == unitNum &&
+        stricmp(entry->driver, driverName) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Capture the full device, volume and assign list
+ *
+ * Only memory reads happen while the list is held; anything that needs
+ * a packet is done afterwards by ProbeCapturedEntries().
+ *
+ * @param count Receives the number of entries
+ * @return Linked list of pool allocated entries (NULL if empty or no memory)
+ */
+CapturedEntry *CaptureFullList(ULONG *count) {
+  struct RootNode *rootNode;
+  struct DosInfo *dosInfo;
+  struct DeviceNode *deviceNode;
+  struct DeviceList *volumeNode;
+  struct DosList *dosList;
+  struct FileSysStartupMsg *startup;
+  struct DosEnvec *environ;
+  CapturedEntry *head = NULL;
+  CapturedEntry *tail = NULL;
+  CapturedEntry *entry;
+  ULONG longs;
+  char *assignName;
+
+  *count = 0;
+
+  rootNode = (struct RootNode *)DOSBase->dl_Root;
+  dosInfo = (struct DosInfo *)BADDR(rootNode->rn_Info);
+
+  Forbid();
+
+  deviceNode = (struct DeviceNode *)BADDR(dosInfo->di_DevInfo);
+  while (deviceNode) {
+    entry = RunAlloc(sizeof(CapturedEntry));
+    if (!entry) {
+      break;
+    }
+
+    entry->type = deviceNode->dn_Type;
+    entry->unit = -1;
+    entry->status = -1;
+    CopyBSTR(deviceNode->dn_Name, entry->name, sizeof(entry->name));
+
+    switch (deviceNode->dn_Type) {
+      case DLT_DEVICE:
+        CopyBSTR(deviceNode->dn_Handler, entry->handler,
+          sizeof(entry->handler));
+        entry->stackSize = deviceNode->dn_StackSize;
+        entry->priority = deviceNode->dn_Priority;
+        entry->running = (BOOL)(deviceNode->dn_Task != NULL);
+
+        if (deviceNode->dn_Startup > 64) {
+          startup = (struct FileSysStartupMsg *)BADDR(deviceNode->dn_Startup);
+          entry->flags |= CAPF_STARTUP;
+          entry->unit = (LONG)startup->fssm_Unit;
+          entry->startupFlags = startup->fssm_Flags;
+          CopyBSTR(startup->fssm_Device, entry->driver,
+            sizeof(entry->driver));
+
+          if (startup->fssm_Environ) {
+            environ = (struct DosEnvec *)BADDR(startup->fssm_Environ);
+            longs = environ->de_TableSize + 1;
+            if (longs > CAPTURE_ENVEC_LONGS) {
+              longs = CAPTURE_ENVEC_LONGS;
+            }
+            memcpy(entry->envec, environ, longs * sizeof(ULONG));
+            entry->envecLongs = (UBYTE)longs;
+          }
+        }
+        break;
+
+      case DLT_VOLUME:
+        volumeNode = (struct DeviceList *)deviceNode;
+        entry->volumeDate = volumeNode->dl_VolumeDate;
+        entry->diskType = volumeNode->dl_DiskType;
+        break;
+
+      case DLT_LATE:
+      case DLT_NONBINDING:
+        dosList = (struct DosList *)deviceNode;
+        assignName = (char *)dosList->dol_misc.dol_assign.dol_AssignName;
+        if (assignName) {
+          strncpy(entry->target, assignName, sizeof(entry->target) - 1);
+        }
+        break;
+    }
+
+    if (tail) {
+      tail->next = entry;
+    }
+    else {
+      head = entry;
+    }
+    tail = entry;
+    (*count)++;
+
+    deviceNode = (struct DeviceNode *)BADDR(deviceNode->dn_Next);
+  }
+
+  Permit();
+
+  return head;
+}
+
+/**
+ * Fill in the results that need a packet: device probes and the
+ * targets of directory assigns
+ *
+ * @param entries Entries from CaptureFullList()
+ */
+void ProbeCapturedEntries(CapturedEntry *entries) {
+  CapturedEntry *entry;
+  struct InfoData *infoData;
+  char fullName[110];
+  BPTR lock;
+
+  for (entry = entries; entry; entry = entry->next) {
+    if (!entry->name[0]) {
+      continue;
+    }
+
+    if (entry->type == DLT_DEVICE && (entry->flags & CAPF_STARTUP)) {
+      infoData = GetRunInfoData();
+      if (!infoData) {
+        continue;
+      }
+
+      entry->status = (BYTE)ProbeMountedVolume(
+        entry->name,
+        infoData,
+        entry->volume,
+        sizeof(entry->volume)
+      );
+      entry->flags |= CAPF_PROBED;
+
+      /* Snapshot readers know mounted, empty and n/a */
+      if (entry->status == STATUS_TIMEOUT) {
+        entry->status = -1;
+      }
+
+      if (entry->status == 0) {
+        entry->diskType = infoData->id_DiskType;
+        entry->numBlocks = infoData->id_NumBlocks;
+        entry->numBlocksUsed = infoData->id_NumBlocksUsed;
+        entry->bytesPerBlock = infoData->id_BytesPerBlock;
+      }
+    }
+    else if (entry->type == DLT_DIRECTORY) {
+      sprintf(fullName, "%s:", entry->name);
+      lock = Lock(fullName, ACCESS_READ);
+      if (lock) {
+        NameFromLock(lock, entry->target, sizeof(entry->target));
+        UnLock(lock);
+      }
+    }
+  }
+}
+
+/* Big endian writers for the capture format */
+#define PUT_BYTE(buf, pos, v) ((buf)[(pos)++] = (UBYTE)(v))
+#define PUT_WORD(buf, pos, v) \
+  (PUT_BYTE(buf, pos, (v) >> 8), PUT_BYTE(buf, pos, (v)))
+#define PUT_LONG(buf, pos, v) \
+  (PUT_WORD(buf, pos, (ULONG)(v) >> 16), PUT_WORD(buf, pos, (v)))
+
+/**
+ * Append a length prefixed string (at most 255 characters)
+ *
+ * @param buffer Record buffer
+ * @param pos Current write position
+ * @param str String to append
+ * @return New write position
+ */
+int PutString(UBYTE *buffer, int pos, const char *str) {
+  int len = strlen(str);
+
+  if (len > 255) {
+    len = 255;
+  }
+  PUT_BYTE(buffer, pos, len);
+  memcpy(&buffer[pos], str, len);
+
+  return pos + len;
+}
+
+/**
+ * Pack one entry into its on-disk record
+ *
+ * Record: UWORD length of the rest, UBYTE type, UBYTE flags, name, then
+ * type specific data. Readers skip what they do not understand using
+ * the length, so fields can be appended in later versions.
+ *
+ * @param entry Entry to pack
+ * @param buffer At least CAPTURE_RECORD_MAX bytes
+ * @return Total record size in bytes
+ */
+int PackCapturedEntry(CapturedEntry *entry, UBYTE *buffer) {
+  int pos = 2;
+  int i;
+
+  PUT_BYTE(buffer, pos, entry->type);
+  PUT_BYTE(buffer, pos, entry->flags);
+  pos = PutString(buffer, pos, entry->name);
+
+  switch (entry->type) {
+    case DLT_DEVICE:
+      pos = PutString(buffer, pos, entry->handler);
+      PUT_LONG(buffer, pos, entry->stackSize);
+      PUT_LONG(buffer, pos, entry->priority);
+
+      if (entry->flags & CAPF_STARTUP) {
+        pos = PutString(buffer, pos, entry->driver);
+        PUT_LONG(buffer, pos, entry->unit);
+        PUT_LONG(buffer, pos, entry->startupFlags);
+        PUT_BYTE(buffer, pos, entry->envecLongs);
+        for (i = 0; i < entry->envecLongs; i++) {
+          PUT_LONG(buffer, pos, entry->envec[i]);
+        }
+      }
+
+      if (entry->flags & CAPF_PROBED) {
+        PUT_BYTE(buffer, pos, entry->status);
+        PUT_LONG(buffer, pos, entry->diskType);
+        PUT_LONG(buffer, pos, entry->numBlocks);
+        PUT_LONG(buffer, pos, entry->numBlocksUsed);
+        PUT_LONG(buffer, pos, entry->bytesPerBlock);
+        pos = PutString(buffer, pos, entry->volume);
+      }
+      break;
+
+    case DLT_VOLUME:
+      PUT_LONG(buffer, pos, entry->volumeDate.ds_Days);
+      PUT_LONG(buffer, pos, entry->volumeDate.ds_Minute);
+      PUT_LONG(buffer, pos, entry->volumeDate.ds_Tick);
+      PUT_LONG(buffer, pos, entry->diskType);
+      break;
+
+    default:
+      pos = PutString(buffer, pos, entry->target);
+      break;
+  }
+
+  buffer[0] = (UBYTE)((pos - 2) >> 8);
+  buffer[1] = (UBYTE)(pos - 2);
+
+  return pos;
+}
+
+/**
+ * Capture the DOS list and probe results into a snapshot file
+ *
+ * @param fileName File to write
+ * @return RC_OK on success, RC_ERROR if nothing could be captured,
+ *         RC_FAIL if the file could not be written
+ */
+int WriteSnapshotFile(const char *fileName) {
+  CapturedEntry *entries;
+  CapturedEntry *entry;
+  struct DateStamp now;
+  UBYTE *buffer;
+  ULONG count;
+  BPTR file;
+  int pos = 0;
+  int len;
+  BOOL ok = TRUE;
+
+  buffer = RunAlloc(CAPTURE_RECORD_MAX);
+  if (!buffer) {
+    return RC_FAIL;
+  }
+
+  entries = CaptureFullList(&count);
+  if (!entries) {
+    OPrintf("Could not capture the DOS list\n");
+    return RC_ERROR;
+  }
+  ProbeCapturedEntries(entries);
+
+  file = Open((STRPTR)fileName, MODE_NEWFILE);
+  if (!file) {
+    OPrintf("Could not create %s\n", fileName);
+    return RC_FAIL;
+  }
+
+  DateStamp(&now);
+  PUT_LONG(buffer, pos, CAPTURE_MAGIC);
+  PUT_WORD(buffer, pos, CAPTURE_VERSION);
+  PUT_WORD(buffer, pos, CAPTURE_HEADER_SIZE);
+  PUT_LONG(buffer, pos, count);
+  PUT_LONG(buffer, pos, now.ds_Days);
+  PUT_LONG(buffer, pos, now.ds_Minute);
+  PUT_LONG(buffer, pos, now.ds_Tick);
+  ok = (Write(file, buffer, pos) == pos);
+
+  for (entry = entries; entry && ok; entry = entry->next) {
+    len = PackCapturedEntry(entry, buffer);
+    ok = (Write(file, buffer, len) == len);
+  }
+
+  Close(file);
+
+  if (!ok) {
+    OPrintf("Error writing %s\n", fileName);
+    DeleteFile((STRPTR)fileName);
+    return RC_FAIL;
+  }
+
+  OPrintf("Captured %lu DOS list entries to %s\n", count, fileName);
+
+  return RC_OK;
+}
+
+/**
+ * Fingerprint a DOSDrivers directory without reading its files
+ *
+ * Combines the directory date with the name, size and date of every
+ * file in it, so added, removed and edited mount files all change the
+ * key. FFS does not update a directory's date when a file in it is
+ * edited in place, which is why the file dates are included.
+ *
+ * @param dirName Directory to examine
+ * @return Fingerprint, 0 if the directory does not exist
+ */
+ULONG DosDriversKey(const char *dirName) {
+  struct FileInfoBlock *fib;
+  BPTR lock;
+  ULONG key = 0;
+  char *c;
+
+  lock = Lock((STRPTR)dirName, ACCESS_READ);
+  if (!lock) {
+    return 0;
+  }
+
+  fib = AllocDosObject(DOS_FIB, NULL);
+  if (fib && Examine(lock, fib)) {
+    key = fib->fib_Date.ds_Days * 1440 + fib->fib_Date.ds_Minute;
+    key = key * 31 + fib->fib_Date.ds_Tick;
+
+    while (ExNext(lock, fib)) {
+      key = key * 31 + fib->fib_Size;
+      key = key * 31 + fib->fib_Date.ds_Days * 1440 + fib->fib_Date.ds_Minute;
+      key = key * 31 + fib->fib_Date.ds_Tick;
+      for (c = fib->fib_FileName; *c; c++) {
+        key = key * 31 + (UBYTE)*c;
+      }
+    }
+  }
+
+  if (fib) {
+    FreeDosObject(DOS_FIB, fib);
+  }
+  UnLock(lock);
+
+  /* Never collide with "directory missing" */
+  return key ? key : 1;
+}
+
+/**
+ * Read the Device and Unit keywords from a mount file
+ *
+ * Mount files hold KEYWORD = value pairs, with C style comments and
+ * optional quotes around values. Only the keywords the index needs are
+ * picked up; everything else is skipped.
+ *
+ * @param path Mount file
+ * @param entry Entry to fill in (name is set by the caller)
+ * @return TRUE if the file could be read
+ */
+BOOL ParseMountFile(const char *path, ConfiguredEntry *entry) {
+  char *buffer;
+  char *p;
+  char *end;
+  char *key;
+  char *value;
+  int keyLen;
+  int valueLen;
+  LONG length;
+  LONG number;
+  BPTR file;
+
+  buffer = RunAlloc(CONFIG_FILE_MAX + 1);
+  if (!buffer) {
+    return FALSE;
+  }
+
+  file = Open((STRPTR)path, MODE_OLDFILE);
+  if (!file) {
+    RunFree(buffer, CONFIG_FILE_MAX + 1);
+    return FALSE;
+  }
+  length = Read(file, buffer, CONFIG_FILE_MAX);
+  Close(file);
+  if (length < 0) {
+    RunFree(buffer, CONFIG_FILE_MAX + 1);
+    return FALSE;
+  }
+  buffer[length] = '\0';
+  end = buffer + length;
+
+  entry->driver[0] = '\0';
+  entry->unit = 0;
+
+  p = buffer;
+  while (p < end) {
+    /* Skip white space, separators and comments */
+    if (*p == '/' && p[1] == '*') {
+      p = strstr(p + 2, "*/");
+      p = p ? p + 2 : end;
+      continue;
+    }
+    if (*p <= ' ' || *p == ';' || *p == '#' || *p == '=') {
+      p++;
+      continue;
+    }
+
+    key = p;
+    while (p < end && *p > ' ' && *p != '=') {
+      p++;
+    }
+    keyLen = p - key;
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '=')) {
+      p++;
+    }
+
+    if (*p == '"') {
+      value = ++p;
+      while (p < end && *p != '"' && *p != '\n') {
+        p++;
+      }
+      valueLen = p - value;
+      if (p < end) {
+        p++;
+      }
+    }
+    else {
+      value = p;
+      while (p < end && *p > ' ' && *p != ';') {
+        p++;
+      }
+      valueLen = p - value;
+    }
+
+    if (keyLen == 6 && strnicmp(key, "Device", 6) == 0) {
+      if (valueLen >= (int)sizeof(entry->driver)) {
+        valueLen = sizeof(entry->driver) - 1;
+      }
+      memcpy(entry->driver, value, valueLen);
+      entry->driver[valueLen] = '\0';
+    }
+    else if (keyLen == 4 && strnicmp(key, "Unit", 4) == 0) {
+      if (valueLen > 2 && value[0] == '0' && (value[1] | 0x20) == 'x') {
+        entry->unit = (LONG)strtoul(value + 2, NULL, 16);
+      }
+      else if (StrToLong((STRPTR)value, &number) > 0) {
+        entry->unit = number;
+      }
+    }
+  }
+
+  RunFree(buffer, CONFIG_FILE_MAX + 1);
+
+  return TRUE;
+}
+
+/**
+ * Parse every mount file in a DOSDrivers directory
+ *
+ * Icons are skipped. A file whose name is already in the index is
+ * skipped too, so DEVS:DOSDrivers wins over Storage when both hold one.
+ *
+ * @param dirName Directory to scan
+ * @param source CONF_* value for the entries found
+ * @param entries Index being built
+ * @param count Entries already in the index
+ * @return New number of entries
+ */
+ULONG ScanDosDrivers(
+  const char *dirName,
+  UBYTE source,
+  ConfiguredEntry *entries,
+  ULONG count
+) {
+  struct FileInfoBlock *fib;
+  ConfiguredEntry *entry;
+  char path[256];
+  BPTR lock;
+  ULONG i;
+  int len;
+
+  lock = Lock((STRPTR)dirName, ACCESS_READ);
+  if (!lock) {
+    return count;
+  }
+
+  fib = AllocDosObject(DOS_FIB, NULL);
+  if (fib && Examine(lock, fib)) {
+    while (count < CONFIG_MAX_ENTRIES && ExNext(lock, fib)) {
+      len = strlen(fib->fib_FileName);
+      if (fib->fib_DirEntryType > 0 || len >= SNAPSHOT_NAME_SIZE ||
+          (len > 5 && stricmp(&fib->fib_FileName[len - 5], ".info") == 0)) {
+        continue;
+      }
+
+      for (i = 0; i < count; i++) {
+        if (stricmp(entries[i].name, fib->fib_FileName) == 0) {
+          break;
+        }
+      }
+      if (i < count) {
+        continue;
+      }
+
+      strcpy(path, dirName);
+      if (!AddPart(path, fib->fib_FileName, sizeof(path))) {
+        continue;
+      }
+
+      entry = &entries[count];
+      memset(entry, 0, sizeof(ConfiguredEntry));
+      strcpy(entry->name, fib->fib_FileName);
+      entry->source = source;
+      if (ParseMountFile(path, entry)) {
+        count++;
+      }
+    }
+  }
+
+  if (fib) {
+    FreeDosObject(DOS_FIB, fib);
+  }
+  UnLock(lock);
+
+  return count;
+}
+
+/**
+ * Get the mount file index, from ENV: when both directories are unchanged
+ *
+ * @param count Receives the number of entries
+ * @return Index in pool memory, or NULL if out of memory
+ */
+ConfiguredEntry *GetConfiguredIndex(ULONG *count) {
+  ConfiguredHeader header;
+  ConfiguredEntry *entries;
+  ULONG keys[2];
+  LONG size;
+  BPTR file;
+
+  *count = 0;
+
+  entries = RunAlloc(CONFIG_MAX_ENTRIES * sizeof(ConfiguredEntry));
+  if (!entries) {
+    return NULL;
+  }
+
+  keys[CONF_ACTIVE] = DosDriversKey(DOSDRIVERS_ACTIVE);
+  keys[CONF_STORAGE] = DosDriversKey(DOSDRIVERS_STORAGE);
+
+  /* Try the cached index first */
+  file = Open((STRPTR)CONFIG_CACHE_FILE, MODE_OLDFILE);
+  if (file) {
+    if (Read(file, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == CONFIG_CACHE_MAGIC &&
+        header.version == CONFIG_CACHE_VERSION &&
+        header.keys[CONF_ACTIVE] == keys[CONF_ACTIVE] &&
+        header.keys[CONF_STORAGE] == keys[CONF_STORAGE] &&
+        header.count <= CONFIG_MAX_ENTRIES) {
+      size = header.count * sizeof(ConfiguredEntry);
+      if (Read(file, entries, size) == size) {
+        *count = header.count;
+        Close(file);
+        return entries;
+      }
+    }
+    Close(file);
+  }
+
+  /* Rebuild and store it for the next run */
+  *count = ScanDosDrivers(DOSDRIVERS_ACTIVE, CONF_ACTIVE, entries, 0);
+  *count = ScanDosDrivers(DOSDRIVERS_STORAGE, CONF_STORAGE, entries, *count);
+
+  header.magic = CONFIG_CACHE_MAGIC;
+  header.version = CONFIG_CACHE_VERSION;
+  header.keys[CONF_ACTIVE] = keys[CONF_ACTIVE];
+  header.keys[CONF_STORAGE] = keys[CONF_STORAGE];
+  header.count = *count;
+
+  file = Open((STRPTR)CONFIG_CACHE_FILE, MODE_NEWFILE);
+  if (file) {
+    size = *count * sizeof(ConfiguredEntry);
+    if (Write(file, &header, sizeof(header)) != sizeof(header) ||
+        Write(file, entries, size) != size) {
+      Close(file);
+      DeleteFile((STRPTR)CONFIG_CACHE_FILE);
+    }
+    else {
+      Close(file);
+    }
+  }
+
+  return entries;
+}
+
+/**
+ * Report configured units merged with the live DOS list
+ *
+ * Every mount file is listed as mounted (with its disk status) or
+ * mountable. Live devices that no mount file describes, such as those
+ * mounted from a MountList or by the boot ROM, are listed as unknown.
+ *
+ * @param driverFilter Only list this driver, NULL for all
+ * @return RC_OK, or RC_ERROR if nothing was found
+ */
+int ListConfiguredDevices(const char *driverFilter) {
+  ConfiguredEntry *configured;
+  CapturedEntry *live;
+  CapturedEntry *entry;
+  struct InfoData *infoData;
+  char volumeName[64];
+  const char *sourceName;
+  ULONG configCount;
+  ULONG liveCount;
+  ULONG listed = 0;
+  ULONG i;
+  BOOL found;
+  int status;
+
+  configured = GetConfiguredIndex(&configCount);
+  if (!configured) {
+    return RC_FAIL;
+  }
+  live = CaptureFullList(&liveCount);
+
+  OPrintf("Configured devices:\n");
+  for (i = 0; i < configCount; i++) {
+    if (driverFilter &&
+        stricmp(configured[i].driver, driverFilter) != 0) {
+      continue;
+    }
+    listed++;
+
+    sourceName = configured[i].source == CONF_ACTIVE ?
+      DOSDRIVERS_ACTIVE : DOSDRIVERS_STORAGE;
+    if (configured[i].driver[0]) {
+      OPrintf("  %s: %s unit %ld (%s) ", configured[i].name,
+        configured[i].driver, configured[i].unit, sourceName);
+    }
+    else {
+      OPrintf("  %s: (%s) ", configured[i].name, sourceName);
+    }
+
+    found = FALSE;
+    for (entry = live; entry; entry = entry->next) {
+      if (entry->type == DLT_DEVICE &&
+          stricmp(entry->name, configured[i].name) == 0) {
+        found = TRUE;
+        break;
+      }
+    }
+    if (!found) {
+      OPrintf("mountable\n");
+      continue;
+    }
+
+    infoData = GetRunInfoData();
+    status = infoData && (entry->flags & CAPF_STARTUP) ?
+      ProbeMountedVolume(entry->name, infoData, volumeName,
+        sizeof(volumeName)) : -1;
+    switch (status) {
+      case 0:
+        OPrintf("mounted, volume \"%s\"\n", volumeName);
+        break;
+      case 1:
+        OPrintf("mounted, no disk\n");
+        break;
+      default:
+        OPrintf("mounted\n");
+        break;
+    }
+  }
+
+  OPrintf("Devices without a mount file:\n");
+  for (entry = live; entry; entry = entry->next) {
+    if (entry->type != DLT_DEVICE || !(entry->flags & CAPF_STARTUP)) {
+      continue;
+    }
+    if (driverFilter &&
+        stricmp(entry->driver, driverFilter) != 0) {
+      continue;
+    }
+
+    found = FALSE;
+    for (i = 0; i < configCount && !found; i++) {
+      found = stricmp(entry->name, configured[i].name) == 0 ||
+        (entry->unit == configured[i].unit &&
+         stricmp(entry->driver, configured[i].driver) == 0);
+    }
+    if (!found) {
+      OPrintf("  %s: %s unit %ld unknown\n", entry->name, entry->driver,
+        entry->unit);
+      listed++;
+    }
+  }
+
+  return listed ? RC_OK : RC_ERROR;
+}
+
+/**
+ * Print command usage
+ */
+void PrintUsage(void) {
+  Printf("Usage: CheckDosDevice <DEVICE> [QUIET] [<DRIVER> driver] [INFO] [MOUNTLIST]\n");
+  Printf("  DEVICE    - DOS device name or unit number\n");
+  Printf("  QUIET     - Suppress output\n");
+  Printf("  DRIVER    - Device driver name (default: diskimage.device)\n");
+  Printf("  INFO      - Show detailed device information\n");
+  Printf("  MOUNTLIST - Generate mountlist entry\n");
+  Printf("  FIELDS    - Report only name,unit,driver,status,volume,space,handler\n");
+  Printf("  SNAPSHOT  - Capture the DOS list and probe results to a file\n");
+  Printf("  PATTERN   - Check every device matching a pattern (e.g. IHD*)\n");
+  Printf("  PRI       - Run at this task priority, yielding between probes\n");
+  Printf("  MAXINFLIGHT - Handler packets outstanding during a scan (default: 1)\n");
+  Printf("  BENCH     - Time N passes of every lookup mode\n");
+  Printf("  TRACE     - Write the last events of the run to a file on exit\n");
+  Printf("  TIMEOUT   - Seconds to wait for a handler (default: forever)\n");
+  Printf("  METRICS   - Write scan results as text metrics to a file\n");
+  Printf("  CONFIGURED - List DOSDrivers units as mounted, mountable or unknown\n");
+  Printf("  PREWARM   - Start the handlers of DEVICE, PATTERN or DRIVER in parallel\n");
+  Printf("  CACHE     - Show each running handler's current buffer count\n");
+  Printf("  REBALANCE - Share this many KB of buffers between handlers\n");
+  Printf("  WEIGHTS   - REBALANCE shares, e.g. DH0=3,DH1=1 (default: by size)\n");
+  Printf("  FSBENCH   - Time file writes, reads, creates and deletes on DEVICE\n");
+  Printf("  FSSIZE    - FSBENCH file size in KB (default: 1024)\n");
+  Printf("  RECSIZES  - FSBENCH record sizes in bytes (default: 512,4096,32768)\n");
+  Printf("  ALIGN     - Check partitions for 4 KiB alignment, propose fixes\n");
+  Printf("  CAPS      - Show the commands each driver unit supports\n");
+  Printf("  IDENTIFY  - Show vendor, product and size of every SCSI unit\n");
+  Printf("  PROBEUNITS - Open units FROM-TO of DRIVER, list them with DOS devices\n");
+  Printf("  SURFACE   - Read all of DEVICE, list bad blocks, show speed and CRC32\n");
+  Printf("  DUMP      - Like SURFACE, writing the partition to an image file\n");
+  Printf("  SPARSE    - DUMP skips zero blocks instead of writing them\n");
+  Printf("\nExamples:\n");
+  Printf("  CheckDosDevice IHD101\n");
+  Printf("  CheckDosDevice 101 INFO\n");
+  Printf("  CheckDosDevice DF0: MOUNTLIST\n");
+  Printf("  CheckDosDevice 0 DRIVER trackdisk.device\n");
+  Printf("  CheckDosDevice IHD101 FIELDS=name\n");
+  Printf("  CheckDosDevice SNAPSHOT=RAM:doslist.snap\n");
+  Printf("  CheckDosDevice PATTERN=IHD* PRI=-5 MAXINFLIGHT=2\n");
+  Printf("  CheckDosDevice PATTERN=* TIMEOUT=10 TRACE=T:cdd.trace\n");
+  Printf("  CheckDosDevice METRICS=RAM:cdd.prom QUIET TIMEOUT=5\n");
+  Printf("  CheckDosDevice CONFIGURED DRIVER=diskimage.device\n");
+  Printf("  CheckDosDevice PREWARM PATTERN=DH* TIMEOUT=30\n");
+  Printf("  CheckDosDevice REBALANCE=2048 WEIGHTS=DH0=3,DH1=1\n");
+  Printf("  CheckDosDevice DH1 FSBENCH FSSIZE=4096 RECSIZES=512,65536\n");
+  Printf("  CheckDosDevice ALIGN PATTERN=DH*\n");
+  Printf("  CheckDosDevice CAPS DRIVER=scsi.device\n");
+  Printf("  CheckDosDevice IDENTIFY TIMEOUT=5\n");
+  Printf("  CheckDosDevice PROBEUNITS=0-6 DRIVER=scsi.device TIMEOUT=5\n");
+  Printf("  CheckDosDevice IHD101 SURFACE\n");
+  Printf("  CheckDosDevice DH1 DUMP=Work:dh1.hdf SPARSE\n");
+}
+
+/**
+ * Open timer.device for E clock timing, once per run
+ *
+ * @return TRUE if ReadRunClock() can be used
+ */
+BOOL OpenRunTimer(void) {
+  Context *context = GetContext();
+
+  if (!context) {
+    return FALSE;
+  }
+  if (context->timerBase) {
+    return TRUE;
+  }
+
+  context->timerPort = CreateMsgPort();
+  if (!context->timerPort) {
+    return FALSE;
+  }
+
+  context->timerReq = (struct timerequest *)CreateIORequest(
+    context->timerPort,
+    sizeof(struct timerequest)
+  );
+  if (!context->timerReq) {
+    DeleteMsgPort(context->timerPort);
+    context->timerPort = NULL;
+    return FALSE;
+  }
+
+  if (OpenDevice((STRPTR)TIMERNAME, UNIT_ECLOCK,
+      (struct IORequest *)context->timerReq, 0) != 0) {
+    DeleteIORequest((struct IORequest *)context->timerReq);
+    DeleteMsgPort(context->timerPort);
+    context->timerReq = NULL;
+    context->timerPort = NULL;
+    return FALSE;
+  }
+
+  context->timerBase = context->timerReq->tr_node.io_Device;
+
+  return TRUE;
+}
+
+/**
+ * Close timer.device if OpenRunTimer() opened it
+ *
+ * @param context Context being torn down
+ */
+void CloseRunTimer(Context *context) {
+  if (context->timerBase) {
+    CloseDevice((struct IORequest *)context->timerReq);
+    context->timerBase = NULL;
+  }
+  if (context->timerReq) {
+    DeleteIORequest((struct IORequest *)context->timerReq);
+    context->timerReq = NULL;
+  }
+  if (context->timerPort) {
+    DeleteMsgPort(context->timerPort);
+    context->timerPort = NULL;
+  }
+  if (context->timeoutReq) {
+    CloseDevice((struct IORequest *)context->timeoutReq);
+    DeleteIORequest((struct IORequest *)context->timeoutReq);
+    context->timeoutReq = NULL;
+  }
+  if (context->timeoutPort) {
+    DeleteMsgPort(context->timeoutPort);
+    context->timeoutPort = NULL;
+  }
+}
+
+/**
+ * Start the scan timeout timer
+ *
+ * @param seconds Timeout in seconds
+ * @param micros Microseconds added to seconds
+ * @return Signal mask of the timer port, 0 if no timer is available
+ */
+ULONG StartTimeout(ULONG seconds, ULONG micros) {
+  Context *context = GetContext();
+
+  if (!context) {
+    return 0;
+  }
+
+  if (!context->timeoutReq) {
+    context->timeoutPort = CreateMsgPort();
+    if (!context->timeoutPort) {
+      return 0;
+    }
+    context->timeoutReq = (struct timerequest *)CreateIORequest(
+      context->timeoutPort,
+      sizeof(struct timerequest)
+    );
+    if (!context->timeoutReq ||
+        OpenDevice((STRPTR)TIMERNAME, UNIT_VBLANK,
+          (struct IORequest *)context->timeoutReq, 0) != 0) {
+      if (context->timeoutReq) {
+        DeleteIORequest((struct IORequest *)context->timeoutReq);
+        context->timeoutReq = NULL;
+      }
+      DeleteMsgPort(context->timeoutPort);
+      context->timeoutPort = NULL;
+      return 0;
+    }
+  }
+
+  context->timeoutReq->tr_node.io_Command = TR_ADDREQUEST;
+  context->timeoutReq->tr_time.tv_secs = seconds;
+  context->timeoutReq->tr_time.tv_micro = micros;
+  SetSignal(0, 1L << context->timeoutPort->mp_SigBit);
+  SendIO((struct IORequest *)context->timeoutReq);
+
+  return 1L << context->timeoutPort->mp_SigBit;
+}
+
+/**
+ * Stop the scan timeout timer, whether or not it has expired
+ */
+void StopTimeout(void) {
+  Context *context = GetContext();
+
+  if (context && context->timeoutReq) {
+    if (!CheckIO((struct IORequest *)context->timeoutReq)) {
+      AbortIO((struct IORequest *)context->timeoutReq);
+    }
+    WaitIO((struct IORequest *)context->timeoutReq);
+  }
+}
+
+/**
+ * Record an event in the trace ring
+ *
+ * Always on: no allocation, one E clock read and a small copy.
+ *
+ * @param event TRACE_* event
+ * @param phase PHASE_* phase
+ * @param name Device name or NULL
+ * @param status Event specific result
+ */
+void TraceEvent(UBYTE event, UBYTE phase, const char *name, LONG status) {
+  Context *context = GetContext();
+  TraceRecord *record;
+  int i;
+
+  if (!context || !context->trace) {
+    return;
+  }
+
+  record = &context->trace[context->traceCount % TRACE_ENTRIES];
+  context->traceCount++;
+
+  ReadRunClock(&record->time);
+  record->event = event;
+  record->phase = phase;
+  record->status = (BYTE)status;
+
+  for (i = 0; name && name[i] && i < TRACE_NAME_SIZE - 1; i++) {
+    record->name[i] = name[i];
+  }
+  record->name[i] = '\0';
+}
+
+/**
+ * Write the trace ring, oldest event first
+ *
+ * @param file Destination (e.g. Output())
+ */
+void DumpTrace(BPTR file) {
+  static const char *phaseNames[PHASE_COUNT] = {
+    "-", "args", "driver", "lookup", "status", "fields", "scan",
+    "snapshot", "bench", "cache"
+  };
+  static const char *eventNames[] = {
+    "?", "enter", "exit", "probe", "reply", "timeout"
+  };
+  Context *context = GetContext();
+  TraceRecord *record;
+  TraceRecord *first;
+  ULONG start;
+  ULONG i;
+  ULONG micros;
+
+  if (!context || !context->trace || !file) {
+    return;
+  }
+
+  start = context->traceCount > TRACE_ENTRIES ?
+    context->traceCount - TRACE_ENTRIES : 0;
+  first = &context->trace[start % TRACE_ENTRIES];
+
+  FPrintf(file, "Trace: last %lu of %lu events\n",
+    context->traceCount - start, context->traceCount);
+
+  for (i = start; i < context->traceCount; i++) {
+    record = &context->trace[i % TRACE_ENTRIES];
+    micros = ElapsedMicros(&first->time, &record->time);
+    FPrintf(file, "  +%6lu.%03lus %-7s %-8s %-12s %ld\n",
+      micros / 1000, micros % 1000,
+      (STRPTR)eventNames[record->event <= TRACE_TIMEOUT ? record->event : 0],
+      (STRPTR)phaseNames[record->phase < PHASE_COUNT ? record->phase : 0],
+      (STRPTR)(record->name[0] ? record->name : "-"),
+      (LONG)record->status);
+  }
+}
+
+/**
+ * Print the trace ring after a handler was abandoned, unless QUIET
+ *
+ * TRACE=<file> still receives the ring on exit.
+ */
+void DumpStallTrace(void) {
+  Context *context = GetContext();
+
+  if (context && !context->quiet) {
+    DumpTrace(Output());
+  }
+}
+
+/**
+ * Write the trace ring to the TRACE=<file> file, if one was given
+ */
+void WriteTraceFile(void) {
+  Context *context = GetContext();
+  BPTR file;
+
+  if (!context || !context->traceFile) {
+    return;
+  }
+
+  file = Open((STRPTR)context->traceFile, MODE_NEWFILE);
+  if (file) {
+    DumpTrace(file);
+    Close(file);
+  }
+}
+
+/**
+ * Read the E clock
+ *
+ * @param clock Receives the current E clock value (zero if no timer)
+ */
+void ReadRunClock(struct EClockVal *clock) {
+  Context *context = GetContext();
+  struct Device *TimerBase;   /* Picked up by the ReadEClock() call */
+
+  if (!context || !context->timerBase) {
+    clock->ev_hi = 0;
+    clock->ev_lo = 0;
+    return;
+  }
+
+  TimerBase = context->timerBase;
+  context->eclockFreq = ReadEClock(clock);
+}
+
+/**
+ * Microseconds between two E clock readings
+ *
+ * Uses only 32 bit multiplies and divides, which the 68060 executes in
+ * hardware (its 64 bit MULU.L/DIVU.L forms trap to 68060.library).
+ *
+ * @param start Earlier reading
+ * @param end Later reading
+ * @return Elapsed microseconds, saturating at 0xFFFFFFFF
+ */
+ULONG ElapsedMicros(struct EClockVal *start, struct EClockVal *end) {
+  Context *context = GetContext();
+  ULONG freq;
+  ULONG ticks;
+  ULONG secs;
+  ULONG rem;
+
+  if (!context || !context->eclockFreq) {
+    return 0;
+  }
+  freq = context->eclockFreq;
+
+  /* More than 2^32 ticks is well over an hour; saturate */
+  if (end->ev_hi - start->ev_hi > 1 ||
+      (end->ev_hi != start->ev_hi && end->ev_lo >= start->ev_lo)) {
+    return 0xFFFFFFFF;
+  }
+  ticks = end->ev_lo - start->ev_lo;
+
+  secs = ticks / freq;
+  rem = ticks % freq;
+  if (secs >= 4294) {
+    return 0xFFFFFFFF;
+  }
+
+  return secs * 1000000 + (rem * 1000 / freq) * 1000 +
+    ((rem * 1000 % freq) * 1000) / freq;
+}
+
+/**
+ * Name of the CPU this binary was built for
+ */
+const char *BuildCpuName(void) {
+#if CPU_VARIANT == 60
+  return "68060";
+#elif CPU_VARIANT == 20
+  return "68020";
+#else
+  return "68000";
+#endif
+}
+
+/**
+ * Name of the CPU we are running on, from AttnFlags
+ */
+const char *RunningCpuName(void) {
+  UWORD attn = SysBase->AttnFlags;
+
+  if (attn & AFF_68060) {
+    return "68060";
+  }
+  if (attn & AFF_68040) {
+    return "68040";
+  }
+  if (attn & AFF_68030) {
+    return "68030";
+  }
+  if (attn & AFF_68020) {
+    return "68020";
+  }
+  if (attn & AFF_68010) {
+    return "68010";
+  }
+  return "68000";
+}
+
+/**
+ * Time every lookup mode and probe backend against the live DOS list
+ *
+ * Each pass looks up every entry once per mode. Results are labelled
+ * with the build variant so the CPU specific binaries can be compared
+ * on the same machine.
+ *
+ * @param iterations Passes per mode
+ * @return RC_OK, RC_WARN on Ctrl-C, RC_FAIL without timer or snapshot
+ */
+int RunLookupBenchmark(LONG iterations) {
+  static const char *modeNames[] = {
+    "name (list walk)",
+    "driver+unit (list walk)",
+    "name (snapshot)",
+    "driver+unit (snapshot)"
+  };
+  DeviceSnapshot *snapshot;
+  SnapshotEntry *entry;
+  struct EClockVal start;
+  struct EClockVal end;
+  ULONG lookups;
+  ULONG micros;
+  ULONG i;
+  LONG pass;
+  int mode;
+
+  snapshot = GetDeviceSnapshot();
+  if (!snapshot || !OpenRunTimer()) {
+    OPrintf("Lookup benchmark needs timer.device and a snapshot of the DOS list\n");
+    return RC_FAIL;
+  }
+
+  OPrintf("Lookup benchmark: %s build on %s, %lu entries, %ld passes\n",
+    BuildCpuName(), RunningCpuName(), snapshot->count, iterations);
+
+  for (mode = 0; mode < 4; mode++) {
+    lookups = 0;
+    ReadRunClock(&start);
+
+    for (pass = 0; pass < iterations; pass++) {
+      if (CheckSignal(SIGBREAKF_CTRL_C)) {
+        OPrintf("***Break\n");
+        return RC_WARN;
+      }
+
+      for (i = 0; i < snapshot->count; i++) {
+        entry = &snapshot->entries[i];
+        switch (mode) {
+          case 0:
+            FindDosDevice(entry->name);
+            break;
+          case 1:
+            if (!entry->driver[0]) {
+              continue;
+            }
+            WalkDeviceByDriverAndUnit(entry->driver, entry->unit, NULL, 0);
+            break;
+          case 2:
+            SnapshotFindName(snapshot, entry->name);
+            break;
+          case 3:
+            if (!entry->driver[0]) {
+              continue;
+            }
+            SnapshotFindUnit(snapshot, entry->driver, entry->unit);
+            break;
+        }
+        lookups++;
+      }
+    }
+
+    ReadRunClock(&end);
+    micros = ElapsedMicros(&start, &end);
+
+    if (lookups) {
+      OPrintf("  %-24s %8lu lookups %6lu.%02lu us/lookup\n",
+        modeNames[mode], lookups, micros / lookups,
+        ((micros % lookups) * 100) / lookups);
+    }
+  }
+
+  return RunProbeBenchmark(snapshot, iterations);
+}
+
+/**
+ * Time each probe backend's queries against the devices it serves
+ *
+ * Every backend with devices in the snapshot is timed for its exists,
+ * media and free unit queries. Backends with their own media query are
+ * also timed through Lock()/Info() on the same devices for comparison.
+ *
+ * @param snapshot Current device list snapshot
+ * @param iterations Passes over the devices per query
+ * @return RC_OK, RC_WARN if interrupted
+ */
+int RunProbeBenchmark(DeviceSnapshot *snapshot, LONG iterations) {
+  static const char *queryNames[] = {
+    "exists",
+    "media",
+    "free unit",
+    "media (Lock/Info)"
+  };
+  const ProbeBackend *generic = &probeBackends[PROBE_BACKEND_COUNT - 1];
+  const ProbeBackend *backend;
+  SnapshotEntry *entry;
+  struct DeviceNode *deviceNode;
+  struct EClockVal start;
+  struct EClockVal end;
+  ULONG calls;
+  ULONG units;
+  ULONG micros;
+  ULONG b;
+  ULONG i;
+  LONG pass;
+  int query;
+
+  OPrintf("Probe backends: %ld passes\n", iterations);
+
+  for (b = 0; b < PROBE_BACKEND_COUNT; b++) {
+    backend = &probeBackends[b];
+
+    units = 0;
+    for (i = 0; i < snapshot->count; i++) {
+      entry = &snapshot->entries[i];
+      if (entry->type == DLT_DEVICE && entry->driver[0] &&
+          FindProbeBackend(entry->driver) == backend) {
+        units++;
+      }
+    }
+    if (!units) {
+      continue;
+    }
+
+    OPrintf("  %s, %lu devices\n",
+      backend->driver ? backend->driver : "generic", units);
+
+    for (query = 0; query < PROBE_QUERIES + 1; query++) {
+      if (query == PROBE_QUERIES && backend->media == generic->media) {
+        break;
+      }
+
+      calls = 0;
+      ReadRunClock(&start);
+
+      for (pass = 0; pass < iterations; pass++) {
+        if (CheckSignal(SIGBREAKF_CTRL_C)) {
+          OPrintf("***Break\n");
+          return RC_WARN;
+        }
+
+        for (i = 0; i < snapshot->count; i++) {
+          entry = &snapshot->entries[i];
+          if (entry->type != DLT_DEVICE || !entry->driver[0] ||
+              FindProbeBackend(entry->driver) != backend) {
+            continue;
+          }
+          switch (query) {
+            case 0:
+              backend->exists(entry->driver, entry->unit, NULL, 0);
+              break;
+            case 1:
+            case 3:
+              deviceNode = FindDosDevice(entry->name);
+              if (!deviceNode) {
+                continue;
+              }
+              (query == 1 ? backend : generic)->media(entry->name,
+                deviceNode, NULL, 0);
+              break;
+            case 2:
+              backend->freeUnit(entry->driver, entry->unit);
+              break;
+          }
+          calls++;
+        }
+      }
+
+      ReadRunClock(&end);
+      micros = ElapsedMicros(&start, &end);
+
+      if (calls) {
+        OPrintf("    %-22s %8lu calls %6lu.%02lu us/call\n",
+          queryNames[query], calls, micros / calls,
+          ((micros % calls) * 100) / calls);
+      }
+    }
+  }
+
+  return RC_OK;
+}
+
+#if CPU_VARIANT == 0
+/**
+ * Run the best CPU specific build instead of this 68000 one
+ *
+ * Only the 68000 build carries this dispatcher. It looks for
+ * CheckDosDevice.060 or CheckDosDevice.020 next to itself (or in C:
+ * when resident) and runs it with our own arguments. Installing the
+ * matching variant as C:CheckDosDevice avoids the extra LoadSeg().
+ *
+ * A lookup that finds nothing is remembered in ENV: with the date of
+ * the directory and the CPU, so later runs skip the LoadSeg() calls
+ * until a file is added to the directory. It runs before any other
+ * setup, so a variant that is found costs this build nothing more.
+ *
+ * @param rc Receives the variant's return code
+ * @return TRUE if a variant ran
+ */
+BOOL DispatchCpuVariant(LONG *rc) {
+  static const char *variants[] = { ".060", ".020" };
+  struct CommandLineInterface *cli = Cli();
+  struct FileInfoBlock *fib;
+  UWORD attn = SysBase->AttnFlags;
+  VariantMiss miss;
+  char path[64];
+  BPTR segList = 0;
+  BPTR dir;
+  BPTR file;
+  STRPTR argStr;
+  ULONG key = 0;
+  int first;
+  int i;
+
+  if (!cli) {
+    return FALSE;
+  }
+
+  if (attn & AFF_68060) {
+    first = 0;
+  }
+  else if (attn & AFF_68020) {
+    first = 1;
+  }
+  else {
+    return FALSE;
+  }
+
+  /* Adding a file to the directory changes its date */
+  fib = AllocDosObject(DOS_FIB, NULL);
+  dir = GetProgramDir() ? GetProgramDir() : Lock((STRPTR)"C:", ACCESS_READ);
+  if (fib && dir && Examine(dir, fib)) {
+    key = fib->fib_Date.ds_Days * 1440 + fib->fib_Date.ds_Minute;
+    key = key * 31 + fib->fib_Date.ds_Tick;
+    key = key * 31 + first + 1;
+  }
+  if (dir && !GetProgramDir()) {
+    UnLock(dir);
+  }
+  if (fib) {
+    FreeDosObject(DOS_FIB, fib);
+  }
+
+  if (key) {
+    file = Open((STRPTR)VARIANT_MISS_FILE, MODE_OLDFILE);
+    if (file) {
+      if (Read(file, &miss, sizeof(miss)) == sizeof(miss) &&
+          miss.magic == VARIANT_MISS_MAGIC &&
+          miss.version == VARIANT_MISS_VERSION &&
+          miss.key == key) {
+        Close(file);
+        return FALSE;
+      }
+      Close(file);
+    }
+  }
+
+  for (i = first; i < 2 && !segList; i++) {
+    strcpy(path, GetProgramDir() ? "PROGDIR:" : "C:");
+    strcat(path, "CheckDosDevice");
+    strcat(path, variants[i]);
+    segList = LoadSeg(path);
+  }
+
+  if (!segList) {
+    if (key) {
+      miss.magic = VARIANT_MISS_MAGIC;
+      miss.version = VARIANT_MISS_VERSION;
+      miss.key = key;
+      file = Open((STRPTR)VARIANT_MISS_FILE, MODE_NEWFILE);
+      if (file) {
+        if (Write(file, &miss, sizeof(miss)) != sizeof(miss)) {
+          Close(file);
+          DeleteFile((STRPTR)VARIANT_MISS_FILE);
+        }
+        else {
+          Close(file);
+        }
+      }
+    }
+    return FALSE;
+  }
+
+  argStr = GetArgStr();
+  *rc = RunCommand(segList, cli->cli_DefaultStack * 4, argStr, strlen(argStr));
+  UnLoadSeg(segList);
+
+  /* RunCommand() returns -1 if it could not start the variant */
+  return (BOOL)(*rc != -1);
+}
+#endif
+
+int exitWith(int rc) {
+#ifdef DEBUG
+  struct Task *task = FindTask(NULL);
   Context *context = (Context *)task->tc_UserData;
 
-  if (context && context->magic == CONTEXT_MAGIC) {
-    task->tc_UserData = context->oldContext;
-    FreeVec(context);
+  if (context && context->magic == CONTEXT_MAGIC) {
+    OPrintf("[debug] %lu pooled allocations, %lu bytes\n",
+      context->allocCount, context->allocBytes);
+  }
+#endif
+
+  WriteTraceFile();
+  FreeContext();
+
+  return rc;
+}
+
+/**
+ * Main entry point
+ *
+ * @param argc Argument count, 0 when started from Workbench
+ * @param argv Arguments, or the WBStartup message when argc is 0
+ */
+int main(int argc, char **argv) {
+  struct RDArgs *rdArgs = NULL;
+  struct Arguments args = { 0 };
+  Context contextStorage;
+  Context *context;
+  BOOL timerOpen;
+
+  char volumeName[64];
+  char cleanName[108];
+  char foundDevice[108];
+  STRPTR driverName;
+  struct DeviceNode *deviceNode;
+  struct Process *proc;
+  APTR oldWindowPtr;
+  int status;
+  int returnCode = RC_ERROR;
+  LONG unitNum;
+  LONG unitFrom;
+  LONG unitTo;
+  ULONG fields = 0;
+  LONG badField;
+  DeviceFacts facts;
+  ScanOptions scanOptions;
+#if CPU_VARIANT == 0
+  LONG variantRC;
+#endif
+
+#if CPU_VARIANT == 0
+  /* Hand over to a faster CPU specific build before any setup */
+  if (DispatchCpuVariant(&variantRC)) {
+    return (int)variantRC;
+  }
+#endif
+
+  context = InstallContext(&contextStorage);
+  timerOpen = OpenRunTimer();  /* Trace timestamps */
+
+  /* Double clicked disk image: mount it, no Shell window or script */
+  if (argc == 0) {
+    return exitWith(MountFromWorkbench((struct WBStartup *)argv));
+  }
+
+  /* Parse command line arguments */
+  TraceEvent(TRACE_ENTER, PHASE_ARGS, NULL, timerOpen);
+  rdArgs = ReadArgs(TEMPLATE, (LONG *)&args, NULL);
+  if (!rdArgs) {
+    PrintUsage();
+    return exitWith(RC_ERROR);
+  }
+
+  /* The name must outlive FreeArgs() to be written by exitWith() */
+  if (args.trace) {
+    context->traceFile = RunAlloc(strlen(args.trace) + 1);
+    if (context->traceFile) {
+      strcpy(context->traceFile, args.trace);
+    }
+  }
+  TraceEvent(TRACE_EXIT, PHASE_ARGS, args.device, 0);
+
+  /* These modes do not work on a single device */
+  if (!args.device && !args.snapshot && !args.pattern && !args.metrics &&
+      !args.bench && !args.configured && !args.prewarm && !args.cache &&
+      !args.rebalance && !args.align && !args.caps && !args.identify &&
+      !args.probeUnits) {
+    PrintUsage();
+    FreeArgs(rdArgs);
+    return exitWith(RC_ERROR);
+  }
+
+  /* One selects a device, the other a set; neither may win silently */
+  if (args.device && args.pattern) {
+    Printf("DEVICE and PATTERN cannot be used together\n");
+    FreeArgs(rdArgs);
+    return exitWith(RC_ERROR);
+  }
+
+  /* Set global quiet flag */
+  context->quiet = args.quiet ? TRUE : FALSE;
+  context->probeTimeout = args.timeout && *args.timeout > 0 ?
+    (ULONG)*args.timeout : 0;
+
+  /* Get driver name (default to diskimage.device) */
+  driverName = args.driver ? args.driver : (STRPTR)"diskimage.device";
+
+  /* Disable system requesters early to prevent any popups */
+  proc = (struct Process *)FindTask(NULL);
+  oldWindowPtr = proc->pr_WindowPtr;
+  proc->pr_WindowPtr = (APTR)-1L;
+
+  /* Run below the shell's priority for background checks */
+  if (args.pri) {
+    if (*args.pri < -128 || *args.pri > 127) {
+      Printf("PRI must be between -128 and 127\n");
+      proc->pr_WindowPtr = oldWindowPtr;
+      FreeArgs(rdArgs);
+      return exitWith(RC_ERROR);
+    }
+    context->oldPri = SetTaskPri((struct Task *)proc, *args.pri);
+    context->priSet = TRUE;
+  }
+
+  /* Physical drive behind every SCSI unit */
+  if (args.identify) {
+    returnCode = IdentifyUnits(args.driver,
+      args.timeout && *args.timeout > 0 ? (ULONG)*args.timeout : 0);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Every unit of DRIVER in a range, mounted or not */
+  if (args.probeUnits) {
+    if (!ParseUnitRange(args.probeUnits, &unitFrom, &unitTo)) {
+      Printf("PROBEUNITS must be FROM-TO, at most %ld units\n",
+        (LONG)PROBEUNITS_MAX);
+      returnCode = RC_ERROR;
+    }
+    else if (!CheckDeviceDriver(driverName)) {
+      OPrintf("Device driver %s not available\n", driverName);
+      returnCode = RC_FAIL;
+    }
+    else {
+      returnCode = ProbeDriverUnits(driverName, unitFrom, unitTo,
+        args.timeout && *args.timeout > 0 ? (ULONG)*args.timeout : 0);
+    }
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Command set of every driver unit */
+  if (args.caps) {
+    returnCode = ReportDriverCaps(args.driver);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Partition alignment of DEVICE, PATTERN or every device */
+  if (args.align) {
+    if (args.device && IsNumber(args.device)) {
+      if (!FindProbeBackend(driverName)->exists(driverName, atol(args.device),
+          foundDevice, sizeof(foundDevice))) {
+        OPrintf("No %s found with unit %s\n", driverName, args.device);
+        proc->pr_WindowPtr = oldWindowPtr;
+        FreeArgs(rdArgs);
+        return exitWith(RC_ERROR);
+      }
+      StripDeviceName(foundDevice, cleanName, sizeof(cleanName));
+    }
+    else if (args.device) {
+      StripDeviceName(args.device, cleanName, sizeof(cleanName));
+    }
+    else {
+      strcpy(cleanName, args.pattern ? (char *)args.pattern : "*");
+    }
+    returnCode = AnalyzeAlignment(cleanName);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Report or redistribute handler buffers */
+  if (args.cache || args.rebalance) {
+    if (args.rebalance && *args.rebalance <= 0) {
+      Printf("REBALANCE must be a positive number of KB\n");
+      returnCode = RC_ERROR;
+    }
+    else {
+      returnCode = ManageCache(
+        args.pattern ? args.pattern : (STRPTR)"*",
+        args.rebalance ? (ULONG)*args.rebalance : 0,
+        args.weights
+      );
+    }
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Start the selected handlers side by side */
+  if (args.prewarm) {
+    scanOptions.maxInFlight = args.maxInFlight && *args.maxInFlight > 0 ?
+      (ULONG)*args.maxInFlight : 0;
+    scanOptions.yield = args.pri ? TRUE : FALSE;
+    scanOptions.timeout = args.timeout && *args.timeout > 0 ?
+      (ULONG)*args.timeout : 0;
+    scanOptions.metricsFile = NULL;
+
+    if (args.pattern) {
+      strncpy(cleanName, args.pattern, sizeof(cleanName) - 1);
+      cleanName[sizeof(cleanName) - 1] = '\0';
+    }
+    else if (args.device && IsNumber(args.device)) {
+      if (!FindProbeBackend(driverName)->exists(driverName, atol(args.device),
+          foundDevice, sizeof(foundDevice))) {
+        OPrintf("No %s found with unit %s\n", driverName, args.device);
+        proc->pr_WindowPtr = oldWindowPtr;
+        FreeArgs(rdArgs);
+        return exitWith(RC_ERROR);
+      }
+      StripDeviceName(foundDevice, cleanName, sizeof(cleanName));
+    }
+    else if (args.device) {
+      StripDeviceName(args.device, cleanName, sizeof(cleanName));
+    }
+    else {
+      strcpy(cleanName, "*");
+    }
+
+    returnCode = PrewarmDevices(cleanName, args.driver, &scanOptions);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Scan every device matching a pattern, all of them for METRICS */
+  if (args.pattern || args.metrics) {
+    scanOptions.maxInFlight = args.maxInFlight && *args.maxInFlight > 0 ?
+      (ULONG)*args.maxInFlight : 1;
+    scanOptions.yield = args.pri ? TRUE : FALSE;
+    scanOptions.timeout = args.timeout && *args.timeout > 0 ?
+      (ULONG)*args.timeout : 0;
+    scanOptions.metricsFile = args.metrics;
+    returnCode = FindMatchingDevices(
+      args.pattern ? args.pattern : (STRPTR)"*",
+      &scanOptions
+    );
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Time the lookup modes for this CPU variant */
+  if (args.bench) {
+    TraceEvent(TRACE_ENTER, PHASE_BENCH, NULL, 0);
+    returnCode = *args.bench > 0 ? RunLookupBenchmark(*args.bench) : RC_ERROR;
+    TraceEvent(TRACE_EXIT, PHASE_BENCH, NULL, returnCode);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Capture the whole DOS list for offline replay */
+  if (args.snapshot) {
+    TraceEvent(TRACE_ENTER, PHASE_SNAPSHOT, NULL, 0);
+    returnCode = WriteSnapshotFile(args.snapshot);
+    TraceEvent(TRACE_EXIT, PHASE_SNAPSHOT, NULL, returnCode);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Mount files merged with live status */
+  if (args.configured) {
+    returnCode = ListConfiguredDevices(args.driver);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* File system throughput through the handler */
+  if (args.fsbench) {
+    if (!args.device) {
+      Printf("FSBENCH needs a DEVICE\n");
+      returnCode = RC_ERROR;
+    }
+    else if (args.fsSize && (*args.fsSize <= 0 || *args.fsSize > FSBENCH_MAX_KB)) {
+      Printf("FSSIZE must be 1 to %ld KB\n", (LONG)FSBENCH_MAX_KB);
+      returnCode = RC_ERROR;
+    }
+    else if (IsNumber(args.device) &&
+        !FindProbeBackend(driverName)->exists(driverName, atol(args.device),
+          foundDevice, sizeof(foundDevice))) {
+      OPrintf("No %s found with unit %s\n", driverName, args.device);
+      returnCode = RC_ERROR;
+    }
+    else {
+      StripDeviceName(IsNumber(args.device) ? foundDevice : (char *)args.device,
+        cleanName, sizeof(cleanName));
+      returnCode = RunFsBenchmark(
+        cleanName,
+        args.fsSize ? (ULONG)*args.fsSize : FSBENCH_DEFAULT_KB,
+        args.recSizes ? (char *)args.recSizes : FSBENCH_DEFAULT_SIZES
+      );
+    }
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Raw read of the whole partition, optionally into an image file */
+  if (args.surface || args.dump) {
+    if (!args.device) {
+      Printf("%s needs a DEVICE\n", args.dump ? "DUMP" : "SURFACE");
+      returnCode = RC_ERROR;
+    }
+    else if (IsNumber(args.device) &&
+        !FindProbeBackend(driverName)->exists(driverName, atol(args.device),
+          foundDevice, sizeof(foundDevice))) {
+      OPrintf("No %s found with unit %s\n", driverName, args.device);
+      returnCode = RC_ERROR;
+    }
+    else {
+      StripDeviceName(IsNumber(args.device) ? foundDevice : (char *)args.device,
+        cleanName, sizeof(cleanName));
+      returnCode = SurfaceScan(cleanName, args.dump, args.sparse ? TRUE : FALSE);
+    }
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* Field selective mode only performs the operations its fields need */
+  if (args.fields) {
+    badField = ParseFields(args.fields, &fields);
+    if (badField || !fields) {
+      Printf("Unknown field in FIELDS=%s\n", args.fields);
+      proc->pr_WindowPtr = oldWindowPtr;
+      FreeArgs(rdArgs);
+      return exitWith(RC_ERROR);
+    }
+
+    TraceEvent(TRACE_ENTER, PHASE_FIELDS, args.device, 0);
+    if (IsNumber(args.device)) {
+      unitNum = atol(args.device);
+      if (!FindProbeBackend(driverName)->exists(
+        driverName,
+        unitNum,
+        foundDevice,
+        sizeof(foundDevice)
+      )) {
+        /* Only a miss needs the driver to pick ERROR over FAIL */
+        if (CheckDeviceDriver(driverName)) {
+          OPrintf("No %s found with unit %ld\n", driverName, unitNum);
+          returnCode = RC_ERROR;
+        }
+        else {
+          OPrintf("Device driver %s not available\n", driverName);
+          returnCode = RC_FAIL;
+        }
+        TraceEvent(TRACE_EXIT, PHASE_FIELDS, args.device, returnCode);
+        proc->pr_WindowPtr = oldWindowPtr;
+        FreeArgs(rdArgs);
+        return exitWith(returnCode);
+      }
+      StripDeviceName(foundDevice, cleanName, sizeof(cleanName));
+    }
+    else {
+      StripDeviceName(args.device, cleanName, sizeof(cleanName));
+    }
+
+    if (!GatherDeviceFacts(cleanName, PlanFieldOps(fields), &facts)) {
+      returnCode = RC_ERROR;
+    }
+    else if (facts.status == STATUS_NOMEMORY) {
+      OPrintf("%s: not enough memory\n", cleanName);
+      SetIoErr(ERROR_NO_FREE_STORE);
+      returnCode = RC_FAIL;
+    }
+    else {
+      PrintDeviceFacts(&facts, fields);
+      returnCode = RC_OK;
+      if ((fields & (FIELD_STATUS | FIELD_VOLUME | FIELD_SPACE)) &&
+          facts.status != 0) {
+        returnCode = RC_WARN;
+      }
+    }
+    TraceEvent(TRACE_EXIT, PHASE_FIELDS, cleanName, returnCode);
+
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(returnCode);
+  }
+
+  /* First check if the device driver is available */
+  if (!CheckDeviceDriver(driverName)) {
+    OPrintf("Device driver %s not available\n", driverName);
+    proc->pr_WindowPtr = oldWindowPtr;
+    FreeArgs(rdArgs);
+    return exitWith(RC_FAIL);
+  }
+
+  /* Check if argument is a pure number */
+  if (IsNumber(args.device)) {
+    /* Convert to unit number */
+    unitNum = atol(args.device);
+
+    /* Find device with this unit number and driver */
+    TraceEvent(TRACE_ENTER, PHASE_LOOKUP, args.device, 0);
+    if (FindProbeBackend(driverName)->exists(
+      driverName,
+      unitNum,
+      foundDevice,
+      sizeof(foundDevice)
+    )) {
+      TraceEvent(TRACE_EXIT, PHASE_LOOKUP, foundDevice, 1);
+      OPrintf("Found %s unit %ld as %s:\n", driverName, unitNum, foundDevice);
+      /* Use the found device name for checking */
+      StripDeviceName(foundDevice, cleanName, sizeof(cleanName));
+    }
+    else {
+      TraceEvent(TRACE_EXIT, PHASE_LOOKUP, args.device, 0);
+      OPrintf("No %s found with unit %ld\n", driverName, unitNum);
+      proc->pr_WindowPtr = oldWindowPtr;
+      FreeArgs(rdArgs);
+      return exitWith(RC_ERROR);
+    }
+  }
+  else {
+    /* Normal device name */
+    StripDeviceName(args.device, cleanName, sizeof(cleanName));
+  }
+
+  /* Get device node for INFO/MOUNTLIST operations */
+  deviceNode = FindDosDevice(cleanName);
+
+  /* Show device info if requested */
+  if (args.info && deviceNode) {
+    ShowDeviceInfo(cleanName, deviceNode);
+  }
+
+  /* Generate mountlist if requested */
+  if (args.mountlist && deviceNode) {
+    GenerateMountlist(cleanName, deviceNode);
+  }
+
+  /* Check device status (unless we only want info/mountlist) */
+  if (!args.info && !args.mountlist) {
+    status = CheckDeviceStatus(cleanName, volumeName, sizeof(volumeName));
+
+    switch (status) {
+      case 0:  /* Volume mounted */
+        if (volumeName[0]) {
+          OPrintf("%s: has mounted volume \"%s\"\n", cleanName, volumeName);
+        }
+        else {
+          OPrintf("%s: has mounted volume\n", cleanName);
+        }
+        returnCode = RC_OK;
+        break;
+
+      case 1:  /* No disk present */
+        OPrintf("%s: no disk present\n", cleanName);
+        returnCode = RC_WARN;
+        break;
+
+      case -1:  /* Device not found */
+        OPrintf("%s: device not found\n", cleanName);
+        returnCode = RC_ERROR;
+        break;
+
+      case STATUS_TIMEOUT:
+        OPrintf("%s: no reply from handler\n", cleanName);
+        returnCode = RC_WARN;
+        break;
+
+      case STATUS_NOMEMORY:
+        OPrintf("%s: not enough memory\n", cleanName);
+        SetIoErr(ERROR_NO_FREE_STORE);
+        returnCode = RC_FAIL;
+        break;
+    }
+  }
+  else if (deviceNode) {
+    /* If only info/mountlist requested and device exists, return OK */
+    returnCode = RC_OK;
+  }
+
+  /* Restore requester state */
+  proc->pr_WindowPtr = oldWindowPtr;
+
+  /* Free the ReadArgs structure */
+  FreeArgs(rdArgs);
+
+  return exitWith(returnCode);
+}
+
+/**
+ * Check whether a device name matches a scan pattern
+ *
+ * A trailing '*' matches any suffix; otherwise the name must match
+ * exactly. Comparison is case insensitive.
+ *
+ * @param pattern Pattern such as "IHD*"
+ * @param name Device name without colon
+ * @return TRUE if the name matches
+ */
+BOOL MatchDevicePattern(const char *pattern, const char *name) {
+  int patLen = strlen(pattern);
+
+  if (patLen > 0 && pattern[patLen - 1] == '*') {
+    return (BOOL)(strnicmp(name, pattern, patLen - 1) == 0);
+  }
+
+  return (BOOL)(stricmp(name, pattern) == 0);
+}
+
+/**
+ * Collect the devices a scan will probe
+ *
+ * Names come from the shared snapshot when it is current, so a scan
+ * normally does not hold Forbid() at all. Otherwise the list is walked
+ * once.
+ *
+ * @param pattern Pattern passed to MatchDevicePattern()
+ * @param count Receives the number of items
+ * @return Pool allocated array or NULL if nothing matched
+ */
+ScanItem *CollectScanItems(const char *pattern, ULONG *count) {
+  DeviceSnapshot *snapshot;
+  CapturedEntry *entries;
+  CapturedEntry *entry;
+  ScanItem *items;
+  ULONG total;
+  ULONG i;
+
+  *count = 0;
+
+  snapshot = GetDeviceSnapshot();
+  if (snapshot) {
+    items = RunAlloc(snapshot->count * sizeof(ScanItem) + 1);
+    if (!items) {
+      return NULL;
+    }
+    for (i = 0; i < snapshot->count; i++) {
+      if (snapshot->entries[i].type == DLT_DEVICE &&
+          MatchDevicePattern(pattern, snapshot->entries[i].name)) {
+        strcpy(items[*count].name, snapshot->entries[i].name);
+        strcpy(items[*count].driver, snapshot->entries[i].driver);
+        items[*count].status = -1;
+        (*count)++;
+      }
+    }
+  }
+  else {
+    entries = CaptureFullList(&total);
+    items = RunAlloc(total * sizeof(ScanItem) + 1);
+    if (!items) {
+      return NULL;
+    }
+    for (entry = entries; entry; entry = entry->next) {
+      if (entry->type == DLT_DEVICE && entry->name[0] &&
+          MatchDevicePattern(pattern, entry->name)) {
+        strcpy(items[*count].name, entry->name);
+        strncpy(items[*count].driver, entry->driver,
+          sizeof(items[*count].driver) - 1);
+        items[*count].status = -1;
+        (*count)++;
+      }
+    }
+  }
+
+  return *count ? items : NULL;
+}
+
+/**
+ * Send a non-blocking ACTION_DISK_INFO packet to a device's handler
+ *
+ * Starts the handler if it is not running yet. If that fails the item
+ * is completed immediately as "no disk", matching a failed Lock().
+ *
+ * The packet and its InfoData come from AllocMem(), not the pool: a
+ * handler that is abandoned may still write to them, so only they are
+ * leaked then and the pool can always be deleted.
+ *
+ * @param item Item to probe
+ * @param replyPort Port that receives the reply
+ * @return TRUE if a packet is now outstanding
+ */
+BOOL SendDiskInfo(ScanItem *item, struct MsgPort *replyPort) {
+  char fullName[110];
+  struct StandardPacket *packet;
+
+  item->packet = AllocMem(sizeof(struct StandardPacket),
+    MEMF_PUBLIC | MEMF_CLEAR);
+  item->infoData = AllocMem(sizeof(struct InfoData), MEMF_PUBLIC | MEMF_CLEAR);
+  if (!item->packet || !item->infoData) {
+    FreeDiskInfo(item);
+    item->status = 1;
+    return FALSE;
+  }
+
+  /* GetDeviceProc() starts a dormant handler, so time it too */
+  sprintf(fullName, "%s:", item->name);
+  ReadRunClock(&item->sent);
+  item->devProc = GetDeviceProc(fullName, NULL);
+  if (!item->devProc || !item->devProc->dvp_Port) {
+    if (item->devProc) {
+      FreeDeviceProc(item->devProc);
+      item->devProc = NULL;
+    }
+    FreeDiskInfo(item);
+    item->status = STATUS_NOHANDLER;
+    return FALSE;
+  }
+
+  packet = item->packet;
+  packet->sp_Msg.mn_Node.ln_Name = (char *)&packet->sp_Pkt;
+  packet->sp_Pkt.dp_Link = &packet->sp_Msg;
+  packet->sp_Pkt.dp_Port = replyPort;
+  packet->sp_Pkt.dp_Type = ACTION_DISK_INFO;
+  packet->sp_Pkt.dp_Arg1 = MKBADDR(item->infoData);
+
+  TraceEvent(TRACE_PROBE, PHASE_SCAN, item->name, 0);
+  PutMsg(item->devProc->dvp_Port, &packet->sp_Msg);
+
+  return TRUE;
+}
+
+/**
+ * Free the packet and InfoData of an item that has no packet out
+ *
+ * @param item Item to clean up
+ */
+void FreeDiskInfo(ScanItem *item) {
+  if (item->packet) {
+    FreeMem(item->packet, sizeof(struct StandardPacket));
+    item->packet = NULL;
+  }
+  if (item->infoData) {
+    FreeMem(item->infoData, sizeof(struct InfoData));
+    item->infoData = NULL;
+  }
+}
+
+/**
+ * Record the result of a replied ACTION_DISK_INFO packet
+ *
+ * @param item Item whose packet came back
+ */
+void CompleteDiskInfo(ScanItem *item) {
+  struct DeviceList *volumeNode;
+  struct InfoData *info = item->infoData;
+  struct EClockVal now;
+
+  ReadRunClock(&now);
+  item->micros = ElapsedMicros(&item->sent, &now);
+  item->status = 1;
+
+  if (item->packet->sp_Pkt.dp_Res1 &&
+      info->id_DiskType != ID_NO_DISK_PRESENT) {
+    item->status = 0;
+    item->totalKB = BlocksToKB(info->id_NumBlocks, info->id_BytesPerBlock);
+    item->freeKB = BlocksToKB(info->id_NumBlocks - info->id_NumBlocksUsed,
+      info->id_BytesPerBlock);
+    volumeNode = BADDR(item->infoData->id_VolumeNode);
+    if (volumeNode) {
+      CopyBSTR(volumeNode->dl_Name, item->volume, sizeof(item->volume));
+    }
+  }
+  memcpy(&item->info, info, sizeof(struct InfoData));
+
+  TraceEvent(TRACE_REPLY, PHASE_SCAN, item->name, item->status);
+
+  FreeDeviceProc(item->devProc);
+  item->devProc = NULL;
+  FreeDiskInfo(item);
+}
+
+/**
+ * Wait for one outstanding packet and complete its item
+ *
+ * Ctrl-D dumps the trace ring while waiting, so a stalled handler can be
+ * identified without stopping the scan. Ctrl-C or the scan timeout end
+ * the wait without a reply. The timeout counts from when the oldest
+ * outstanding packet was sent, so replies from other handlers do not
+ * extend the wait for a stalled one.
+ *
+ * @param items Scan items
+ * @param count Number of items
+ * @param replyPort Port the packets reply to
+ * @param options Scan options (timeout)
+ * @return TRUE if a reply arrived, FALSE on timeout or Ctrl-C
+ */
+BOOL WaitDiskInfo(
+  ScanItem *items,
+  ULONG count,
+  struct MsgPort *replyPort,
+  ScanOptions *options
+) {
+  struct Message *msg;
+  struct DosPacket *packet;
+  struct EClockVal now;
+  ULONG timeoutMask = 0;
+  ULONG signals;
+  ULONG waited = 0;
+  ULONG micros;
+  ULONG i;
+  BOOL expired = FALSE;
+
+  if (options->timeout) {
+    ReadRunClock(&now);
+    for (i = 0; i < count; i++) {
+      if (items[i].devProc) {
+        micros = ElapsedMicros(&items[i].sent, &now);
+        if (micros > waited) {
+          waited = micros;
+        }
+      }
+    }
+    if (waited / 1000000 >= options->timeout) {
+      expired = TRUE;
+    }
+    else if (waited % 1000000) {
+      timeoutMask = StartTimeout(options->timeout - waited / 1000000 - 1,
+        1000000 - waited % 1000000);
+    }
+    else {
+      timeoutMask = StartTimeout(options->timeout - waited / 1000000, 0);
+    }
+  }
+
+  while (!(msg = GetMsg(replyPort))) {
+    if (expired) {
+      return FALSE;
+    }
+    signals = Wait((1L << replyPort->mp_SigBit) | timeoutMask |
+      SIGBREAKF_CTRL_C | SIGBREAKF_CTRL_D);
+
+    if (signals & SIGBREAKF_CTRL_D) {
+      DumpTrace(Output());
+    }
+    if (signals & (SIGBREAKF_CTRL_C | timeoutMask)) {
+      /* A reply may have raced the timer */
+      msg = GetMsg(replyPort);
+      if (!msg) {
+        if (timeoutMask) {
+          StopTimeout();
+        }
+        if (signals & SIGBREAKF_CTRL_C) {
+          SetSignal(SIGBREAKF_CTRL_C, SIGBREAKF_CTRL_C);  /* For the caller */
+        }
+        return FALSE;
+      }
+      break;
+    }
+  }
+
+  if (timeoutMask) {
+    StopTimeout();
+  }
+
+  packet = (struct DosPacket *)msg->mn_Node.ln_Name;
+  for (i = 0; i < count; i++) {
+    if (items[i].devProc && &items[i].packet->sp_Pkt == packet) {
+      CompleteDiskInfo(&items[i]);
+      break;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * Give up on every outstanding packet
+ *
+ * The handlers still own the packets and will reply eventually, so the
+ * packets, their InfoData and the reply port, left with PA_IGNORE, are
+ * leaked. None of them is in the pool. The trace ring is printed, unless
+ * QUIET, to show which probes stalled.
+ *
+ * @param items Scan items
+ * @param count Number of items
+ * @param replyPort Port the packets reply to
+ */
+void AbandonDiskInfo(ScanItem *items, ULONG count, struct MsgPort *replyPort) {
+  ULONG i;
+
+  for (i = 0; i < count; i++) {
+    if (items[i].devProc) {
+      items[i].status = STATUS_TIMEOUT;
+      TraceEvent(TRACE_TIMEOUT, PHASE_SCAN, items[i].name, 0);
+      FreeDeviceProc(items[i].devProc);
+      items[i].devProc = NULL;
+      items[i].packet = NULL;
+      items[i].infoData = NULL;
+    }
+  }
+
+  Forbid();
+  replyPort->mp_Flags = PA_IGNORE;
+  Permit();
+
+  DumpStallTrace();
+}
+
+/**
+ * Probe every scan item, keeping at most maxInFlight packets outstanding
+ *
+ * @param items Scan items
+ * @param count Number of items
+ * @param options Scan options
+ * @return TRUE if all items were probed, FALSE on Ctrl-C or no memory
+ */
+BOOL ProbeScanItems(ScanItem *items, ULONG count, ScanOptions *options) {
+  struct MsgPort *replyPort;
+  ULONG next;
+  ULONG inFlight = 0;
+  BOOL completed = TRUE;
+
+  replyPort = CreateMsgPort();
+  if (!replyPort) {
+    return FALSE;
+  }
+
+  for (next = 0; next < count; next++) {
+    if (CheckSignal(SIGBREAKF_CTRL_C)) {
+      completed = FALSE;
+      break;
+    }
+
+    while (inFlight >= options->maxInFlight) {
+      if (!WaitDiskInfo(items, count, replyPort, options)) {
+        AbandonDiskInfo(items, count, replyPort);
+        return FALSE;
+      }
+      inFlight--;
+    }
+
+    if (SendDiskInfo(&items[next], replyPort)) {
+      inFlight++;
+    }
+
+    /* Give equal or lower priority tasks a chance between probes */
+    if (options->yield) {
+      Delay(1);
+    }
+  }
+
+  /* Always collect every outstanding reply before the port goes away */
+  while (inFlight > 0) {
+    if (!WaitDiskInfo(items, count, replyPort, options)) {
+      AbandonDiskInfo(items, count, replyPort);
+      return FALSE;
+    }
+    inFlight--;
+  }
+
+  DeleteMsgPort(replyPort);
+
+  return completed;
+}
+
+/**
+ * Find all devices matching a pattern and check their status
+ *
+ * Works on a copy of the device names, so the DOS list is never held
+ * while handlers are asked for their status.
+ *
+ * @param pattern Pattern such as "IHD*" or an exact device name
+ * @param options Scan options (packets in flight, yielding)
+ * @return RC_OK if devices were found, RC_ERROR if none matched,
+ *         RC_WARN if the scan was interrupted
+ */
+int FindMatchingDevices(const char *pattern, ScanOptions *options) {
+  ScanItem *items;
+  ULONG count;
+  ULONG i;
+  BOOL completed;
+  struct EClockVal start;
+  struct EClockVal end;
+  int rc = RC_OK;
+
+  OPrintf("Devices matching pattern \"%s\":\n", pattern);
+
+  items = CollectScanItems(pattern, &count);
+  if (!items) {
+    OPrintf("No devices found matching pattern \"%s\"\n", pattern);
+    return RC_ERROR;
+  }
+
+  TraceEvent(TRACE_ENTER, PHASE_SCAN, NULL, count);
+  ReadRunClock(&start);
+  completed = ProbeScanItems(items, count, options);
+  ReadRunClock(&end);
+  TraceEvent(TRACE_EXIT, PHASE_SCAN, NULL, completed);
+
+  for (i = 0; i < count; i++) {
+    switch (items[i].status) {
+      case 0:
+        if (items[i].volume[0]) {
+          OPrintf("  %s: Volume \"%s\"\n", items[i].name, items[i].volume);
+        }
+        else {
+          OPrintf("  %s: Volume mounted\n", items[i].name);
+        }
+        break;
+      case 1:
+      case STATUS_NOHANDLER:
+        OPrintf("  %s: No disk present\n", items[i].name);
+        break;
+      case STATUS_TIMEOUT:
+        OPrintf("  %s: No reply from handler\n", items[i].name);
+        break;
+    }
+  }
+
+  if (!completed) {
+    OPrintf("Scan did not complete\n");
+    rc = RC_WARN;
+  }
+
+  /* Partial scans are exported too; the timeout count shows why */
+  if (options->metricsFile) {
+    if (WriteMetricsFile(options->metricsFile, items, count,
+        ElapsedMicros(&start, &end)) != RC_OK) {
+      rc = RC_FAIL;
+    }
+  }
+
+  return rc;
+}
+
+/**
+ * Write a metrics label value, escaping quotes and backslashes
+ *
+ * @param file Open file
+ * @param value Label value
+ */
+void PutMetricsLabel(BPTR file, const char *value) {
+  FPutC(file, '"');
+  for (; *value; value++) {
+    if (*value == '"' || *value == '\\') {
+      FPutC(file, '\\');
+    }
+    FPutC(file, *value);
+  }
+  FPutC(file, '"');
+}
+
+/**
+ * Write scan results as Prometheus style text metrics
+ *
+ * The file is written under a temporary name and then renamed over the
+ * old one, so a collector never reads a half written file. AmigaDOS
+ * Rename() will not replace an existing file, so the old one is deleted
+ * first; a reader can briefly find no file, but never a partial one.
+ *
+ * @param fileName Destination file
+ * @param items Probed scan items
+ * @param count Number of items
+ * @param scanMicros Duration of the whole scan
+ * @return RC_OK on success, RC_FAIL if the file could not be written
+ */
+int WriteMetricsFile(
+  const char *fileName,
+  ScanItem *items,
+  ULONG count,
+  ULONG scanMicros
+) {
+  static const char *stateNames[METRICS_STATES] = {
+    "mounted", "empty", "timeout", "absent"
+  };
+  static const ULONG bucketMicros[METRICS_BUCKETS] = {
+    1000, 5000, 20000, 100000, 500000, 2000000
+  };
+  static const char *bucketNames[METRICS_BUCKETS] = {
+    "0.001", "0.005", "0.02", "0.1", "0.5", "2"
+  };
+  const char *drivers[METRICS_MAX_DRIVERS];
+  ULONG driverStates[METRICS_MAX_DRIVERS][METRICS_STATES];
+  ULONG buckets[METRICS_BUCKETS];
+  ULONG driverCount = 0;
+  ULONG answered = 0;
+  ULONG timeouts = 0;
+  ULONG sumMillis = 0;
+  ULONG state;
+  ULONG i;
+  ULONG d;
+  ULONG b;
+  char tempName[256];
+  struct DateStamp now;
+  BPTR file;
+  LONG ok;
+
+  memset(driverStates, 0, sizeof(driverStates));
+  memset(buckets, 0, sizeof(buckets));
+
+  for (i = 0; i < count; i++) {
+    switch (items[i].status) {
+      case 0:               state = 0; break;
+      case 1:               state = 1; break;
+      case STATUS_TIMEOUT:  state = 2; break;
+      default:              state = 3; break;
+    }
+
+    /* Drivers beyond the table are counted under the last slot */
+    for (d = 0; d < driverCount; d++) {
+      if (stricmp(drivers[d], items[i].driver) == 0) {
+        break;
+      }
+    }
+    if (d == driverCount) {
+      if (driverCount < METRICS_MAX_DRIVERS) {
+        drivers[driverCount++] = items[i].driver;
+      }
+      else {
+        d = METRICS_MAX_DRIVERS - 1;
+      }
+    }
+    driverStates[d][state]++;
+
+    if (state == 2) {
+      timeouts++;
+    }
+    else if (state <= 1) {
+      answered++;
+      sumMillis += items[i].micros / 1000;
+      for (b = 0; b < METRICS_BUCKETS; b++) {
+        if (items[i].micros <= bucketMicros[b]) {
+          buckets[b]++;
+        }
+      }
+    }
+  }
+
+  if (strlen(fileName) + 5 > sizeof(tempName)) {
+    return RC_FAIL;
+  }
+  sprintf(tempName, "%s.tmp", fileName);
+
+  file = Open((STRPTR)tempName, MODE_NEWFILE);
+  if (!file) {
+    OPrintf("Could not create %s\n", tempName);
+    return RC_FAIL;
+  }
+
+  DateStamp(&now);
+
+  FPrintf(file, "# HELP cdd_devices Devices matched by the scan.\n");
+  FPrintf(file, "# TYPE cdd_devices gauge\n");
+  for (d = 0; d < driverCount; d++) {
+    for (state = 0; state < METRICS_STATES; state++) {
+      FPrintf(file, "cdd_devices{driver=");
+      PutMetricsLabel(file, drivers[d][0] ? drivers[d] : "none");
+      FPrintf(file, ",state=\"%s\"} %lu\n",
+        (STRPTR)stateNames[state], driverStates[d][state]);
+    }
+  }
+
+  FPrintf(file, "# HELP cdd_volume_free_kilobytes Free space on mounted volumes.\n");
+  FPrintf(file, "# TYPE cdd_volume_free_kilobytes gauge\n");
+  for (i = 0; i < count; i++) {
+    if (items[i].status == 0) {
+      FPrintf(file, "cdd_volume_free_kilobytes{device=");
+      PutMetricsLabel(file, items[i].name);
+      FPrintf(file, ",volume=");
+      PutMetricsLabel(file, items[i].volume);
+      FPrintf(file, "} %lu\n", items[i].freeKB);
+    }
+  }
+
+  FPrintf(file, "# HELP cdd_volume_size_kilobytes Size of mounted volumes.\n");
+  FPrintf(file, "# TYPE cdd_volume_size_kilobytes gauge\n");
+  for (i = 0; i < count; i++) {
+    if (items[i].status == 0) {
+      FPrintf(file, "cdd_volume_size_kilobytes{device=");
+      PutMetricsLabel(file, items[i].name);
+      FPrintf(file, ",volume=");
+      PutMetricsLabel(file, items[i].volume);
+      FPrintf(file, "} %lu\n", items[i].totalKB);
+    }
+  }
+
+  FPrintf(file, "# HELP cdd_probe_latency_seconds ACTION_DISK_INFO round trip.\n");
+  FPrintf(file, "# TYPE cdd_probe_latency_seconds histogram\n");
+  for (b = 0; b < METRICS_BUCKETS; b++) {
+    FPrintf(file, "cdd_probe_latency_seconds_bucket{le=\"%s\"} %lu\n",
+      (STRPTR)bucketNames[b], buckets[b]);
+  }
+  FPrintf(file, "cdd_probe_latency_seconds_bucket{le=\"+Inf\"} %lu\n", answered);
+  FPrintf(file, "cdd_probe_latency_seconds_sum %lu.%03lu\n",
+    sumMillis / 1000, sumMillis % 1000);
+  FPrintf(file, "cdd_probe_latency_seconds_count %lu\n", answered);
+
+  FPrintf(file, "# HELP cdd_probe_timeouts Handlers that did not reply in time.\n");
+  FPrintf(file, "# TYPE cdd_probe_timeouts gauge\n");
+  FPrintf(file, "cdd_probe_timeouts %lu\n", timeouts);
+
+  FPrintf(file, "# HELP cdd_scan_duration_seconds Time taken by the whole scan.\n");
+  FPrintf(file, "# TYPE cdd_scan_duration_seconds gauge\n");
+  FPrintf(file, "cdd_scan_duration_seconds %lu.%06lu\n",
+    scanMicros / 1000000, scanMicros % 1000000);
+
+  FPrintf(file, "# HELP cdd_scan_timestamp_seconds When the scan ran.\n");
+  FPrintf(file, "# TYPE cdd_scan_timestamp_seconds gauge\n");
+  FPrintf(file, "cdd_scan_timestamp_seconds %lu\n",
+    (ULONG)now.ds_Days * 86400 + (ULONG)now.ds_Minute * 60 +
+    (ULONG)now.ds_Tick / TICKS_PER_SECOND + AMIGA_EPOCH_OFFSET);
+
+  /* Buffered write errors only surface when the buffer is flushed */
+  ok = Flush(file);
+  if (!Close(file)) {
+    ok = FALSE;
+  }
+
+  if (ok) {
+    DeleteFile((STRPTR)fileName);
+    ok = Rename((STRPTR)tempName, (STRPTR)fileName);
+  }
+  if (!ok) {
+    OPrintf("Error writing %s\n", fileName);
+    DeleteFile((STRPTR)tempName);
+    return RC_FAIL;
+  }
+
+  return RC_OK;
+}
+
+/**
+ * Mark scan items whose handler has not been started yet
+ *
+ * @param items Scan items
+ * @param count Number of items
+ */
+void MarkDormantItems(ScanItem *items, ULONG count) {
+  struct RootNode *rootNode;
+  struct DosInfo *dosInfo;
+  struct DeviceNode *deviceNode;
+  char devName[108];
+  ULONG i;
+
+  rootNode = (struct RootNode *)DOSBase->dl_Root;
+  dosInfo = (struct DosInfo *)BADDR(rootNode->rn_Info);
+
+  /* One walk for all items; dn_Task is only stable under Forbid() */
+  Forbid();
+
+  deviceNode = (struct DeviceNode *)BADDR(dosInfo->di_DevInfo);
+  while (deviceNode) {
+    if (deviceNode->dn_Type == DLT_DEVICE && !deviceNode->dn_Task &&
+        CopyBSTR(deviceNode->dn_Name, devName, sizeof(devName))) {
+      for (i = 0; i < count; i++) {
+        if (stricmp(items[i].name, devName) == 0) {
+          items[i].dormant = TRUE;
+          break;
+        }
+      }
+    }
+    deviceNode = (struct DeviceNode *)BADDR(deviceNode->dn_Next);
+  }
+
+  Permit();
+}
+
+/**
+ * Start the handlers of the selected devices concurrently
+ *
+ * Each handler is started by GetDeviceProc() and then sent an
+ * ACTION_DISK_INFO packet without waiting for the reply, so the slow
+ * part of a handler's startup (reading and validating the disk) runs
+ * in parallel on every device instead of one after another as scripts
+ * touch them.
+ *
+ * @param pattern Device pattern, a plain name selects one device
+ * @param driverFilter Only prewarm devices of this driver, NULL for all
+ * @param options Scan options; maxInFlight 0 means all at once
+ * @return RC_OK, RC_WARN if a handler did not become ready
+ */
+int PrewarmDevices(
+  const char *pattern,
+  const char *driverFilter,
+  ScanOptions *options
+) {
+  ScanItem *items;
+  ULONG count;
+  ULONG selected = 0;
+  ULONG dormant = 0;
+  ULONG i;
+  BOOL completed;
+  int rc = RC_OK;
+
+  items = CollectScanItems(pattern, &count);
+  if (!items) {
+    OPrintf("No devices found matching pattern \"%s\"\n", pattern);
+    return RC_ERROR;
+  }
+
+  /* Keep only the driver asked for */
+  for (i = 0; i < count; i++) {
+    if (!driverFilter ||
+        stricmp(items[i].driver, driverFilter) == 0) {
+      if (selected != i) {
+        items[selected] = items[i];
+      }
+      selected++;
+    }
+  }
+  if (!selected) {
+    OPrintf("No %s devices found matching pattern \"%s\"\n",
+      driverFilter, pattern);
+    return RC_ERROR;
+  }
+
+  MarkDormantItems(items, selected);
+  for (i = 0; i < selected; i++) {
+    if (items[i].dormant) {
+      dormant++;
+    }
+  }
+
+  if (!options->maxInFlight) {
+    options->maxInFlight = selected;
+  }
+
+  OPrintf("Prewarming %lu devices (%lu dormant):\n", selected, dormant);
+
+  TraceEvent(TRACE_ENTER, PHASE_SCAN, NULL, selected);
+  completed = ProbeScanItems(items, selected, options);
+  TraceEvent(TRACE_EXIT, PHASE_SCAN, NULL, completed);
+
+  for (i = 0; i < selected; i++) {
+    switch (items[i].status) {
+      case 0:
+      case 1:
+        OPrintf("  %s: ready in %lu ms%s%s\n", items[i].name,
+          items[i].micros / 1000,
+          items[i].dormant ? " (started)" : " (already running)",
+          items[i].status == 1 ? ", no disk" : "");
+        break;
+      case STATUS_TIMEOUT:
+        OPrintf("  %s: no reply from handler\n", items[i].name);
+        rc = RC_WARN;
+        break;
+      case STATUS_NOHANDLER:
+        OPrintf("  %s: handler could not be started\n", items[i].name);
+        rc = RC_WARN;
+        break;
+    }
+  }
+
+  if (!completed) {
+    OPrintf("Prewarm did not complete\n");
+    rc = RC_WARN;
+  }
+
+  return rc;
+}
+
+/**
+ * Send ACTION_MORE_CACHE to a running handler
+ *
+ * FFS and most V36+ handlers return their new buffer total; a delta of
+ * 0 only asks for it. Old handlers return DOSTRUE, and those that do not
+ * know the packet return 0; both are reported as -1.
+ *
+ * The packet is sent without blocking and waited for like a scan probe:
+ * TIMEOUT=<n> abandons a handler that does not reply, Ctrl-C stops the
+ * wait and Ctrl-D prints the trace ring.
+ *
+ * @param deviceName Device name without colon
+ * @param delta Buffers to add, negative to remove
+ * @return Buffer total after the change, -1 if unknown or no reply
+ */
+LONG SendMoreCache(const char *deviceName, LONG delta) {
+  Context *context = GetContext();
+  struct StandardPacket *packet;
+  struct MsgPort *replyPort;
+  struct DevProc *devProc = NULL;
+  char fullName[110];
+  ULONG timeoutMask = 0;
+  ULONG signals;
+  LONG result;
+
+  /* Not from the pool, as an abandoned packet is leaked */
+  sprintf(fullName, "%s:", deviceName);
+  packet = AllocMem(sizeof(struct StandardPacket), MEMF_PUBLIC | MEMF_CLEAR);
+  replyPort = CreateMsgPort();
+  if (packet && replyPort) {
+    devProc = GetDeviceProc(fullName, NULL);
+  }
+  if (!devProc || !devProc->dvp_Port) {
+    if (devProc) {
+      FreeDeviceProc(devProc);
+    }
+    if (replyPort) {
+      DeleteMsgPort(replyPort);
+    }
+    if (packet) {
+      FreeMem(packet, sizeof(struct StandardPacket));
+    }
+    return -1;
+  }
+
+  packet->sp_Msg.mn_Node.ln_Name = (char *)&packet->sp_Pkt;
+  packet->sp_Pkt.dp_Link = &packet->sp_Msg;
+  packet->sp_Pkt.dp_Port = replyPort;
+  packet->sp_Pkt.dp_Type = ACTION_MORE_CACHE;
+  packet->sp_Pkt.dp_Arg1 = delta;
+
+  TraceEvent(TRACE_PROBE, PHASE_CACHE, deviceName, delta);
+  PutMsg(devProc->dvp_Port, &packet->sp_Msg);
+  FreeDeviceProc(devProc);
+
+  if (context && context->probeTimeout) {
+    timeoutMask = StartTimeout(context->probeTimeout, 0);
+  }
+
+  while (!GetMsg(replyPort)) {
+    signals = Wait((1L << replyPort->mp_SigBit) | timeoutMask |
+      SIGBREAKF_CTRL_C | SIGBREAKF_CTRL_D);
+
+    if (signals & SIGBREAKF_CTRL_D) {
+      DumpTrace(Output());
+    }
+    if (signals & (SIGBREAKF_CTRL_C | timeoutMask)) {
+      /* A reply may have raced the timer */
+      if (GetMsg(replyPort)) {
+        break;
+      }
+      if (timeoutMask) {
+        StopTimeout();
+      }
+      if (signals & SIGBREAKF_CTRL_C) {
+        SetSignal(SIGBREAKF_CTRL_C, SIGBREAKF_CTRL_C);  /* For the caller */
+      }
+
+      /* The handler still owns the packet; see AbandonDiskInfo() */
+      TraceEvent(TRACE_TIMEOUT, PHASE_CACHE, deviceName, 0);
+      Forbid();
+      replyPort->mp_Flags = PA_IGNORE;
+      Permit();
+      DumpStallTrace();
+      return -1;
+    }
+  }
+
+  if (timeoutMask) {
+    StopTimeout();
+  }
+  DeleteMsgPort(replyPort);
+
+  result = packet->sp_Pkt.dp_Res1;
+  TraceEvent(TRACE_REPLY, PHASE_CACHE, deviceName, result);
+  FreeMem(packet, sizeof(struct StandardPacket));
+
+  return result > 0 ? result : -1;
+}
+
+/**
+ * Collect the running handlers matching a pattern with their buffer counts
+ *
+ * Dormant handlers are left alone; querying them would start them.
+ *
+ * @param pattern Device pattern
+ * @param count Receives the number of items
+ * @return Items in pool memory, NULL if none
+ */
+CacheItem *CollectCacheItems(const char *pattern, ULONG *count) {
+  CapturedEntry *entries;
+  CapturedEntry *entry;
+  CacheItem *items;
+  CacheItem *item;
+  ULONG total;
+  ULONG cylinders;
+
+  *count = 0;
+
+  entries = CaptureFullList(&total);
+  items = RunAlloc(total * sizeof(CacheItem) + 1);
+  if (!entries || !items) {
+    return NULL;
+  }
+
+  for (entry = entries; entry; entry = entry->next) {
+    if (entry->type != DLT_DEVICE || !(entry->flags & CAPF_STARTUP) ||
+        entry->envecLongs <= DE_NUMBUFFERS || !entry->name[0] ||
+        !MatchDevicePattern(pattern, entry->name) || !entry->running) {
+      continue;
+    }
+
+    /* Ctrl-C is left set for ManageCache() */
+    if (SetSignal(0, 0) & SIGBREAKF_CTRL_C) {
+      break;
+    }
+
+    item = &items[*count];
+    strncpy(item->name, entry->name, sizeof(item->name) - 1);
+    if (entry->envecLongs > DE_DOSTYPE && !entry->handler[0]) {
+      strncpy(item->handler, GetHandlerFromDosType(entry->envec[DE_DOSTYPE]),
+        sizeof(item->handler) - 1);
+    }
+    else {
+      strncpy(item->handler, entry->handler, sizeof(item->handler) - 1);
+    }
+    item->blockSize = entry->envec[DE_SIZEBLOCK] * 4;
+    item->configured = entry->envec[DE_NUMBUFFERS];
+
+    /* Partition size from the geometry, so no disk access is needed */
+    cylinders = entry->envec[DE_UPPERCYL] - entry->envec[DE_LOWCYL] + 1;
+    item->sizeKB = BlocksToKB(cylinders * entry->envec[DE_NUMHEADS] *
+      entry->envec[DE_BLKSPERTRACK], item->blockSize);
+
+    item->current = SendMoreCache(item->name, 0);
+    if (item->blockSize && item->current >= 0) {
+      (*count)++;
+    }
+  }
+
+  return *count ? items : NULL;
+}
+
+/**
+ * Look up a device's weight in a WEIGHTS=DH0=3,DH1=1 list
+ *
+ * @param weights Weight list, NULL if none
+ * @param name Device name
+ * @return Weight, 0 if the device is not listed
+ */
+ULONG FindCacheWeight(const char *weights, const char *name) {
+  const char *p = weights;
+  int len = strlen(name);
+  LONG weight;
+
+  while (p && *p) {
+    if (strnicmp(p, name, len) == 0 && p[len] == '=') {
+      if (StrToLong((STRPTR)&p[len + 1], &weight) > 0 && weight > 0) {
+        return (ULONG)weight;
+      }
+      return 0;
+    }
+    p = strchr(p, ',');
+    if (p) {
+      p++;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Report, and optionally redistribute, handler buffer caches
+ *
+ * With a budget, every selected device gets a share of it in proportion
+ * to its weight (WEIGHTS, default 1 per listed device) or otherwise to
+ * its partition size. The CACHE_MIN_BUFFERS every handler keeps come
+ * out of the budget first; only the rest is shared. All targets are
+ * computed before any handler is changed, then each handler gets one
+ * ACTION_MORE_CACHE with the difference.
+ *
+ * @param pattern Devices to include
+ * @param budgetKB Total cache to distribute, 0 to only report
+ * @param weights WEIGHTS list or NULL
+ * @return RC_OK, RC_WARN if a handler refused a change, RC_ERROR if no
+ *         running handler matched or the budget does not cover the
+ *         minimum buffers
+ */
+int ManageCache(const char *pattern, ULONG budgetKB, const char *weights) {
+  CacheItem *items;
+  ULONG count;
+  ULONG sumWeights = 0;
+  ULONG reservedKB = 0;
+  ULONG spareKB;
+  ULONG shareKB;
+  ULONG i;
+  int rc = RC_OK;
+
+  items = CollectCacheItems(pattern, &count);
+  if (CheckSignal(SIGBREAKF_CTRL_C)) {
+    OPrintf("***Break\n");
+    return RC_WARN;
+  }
+  if (!items) {
+    OPrintf("No running handlers match \"%s\"\n", pattern);
+    return RC_ERROR;
+  }
+
+  if (budgetKB) {
+    for (i = 0; i < count; i++) {
+      reservedKB += (CACHE_MIN_BUFFERS * items[i].blockSize + 1023) / 1024;
+    }
+    if (reservedKB > budgetKB) {
+      OPrintf("%lu KB cannot give %lu handlers %ld buffers each; "
+        "that needs %lu KB\n", budgetKB, count, (LONG)CACHE_MIN_BUFFERS,
+        reservedKB);
+      return RC_ERROR;
+    }
+    spareKB = budgetKB - reservedKB;
+
+    for (i = 0; i < count; i++) {
+      if (weights) {
+        items[i].weight = FindCacheWeight(weights, items[i].name);
+        if (!items[i].weight) {
+          items[i].weight = 1;
+        }
+      }
+      else {
+        items[i].weight = items[i].sizeKB / 1024 + 1;
+      }
+      sumWeights += items[i].weight;
+    }
+
+    /* Keep (spare % sum) * weight within 32 bits */
+    while (sumWeights > 0xFFFF) {
+      sumWeights = 0;
+      for (i = 0; i < count; i++) {
+        items[i].weight = (items[i].weight >> 1) | 1;
+        sumWeights += items[i].weight;
+      }
+    }
+
+    for (i = 0; i < count; i++) {
+      shareKB = (spareKB / sumWeights) * items[i].weight +
+        ((spareKB % sumWeights) * items[i].weight) / sumWeights;
+      items[i].target = CACHE_MIN_BUFFERS +
+        (shareKB * 1024) / items[i].blockSize;
+    }
+
+    for (i = 0; i < count; i++) {
+      if (SetSignal(0, 0) & SIGBREAKF_CTRL_C) {
+        items[i].after = -1;
+        rc = RC_WARN;
+      }
+      else if (items[i].target != items[i].current) {
+        items[i].after = SendMoreCache(items[i].name,
+          items[i].target - items[i].current);
+        if (items[i].after != items[i].target) {
+          rc = RC_WARN;
+        }
+      }
+      else {
+        items[i].after = items[i].current;
+      }
+    }
+  }
+
+  OPrintf("%-12s %-20s %6s %6s %6s %9s\n", "Device", "Handler", "Block",
+    "Mount", "Now", "Cache KB");
+  for (i = 0; i < count; i++) {
+    if (budgetKB) {
+      OPrintf("%-12s %-20s %6lu %6lu %6ld %9lu  (was %ld)\n",
+        items[i].name, items[i].handler, items[i].blockSize,
+        items[i].configured, items[i].after,
+        items[i].after > 0 ? (ULONG)items[i].after * items[i].blockSize / 1024 : 0,
+        items[i].current);
+    }
+    else {
+      OPrintf("%-12s %-20s %6lu %6lu %6ld %9lu\n",
+        items[i].name, items[i].handler, items[i].blockSize,
+        items[i].configured, items[i].current,
+        (ULONG)items[i].current * items[i].blockSize / 1024);
+    }
+  }
+
+  if (CheckSignal(SIGBREAKF_CTRL_C)) {
+    OPrintf("***Break\n");
+  }
+  else if (rc == RC_WARN) {
+    OPrintf("Some handlers did not accept the new buffer count\n");
+  }
+
+  return rc;
+}
+
+/**
+ * Time a full write or read of the benchmark file with one record size
+ *
+ * @param fileName Benchmark file
+ * @param buffer Record buffer
+ * @param recordSize Bytes per Write()/Read()
+ * @param totalBytes File size
+ * @param writing TRUE to create the file, FALSE to read it back
+ * @return Elapsed microseconds, 0 on error or Ctrl-C (left set for the
+ *         caller to see)
+ */
+ULONG TimeFileTransfer(
+  const char *fileName,
+  UBYTE *buffer,
+  ULONG recordSize,
+  ULONG totalBytes,
+  BOOL writing
+) {
+  struct EClockVal start;
+  struct EClockVal end;
+  ULONG done = 0;
+  ULONG chunk;
+  LONG actual;
+  BPTR file;
+
+  ReadRunClock(&start);
+
+  file = Open((STRPTR)fileName, writing ? MODE_NEWFILE : MODE_OLDFILE);
+  if (!file) {
+    return 0;
+  }
+
+  while (done < totalBytes) {
+    chunk = totalBytes - done < recordSize ? totalBytes - done : recordSize;
+    actual = writing ? Write(file, buffer, chunk) : Read(file, buffer, chunk);
+    if (actual != (LONG)chunk || (SetSignal(0, 0) & SIGBREAKF_CTRL_C)) {
+      Close(file);
+      return 0;
+    }
+    done += chunk;
+  }
+
+  if (!Close(file)) {
+    return 0;
+  }
+
+  ReadRunClock(&end);
+
+  return ElapsedMicros(&start, &end) | 1;
+}
+
+/**
+ * Convert bytes moved in a time to KB/s without overflowing 32 bits
+ *
+ * @param bytes Bytes transferred
+ * @param micros Elapsed microseconds
+ * @return KB per second
+ */
+ULONG KBPerSecond(ULONG bytes, ULONG micros) {
+  ULONG millis = micros / 1000;
+
+  if (!millis) {
+    millis = 1;
+  }
+
+  return (bytes / 1024) * 1000 / millis;
+}
+
+/**
+ * Measure file system throughput on a mounted volume through its handler
+ *
+ * Writes and reads back a temporary file in the volume's root once per
+ * record size, then times creating and deleting a batch of empty files.
+ * The file names carry this task's address, so runs at the same time
+ * use their own files, and the benchmark refuses to start if any of
+ * them exists already. Everything it creates is deleted again, also on
+ * errors and Ctrl-C.
+ *
+ * @param cleanName Device name without colon
+ * @param sizeKB Size of the test file
+ * @param recordSizes Comma separated record sizes in bytes
+ * @return RC_OK, RC_WARN if interrupted, RC_ERROR if the volume is not
+ *         usable, RC_FAIL on write errors or lack of memory
+ */
+int RunFsBenchmark(const char *cleanName, ULONG sizeKB, const char *recordSizes) {
+  struct DeviceNode *deviceNode;
+  struct FileSysStartupMsg *startup;
+  struct DosEnvec *environ = NULL;
+  struct EClockVal start;
+  struct EClockVal end;
+  char handler[108];
+  char baseName[160];
+  char fileName[160];
+  char volumeName[64];
+  ULONG sizes[FSBENCH_MAX_SIZES];
+  ULONG sizeCount = 0;
+  ULONG maxSize = 0;
+  ULONG totalBytes = sizeKB * 1024;
+  ULONG writeMicros;
+  ULONG readMicros;
+  ULONG createMicros;
+  ULONG deleteMicros;
+  const char *p;
+  UBYTE *buffer;
+  LONG value;
+  LONG used;
+  LONG buffers;
+  LONG error = 0;
+  BPTR file;
+  BPTR lock;
+  ULONG i;
+  int rc = RC_OK;
+
+  /* Parse record sizes */
+  for (p = recordSizes; *p && sizeCount < FSBENCH_MAX_SIZES; ) {
+    used = StrToLong((STRPTR)p, &value);
+    if (used <= 0 || value < 16 || value > FSBENCH_MAX_RECORD) {
+      Printf("Record sizes must be 16 to %ld bytes\n", (LONG)FSBENCH_MAX_RECORD);
+      return RC_ERROR;
+    }
+    sizes[sizeCount++] = (ULONG)value;
+    if ((ULONG)value > maxSize) {
+      maxSize = (ULONG)value;
+    }
+    p += used;
+    if (*p == ',') {
+      p++;
+    }
+  }
+
+  if (CheckDeviceStatus(cleanName, volumeName, sizeof(volumeName)) != 0) {
+    OPrintf("%s: no mounted volume to benchmark\n", cleanName);
+    return RC_ERROR;
+  }
+
+  deviceNode = FindDosDevice(cleanName);
+  handler[0] = '\0';
+  if (deviceNode) {
+    CopyBSTR(deviceNode->dn_Handler, handler, sizeof(handler));
+    if (deviceNode->dn_Startup > 64) {
+      startup = (struct FileSysStartupMsg *)BADDR(deviceNode->dn_Startup);
+      if (startup->fssm_Environ) {
+        environ = (struct DosEnvec *)BADDR(startup->fssm_Environ);
+      }
+    }
+  }
+  if (!handler[0] && environ && environ->de_TableSize >= DE_DOSTYPE) {
+    strcpy(handler, GetHandlerFromDosType(environ->de_DosType));
+  }
+  buffers = SendMoreCache(cleanName, 0);
+
+  buffer = RunAlloc(maxSize);
+  if (!buffer) {
+    return RC_FAIL;
+  }
+  for (i = 0; i < maxSize; i++) {
+    buffer[i] = (UBYTE)i;
+  }
+
+  /* Never overwrite a file that is not ours */
+  sprintf(baseName, "%s:%s.%08lx", cleanName, FSBENCH_FILE,
+    (ULONG)FindTask(NULL));
+  for (i = 0; i <= FSBENCH_FILES; i++) {
+    if (i < FSBENCH_FILES) {
+      sprintf(fileName, "%s.%lu", baseName, i);
+    }
+    else {
+      strcpy(fileName, baseName);
+    }
+    lock = Lock((STRPTR)fileName, ACCESS_READ);
+    if (lock) {
+      UnLock(lock);
+      OPrintf("%s already exists; not overwriting it\n", fileName);
+      return RC_ERROR;
+    }
+  }
+
+  OPrintf("File system benchmark on %s: (\"%s\", %s)\n", cleanName,
+    volumeName, handler[0] ? handler : "unknown handler");
+  if (environ) {
+    OPrintf("  %lu byte blocks, %ld buffers mounted, %ld now, %lu KB file\n",
+      environ->de_SizeBlock * 4, (LONG)environ->de_NumBuffers, buffers,
+      sizeKB);
+  }
+  OPrintf("  %10s %12s %12s\n", "Record", "Write KB/s", "Read KB/s");
+
+  strcpy(fileName, baseName);
+
+  for (i = 0; i < sizeCount; i++) {
+    if (CheckSignal(SIGBREAKF_CTRL_C)) {
+      rc = RC_WARN;
+      break;
+    }
+
+    writeMicros = TimeFileTransfer(fileName, buffer, sizes[i], totalBytes, TRUE);
+    readMicros = writeMicros ?
+      TimeFileTransfer(fileName, buffer, sizes[i], totalBytes, FALSE) : 0;
+    error = IoErr();
+    DeleteFile((STRPTR)fileName);
+
+    if ((!writeMicros || !readMicros) && CheckSignal(SIGBREAKF_CTRL_C)) {
+      rc = RC_WARN;
+      break;
+    }
+    if (!writeMicros || !readMicros) {
+      OPrintf("  %10lu  failed (error %ld)\n", sizes[i], error);
+      rc = RC_FAIL;
+      break;
+    }
+
+    OPrintf("  %10lu %12lu %12lu\n", sizes[i],
+      KBPerSecond(totalBytes, writeMicros), KBPerSecond(totalBytes, readMicros));
+  }
+
+  /* Directory operations: create then delete a batch of empty files */
+  if (rc == RC_OK) {
+    ReadRunClock(&start);
+    for (i = 0; i < FSBENCH_FILES; i++) {
+      sprintf(fileName, "%s.%lu", baseName, i);
+      file = Open((STRPTR)fileName, MODE_NEWFILE);
+      if (!file) {
+        error = IoErr();
+        rc = RC_FAIL;
+        break;
+      }
+      Close(file);
+    }
+    ReadRunClock(&end);
+    createMicros = ElapsedMicros(&start, &end);
+
+    ReadRunClock(&start);
+    for (i = 0; i < FSBENCH_FILES; i++) {
+      sprintf(fileName, "%s.%lu", baseName, i);
+      DeleteFile((STRPTR)fileName);
+    }
+    ReadRunClock(&end);
+    deleteMicros = ElapsedMicros(&start, &end);
+
+    if (rc == RC_OK) {
+      OPrintf("  Create: %lu files/s, delete: %lu files/s\n",
+        FSBENCH_FILES * 1000 / (createMicros / 1000 + 1),
+        FSBENCH_FILES * 1000 / (deleteMicros / 1000 + 1));
+    }
+    else {
+      OPrintf("  Could not create test files (error %ld)\n", error);
+    }
+  }
+
+  return rc;
+}
+
+/**
+ * Read the Rigid Disk Block of a driver unit
+ *
+ * Searches the first RDB_LOCATION_LIMIT blocks for a block with the
+ * RDSK id and a valid checksum, as the boot ROM does. Blocks are the
+ * sector size TD_GETGEOMETRY reports, so 2048 and 4096 byte sector
+ * drives are searched at the right offsets.
+ *
+ * @param driverName Device driver
+ * @param unit Unit number
+ * @param flags fssm_Flags for OpenDevice()
+ * @param rdb Receives the block
+ * @return TRUE if an RDB was found
+ */
+BOOL ReadRigidDiskBlock(
+  const char *driverName,
+  LONG unit,
+  ULONG flags,
+  struct RigidDiskBlock *rdb
+) {
+  struct MsgPort *port;
+  struct IOStdReq *io;
+  struct DriveGeometry *geometry;
+  ULONG *block = NULL;
+  ULONG blockSize = RDB_BLOCK_SIZE;
+  ULONG longs;
+  ULONG sum;
+  ULONG i;
+  ULONG n;
+  BOOL found = FALSE;
+
+  geometry = RunAlloc(sizeof(struct DriveGeometry));
+  if (!geometry) {
+    return FALSE;
+  }
+
+  port = CreateMsgPort();
+  if (!port) {
+    return FALSE;
+  }
+  io = (struct IOStdReq *)CreateIORequest(port, sizeof(struct IOStdReq));
+  if (!io) {
+    DeleteMsgPort(port);
+    return FALSE;
+  }
+
+  if (OpenDevice((STRPTR)driverName, unit, (struct IORequest *)io, flags) == 0) {
+    io->io_Command = TD_GETGEOMETRY;
+    io->io_Data = geometry;
+    io->io_Length = sizeof(struct DriveGeometry);
+    if (DoIO((struct IORequest *)io) == 0 &&
+        geometry->dg_SectorSize >= RDB_BLOCK_SIZE &&
+        geometry->dg_SectorSize <= RDB_MAX_BLOCK_SIZE &&
+        geometry->dg_SectorSize % RDB_BLOCK_SIZE == 0) {
+      blockSize = geometry->dg_SectorSize;
+    }
+    block = RunAlloc(blockSize);
+
+    for (i = 0; block && i < RDB_LOCATION_LIMIT && !found; i++) {
+      io->io_Command = CMD_READ;
+      io->io_Data = block;
+      io->io_Length = blockSize;
+      io->io_Offset = i * blockSize;
+      if (DoIO((struct IORequest *)io) != 0 || block[0] != IDNAME_RIGIDDISK) {
+        continue;
+      }
+
+      longs = block[1];
+      if (longs < sizeof(struct RigidDiskBlock) / 4 ||
+          longs > blockSize / 4) {
+        continue;
+      }
+      for (sum = 0, n = 0; n < longs; n++) {
+        sum += block[n];
+      }
+      if (sum == 0) {
+        memcpy(rdb, block, sizeof(struct RigidDiskBlock));
+        found = TRUE;
+      }
+    }
+    CloseDevice((struct IORequest *)io);
+  }
+
+  DeleteIORequest((struct IORequest *)io);
+  DeleteMsgPort(port);
+
+  return found;
+}
+
+/**
+ * Check partition start offsets and block sizes against 4 KiB
+ *
+ * The start of a partition is LowCyl * Surfaces * BlocksPerTrack blocks
+ * into the unit. When that offset or the file system block size is not a
+ * multiple of 4 KiB, every file system block write turns into a
+ * read-modify-write on the host file system (UAE HDFs) or on flash media.
+ * For misaligned partitions an aligned geometry is proposed that lies
+ * entirely inside the current one, with 64 KiB cylinders.
+ *
+ * @param pattern Devices to check
+ * @return RC_OK if all are aligned, RC_WARN if any are not, RC_ERROR if
+ *         no device matched
+ */
+int AnalyzeAlignment(const char *pattern) {
+  CapturedEntry *entries;
+  CapturedEntry *entry;
+  struct RigidDiskBlock rdb;
+  char rdbDriver[108];
+  LONG rdbUnit = -1;
+  BOOL haveRdb = FALSE;
+  ULONG total;
+  ULONG blockSize;
+  ULONG fsBlockSize;
+  ULONG cylBlocks;
+  ULONG startBlock;
+  ULONG endBlock;
+  ULONG startMisalign;
+  ULONG newBpt;
+  ULONG newLowCyl;
+  ULONG newHighCyl;
+  ULONG checked = 0;
+  ULONG misaligned = 0;
+
+  entries = CaptureFullList(&total);
+  rdbDriver[0] = '\0';
+
+  for (entry = entries; entry; entry = entry->next) {
+    if (entry->type != DLT_DEVICE || !(entry->flags & CAPF_STARTUP) ||
+        entry->envecLongs <= DE_UPPERCYL || !entry->name[0] ||
+        !MatchDevicePattern(pattern, entry->name)) {
+      continue;
+    }
+
+    blockSize = entry->envec[DE_SIZEBLOCK] * 4;
+    cylBlocks = entry->envec[DE_NUMHEADS] * entry->envec[DE_BLKSPERTRACK];
+    if (!blockSize || !cylBlocks) {
+      continue;
+    }
+    fsBlockSize = blockSize;
+    if (entry->envecLongs > DE_SECSPERBLK && entry->envec[DE_SECSPERBLK] > 1) {
+      fsBlockSize *= entry->envec[DE_SECSPERBLK];
+    }
+    startBlock = entry->envec[DE_LOWCYL] * cylBlocks;
+    endBlock = (entry->envec[DE_UPPERCYL] + 1) * cylBlocks;
+
+    /* (startBlock * blockSize) % 4096 without overflowing 32 bits */
+    startMisalign = ((startBlock % ALIGN_BYTES) * blockSize) % ALIGN_BYTES;
+
+    /* One RDB read per unit; floppies have none */
+    if (stricmp(entry->driver, "trackdisk.device") != 0 &&
+        (entry->unit != rdbUnit || strcmp(entry->driver, rdbDriver) != 0)) {
+      strcpy(rdbDriver, entry->driver);
+      rdbUnit = entry->unit;
+      haveRdb = ReadRigidDiskBlock(entry->driver, entry->unit,
+        entry->startupFlags, &rdb);
+      if (haveRdb) {
+        OPrintf("%s unit %ld RDB: %lu cylinders, %lu heads, %lu sectors, "
+          "%lu byte blocks%s\n", entry->driver, entry->unit,
+          rdb.rdb_Cylinders, rdb.rdb_Heads, rdb.rdb_Sectors,
+          rdb.rdb_BlockBytes,
+          ((rdb.rdb_CylBlocks % ALIGN_BYTES) * rdb.rdb_BlockBytes) %
+            ALIGN_BYTES ? " (cylinders not 4 KiB multiples)" : "");
+      }
+    }
+
+    checked++;
+    OPrintf("%s: starts at %lu KB, %lu byte blocks, %lu byte fs blocks: ",
+      entry->name, BlocksToKB(startBlock, blockSize), blockSize, fsBlockSize);
+
+    if (startMisalign) {
+      OPrintf("MISALIGNED by %lu bytes\n", startMisalign);
+    }
+    else {
+      OPrintf("aligned\n");
+    }
+
+    /* Aligned partitions still split 4 KiB pages with smaller blocks */
+    if (fsBlockSize % ALIGN_BYTES) {
+      OPrintf("  File system blocks are smaller than 4 KiB; "
+        "format with 4096 byte blocks to avoid partial writes\n");
+    }
+    if (startMisalign || fsBlockSize % ALIGN_BYTES) {
+      misaligned++;
+    }
+    if (!startMisalign) {
+      continue;
+    }
+
+    /* Round the start up and the end down to 64 KiB cylinders */
+    newBpt = ALIGN_CYL_BYTES / blockSize;
+    if (!newBpt) {
+      OPrintf("  Blocks are larger than a 64 KiB cylinder; "
+        "no geometry proposed\n");
+      continue;
+    }
+    newLowCyl = (startBlock + newBpt - 1) / newBpt;
+    newHighCyl = endBlock / newBpt;
+    if (newHighCyl <= newLowCyl) {
+      OPrintf("  Partition too small to realign\n");
+      continue;
+    }
+    newHighCyl--;
+
+    OPrintf("  /* Aligned geometry for %s:, needs a reformat */\n", entry->name);
+    OPrintf("  Surfaces = 1\n");
+    OPrintf("  BlocksPerTrack = %lu\n", newBpt);
+    OPrintf("  LowCyl = %lu\n", newLowCyl);
+    OPrintf("  HighCyl = %lu\n", newHighCyl);
+    OPrintf("  /* %lu KB smaller than now */\n",
+      BlocksToKB(endBlock - startBlock -
+        (newHighCyl - newLowCyl + 1) * newBpt, blockSize));
+  }
+
+  if (!checked) {
+    OPrintf("No devices with geometry match \"%s\"\n", pattern);
+    return RC_ERROR;
+  }
+
+  return misaligned ? RC_WARN : RC_OK;
+}
+
+/**
+ * Find the version of a loaded device driver without opening it
+ *
+ * @param driverName Device driver
+ * @param version Receives lib_Version << 16 | lib_Revision
+ * @return TRUE if the driver is in the exec device list
+ */
+BOOL FindDriverVersion(const char *driverName, ULONG *version) {
+  struct Library *device;
+
+  Forbid();
+  device = (struct Library *)FindName(&SysBase->DeviceList, (STRPTR)driverName);
+  if (device) {
+    *version = ((ULONG)device->lib_Version << 16) | device->lib_Revision;
+  }
+  Permit();
+
+  return (BOOL)(device != NULL);
+}
+
+/**
+ * Probe which commands a driver unit supports
+ *
+ * NSCMD_DEVICEQUERY answers for New Style Devices. For other drivers
+ * each command is tried in a harmless form (zero length TD_READ64, SCSI
+ * TEST UNIT READY); anything but IOERR_NOCMD means it is implemented.
+ *
+ * @param entry Driver and unit to probe; caps and version are filled in
+ * @param flags fssm_Flags for OpenDevice()
+ * @return TRUE if the unit could be opened
+ */
+BOOL ProbeDriverCaps(CapsEntry *entry, ULONG flags) {
+  struct MsgPort *port;
+  struct IOStdReq *io;
+  struct NSDeviceQueryResult *query;
+  struct DriveGeometry *geometry;
+  struct SCSICmd *scsi;
+  UBYTE *cdb;
+  UBYTE *sense;
+  UWORD *command;
+  BOOL opened = FALSE;
+
+  query = RunAlloc(sizeof(struct NSDeviceQueryResult));
+  geometry = RunAlloc(sizeof(struct DriveGeometry));
+  scsi = RunAlloc(sizeof(struct SCSICmd));
+  cdb = RunAlloc(6);
+  sense = RunAlloc(CAPS_SENSE_SIZE);
+  if (!query || !geometry || !scsi || !cdb || !sense) {
+    return FALSE;
+  }
+
+  port = CreateMsgPort();
+  if (!port) {
+    return FALSE;
+  }
+  io = (struct IOStdReq *)CreateIORequest(port, sizeof(struct IOStdReq));
+  if (!io) {
+    DeleteMsgPort(port);
+    return FALSE;
+  }
+
+  entry->caps = 0;
+
+  if (OpenDevice((STRPTR)entry->driver, entry->unit,
+      (struct IORequest *)io, flags) == 0) {
+    opened = TRUE;
+    entry->version = ((ULONG)io->io_Device->dd_Library.lib_Version << 16) |
+      io->io_Device->dd_Library.lib_Revision;
+
+    io->io_Command = NSCMD_DEVICEQUERY;
+    io->io_Data = query;
+    io->io_Length = sizeof(struct NSDeviceQueryResult);
+    io->io_Actual = 0;
+    if (DoIO((struct IORequest *)io) == 0 &&
+        io->io_Actual >= 16 && query->SizeAvailable >= 16 &&
+        query->SupportedCommands) {
+      entry->caps |= CAPS_NSD;
+      for (command = query->SupportedCommands; *command; command++) {
+        switch (*command) {
+          case TD_READ64:        entry->caps |= CAPS_TD64; break;
+          case NSCMD_TD_READ64:  entry->caps |= CAPS_NSD64; break;
+          case HD_SCSICMD:       entry->caps |= CAPS_SCSI; break;
+          case TD_GETGEOMETRY:   entry->caps |= CAPS_GEOMETRY; break;
+          case TD_CHANGESTATE:   entry->caps |= CAPS_CHANGE; break;
+        }
+      }
+    }
+    else {
+      io->io_Command = TD_GETGEOMETRY;
+      io->io_Data = geometry;
+      io->io_Length = sizeof(struct DriveGeometry);
+      if (DoIO((struct IORequest *)io) == 0) {
+        entry->caps |= CAPS_GEOMETRY;
+      }
+
+      io->io_Command = TD_CHANGESTATE;
+      if (DoIO((struct IORequest *)io) != IOERR_NOCMD) {
+        entry->caps |= CAPS_CHANGE;
+      }
+
+      /* io_Actual holds the high 32 bits of the offset for TD64 */
+      io->io_Command = TD_READ64;
+      io->io_Data = geometry;
+      io->io_Length = 0;
+      io->io_Offset = 0;
+      io->io_Actual = 0;
+      if (DoIO((struct IORequest *)io) != IOERR_NOCMD) {
+        entry->caps |= CAPS_TD64;
+      }
+
+      memset(cdb, 0, 6);                  /* TEST UNIT READY */
+      memset(scsi, 0, sizeof(struct SCSICmd));
+      scsi->scsi_Command = cdb;
+      scsi->scsi_CmdLength = 6;
+      scsi->scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
+      scsi->scsi_SenseData = sense;
+      scsi->scsi_SenseLength = CAPS_SENSE_SIZE;
+      io->io_Command = HD_SCSICMD;
+      io->io_Data = scsi;
+      io->io_Length = sizeof(struct SCSICmd);
+      if (DoIO((struct IORequest *)io) != IOERR_NOCMD) {
+        entry->caps |= CAPS_SCSI;
+      }
+    }
+
+    CloseDevice((struct IORequest *)io);
+  }
+
+  DeleteIORequest((struct IORequest *)io);
+  DeleteMsgPort(port);
+
+  return opened;
+}
+
+/**
+ * Load the capability cache from ENV:
+ *
+ * @param count Receives the number of entries
+ * @return Entries in pool memory (room for CAPS_MAX_ENTRIES), or NULL
+ */
+CapsEntry *LoadCapsCache(ULONG *count) {
+  CapsEntry *entries;
+  ULONG header[3];
+  LONG size;
+  BPTR file;
+
+  *count = 0;
+
+  entries = RunAlloc(CAPS_MAX_ENTRIES * sizeof(CapsEntry));
+  if (!entries) {
+    return NULL;
+  }
+
+  file = Open((STRPTR)CAPS_CACHE_FILE, MODE_OLDFILE);
+  if (file) {
+    if (Read(file, header, sizeof(header)) == sizeof(header) &&
+        header[0] == CAPS_CACHE_MAGIC && header[1] == CAPS_CACHE_VERSION &&
+        header[2] <= CAPS_MAX_ENTRIES) {
+      size = header[2] * sizeof(CapsEntry);
+      if (Read(file, entries, size) == size) {
+        *count = header[2];
+      }
+    }
+    Close(file);
+  }
+
+  return entries;
+}
+
+/**
+ * Store the capability cache in ENV:
+ *
+ * @param entries Cache entries
+ * @param count Number of entries
+ */
+void SaveCapsCache(CapsEntry *entries, ULONG count) {
+  ULONG header[3];
+  LONG size = count * sizeof(CapsEntry);
+  BPTR file;
+
+  header[0] = CAPS_CACHE_MAGIC;
+  header[1] = CAPS_CACHE_VERSION;
+  header[2] = count;
+
+  file = Open((STRPTR)CAPS_CACHE_FILE, MODE_NEWFILE);
+  if (file) {
+    if (Write(file, header, sizeof(header)) != sizeof(header) ||
+        Write(file, entries, size) != size) {
+      Close(file);
+      DeleteFile((STRPTR)CAPS_CACHE_FILE);
+      return;
+    }
+    Close(file);
+  }
+}
+
+/**
+ * Get a driver unit's capabilities, probing only on a cache miss
+ *
+ * The cache is keyed by driver name, unit and driver version, so a
+ * driver update is probed again. A driver that is not loaded yet is
+ * probed (which loads it) rather than trusted from the cache. Names are
+ * compared as far as the cache stores them. When the cache is full the
+ * oldest entry makes room for the new one.
+ *
+ * @param entries Loaded cache, updated in place
+ * @param count Number of cache entries, updated
+ * @param driverName Device driver
+ * @param unit Unit number
+ * @param flags fssm_Flags for OpenDevice()
+ * @param cached Receives TRUE if the answer came from the cache
+ * @return The entry, or NULL if the unit could not be opened
+ */
+CapsEntry *LookupDriverCaps(
+  CapsEntry *entries,
+  ULONG *count,
+  const char *driverName,
+  LONG unit,
+  ULONG flags,
+  BOOL *cached
+) {
+  CapsEntry probe;
+  CapsEntry *entry = NULL;
+  ULONG version;
+  ULONG i;
+
+  *cached = FALSE;
+
+  for (i = 0; i < *count; i++) {
+    if (entries[i].unit == unit && strnicmp(entries[i].driver, driverName,
+        sizeof(entries[i].driver) - 1) == 0) {
+      entry = &entries[i];
+      break;
+    }
+  }
+
+  if (entry && FindDriverVersion(driverName, &version) &&
+      version == entry->version) {
+    *cached = TRUE;
+    return entry;
+  }
+
+  memset(&probe, 0, sizeof(probe));
+  strncpy(probe.driver, driverName, sizeof(probe.driver) - 1);
+  probe.unit = unit;
+  if (!ProbeDriverCaps(&probe, flags)) {
+    return NULL;
+  }
+
+  /* Entries stay in probe order, so the first is the one to drop */
+  if (entry) {
+    i = entry - entries;
+  }
+  else if (*count >= CAPS_MAX_ENTRIES) {
+    i = 0;
+  }
+  else {
+    i = *count;
+  }
+  if (i < *count) {
+    memmove(&entries[i], &entries[i + 1], (*count - i - 1) * sizeof(CapsEntry));
+    (*count)--;
+  }
+  entry = &entries[(*count)++];
+  *entry = probe;
+
+  return entry;
+}
+
+/**
+ * Get the capabilities of one driver unit for other modes
+ *
+ * @param driverName Device driver
+ * @param unit Unit number
+ * @param flags fssm_Flags for OpenDevice()
+ * @return CAPS_* bits, 0 if unknown
+ */
+ULONG GetDriverCaps(const char *driverName, LONG unit, ULONG flags) {
+  CapsEntry *entries;
+  CapsEntry *entry;
+  ULONG count;
+  BOOL cached;
+
+  entries = LoadCapsCache(&count);
+  if (!entries) {
+    return 0;
+  }
+
+  entry = LookupDriverCaps(entries, &count, driverName, unit, flags, &cached);
+  if (entry && !cached) {
+    SaveCapsCache(entries, count);
+  }
+
+  return entry ? entry->caps : 0;
+}
+
+/**
+ * Print the capability matrix of every driver unit in the DOS list
+ *
+ * @param driverFilter Only this driver, NULL for all
+ * @return RC_OK, RC_ERROR if no unit could be opened
+ */
+int ReportDriverCaps(const char *driverFilter) {
+  CapsEntry *entries;
+  CapsEntry *entry;
+  CapturedEntry *devices;
+  CapturedEntry *device;
+  CapturedEntry *seen;
+  ULONG count;
+  ULONG total;
+  ULONG listed = 0;
+  BOOL changed = FALSE;
+  BOOL cached;
+
+  entries = LoadCapsCache(&count);
+  devices = CaptureFullList(&total);
+  if (!entries) {
+    return RC_FAIL;
+  }
+
+  OPrintf("%-22s %5s %8s %4s %5s %5s %5s %5s %6s\n", "Driver", "Unit",
+    "Version", "NSD", "TD64", "NSD64", "SCSI", "GEOM", "Source");
+
+  for (device = devices; device; device = device->next) {
+    if (device->type != DLT_DEVICE || !(device->flags & CAPF_STARTUP) ||
+        !device->driver[0] ||
+        (driverFilter &&
+         stricmp(device->driver, driverFilter) != 0)) {
+      continue;
+    }
+
+    /* Several partitions share a unit; report it once */
+    for (seen = devices; seen != device; seen = seen->next) {
+      if (seen->type == DLT_DEVICE && (seen->flags & CAPF_STARTUP) &&
+          seen->unit == device->unit &&
+          strcmp(seen->driver, device->driver) == 0) {
+        break;
+      }
+    }
+    if (seen != device) {
+      continue;
+    }
+
+    entry = LookupDriverCaps(entries, &count, device->driver, device->unit,
+      device->startupFlags, &cached);
+    if (!entry) {
+      OPrintf("%-22s %5ld  could not be opened\n", device->driver,
+        device->unit);
+      continue;
+    }
+    if (!cached) {
+      changed = TRUE;
+    }
+    listed++;
+
+    OPrintf("%-22s %5ld %5lu.%-2lu %4s %5s %5s %5s %5s %6s\n",
+      entry->driver, entry->unit, entry->version >> 16,
+      entry->version & 0xFFFF,
+      (STRPTR)(entry->caps & CAPS_NSD ? "yes" : "-"),
+      (STRPTR)(entry->caps & CAPS_TD64 ? "yes" : "-"),
+      (STRPTR)(entry->caps & CAPS_NSD64 ? "yes" : "-"),
+      (STRPTR)(entry->caps & CAPS_SCSI ? "yes" : "-"),
+      (STRPTR)(entry->caps & CAPS_GEOMETRY ? "yes" : "-"),
+      (STRPTR)(cached ? "cache" : "probe"));
+  }
+
+  if (changed) {
+    SaveCapsCache(entries, count);
+  }
+
+  return listed ? RC_OK : RC_ERROR;
+}
+
+/**
+ * Prepare one SCSI command on an identify item
+ *
+ * @param io Request to fill in
+ * @param scsi SCSICmd to fill in
+ * @param cdb Command block
+ * @param cdbLength Command length
+ * @param data Reply buffer
+ * @param dataLength Reply buffer size
+ * @param sense Sense buffer
+ */
+void SetupScsiCommand(
+  struct IOStdReq *io,
+  struct SCSICmd *scsi,
+  UBYTE *cdb,
+  UWORD cdbLength,
+  UBYTE *data,
+  ULONG dataLength,
+  UBYTE *sense
+) {
+  memset(scsi, 0, sizeof(struct SCSICmd));
+  scsi->scsi_Data = (UWORD *)data;
+  scsi->scsi_Length = dataLength;
+  scsi->scsi_Command = cdb;
+  scsi->scsi_CmdLength = cdbLength;
+  scsi->scsi_Flags = SCSIF_READ | SCSIF_AUTOSENSE;
+  scsi->scsi_SenseData = sense;
+  scsi->scsi_SenseLength = CAPS_SENSE_SIZE;
+
+  io->io_Command = HD_SCSICMD;
+  io->io_Data = scsi;
+  io->io_Length = sizeof(struct SCSICmd);
+}
+
+/**
+ * Open a unit and start its INQUIRY and READ CAPACITY without waiting
+ *
+ * @param item Unit to identify
+ * @param replyPort Port both requests reply to
+ * @return TRUE if both requests were sent
+ */
+BOOL SendIdentify(IdentifyItem *item, struct MsgPort *replyPort) {
+  item->inquiryIO = (struct IOStdReq *)CreateIORequest(replyPort,
+    sizeof(struct IOStdReq));
+  item->capacityIO = (struct IOStdReq *)CreateIORequest(replyPort,
+    sizeof(struct IOStdReq));
+  if (!item->inquiryIO || !item->capacityIO) {
+    return FALSE;
+  }
+
+  if (OpenDevice((STRPTR)item->entry.driver, item->entry.unit,
+      (struct IORequest *)item->inquiryIO, item->flags) != 0) {
+    return FALSE;
+  }
+  item->opened = TRUE;
+
+  /* A copy of an opened request may be used on the same unit */
+  memcpy(item->capacityIO, item->inquiryIO, sizeof(struct IOStdReq));
+
+  memset(item->inquiryCdb, 0, sizeof(item->inquiryCdb));
+  item->inquiryCdb[0] = SCSI_INQUIRY;
+  item->inquiryCdb[4] = SCSI_INQUIRY_LENGTH;
+  SetupScsiCommand(item->inquiryIO, &item->inquiryCmd, item->inquiryCdb, 6,
+    item->inquiryData, SCSI_INQUIRY_LENGTH, item->inquirySense);
+
+  memset(item->capacityCdb, 0, sizeof(item->capacityCdb));
+  item->capacityCdb[0] = SCSI_READ_CAPACITY;
+  SetupScsiCommand(item->capacityIO, &item->capacityCmd, item->capacityCdb,
+    10, item->capacityData, 8, item->capacitySense);
+
+  SendIO((struct IORequest *)item->inquiryIO);
+  SendIO((struct IORequest *)item->capacityIO);
+  item->pending = 2;
+
+  return TRUE;
+}
+
+/**
+ * Fill in an identify item's cache entry from its replies
+ *
+ * @param item Unit whose requests have both returned
+ */
+void CompleteIdentify(IdentifyItem *item) {
+  UBYTE *inquiry = item->inquiryData;
+  UBYTE *capacity = item->capacityData;
+  ULONG lastBlock;
+
+  if (item->inquiryIO->io_Error == 0 && item->inquiryCmd.scsi_Status == 0 &&
+      item->inquiryCmd.scsi_Actual >= 36) {
+    item->entry.valid = TRUE;
+    item->entry.type = inquiry[0] & 0x1F;
+    item->entry.removable = (inquiry[1] & 0x80) ? TRUE : FALSE;
+    memcpy(item->entry.vendor, &inquiry[8], 8);
+    memcpy(item->entry.product, &inquiry[16], 16);
+    memcpy(item->entry.revision, &inquiry[32], 4);
+  }
+
+  if (item->capacityIO->io_Error == 0 && item->capacityCmd.scsi_Status == 0 &&
+      item->capacityCmd.scsi_Actual >= 8) {
+    lastBlock = ((ULONG)capacity[0] << 24) | ((ULONG)capacity[1] << 16) |
+      ((ULONG)capacity[2] << 8) | capacity[3];
+
+    /* More blocks than 32 bits hold; READ CAPACITY(10) cannot say */
+    item->entry.blocks = lastBlock == SCSI_CAPACITY_MAX ? 0 : lastBlock + 1;
+    item->entry.blockSize = ((ULONG)capacity[4] << 24) |
+      ((ULONG)capacity[5] << 16) | ((ULONG)capacity[6] << 8) | capacity[7];
+  }
+}
+
+/**
+ * Load the identity cache from ENV:
+ *
+ * @param count Receives the number of entries, 0 if there is no cache
+ * @return Entries in pool memory (room for IDENTIFY_MAX_ENTRIES), or NULL
+ */
+IdentifyEntry *LoadIdentifyCache(ULONG *count) {
+  IdentifyEntry *entries;
+  ULONG header[3];
+  LONG size;
+  BPTR file;
+
+  *count = 0;
+  entries = RunAlloc(IDENTIFY_MAX_ENTRIES * sizeof(IdentifyEntry));
+  if (!entries) {
+    return NULL;
+  }
+
+  file = Open((STRPTR)IDENTIFY_CACHE_FILE, MODE_OLDFILE);
+  if (file) {
+    if (Read(file, header, sizeof(header)) == sizeof(header) &&
+        header[0] == IDENTIFY_CACHE_MAGIC &&
+        header[1] == IDENTIFY_CACHE_VERSION &&
+        header[2] <= IDENTIFY_MAX_ENTRIES) {
+      size = header[2] * sizeof(IdentifyEntry);
+      if (Read(file, entries, size) == size) {
+        *count = header[2];
+      }
+    }
+    Close(file);
+  }
+
+  return entries;
+}
+
+/**
+ * Store the identity cache in ENV:
+ *
+ * @param entries Cache entries
+ * @param count Number of entries
+ */
+void SaveIdentifyCache(IdentifyEntry *entries, ULONG count) {
+  ULONG header[3];
+  LONG size = count * sizeof(IdentifyEntry);
+  BPTR file;
+
+  header[0] = IDENTIFY_CACHE_MAGIC;
+  header[1] = IDENTIFY_CACHE_VERSION;
+  header[2] = count;
+
+  file = Open((STRPTR)IDENTIFY_CACHE_FILE, MODE_NEWFILE);
+  if (file) {
+    if (Write(file, header, sizeof(header)) != sizeof(header) ||
+        Write(file, entries, size) != size) {
+      Close(file);
+      DeleteFile((STRPTR)IDENTIFY_CACHE_FILE);
+      return;
+    }
+    Close(file);
+  }
+}
+
+/**
+ * Merge this run's answers into the identity cache
+ *
+ * Entries of units asked this run are replaced, or dropped if the unit
+ * did not identify; entries of other units, such as other drivers left
+ * out by DRIVER=, are kept. When the cache is full the oldest entry
+ * makes room, as in LookupDriverCaps().
+ *
+ * @param entries Loaded cache, updated in place
+ * @param count Number of cache entries, updated
+ * @param items Units of this run
+ * @param itemCount Number of units
+ */
+void MergeIdentifyCache(
+  IdentifyEntry *entries,
+  ULONG *count,
+  IdentifyItem *items,
+  ULONG itemCount
+) {
+  ULONG i;
+  ULONG c;
+
+  for (i = 0; i < itemCount; i++) {
+    if (items[i].cached) {
+      continue;
+    }
+
+    for (c = 0; c < *count; c++) {
+      if (entries[c].unit == items[i].entry.unit &&
+          strcmp(entries[c].driver, items[i].entry.driver) == 0) {
+        memmove(&entries[c], &entries[c + 1],
+          (*count - c - 1) * sizeof(IdentifyEntry));
+        (*count)--;
+        break;
+      }
+    }
+
+    if (!items[i].entry.valid) {
+      continue;
+    }
+    if (*count >= IDENTIFY_MAX_ENTRIES) {
+      memmove(&entries[0], &entries[1],
+        (*count - 1) * sizeof(IdentifyEntry));
+      (*count)--;
+    }
+    entries[(*count)++] = items[i].entry;
+  }
+}
+
+/**
+ * Identify every SCSI capable unit in the DOS list in parallel
+ *
+ * Units whose driver has no HD_SCSICMD (per the CAPS cache) are skipped.
+ * All INQUIRY and READ CAPACITY requests are sent with SendIO() before
+ * any reply is waited for, so a full bus costs about one command's time.
+ * Fixed drives answered in an earlier run of the same driver version
+ * are taken from ENV:; removable ones are always asked again.
+ *
+ * @param driverFilter Only this driver, NULL for all
+ * @param timeout Seconds to wait before aborting requests, 0 = forever
+ * @return RC_OK, RC_WARN if a unit did not answer, RC_ERROR if no unit
+ *         could be identified
+ */
+int IdentifyUnits(const char *driverFilter, ULONG timeout) {
+  CapturedEntry *devices;
+  CapturedEntry *device;
+  CapturedEntry *seen;
+  CapsEntry *capsEntries;
+  CapsEntry *caps;
+  IdentifyEntry *cache;
+  IdentifyItem *items;
+  IdentifyItem *item;
+  struct MsgPort *replyPort;
+  struct Message *msg;
+  ULONG capsCount;
+  ULONG cacheCount;
+  ULONG total;
+  ULONG count = 0;
+  ULONG pending = 0;
+  ULONG timeoutMask = 0;
+  ULONG signals;
+  ULONG version;
+  ULONG i;
+  ULONG c;
+  BOOL cached;
+  BOOL timedOut = FALSE;
+  int rc = RC_OK;
+
+  devices = CaptureFullList(&total);
+  items = RunAlloc(total * sizeof(IdentifyItem) + 1);
+  cache = LoadIdentifyCache(&cacheCount);
+  capsEntries = LoadCapsCache(&capsCount);
+  if (!items || !cache || !capsEntries) {
+    return RC_FAIL;
+  }
+
+  /* One item per SCSI capable driver unit */
+  for (device = devices; device; device = device->next) {
+    if (device->type != DLT_DEVICE || !(device->flags & CAPF_STARTUP) ||
+        !device->driver[0] || strlen(device->driver) >= SNAPSHOT_NAME_SIZE ||
+        (driverFilter &&
+         stricmp(device->driver, driverFilter) != 0)) {
+      continue;
+    }
+    for (seen = devices; seen != device; seen = seen->next) {
+      if (seen->type == DLT_DEVICE && (seen->flags & CAPF_STARTUP) &&
+          seen->unit == device->unit &&
+          strcmp(seen->driver, device->driver) == 0) {
+        break;
+      }
+    }
+    if (seen != device) {
+      continue;
+    }
+
+    caps = LookupDriverCaps(capsEntries, &capsCount, device->driver,
+      device->unit, device->startupFlags, &cached);
+    if (!caps || !(caps->caps & CAPS_SCSI)) {
+      continue;
+    }
+
+    item = &items[count++];
+    strcpy(item->entry.driver, device->driver);
+    item->entry.unit = device->unit;
+    item->entry.version = caps->version;
+    item->flags = device->startupFlags;
+
+    for (c = 0; c < cacheCount; c++) {
+      if (cache[c].unit == device->unit && cache[c].valid &&
+          !cache[c].removable && strcmp(cache[c].driver, device->driver) == 0 &&
+          FindDriverVersion(device->driver, &version) &&
+          version == cache[c].version) {
+        item->entry = cache[c];
+        item->cached = TRUE;
+        break;
+      }
+    }
+  }
+  SaveCapsCache(capsEntries, capsCount);
+
+  if (!count) {
+    OPrintf("No SCSI capable units found\n");
+    return RC_ERROR;
+  }
+
+  replyPort = CreateMsgPort();
+  if (!replyPort) {
+    return RC_FAIL;
+  }
+
+  /* Send everything first, then collect */
+  for (i = 0; i < count; i++) {
+    if (!items[i].cached && SendIdentify(&items[i], replyPort)) {
+      pending += 2;
+    }
+  }
+
+  if (pending && timeout) {
+    timeoutMask = StartTimeout(timeout, 0);
+  }
+
+  while (pending) {
+    while ((msg = GetMsg(replyPort)) != NULL) {
+      for (i = 0; i < count; i++) {
+        if (msg == &items[i].inquiryIO->io_Message ||
+            msg == &items[i].capacityIO->io_Message) {
+          if (msg == &items[i].inquiryIO->io_Message) {
+            items[i].inquiryDone = TRUE;
+          }
+          else {
+            items[i].capacityDone = TRUE;
+          }
+          pending--;
+          if (--items[i].pending == 0) {
+            CompleteIdentify(&items[i]);
+          }
+          break;
+        }
+      }
+    }
+    if (!pending) {
+      break;
+    }
+
+    signals = Wait((1L << replyPort->mp_SigBit) | timeoutMask |
+      SIGBREAKF_CTRL_C);
+    if (signals & (timeoutMask | SIGBREAKF_CTRL_C)) {
+      timedOut = TRUE;
+      break;
+    }
+  }
+
+  if (timeoutMask) {
+    StopTimeout();
+  }
+
+  /* Unlike packets, I/O requests can be taken back; WaitIO() also
+     removes replies still queued, but must not see one already taken */
+  for (i = 0; i < count; i++) {
+    item = &items[i];
+    if (item->pending) {
+      if (!item->inquiryDone) {
+        if (!CheckIO((struct IORequest *)item->inquiryIO)) {
+          AbortIO((struct IORequest *)item->inquiryIO);
+        }
+        WaitIO((struct IORequest *)item->inquiryIO);
+      }
+      if (!item->capacityDone) {
+        if (!CheckIO((struct IORequest *)item->capacityIO)) {
+          AbortIO((struct IORequest *)item->capacityIO);
+        }
+        WaitIO((struct IORequest *)item->capacityIO);
+      }
+      item->pending = 0;
+      item->timedOut = TRUE;
+    }
+    if (item->opened) {
+      CloseDevice((struct IORequest *)item->inquiryIO);
+    }
+    if (item->inquiryIO) {
+      DeleteIORequest((struct IORequest *)item->inquiryIO);
+    }
+    if (item->capacityIO) {
+      DeleteIORequest((struct IORequest *)item->capacityIO);
+    }
+  }
+  DeleteMsgPort(replyPort);
+
+  OPrintf("%-20s %4s %-5s %-8s %-16s %-4s %8s  %s\n", "Driver", "Unit",
+    "Type", "Vendor", "Product", "Rev", "Size MB", "DOS devices");
+
+  for (i = 0; i < count; i++) {
+    item = &items[i];
+    if (!item->entry.valid) {
+      OPrintf("%-20s %4ld  %s\n", item->entry.driver, item->entry.unit,
+        item->timedOut ? "no answer" : "did not identify");
+      rc = RC_WARN;
+      continue;
+    }
+
+    OPrintf("%-20s %4ld %-5s %-8s %-16s %-4s ",
+      item->entry.driver, item->entry.unit,
+      (STRPTR)(item->entry.type == 0 ? "disk" :
+        item->entry.type == 5 ? "cdrom" :
+        item->entry.type == 7 ? "optic" : "other"),
+      item->entry.vendor, item->entry.product, item->entry.revision);
+    if (item->entry.blocks && item->entry.blockSize) {
+      OPrintf("%8lu ",
+        BlocksToKB(item->entry.blocks, item->entry.blockSize) / 1024);
+    }
+    else {
+      OPrintf("%8s ", "unknown");
+    }
+
+    for (device = devices; device; device = device->next) {
+      if (device->type == DLT_DEVICE && (device->flags & CAPF_STARTUP) &&
+          device->unit == item->entry.unit &&
+          strcmp(device->driver, item->entry.driver) == 0) {
+        OPrintf(" %s", device->name);
+      }
+    }
+    OPrintf("%s\n", item->cached ? " (cached)" : "");
+  }
+
+  /* Keep the answers for the next run */
+  MergeIdentifyCache(cache, &cacheCount, items, count);
+  SaveIdentifyCache(cache, cacheCount);
+
+  if (timedOut) {
+    OPrintf("Identify did not complete\n");
+    rc = RC_WARN;
+  }
+
+  return rc;
+}
+
+/**
+ * Parse a PROBEUNITS range, FROM-TO or a single unit
+ *
+ * @param text Range text
+ * @param from Receives the first unit
+ * @param to Receives the last unit
+ * @return TRUE if the range is valid and not larger than PROBEUNITS_MAX
+ */
+BOOL ParseUnitRange(const char *text, LONG *from, LONG *to) {
+  LONG used;
+
+  used = StrToLong((STRPTR)text, from);
+  if (used <= 0 || *from < 0) {
+    return FALSE;
+  }
+  text += used;
+
+  if (*text == '\0') {
+    *to = *from;
+    return TRUE;
+  }
+  if (*text != '-') {
+    return FALSE;
+  }
+
+  used = StrToLong((STRPTR)text + 1, to);
+  if (used <= 0 || text[1 + used] != '\0' || *to < *from ||
+      *to - *from >= PROBEUNITS_MAX) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Open every unit of a driver in a range and list which exist, which
+ * have a disk in and which DOS devices use them
+ *
+ * Each unit gets its own request on one reply port. As soon as a unit
+ * opens, its TD_CHANGESTATE is sent, and all of them are collected
+ * together, so slow units overlap. Units that neither open nor have a
+ * DOS device are left out of the table.
+ *
+ * @param driverName Device driver
+ * @param from First unit
+ * @param to Last unit
+ * @param timeout Seconds to wait for media answers, 0 = forever
+ * @return RC_OK if a unit exists, RC_WARN if answers are missing,
+ *         RC_ERROR if no unit exists, RC_FAIL on lack of memory
+ */
+int ProbeDriverUnits(
+  const char *driverName,
+  LONG from,
+  LONG to,
+  ULONG timeout
+) {
+  static const char *mediaNames[] = { "-", "empty", "disk", "?", "timeout" };
+  CapturedEntry *entries;
+  CapturedEntry *entry;
+  UnitProbeItem *items;
+  UnitProbeItem *item;
+  struct MsgPort *replyPort;
+  struct Message *msg;
+  ULONG count = (ULONG)(to - from + 1);
+  ULONG pending = 0;
+  ULONG present = 0;
+  ULONG unmounted = 0;
+  ULONG timeoutMask = 0;
+  ULONG signals;
+  ULONG listed;
+  ULONG total;
+  ULONG i;
+  BOOL timedOut = FALSE;
+
+  /* The full list, as snapshot names are limited in length */
+  entries = CaptureFullList(&total);
+  items = RunAlloc(count * sizeof(UnitProbeItem));
+  if (!items) {
+    return RC_FAIL;
+  }
+
+  replyPort = CreateMsgPort();
+  if (!replyPort) {
+    return RC_FAIL;
+  }
+
+  for (i = 0; i < count; i++) {
+    items[i].unit = from + (LONG)i;
+    items[i].openError = IOERR_OPENFAIL;
+  }
+
+  /* OpenDevice() only returns once the driver has looked for the unit,
+     so the opens run in turn; the media queries all overlap */
+  for (i = 0; i < count; i++) {
+    item = &items[i];
+
+    if (CheckSignal(SIGBREAKF_CTRL_C)) {
+      timedOut = TRUE;
+      break;
+    }
+
+    item->io = (struct IOStdReq *)CreateIORequest(replyPort,
+      sizeof(struct IOStdReq));
+    if (!item->io) {
+      continue;
+    }
+    item->tried = TRUE;
+
+    TraceEvent(TRACE_PROBE, PHASE_SCAN, driverName, 0);
+    item->openError = OpenDevice((STRPTR)driverName, item->unit,
+      (struct IORequest *)item->io, 0);
+    TraceEvent(TRACE_REPLY, PHASE_SCAN, driverName, item->openError);
+    if (item->openError != 0) {
+      continue;
+    }
+
+    item->io->io_Command = TD_CHANGESTATE;
+    item->io->io_Actual = 0;
+    SendIO((struct IORequest *)item->io);
+    item->sent = TRUE;
+    pending++;
+  }
+
+  if (pending && timeout) {
+    timeoutMask = StartTimeout(timeout, 0);
+  }
+
+  while (pending && !timedOut) {
+    while ((msg = GetMsg(replyPort)) != NULL) {
+      for (i = 0; i < count; i++) {
+        item = &items[i];
+        if (item->sent && msg == &item->io->io_Message) {
+          item->done = TRUE;
+          if (item->io->io_Error != 0) {
+            item->media = UNIT_MEDIA_UNKNOWN;
+          }
+          else {
+            item->media = item->io->io_Actual ?
+              UNIT_MEDIA_EMPTY : UNIT_MEDIA_PRESENT;
+          }
+          pending--;
+          break;
+        }
+      }
+    }
+    if (!pending) {
+      break;
+    }
+
+    signals = Wait((1L << replyPort->mp_SigBit) | timeoutMask |
+      SIGBREAKF_CTRL_C);
+    if (signals & (timeoutMask | SIGBREAKF_CTRL_C)) {
+      timedOut = TRUE;
+    }
+  }
+
+  if (timeoutMask) {
+    StopTimeout();
+  }
+
+  /* Take back what has not answered; WaitIO() must not see a reply
+     that was already taken off the port */
+  for (i = 0; i < count; i++) {
+    item = &items[i];
+    if (item->sent && !item->done) {
+      if (!CheckIO((struct IORequest *)item->io)) {
+        AbortIO((struct IORequest *)item->io);
+      }
+      WaitIO((struct IORequest *)item->io);
+      item->media = UNIT_MEDIA_TIMEOUT;
+    }
+    if (item->openError == 0) {
+      CloseDevice((struct IORequest *)item->io);
+    }
+    if (item->io) {
+      DeleteIORequest((struct IORequest *)item->io);
+    }
+  }
+  DeleteMsgPort(replyPort);
+
+  OPrintf("%-20s %5s %-6s %-7s %s\n", "Driver", "Unit", "Open", "Media",
+    "DOS devices");
+
+  for (i = 0; i < count; i++) {
+    item = &items[i];
+
+    listed = 0;
+    for (entry = entries; entry; entry = entry->next) {
+      if (entry->type == DLT_DEVICE && entry->unit == item->unit &&
+          stricmp(entry->driver, driverName) == 0) {
+        listed++;
+      }
+    }
+
+    /* A unit the driver keeps to itself still exists */
+    if (item->openError == 0 || item->openError == IOERR_UNITBUSY) {
+      present++;
+      if (!listed) {
+        unmounted++;
+      }
+    }
+    else if (!listed) {
+      continue;
+    }
+
+    OPrintf("%-20s %5ld %-6s %-7s", driverName, item->unit,
+      (STRPTR)(!item->tried ? "-" :
+        item->openError == 0 ? "ok" :
+        item->openError == IOERR_UNITBUSY ? "busy" : "none"),
+      mediaNames[item->media]);
+
+    if (!listed) {
+      OPrintf(" -");
+    }
+    for (entry = listed ? entries : NULL; entry; entry = entry->next) {
+      if (entry->type == DLT_DEVICE && entry->unit == item->unit &&
+          stricmp(entry->driver, driverName) == 0) {
+        OPrintf(" %s", entry->name);
+      }
+    }
+    OPrintf("\n");
+  }
+
+  OPrintf("%lu of %lu units exist, %lu without a DOS device\n", present,
+    count, unmounted);
+
+  if (timedOut) {
+    OPrintf("Unit probe did not complete\n");
+    return RC_WARN;
+  }
+
+  return present ? RC_OK : RC_ERROR;
+}
+
+/**
+ * Fill in the table for the CRC-32 used by zip and gzip
+ *
+ * @param table 256 entries
+ */
+void MakeCrc32Table(ULONG *table) {
+  ULONG c;
+  ULONG n;
+  int k;
+
+  for (n = 0; n < 256; n++) {
+    c = n;
+    for (k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    table[n] = c;
+  }
+}
+
+/**
+ * Add bytes to a running CRC-32
+ *
+ * @param crc CRC so far, 0 to start
+ * @param table Table from MakeCrc32Table()
+ * @param data Bytes to add
+ * @param length Number of bytes
+ * @return Updated CRC
+ */
+ULONG UpdateCrc32(ULONG crc, ULONG *table, UBYTE *data, ULONG length) {
+  crc = ~crc;
+  while (length--) {
+    crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/**
+ * Point a surface scan request at a run of partition blocks
+ *
+ * @param slot Request to set up
+ * @param block First block, from the start of the disk
+ * @param blocks Number of blocks
+ * @param shift log2 of the block size
+ * @param command CMD_READ, TD_READ64 or NSCMD_TD_READ64
+ */
+void SetSurfaceRead(
+  SurfaceSlot *slot,
+  ULONG block,
+  ULONG blocks,
+  UWORD shift,
+  UWORD command
+) {
+  slot->block = block;
+  slot->blocks = blocks;
+  slot->io->io_Command = command;
+  slot->io->io_Data = slot->buffer;
+  slot->io->io_Length = blocks << shift;
+  slot->io->io_Offset = block << shift;
+  /* io_Actual holds the high 32 bits of the offset for 64 bit reads */
+  slot->io->io_Actual = command == CMD_READ ? 0 : block >> (32 - shift);
+}
+
+/**
+ * Check whether a path, existing or not, is handled by a device's handler
+ *
+ * Every directory of a multi-directory assign is checked.
+ *
+ * @param path Path to check
+ * @param deviceNode Device to compare against
+ * @return TRUE if the path resolves to the device's handler
+ */
+BOOL IsPathOnDevice(const char *path, struct DeviceNode *deviceNode) {
+  struct DevProc *devProc = NULL;
+  BOOL onDevice = FALSE;
+
+  while (!onDevice &&
+      (devProc = GetDeviceProc((STRPTR)path, devProc)) != NULL) {
+    if (devProc->dvp_Port && devProc->dvp_Port == deviceNode->dn_Task) {
+      onDevice = TRUE;
+    }
+    if (!(devProc->dvp_Flags & DVPF_ASSIGN)) {
+      break;
+    }
+  }
+  if (devProc) {
+    FreeDeviceProc(devProc);
+  }
+
+  return onDevice;
+}
+
+/**
+ * Read a partition end to end and report unreadable blocks, throughput
+ * and a CRC-32 of its contents
+ *
+ * SURFACE_REQUESTS reads of up to de_MaxTransfer bytes are kept out at
+ * once, so the driver always has the next read queued. The oldest one
+ * is waited for, added to the CRC in order and sent again for the next
+ * range. A read that fails is retried one block at a time to find the
+ * blocks that cannot be read; those count as zeros in the CRC.
+ *
+ * With a dump file each read is written out in order while the reads
+ * behind it stay queued at the driver. Unreadable blocks are written as
+ * zeros. A dump that does not complete is deleted. The file system is
+ * inhibited for the dump so the image is consistent, and a dump file on
+ * the partition itself is refused.
+ *
+ * @param cleanName Device name without colon
+ * @param dumpName Image file to write, NULL for none
+ * @param sparse Leave zero blocks in the image as holes
+ * @return RC_OK, RC_WARN on unreadable blocks or Ctrl-C, RC_ERROR if the
+ *         device cannot be scanned or the image written, RC_FAIL if
+ *         memory or the unit is not available
+ */
+int SurfaceScan(const char *cleanName, const char *dumpName, BOOL sparse) {
+  SurfaceSlot slots[SURFACE_REQUESTS];
+  SurfaceSlot *slot;
+  DumpFile dump;
+  struct DeviceNode *deviceNode;
+  struct FileSysStartupMsg *startup;
+  struct DosEnvec *environ;
+  struct MsgPort *port;
+  struct EClockVal mark;
+  struct EClockVal now;
+  char driver[SNAPSHOT_NAME_SIZE];
+  char fullName[110];
+  ULONG *crcTable;
+  ULONG flags;
+  ULONG blockBytes;
+  ULONG bufMemType = MEMF_PUBLIC;
+  ULONG mask = 0xFFFFFFFE;
+  ULONG chunkBytes = SURFACE_CHUNK_MAX;
+  ULONG chunkBlocks;
+  ULONG first;
+  ULONG end;
+  ULONG next;
+  ULONG scanned = 0;
+  ULONG bad = 0;
+  ULONG crc = 0;
+  ULONG caps;
+  ULONG run;
+  ULONG runBlocks;
+  ULONG size;
+  ULONG kb;
+  ULONG millis = 0;
+  ULONG micros = 0;
+  ULONG rate;
+  ULONG b;
+  LONG unit;
+  UWORD shift;
+  UWORD command = CMD_READ;
+  int head = 0;
+  int i;
+  BOOL timed = OpenRunTimer();
+  BOOL broken = FALSE;
+  BOOL writeFailed = FALSE;
+  BOOL inhibited = FALSE;
+  int rc = RC_OK;
+
+  memset(&dump, 0, sizeof(dump));
+
+  deviceNode = FindDosDevice(cleanName);
+  if (!deviceNode ||
+      !GetStartupDriver(deviceNode, driver, sizeof(driver), &unit, &flags)) {
+    OPrintf("%s: not a device with a driver\n", cleanName);
+    return RC_ERROR;
+  }
+  startup = (struct FileSysStartupMsg *)BADDR(deviceNode->dn_Startup);
+  environ = (struct DosEnvec *)BADDR(startup->fssm_Environ);
+  if (!environ) {
+    OPrintf("%s: no environment vector\n", cleanName);
+    return RC_ERROR;
+  }
+
+  blockBytes = environ->de_SizeBlock * 4;
+  shift = 0;
+  while (shift < 16 && (1UL << shift) != blockBytes) {
+    shift++;
+  }
+  if (shift < 9 || shift > 15 || environ->de_HighCyl < environ->de_LowCyl) {
+    OPrintf("%s: cannot scan %lu byte blocks or cylinders %lu-%lu\n",
+      cleanName, blockBytes, environ->de_LowCyl, environ->de_HighCyl);
+    return RC_ERROR;
+  }
+
+  if (environ->de_TableSize >= DE_MEMBUFTYPE) {
+    bufMemType = environ->de_BufMemType;
+  }
+  if (environ->de_TableSize >= DE_MASK) {
+    if (environ->de_MaxTransfer && environ->de_MaxTransfer < chunkBytes) {
+      chunkBytes = environ->de_MaxTransfer;
+    }
+    mask = environ->de_Mask;
+  }
+  chunkBlocks = chunkBytes >> shift;
+  if (!chunkBlocks) {
+    chunkBlocks = 1;
+  }
+
+  b = environ->de_Surfaces * environ->de_BlocksPerTrack;
+  first = environ->de_LowCyl * b;
+  end = (environ->de_HighCyl + 1) * b;
+
+  /* Past 4 GiB the offset needs 64 bit reads */
+  if (end > (0xFFFFFFFFUL >> shift) + 1) {
+    caps = GetDriverCaps(driver, unit, flags);
+    if (caps & CAPS_TD64) {
+      command = TD_READ64;
+    }
+    else if (caps & CAPS_NSD64) {
+      command = NSCMD_TD_READ64;
+    }
+    else {
+      OPrintf("%s: ends past 4 GiB and %s has no 64 bit reads\n", cleanName,
+        driver);
+      return RC_ERROR;
+    }
+  }
+
+  crcTable = RunAlloc(256 * sizeof(ULONG));
+  port = CreateMsgPort();
+  if (!crcTable || !port) {
+    if (port) {
+      DeleteMsgPort(port);
+    }
+    return RC_FAIL;
+  }
+  MakeCrc32Table(crcTable);
+
+  /* Buffers come from AllocVec(), not the pool, to honour BufMemType */
+  size = chunkBlocks << shift;
+  memset(slots, 0, sizeof(slots));
+  for (i = 0; i < SURFACE_REQUESTS; i++) {
+    slots[i].io = (struct IOStdReq *)CreateIORequest(port,
+      sizeof(struct IOStdReq));
+    slots[i].buffer = AllocVec(size, bufMemType);
+    if (!slots[i].io || !slots[i].buffer) {
+      rc = RC_FAIL;
+    }
+    else if (((ULONG)slots[i].buffer & ~mask) ||
+        (((ULONG)slots[i].buffer + size - 1) & ~mask)) {
+      OPrintf("%s: no buffer memory within Mask 0x%08lx\n", cleanName, mask);
+      rc = RC_ERROR;
+    }
+  }
+
+  if (rc == RC_OK && dumpName) {
+    dump.sparse = sparse;
+    dump.blockBytes = blockBytes;
+    dump.zeros = RunAlloc(blockBytes);
+    dump.check = sparse ? RunAlloc(blockBytes) : dump.zeros;
+    if (!dump.zeros || !dump.check) {
+      rc = RC_FAIL;
+    }
+    else if (IsPathOnDevice(dumpName, deviceNode)) {
+      OPrintf("%s: is on %s itself; dump to another volume\n", dumpName,
+        cleanName);
+      rc = RC_ERROR;
+    }
+    else {
+      dump.file = Open((STRPTR)dumpName, MODE_NEWFILE);
+      if (!dump.file) {
+        OPrintf("%s: cannot be created, error %ld\n", dumpName, IoErr());
+        rc = RC_ERROR;
+      }
+    }
+  }
+
+  /* Keep the file system from writing while it is imaged; a handler
+     that is not running writes nothing */
+  if (rc == RC_OK && dump.file && deviceNode->dn_Task) {
+    sprintf(fullName, "%s:", cleanName);
+    if (!Inhibit((STRPTR)fullName, DOSTRUE)) {
+      OPrintf("%s: cannot be inhibited, error %ld\n", cleanName, IoErr());
+      rc = RC_ERROR;
+    }
+    else {
+      inhibited = TRUE;
+    }
+  }
+
+  if (rc == RC_OK && OpenDevice((STRPTR)driver, unit,
+      (struct IORequest *)slots[0].io, flags) != 0) {
+    OPrintf("%s: %s unit %ld does not open\n", cleanName, driver, unit);
+    rc = RC_FAIL;
+  }
+
+  if (rc == RC_OK) {
+    /* A copy of an opened request may be used on the same unit */
+    for (i = 1; i < SURFACE_REQUESTS; i++) {
+      memcpy(slots[i].io, slots[0].io, sizeof(struct IOStdReq));
+    }
+
+    OPrintf("%s: %s unit %ld, blocks %lu-%lu of %lu bytes, %d reads of %lu KB\n",
+      cleanName, driver, unit, first, end - 1, blockBytes,
+      SURFACE_REQUESTS, size / 1024);
+
+    ReadRunClock(&mark);
+
+    next = first;
+    for (i = 0; i < SURFACE_REQUESTS && next < end; i++) {
+      b = end - next < chunkBlocks ? end - next : chunkBlocks;
+      SetSurfaceRead(&slots[i], next, b, shift, command);
+      SendIO((struct IORequest *)slots[i].io);
+      slots[i].sent = TRUE;
+      next += b;
+    }
+
+    while (slots[head].sent) {
+      slot = &slots[head];
+      WaitIO((struct IORequest *)slot->io);
+      slot->sent = FALSE;
+
+      /* Summed per read, as ElapsedMicros() saturates after an hour */
+      ReadRunClock(&now);
+      micros += ElapsedMicros(&mark, &now);
+      mark = now;
+      millis += micros / 1000;
+      micros %= 1000;
+
+      if (slot->io->io_Error != 0 && !broken) {
+        /* Find the blocks that failed; the rest of the run is still good */
+        run = slot->block;
+        runBlocks = slot->blocks;
+        for (b = 0; b < runBlocks; b++) {
+          SetSurfaceRead(slot, run + b, 1, shift, command);
+          slot->io->io_Data = slot->buffer + (b << shift);
+          if (DoIO((struct IORequest *)slot->io) != 0) {
+            if (bad < SURFACE_MAX_LISTED) {
+              OPrintf("  Block %lu unreadable, error %ld\n", run + b - first,
+                (LONG)slot->io->io_Error);
+            }
+            memset(slot->buffer + (b << shift), 0, blockBytes);
+            bad++;
+          }
+        }
+        slot->block = run;
+        slot->blocks = runBlocks;
+      }
+
+      if (!broken) {
+        crc = UpdateCrc32(crc, crcTable, slot->buffer, slot->blocks << shift);
+        scanned += slot->blocks;
+
+        if (dump.file && !WriteDumpRun(&dump, slot->buffer, slot->blocks)) {
+          OPrintf("%s: write failed, error %ld\n", dumpName, IoErr());
+          writeFailed = TRUE;
+          broken = TRUE;
+        }
+
+        if (!broken && CheckSignal(SIGBREAKF_CTRL_C)) {
+          OPrintf("***Break\n");
+          broken = TRUE;
+        }
+      }
+
+      if (!broken && next < end) {
+        b = end - next < chunkBlocks ? end - next : chunkBlocks;
+        SetSurfaceRead(slot, next, b, shift, command);
+        SendIO((struct IORequest *)slot->io);
+        slot->sent = TRUE;
+        next += b;
+      }
+
+      head = (head + 1) % SURFACE_REQUESTS;
+    }
+
+    if (dump.file && !broken && !FlushDumpHole(&dump)) {
+      OPrintf("%s: write failed, error %ld\n", dumpName, IoErr());
+      writeFailed = TRUE;
+      broken = TRUE;
+    }
+
+    ReadRunClock(&now);
+    millis += (micros + ElapsedMicros(&mark, &now)) / 1000;
+    if (!millis) {
+      millis = 1;
+    }
+
+    /* Every read is back; let a floppy drive stop spinning */
+    if (stricmp(driver, "trackdisk.device") == 0) {
+      slots[0].io->io_Command = TD_MOTOR;
+      slots[0].io->io_Length = 0;
+      DoIO((struct IORequest *)slots[0].io);
+    }
+    CloseDevice((struct IORequest *)slots[0].io);
+
+    if (shift > 10) {
+      kb = scanned << (shift - 10);
+    }
+    else {
+      kb = scanned >> (10 - shift);
+    }
+    if (kb < 0xFFFFFFFFUL / 1000) {
+      rate = kb * 1000 / millis;
+    }
+    else {
+      rate = millis >= 1000 ? kb / (millis / 1000) : kb;
+    }
+
+    if (timed) {
+      OPrintf("Read %lu KB in %lu.%02lu s, %lu KB/s\n", kb, millis / 1000,
+        (millis % 1000) / 10, rate);
+    }
+    else {
+      OPrintf("Read %lu KB\n", kb);
+    }
+    if (bad > SURFACE_MAX_LISTED) {
+      OPrintf("  ... %lu more\n", bad - SURFACE_MAX_LISTED);
+    }
+    OPrintf("%lu unreadable blocks\n", bad);
+    OPrintf("CRC32 %08lx%s\n", crc, (STRPTR)(broken ? " (partial)" : ""));
+    if (dump.file && !broken) {
+      OPrintf("Wrote %s: %lu KB of data, %lu KB left as holes\n", dumpName,
+        dump.dataBlocks * (blockBytes / 512) / 2,
+        dump.holeBlocks * (blockBytes / 512) / 2);
+    }
+
+    if (writeFailed) {
+      rc = RC_ERROR;
+    }
+    else if (bad || broken) {
+      rc = RC_WARN;
+    }
+  }
+
+  if (inhibited) {
+    Inhibit((STRPTR)fullName, DOSFALSE);
+  }
+
+  if (dump.file) {
+    Close(dump.file);
+    if (rc != RC_OK && (broken || rc != RC_WARN)) {
+      DeleteFile((STRPTR)dumpName);
+      OPrintf("%s: incomplete image deleted\n", dumpName);
+    }
+  }
+
+  for (i = 0; i < SURFACE_REQUESTS; i++) {
+    if (slots[i].buffer) {
+      FreeVec(slots[i].buffer);
+    }
+    if (slots[i].io) {
+      DeleteIORequest((struct IORequest *)slots[i].io);
+    }
   }
+  DeleteMsgPort(port);
 
   return rc;
 }
 
 /**
- * Main entry point
+ * Write zeros for a hole the file system could not leave
+ *
+ * @param dump Output file
+ * @return TRUE if all of the hole was written
  */
-int main(void) {
-  struct RDArgs *rdArgs = NULL;
-  struct Arguments args = { NULL, FALSE, NULL, FALSE, FALSE };
-  struct Context *context = GetContext();
-
-  char volumeName[64];
-  char cleanName[108];
-  char foundDevice[108];
-  STRPTR driverName;
-  struct DeviceNode *deviceNode;
-  struct Process *proc;
-  APTR oldWindowPtr;
-  int status;
-  int returnCode = RC_ERROR;
-  LONG unitNum;
+BOOL FillDumpHole(DumpFile *dump) {
+  ULONG n;
 
-  /* Parse command line arguments */
-  rdArgs = ReadArgs(TEMPLATE, (LONG *)&args, NULL);
-  if (!rdArgs) {
-    Printf("Usage: CheckDosDevice <DEVICE> [QUIET] [<DRIVER> driver] [INFO] [MOUNTLIST]\n");
-    Printf("  DEVICE    - DOS device name or unit number\n");
-    Printf("  QUIET     - Suppress output\n");
-    Printf("  DRIVER    - Device driver name (default: diskimage.device)\n");
-    Printf("  INFO      - Show detailed device information\n");
-    Printf("  MOUNTLIST - Generate mountlist entry\n");
-    Printf("\nExamples:\n");
-    Printf("  CheckDosDevice IHD101\n");
-    Printf("  CheckDosDevice 101 INFO\n");
-    Printf("  CheckDosDevice DF0: MOUNTLIST\n");
-    Printf("  CheckDosDevice 0 DRIVER trackdisk.device\n");
-    return exitWith(RC_ERROR);
+  while (dump->hole) {
+    n = dump->hole < dump->blockBytes ? dump->hole : dump->blockBytes;
+    if (Write(dump->file, dump->zeros, n) != n) {
+      return FALSE;
+    }
+    dump->hole -= n;
+    dump->dataBlocks++;
   }
 
-  /* Set global quiet flag */
-  context->quiet = args.quiet ? TRUE : FALSE;
+  return TRUE;
+}
 
-  /* Get driver name (default to diskimage.device) */
-  driverName = args.driver ? args.driver : (STRPTR)"diskimage.device";
+/**
+ * Pass over the zero blocks not written yet
+ *
+ * The file is grown with SetFileSize(), which leaves the grown part
+ * undefined: a host directory under UAE reads it as zeros and keeps it
+ * sparse, FFS and SFS hand out free blocks as they are. So the grown
+ * part is read back, which also moves the position past it, and kept
+ * only as far as it is zeros. From the first block that is not, zeros
+ * are written, for this hole and all later ones. Where growing fails
+ * the zeros are written too.
+ *
+ * @param dump Output file
+ * @return TRUE on success
+ */
+BOOL FlushDumpHole(DumpFile *dump) {
+  ULONG *longs = (ULONG *)dump->check;
+  ULONG n;
+  ULONG i;
 
-  /* Disable system requesters early to prevent any popups */
-  proc = (struct Process *)FindTask(NULL);
-  oldWindowPtr = proc->pr_WindowPtr;
-  proc->pr_WindowPtr = (APTR)-1L;
+  if (!dump->hole) {
+    return TRUE;
+  }
 
-  /* First check if the device driver is available */
-  if (!CheckDeviceDriver(driverName)) {
-    OPrintf("Device driver %s not available\n", driverName);
-    proc->pr_WindowPtr = oldWindowPtr;
-    FreeArgs(rdArgs);
-    return exitWith(RC_FAIL);
+  if (!dump->noHoles &&
+      SetFileSize(dump->file, (LONG)dump->position, OFFSET_BEGINNING) ==
+      (LONG)dump->position) {
+    while (dump->hole) {
+      n = dump->hole < dump->blockBytes ? dump->hole : dump->blockBytes;
+      if (Read(dump->file, dump->check, n) != n) {
+        break;
+      }
+      i = 0;
+      while (i < n / 4 && !longs[i]) {
+        i++;
+      }
+      if (i < n / 4) {
+        break;
+      }
+      dump->hole -= n;
+      dump->holeBlocks++;
+    }
+    if (!dump->hole) {
+      return TRUE;
+    }
+
+    dump->noHoles = TRUE;
+    if (Seek(dump->file, (LONG)(dump->position - dump->hole),
+        OFFSET_BEGINNING) < 0) {
+      return FALSE;
+    }
   }
 
-  /* Check if argument is a pure number */
-  if (IsNumber(args.device)) {
-    /* Convert to unit number */
-    unitNum = atol(args.device);
+  return FillDumpHole(dump);
+}
 
-    /* Find device with this unit number and driver */
-    if (FindDeviceByDriverAndUnit(
-      driverName,
-      unitNum,
-      foundDevice,
-      sizeof(foundDevice)
-    )) {
-      OPrintf("Found %s unit %ld as %s:\n", driverName, unitNum, foundDevice);
-      /* Use the found device name for checking */
-      StripDeviceName(foundDevice, cleanName, sizeof(cleanName));
+/**
+ * Append blocks read from the partition to the dump
+ *
+ * Runs of blocks with data go out in one Write(). With SPARSE, blocks of
+ * zeros are only counted, up to the 2 GiB that Seek() can address.
+ *
+ * @param dump Output file
+ * @param data Blocks read
+ * @param blocks Number of blocks
+ * @return TRUE on success
+ */
+BOOL WriteDumpRun(DumpFile *dump, UBYTE *data, ULONG blocks) {
+  ULONG *longs;
+  ULONG start = 0;
+  ULONG bytes;
+  ULONG b;
+  ULONG i;
+  BOOL zero;
+
+  for (b = 0; b <= blocks; b++) {
+    zero = FALSE;
+
+    if (b < blocks && dump->sparse) {
+      if (dump->position > DUMP_SPARSE_LIMIT - dump->blockBytes) {
+        dump->sparse = FALSE;
+      }
+      else {
+        longs = (ULONG *)(data + b * dump->blockBytes);
+        i = 0;
+        while (i < dump->blockBytes / 4 && !longs[i]) {
+          i++;
+        }
+        zero = (BOOL)(i == dump->blockBytes / 4);
+      }
     }
-    else {
-      OPrintf("No %s found with unit %ld\n", driverName, unitNum);
-      proc->pr_WindowPtr = oldWindowPtr;
-      FreeArgs(rdArgs);
-      return exitWith(RC_ERROR);
+    if (b < blocks && !zero) {
+      continue;
+    }
+
+    /* Blocks start to b - 1 hold data */
+    if (b > start) {
+      if (!FlushDumpHole(dump)) {
+        return FALSE;
+      }
+      bytes = (b - start) * dump->blockBytes;
+      if (Write(dump->file, data + start * dump->blockBytes, bytes) != bytes) {
+        return FALSE;
+      }
+      dump->dataBlocks += b - start;
+      dump->position += bytes;
+    }
+
+    if (zero) {
+      dump->hole += dump->blockBytes;
+      dump->position += dump->blockBytes;
     }
+    start = b + 1;
   }
-  else {
-    /* Normal device name */
-    StripDeviceName(args.device, cleanName, sizeof(cleanName));
+
+  return TRUE;
+}
+
+/**
+ * Tell a Workbench user something; there is no console to print to
+ *
+ * @param text Message
+ */
+void ShowWorkbenchMessage(const char *text) {
+  struct Library *IntuitionBase;      /* Picked up by EasyRequestArgs() */
+  struct EasyStruct easy;
+  APTR args[1];
+
+  IntuitionBase = OpenLibrary("intuition.library", 36);
+  if (!IntuitionBase) {
+    return;
   }
 
-  /* Get device node for INFO/MOUNTLIST operations */
-  deviceNode = FindDosDevice(cleanName);
+  easy.es_StructSize = sizeof(struct EasyStruct);
+  easy.es_Flags = 0;
+  easy.es_Title = (UBYTE *)"CheckDosDevice";
+  easy.es_TextFormat = (UBYTE *)"%s";
+  easy.es_GadgetFormat = (UBYTE *)"OK";
+  args[0] = (APTR)text;
+  EasyRequestArgs(NULL, &easy, NULL, args);
 
-  /* Show device info if requested */
-  if (args.info && deviceNode) {
-    ShowDeviceInfo(cleanName, deviceNode);
+  CloseLibrary(IntuitionBase);
+}
+
+/**
+ * Read ACTION, DRIVER, FROM and MOUNTER tooltypes from one icon
+ *
+ * Tooltypes that are not set leave the option unchanged, so the project
+ * icon can override what the tool icon sets.
+ *
+ * @param arg Icon to read (lock of its drawer and name)
+ * @param options Options to update
+ */
+void ReadWorkbenchToolTypes(struct WBArg *arg, WorkbenchOptions *options) {
+  struct Library *IconBase;           /* Picked up by the icon calls */
+  struct DiskObject *icon;
+  STRPTR value;
+  BPTR oldDir;
+  LONG number;
+
+  if (!arg->wa_Name || !arg->wa_Name[0]) {
+    return;
   }
 
-  /* Generate mountlist if requested */
-  if (args.mountlist && deviceNode) {
-    GenerateMountlist(cleanName, deviceNode);
+  IconBase = OpenLibrary("icon.library", 36);
+  if (!IconBase) {
+    return;
   }
 
-  /* Check device status (unless we only want info/mountlist) */
-  if (!args.info && !args.mountlist) {
-    status = CheckDeviceStatus(cleanName, volumeName, sizeof(volumeName));
+  oldDir = CurrentDir(arg->wa_Lock);
+  icon = GetDiskObject((STRPTR)arg->wa_Name);
+  CurrentDir(oldDir);
 
-    switch (status) {
-      case 0:  /* Volume mounted */
-        if (volumeName[0]) {
-          OPrintf("%s: has mounted volume \"%s\"\n", cleanName, volumeName);
-        }
-        else {
-          OPrintf("%s: has mounted volume\n", cleanName);
-        }
-        returnCode = RC_OK;
-        break;
+  if (icon) {
+    value = FindToolType(icon->do_ToolTypes, (STRPTR)"ACTION");
+    if (value) {
+      strncpy(options->action, value, sizeof(options->action) - 1);
+    }
+    value = FindToolType(icon->do_ToolTypes, (STRPTR)"DRIVER");
+    if (value) {
+      strncpy(options->driver, value, sizeof(options->driver) - 1);
+    }
+    value = FindToolType(icon->do_ToolTypes, (STRPTR)"FROM");
+    if (value && StrToLong(value, &number) > 0 && number >= 0) {
+      options->from = number;
+    }
+    value = FindToolType(icon->do_ToolTypes, (STRPTR)"MOUNTER");
+    if (value) {
+      strncpy(options->mounter, value, sizeof(options->mounter) - 1);
+    }
+    FreeDiskObject(icon);
+  }
 
-      case 1:  /* No disk present */
-        OPrintf("%s: no disk present\n", cleanName);
-        returnCode = RC_WARN;
-        break;
+  CloseLibrary(IconBase);
+}
 
-      case -1:  /* Device not found */
-        OPrintf("%s: device not found\n", cleanName);
-        returnCode = RC_ERROR;
-        break;
+/**
+ * Find the first unit of a driver, from a given one up, that no DOS
+ * device uses
+ *
+ * Units that are mounted with or without a disk both count as taken,
+ * as in scripts/WBHDFMounter. The driver's probe backend skips units
+ * the driver cannot have.
+ *
+ * @param driverName Device driver
+ * @param from First unit to try
+ * @return Free unit, -1 if none was found
+ */
+LONG FindFreeUnit(const char *driverName, LONG from) {
+  return FindProbeBackend(driverName)->freeUnit(driverName, from);
+}
+
+/**
+ * Quote a command line argument for ReadArgs()
+ *
+ * The text is put in double quotes, with * written as **, " as *" and
+ * a newline as *N, so any file name reaches the command unchanged.
+ *
+ * @param text Argument
+ * @param buffer Buffer for the quoted argument
+ * @param bufSize Size of buffer
+ * @return TRUE, FALSE if the quoted argument does not fit
+ */
+BOOL QuoteArgument(const char *text, char *buffer, int bufSize) {
+  int len = 0;
+
+  if (bufSize < 3) {
+    return FALSE;
+  }
+  buffer[len++] = '"';
+  for (; *text; text++) {
+    if (len + 4 > bufSize) {
+      return FALSE;
+    }
+    if (*text == '"' || *text == '*') {
+      buffer[len++] = '*';
+      buffer[len++] = *text;
+    } else if (*text == '\n') {
+      buffer[len++] = '*';
+      buffer[len++] = 'N';
+    } else {
+      buffer[len++] = *text;
     }
   }
-  else if (deviceNode) {
-    /* If only info/mountlist requested and device exists, return OK */
-    returnCode = RC_OK;
+  buffer[len++] = '"';
+  buffer[len] = '\0';
+
+  return TRUE;
+}
+
+/**
+ * Entry of the process that runs MOUNTER for a Workbench mount
+ *
+ * The process is made with a CLI, so the command sees a normal command
+ * line through RunCommand() without a Shell being started. MOUNTER is
+ * loaded as given, or from C: when it is a plain name, as a Workbench
+ * process has no command path. The code may be a resident copy whose
+ * data belongs to the parent, so only locals and the message are used.
+ * The reply is sent under Forbid(), so the parent cannot unload the
+ * code before this process is gone.
+ */
+void MountProcess(void) {
+  struct ExecBase *SysBase = *(struct ExecBase **)4L;
+  struct DosLibrary *DOSBase;
+  struct Process *proc = (struct Process *)FindTask(NULL);
+  MountMessage *mount;
+  char fallback[WB_MOUNTER_SIZE + 2];
+  char *c;
+  BPTR segment;
+  BOOL plainName = TRUE;
+  int i;
+
+  WaitPort(&proc->pr_MsgPort);
+  mount = (MountMessage *)GetMsg(&proc->pr_MsgPort);
+  DOSBase = mount->dosBase;
+
+  segment = LoadSeg((STRPTR)mount->mounter);
+  if (!segment) {
+    for (c = mount->mounter; *c; c++) {
+      if (*c == ':' || *c == '/') {
+        plainName = FALSE;
+      }
+    }
+    if (plainName) {
+      /* No string constants: they may live in the parent's data */
+      fallback[0] = 'C';
+      fallback[1] = ':';
+      for (i = 0; mount->mounter[i]; i++) {
+        fallback[i + 2] = mount->mounter[i];
+      }
+      fallback[i + 2] = '\0';
+      segment = LoadSeg((STRPTR)fallback);
+    }
   }
 
-  /* Restore requester state */
-  proc->pr_WindowPtr = oldWindowPtr;
+  if (segment) {
+    SetProgramName((STRPTR)mount->mounter);
+    mount->result = RunCommand(segment, WB_MOUNTER_STACK,
+      (STRPTR)mount->args, mount->argsLength);
+    mount->error = IoErr();
+    UnLoadSeg(segment);
+  } else {
+    mount->result = -1;
+    mount->error = IoErr();
+  }
 
-  /* Free the ReadArgs structure */
-  FreeArgs(rdArgs);
+  Forbid();
+  ReplyMsg(&mount->message);
+}
 
-  return exitWith(returnCode);
+/**
+ * Run MOUNTER for one disk image in a process of its own
+ *
+ * The process gets NIL: as its input and output, which it closes when
+ * it ends, so no window opens.
+ *
+ * @param mounter Mount command, MountHDF
+ * @param path Full path of the image
+ * @param unit Unit to mount it on
+ * @param error Set to the DOS error if the command was not run
+ * @return Return code of the command, -1 if it was not run
+ */
+LONG RunMounter(const char *mounter, const char *path, LONG unit, LONG *error) {
+  MountMessage mount;
+  struct MsgPort *replyPort;
+  struct Process *child = NULL;
+  char quoted[WB_PATH_SIZE * 2 + 2];
+  BPTR input;
+  BPTR output;
+
+  *error = 0;
+  if (!QuoteArgument(path, quoted, sizeof(quoted))) {
+    *error = ERROR_LINE_TOO_LONG;
+    return -1;
+  }
+
+  memset(&mount, 0, sizeof(mount));
+  mount.dosBase = DOSBase;
+  strncpy(mount.mounter, mounter, sizeof(mount.mounter) - 1);
+  sprintf(mount.args, "HDF %s UNIT %ld\n", quoted, unit);
+  mount.argsLength = strlen(mount.args);
+
+  replyPort = CreateMsgPort();
+  if (!replyPort) {
+    *error = ERROR_NO_FREE_STORE;
+    return -1;
+  }
+  mount.message.mn_ReplyPort = replyPort;
+  mount.message.mn_Length = sizeof(mount);
+
+  input = Open((STRPTR)"NIL:", MODE_OLDFILE);
+  output = Open((STRPTR)"NIL:", MODE_NEWFILE);
+  if (input && output) {
+    child = CreateNewProcTags(NP_Entry, (ULONG)MountProcess,
+      NP_Name, (ULONG)"CheckDosDevice mounter",
+      NP_Cli, TRUE,
+      NP_Input, input,
+      NP_Output, output,
+      NP_StackSize, 4096,
+      TAG_DONE);
+  }
+  if (!child) {
+    *error = IoErr();
+    if (input) {
+      Close(input);
+    }
+    if (output) {
+      Close(output);
+    }
+    DeleteMsgPort(replyPort);
+    return -1;
+  }
+
+  PutMsg(&child->pr_MsgPort, &mount.message);
+  WaitPort(replyPort);
+  GetMsg(replyPort);
+  DeleteMsgPort(replyPort);
+
+  if (mount.result < 0) {
+    *error = mount.error;
+  }
+  return mount.result;
 }
 
 /**
- * Find all devices matching a pattern
+ * Mount the disk images a Workbench user opened with CheckDosDevice as
+ * their default tool
  *
- * This function can be used to find devices that match a pattern
- * like "IHD*" or "IMG*" and check their status.
+ * Each selected project is mounted on the next free unit of DRIVER from
+ * FROM up by running MOUNTER (MountHDF) with RunMounter(), which needs
+ * no Shell. Tooltypes of the tool icon apply first, those of each
+ * project icon override them for that project. Problems are shown in a
+ * requester.
  *
- * @param pattern Pattern to match (simple wildcards: * = any chars)
+ * @param startup Workbench startup message
+ * @return RC_OK, RC_ERROR if an image could not be mounted, RC_FAIL if the
+ *         driver is not available
  */
-void FindMatchingDevices(const char *pattern) {
-  struct RootNode *rootNode;
-  struct DosInfo *dosInfo;
-  struct DeviceNode *deviceNode;
-  char *bstrName;
-  char devName[108];
-  char volumeName[64];
-  int status;
-  int patLen;
-  BOOL foundAny = FALSE;
+int MountFromWorkbench(struct WBStartup *startup) {
+  struct Process *proc = (struct Process *)FindTask(NULL);
+  WorkbenchOptions toolOptions;
+  WorkbenchOptions options;
+  struct WBArg *arg;
+  APTR oldWindowPtr;
+  char path[WB_PATH_SIZE];
+  char message[WB_MOUNTER_SIZE + WB_PATH_SIZE];  /* Names cut to 200 */
+  LONG unit;
+  LONG nextUnit = -1;
+  LONG result;
+  LONG error;
+  LONG i;
+  int rc = RC_OK;
 
-  OPrintf("Devices matching pattern \"%s\":\n", pattern);
+  GetContext()->quiet = TRUE;
 
-  /* Get pattern length for simple matching */
-  patLen = strlen(pattern);
+  memset(&toolOptions, 0, sizeof(toolOptions));
+  strcpy(toolOptions.action, "MOUNT");
+  strcpy(toolOptions.driver, "diskimage.device");
+  toolOptions.from = WB_DEFAULT_FROM;
+  strcpy(toolOptions.mounter, WB_DEFAULT_MOUNTER);
+  ReadWorkbenchToolTypes(&startup->sm_ArgList[0], &toolOptions);
 
-  /* Get the DOS root node */
-  rootNode = (struct RootNode *)DOSBase->dl_Root;
-  dosInfo = (struct DosInfo *)BADDR(rootNode->rn_Info);
+  if (startup->sm_NumArgs < 2) {
+    ShowWorkbenchMessage("Set CheckDosDevice as the default tool\n"
+      "of a disk image icon to mount it");
+    return RC_ERROR;
+  }
 
-  /* Lock the DOS device list */
-  Forbid();
+  oldWindowPtr = proc->pr_WindowPtr;
+  proc->pr_WindowPtr = (APTR)-1L;
 
-  /* Walk through the device list */
-  deviceNode = (struct DeviceNode *)BADDR(dosInfo->di_DevInfo);
+  for (i = 1; i < startup->sm_NumArgs; i++) {
+    arg = &startup->sm_ArgList[i];
+    options = toolOptions;
+    ReadWorkbenchToolTypes(arg, &options);
 
-  while (deviceNode) {
-    /* Get the device name from BCPL string */
-    bstrName = (char *)BADDR(deviceNode->dn_Name);
-    if (bstrName && bstrName[0] > 0) {
-      /* Convert BCPL string to C string */
-      int len = bstrName[0];
-      if (len < sizeof(devName) - 1) {
-        memcpy(devName, &bstrName[1], len);
-        devName[len] = '\0';
+    if (stricmp(options.action, "MOUNT") != 0) {
+      sprintf(message, "Unknown ACTION=%s for %.200s", options.action,
+        arg->wa_Name);
+      ShowWorkbenchMessage(message);
+      rc = RC_ERROR;
+      continue;
+    }
 
-        /* Simple pattern matching (could be enhanced) */
-        /* For now, just check prefix if pattern ends with * */
-        if (patLen > 0 && pattern[patLen-1] == '*') {
-          if (strnicmp(devName, pattern, patLen-1) == 0) {
-            foundAny = TRUE;
-            Permit();
-
-            /* Check device status */
-            status = CheckDeviceStatus(devName, volumeName, sizeof(volumeName));
-            switch (status) {
-              case 0:
-                if (volumeName[0]) {
-                  OPrintf("  %s: Volume \"%s\"\n", devName, volumeName);
-                }
-                else {
-                  OPrintf("  %s: Volume mounted\n", devName);
-                }
-                break;
-              case 1:
-                OPrintf("  %s: No disk present\n", devName);
-                break;
-            }
+    if (!NameFromLock(arg->wa_Lock, path, sizeof(path)) ||
+        !AddPart(path, (STRPTR)arg->wa_Name, sizeof(path))) {
+      sprintf(message, "Path of %.200s is too long", arg->wa_Name);
+      ShowWorkbenchMessage(message);
+      rc = RC_ERROR;
+      continue;
+    }
 
-            Forbid();
-          }
-        }
-      }
+    if (!CheckDeviceDriver(options.driver)) {
+      sprintf(message, "%s is not available", options.driver);
+      ShowWorkbenchMessage(message);
+      rc = RC_FAIL;
+      break;
     }
 
-    /* Move to next device */
-    deviceNode = (struct DeviceNode *)BADDR(deviceNode->dn_Next);
+    /* The DOS list view is not refreshed, so skip units mounted above */
+    unit = FindFreeUnit(options.driver,
+      nextUnit > options.from ? nextUnit : options.from);
+    if (unit < 0) {
+      sprintf(message, "No free %s unit from %ld", options.driver,
+        options.from);
+      ShowWorkbenchMessage(message);
+      rc = RC_ERROR;
+      continue;
+    }
+    nextUnit = unit + 1;
+
+    result = RunMounter(options.mounter, path, unit, &error);
+    if (result != 0) {
+      sprintf(message, "%s could not mount\n%.200s\non unit %ld (%s %ld)",
+        options.mounter, arg->wa_Name, unit,
+        result < 0 ? "not started, error" : "return code",
+        result < 0 ? error : result);
+      ShowWorkbenchMessage(message);
+      rc = RC_ERROR;
+    }
   }
 
-  Permit();
+  proc->pr_WindowPtr = oldWindowPtr;
 
-  if (!foundAny) {
-    OPrintf("No devices found matching pattern \"%s\"\n", pattern);
-  }
+  return rc;
 }
@@ -0,0 +1,585 @@
+/**
+ * imgbatch.c - Inspect many ADF and HDF images with batched reads
+ *
+ * The io_uring engine uses the system calls directly, without liburing:
+ * one submission and one completion ring, IORING_OP_READV requests whose
+ * user_data is the index of the read, and io_uring_enter() both to
+ * submit and to wait. When the kernel or the headers lack io_uring, the
+ * pread() pool is used instead.
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#include "imgbatch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_URING          1
+#endif
+#endif
+#endif
+
+/* Gzip magic, as ImgOpen() checks it */
+#define GZIP_MAGIC0         0x1F
+#define GZIP_MAGIC1         0x8B
+
+/**
+ * One read of a batch, into a cached extent
+ */
+typedef struct BatchRead {
+  int fd;
+  ImgExtent *extent;
+  struct iovec iov;
+  int64_t result;                     /* Bytes read, or -errno */
+} BatchRead;
+
+/**
+ * One image of a window and the extents read from it so far
+ */
+typedef struct BatchFile {
+  ImgJob *job;
+  int fd;
+  int done;
+  ImgExtent *extents;
+  int extentCount;
+  int capacity;
+  int fetched;                        /* Extents below this have been read */
+} BatchFile;
+
+/**
+ * Reads shared by the threads of the pread() engine
+ */
+typedef struct ReadPool {
+  BatchRead *reads;
+  int count;
+  int next;                           /* Next read to claim, atomic */
+} ReadPool;
+
+#ifdef HAVE_URING
+/**
+ * Mapped io_uring rings
+ */
+typedef struct Uring {
+  int fd;
+  unsigned entries;
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+} Uring;
+#else
+typedef struct Uring {
+  int fd;
+} Uring;
+#endif
+
+/**
+ * Read all of one request with pread(), from where it got to
+ *
+ * @param read Request; result holds the bytes already read
+ */
+static void FinishRead(BatchRead *read) {
+  unsigned char *base = read->iov.iov_base;
+  size_t done = read->result > 0 ? (size_t)read->result : 0;
+  ssize_t n;
+
+  while (done < read->iov.iov_len) {
+    n = pread(read->fd, base + done, read->iov.iov_len - done,
+      (off_t)(read->extent->offset + done));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      read->result = -errno;
+      return;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += (size_t)n;
+  }
+  read->result = (int64_t)done;
+}
+
+static void *ReadThread(void *data) {
+  ReadPool *pool = data;
+  int i;
+
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+      pool->count) {
+    pool->reads[i].result = 0;
+    FinishRead(&pool->reads[i]);
+  }
+
+  return NULL;
+}
+
+/**
+ * Run a batch on a pool of threads calling pread()
+ *
+ * @param reads Requests
+ * @param count Number of requests
+ * @param threads Most threads to start
+ */
+static void ReadThreads(BatchRead *reads, int count, int threads) {
+  pthread_t *ids;
+  ReadPool pool;
+  int started = 0;
+  int i;
+
+  pool.reads = reads;
+  pool.count = count;
+  pool.next = 0;
+
+  if (threads > count) {
+    threads = count;
+  }
+  ids = malloc(threads * sizeof(pthread_t));
+  if (ids) {
+    for (started = 0; started < threads; started++) {
+      if (pthread_create(&ids[started], NULL, ReadThread, &pool) != 0) {
+        break;
+      }
+    }
+  }
+
+  /* Whatever the threads have not claimed, including everything when
+     none could be started */
+  ReadThread(&pool);
+
+  for (i = 0; i < started; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  free(ids);
+}
+
+#ifdef HAVE_URING
+/**
+ * Set up an io_uring instance and map its rings
+ *
+ * @param ring Receives the rings
+ * @param entries Requests in flight
+ * @return 0, or -1 when io_uring is not available
+ */
+static int UringOpen(Uring *ring, unsigned entries) {
+  struct io_uring_params params;
+
+  memset(ring, 0, sizeof(Uring));
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    return -1;
+  }
+  ring->entries = params.sq_entries;
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries *
+    sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries *
+    sizeof(struct io_uring_cqe);
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    if (ring->sqRing != MAP_FAILED) {
+      munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->cqRing != MAP_FAILED) {
+      munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqesSize);
+    }
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+  }
+
+  ring->sqTail = (unsigned *)((char *)ring->sqRing + params.sq_off.tail);
+  ring->sqMask = (unsigned *)((char *)ring->sqRing + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)((char *)ring->sqRing + params.sq_off.array);
+  ring->cqHead = (unsigned *)((char *)ring->cqRing + params.cq_off.head);
+  ring->cqTail = (unsigned *)((char *)ring->cqRing + params.cq_off.tail);
+  ring->cqMask = (unsigned *)((char *)ring->cqRing + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cqRing +
+    params.cq_off.cqes);
+
+  return 0;
+}
+
+static void UringClose(Uring *ring) {
+  if (ring->fd < 0) {
+    return;
+  }
+  munmap(ring->sqes, ring->sqesSize);
+  munmap(ring->cqRing, ring->cqRingSize);
+  munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+/**
+ * Run a batch through io_uring, keeping the submission ring full
+ *
+ * Short reads are finished with pread().
+ *
+ * @param ring Rings
+ * @param reads Requests
+ * @param count Number of requests
+ * @return 0, or -1 when io_uring_enter() failed; reads not completed
+ *         then have result 0 and no data
+ */
+static int ReadUring(Uring *ring, BatchRead *reads, int count) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  BatchRead *read;
+  unsigned tail;
+  unsigned head;
+  unsigned index;
+  int queued = 0;                     /* In the ring, not yet taken */
+  int inFlight = 0;
+  int next = 0;
+  int completed = 0;
+  int rc;
+
+  for (index = 0; index < (unsigned)count; index++) {
+    reads[index].result = 0;
+  }
+
+  while (completed < count) {
+    tail = *ring->sqTail;
+    while (next < count && inFlight + queued < (int)ring->entries) {
+      index = tail & *ring->sqMask;
+      sqe = &ring->sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = reads[next].fd;
+      sqe->off = reads[next].extent->offset;
+      sqe->addr = (uint64_t)(uintptr_t)&reads[next].iov;
+      sqe->len = 1;
+      sqe->user_data = (uint64_t)next;
+      ring->sqArray[index] = index;
+      tail++;
+      next++;
+      queued++;
+    }
+    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+    rc = (int)syscall(__NR_io_uring_enter, ring->fd, (unsigned)queued, 1U,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    queued -= rc;
+    inFlight += rc;
+
+    head = *ring->cqHead;
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & *ring->cqMask];
+      read = &reads[cqe->user_data];
+      read->result = cqe->res;
+      if (read->result >= 0 && (size_t)read->result < read->iov.iov_len) {
+        FinishRead(read);
+      }
+      head++;
+      inFlight--;
+      completed++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+#endif
+
+/**
+ * Add an extent to read to a file of the window
+ *
+ * @return 0, or -1 when out of memory
+ */
+static int AddExtent(BatchFile *file, uint64_t offset, uint32_t length) {
+  ImgExtent *grown;
+  ImgExtent *extent;
+
+  if (file->extentCount == file->capacity) {
+    file->capacity = file->capacity ? file->capacity * 2 : 4;
+    grown = realloc(file->extents, file->capacity * sizeof(ImgExtent));
+    if (!grown) {
+      return -1;
+    }
+    file->extents = grown;
+  }
+
+  extent = &file->extents[file->extentCount];
+  extent->offset = offset;
+  extent->length = length;
+  extent->error = IMG_ERR_IO;
+  extent->data = malloc(length);
+  if (!extent->data) {
+    return -1;
+  }
+  file->extentCount++;
+
+  return 0;
+}
+
+/**
+ * Inspect one window of images, a batch of reads per round
+ *
+ * @param files Window state, one per job
+ * @param jobs Images of the window
+ * @param count Number of images
+ * @param reads Room for count * IMG_MAX_MISSES reads
+ * @param ring Rings, when the engine is io_uring
+ * @param threads Threads of the pread() engine
+ * @param stats Updated; engine turns to threads if io_uring fails
+ */
+static void InspectWindow(
+  BatchFile *files,
+  ImgJob *jobs,
+  int count,
+  BatchRead *reads,
+  Uring *ring,
+  int threads,
+  ImgBatchStats *stats
+) {
+  BatchFile *file;
+  ImgJob *job;
+  ImgFile img;
+  int readCount;
+  int pending = 0;
+  int round;
+  int i;
+  int j;
+
+  for (i = 0; i < count; i++) {
+    file = &files[i];
+    job = &jobs[i];
+    memset(file, 0, sizeof(BatchFile));
+    file->job = job;
+    job->count = 0;
+    job->compressed = 0;
+    job->inflated = 0;
+    job->consumed = 0;
+
+    file->fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+      job->count = IMG_ERR_IO;
+      file->done = 1;
+      continue;
+    }
+    if (job->size > 0 && AddExtent(file, 0,
+        job->size < IMG_BATCH_HEAD ? (uint32_t)job->size : IMG_BATCH_HEAD) != 0) {
+      job->count = IMG_ERR_MEMORY;
+      file->done = 1;
+      continue;
+    }
+    pending++;
+  }
+
+  for (round = 0; pending > 0; round++) {
+    readCount = 0;
+    for (i = 0; i < count; i++) {
+      file = &files[i];
+      for (j = file->fetched; !file->done && j < file->extentCount; j++) {
+        reads[readCount].fd = file->fd;
+        reads[readCount].extent = &file->extents[j];
+        reads[readCount].iov.iov_base = file->extents[j].data;
+        reads[readCount].iov.iov_len = file->extents[j].length;
+        readCount++;
+      }
+      file->fetched = file->extentCount;
+    }
+
+#ifdef HAVE_URING
+    if (stats->engine == IMG_ENGINE_URING &&
+        ReadUring(ring, reads, readCount) != 0) {
+      stats->engine = IMG_ENGINE_THREADS;
+    }
+#else
+    (void)ring;
+#endif
+    if (stats->engine == IMG_ENGINE_THREADS) {
+      ReadThreads(reads, readCount, threads);
+    }
+
+    for (i = 0; i < readCount; i++) {
+      if (reads[i].result == (int64_t)reads[i].iov.iov_len) {
+        reads[i].extent->error = IMG_OK;
+        stats->bytes += reads[i].iov.iov_len;
+      }
+    }
+    stats->reads += readCount;
+    if (round + 1 > stats->rounds) {
+      stats->rounds = round + 1;
+    }
+
+    for (i = 0; i < count; i++) {
+      file = &files[i];
+      job = file->job;
+      if (file->done) {
+        continue;
+      }
+
+      /* Left for the stream path of ImgOpen() */
+      if (round == 0 && file->extentCount && file->extents[0].length >= 2 &&
+          file->extents[0].error == IMG_OK &&
+          file->extents[0].data[0] == GZIP_MAGIC0 &&
+          file->extents[0].data[1] == GZIP_MAGIC1) {
+        job->compressed = 1;
+        file->done = 1;
+        pending--;
+        continue;
+      }
+
+      ImgOpenCached(&img, job->size, file->extents, file->extentCount);
+      job->count = ImgInspect(&img, job->volumes, IMG_MAX_VOLUMES);
+
+      if (img.missCount == 0 || round + 1 >= IMG_BATCH_ROUNDS) {
+        file->done = 1;
+        pending--;
+        continue;
+      }
+      for (j = 0; j < img.missCount; j++) {
+        if (AddExtent(file, img.misses[j].offset, img.misses[j].length) != 0) {
+          job->count = IMG_ERR_MEMORY;
+          file->done = 1;
+          pending--;
+          break;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    file = &files[i];
+    if (file->fd >= 0) {
+      close(file->fd);
+    }
+    for (j = 0; j < file->extentCount; j++) {
+      free(file->extents[j].data);
+    }
+    free(file->extents);
+  }
+}
+
+/**
+ * Inspect many images, reading in batches
+ *
+ * Results are those of ImgOpen() and ImgInspect() on each image: count
+ * is the number of volumes found or an IMG_ERR_* code, IMG_ERR_IO when
+ * the image could not be opened.
+ *
+ * @param jobs Images; path and size set by the caller
+ * @param count Number of images
+ * @param options Engine, depth and threads
+ * @param stats Receives the engine used and the reads made
+ * @return IMG_OK, or IMG_ERR_MEMORY
+ */
+int ImgInspectBatch(
+  ImgJob *jobs,
+  int count,
+  const ImgBatchOptions *options,
+  ImgBatchStats *stats
+) {
+  BatchFile *files;
+  BatchRead *reads;
+  ImgFile img;
+  ImgJob *job;
+  Uring ring;
+  int depth = options->depth > 0 ? options->depth : IMG_BATCH_DEPTH;
+  int threads = options->threads > 0 ? options->threads : IMG_BATCH_THREADS;
+  int start;
+  int i;
+
+  memset(stats, 0, sizeof(ImgBatchStats));
+  ring.fd = -1;
+
+  files = calloc(depth, sizeof(BatchFile));
+  reads = calloc((size_t)depth * IMG_MAX_MISSES, sizeof(BatchRead));
+  if (!files || !reads) {
+    free(files);
+    free(reads);
+    return IMG_ERR_MEMORY;
+  }
+
+  stats->engine = IMG_ENGINE_THREADS;
+#ifdef HAVE_URING
+  if (options->engine != IMG_ENGINE_THREADS &&
+      UringOpen(&ring, (unsigned)depth) == 0) {
+    stats->engine = IMG_ENGINE_URING;
+  }
+#endif
+
+  for (start = 0; start < count; start += depth) {
+    InspectWindow(files, &jobs[start], count - start < depth ?
+      count - start : depth, reads, &ring, threads, stats);
+  }
+
+#ifdef HAVE_URING
+  UringClose(&ring);
+#endif
+  free(files);
+  free(reads);
+
+  for (i = 0; i < count; i++) {
+    job = &jobs[i];
+    if (!job->compressed) {
+      continue;
+    }
+    if (ImgOpen(job->path, &img) != IMG_OK) {
+      job->count = IMG_ERR_IO;
+      continue;
+    }
+    job->count = ImgInspect(&img, job->volumes, IMG_MAX_VOLUMES);
+    job->inflated = img.inflated;
+    job->consumed = img.consumed;
+    ImgClose(&img);
+  }
+
+  return IMG_OK;
+}
+
+/**
+ * Name an engine, for reports
+ */
+const char *ImgEngineName(int engine) {
+  switch (engine) {
+    case IMG_ENGINE_URING:
+      return "io_uring";
+    case IMG_ENGINE_THREADS:
+      return "threads";
+    default:
+      return "auto";
+  }
+}
@@ -0,0 +1,76 @@
+/**
+ * imgbatch.h - Inspect many ADF and HDF images with batched reads
+ *
+ * ImgInspect() reads a handful of small blocks per image, each one found
+ * from the last, so inspecting images one after the other waits for
+ * every read in turn. Here a window of images is inspected together: the
+ * sectors of each that may hold a Rigid Disk Block are read, ImgInspect()
+ * runs on the cached bytes, and the reads it missed, from every image in
+ * the window, are issued as the next batch, until no image misses a read.
+ *
+ * A batch goes to io_uring, which keeps up to depth reads in flight from
+ * one thread, or to a pool of threads calling pread(). Gzip compressed
+ * images are inflated as a stream and are inspected one at a time.
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#ifndef IMGBATCH_H
+#define IMGBATCH_H
+
+#include "imgscan.h"
+
+/* Engines */
+#define IMG_ENGINE_AUTO     0   /* io_uring when the kernel has it */
+#define IMG_ENGINE_URING    1
+#define IMG_ENGINE_THREADS  2
+
+/* Defaults: reads in flight, which is also the images per window, and
+   threads of the pread() engine */
+#define IMG_BATCH_DEPTH     256
+#define IMG_BATCH_THREADS   16
+
+/* First read of each image, the sectors searched for a Rigid Disk Block */
+#define IMG_BATCH_HEAD      (IMG_RDB_LIMIT * IMG_SECTOR_SIZE)
+
+/* Most batches one window is given; each PART block needs one, and
+   ImgInspect() follows at most 64 */
+#define IMG_BATCH_ROUNDS    72
+
+/**
+ * One image to inspect, and what was found
+ */
+typedef struct ImgJob {
+  const char *path;
+  uint64_t size;                      /* From stat() */
+  int count;                          /* Volumes found, or IMG_ERR_* */
+  ImgVolume volumes[IMG_MAX_VOLUMES];
+  int compressed;
+  uint64_t inflated;                  /* Compressed images: as ImgFile */
+  uint64_t consumed;
+} ImgJob;
+
+/**
+ * How to read
+ */
+typedef struct ImgBatchOptions {
+  int engine;                         /* IMG_ENGINE_* */
+  int depth;                          /* 0 for IMG_BATCH_DEPTH */
+  int threads;                        /* 0 for IMG_BATCH_THREADS */
+} ImgBatchOptions;
+
+/**
+ * What the reads took
+ */
+typedef struct ImgBatchStats {
+  int engine;                         /* Engine used, never AUTO */
+  uint64_t reads;
+  uint64_t bytes;
+  int rounds;                         /* Most batches of any window */
+} ImgBatchStats;
+
+int ImgInspectBatch(ImgJob *jobs, int count, const ImgBatchOptions *options,
+  ImgBatchStats *stats);
+const char *ImgEngineName(int engine);
+
+#endif
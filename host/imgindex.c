@@ -0,0 +1,983 @@
+/**
+ * imgindex - Index the volumes in a collection of ADF and HDF images
+ *
+ * Builds a compact index of the volume name, DosType and creation date
+ * of every volume in every image (.adf, .hdf and their gzip compressed
+ * .adz, .hdz and .gz forms) below the given directories, sorted by
+ * volume name, and answers "which image holds volume X" by binary search
+ * over the mapped index, and "which images use PFS" by one pass over it.
+ * Rebuilding rescans only images whose size or modification time changed.
+ * Images are scanned with batched reads (see imgbatch.h); bench times
+ * that against scanning them one at a time, from a cold page cache.
+ *
+ * Usage:
+ *   imgindex build <index> <directory or image>...
+ *   imgindex volume <index> <name or prefix*>
+ *   imgindex dostype <index> <OFS|FFS|PFS|SFS|muFS|DOS\3|0x444f5303>
+ *   imgindex list <index>
+ *   imgindex bench [-j threads] [-q depth] <directory or image>...
+ *
+ * Returns 0 when something was found (or the index was written, or the
+ * benchmarked scans agreed), 1 when a query matched nothing (or the
+ * scans disagreed), 2 on errors.
+ *
+ * Compile with:
+ *   cc -O2 -Wall -pthread -o imgindex imgindex.c imgscan.c imgbatch.c -lz
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#include "imgbatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Index file, all values little endian */
+#define INDEX_MAGIC         0x58494443 /* "CDIX" */
+#define INDEX_VERSION       1
+#define INDEX_HEADER_SIZE   32
+#define INDEX_FILE_SIZE     24
+#define INDEX_VOLUME_SIZE   88
+
+/* Offsets in a volume record */
+#define VOL_NAME            0
+#define VOL_PARTITION       32
+#define VOL_DOSTYPE         64
+#define VOL_DAYS            68
+#define VOL_MINUTE          72
+#define VOL_TICK            76
+#define VOL_BLOCKSIZE       80
+#define VOL_FILE            84
+
+/* Offsets in a file record */
+#define FILE_PATH           0
+#define FILE_VOLUMES        4
+#define FILE_MTIME          8
+#define FILE_SIZE           16
+
+/* Seconds from 1970-01-01 to the AmigaDOS epoch 1978-01-01 */
+#define AMIGA_EPOCH         252460800
+
+/**
+ * One image in the collection, with its volumes
+ */
+typedef struct Image {
+  char *path;
+  int64_t mtime;                      /* Nanoseconds */
+  uint64_t size;
+  int volumeCount;
+  ImgVolume *volumes;
+} Image;
+
+/**
+ * A mapped index file
+ */
+typedef struct Index {
+  unsigned char *data;
+  size_t size;
+  uint32_t fileCount;
+  uint32_t volumeCount;
+  const unsigned char *files;
+  const unsigned char *volumes;
+  const char *strings;
+  uint32_t stringsSize;
+} Index;
+
+/**
+ * Growable list of images
+ */
+typedef struct ImageList {
+  Image *images;
+  int count;
+  int capacity;
+} ImageList;
+
+/* Volume sort key for qsort() */
+typedef struct SortVolume {
+  const ImgVolume *volume;
+  uint32_t file;
+} SortVolume;
+
+static uint32_t GetLE32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+    ((uint32_t)p[3] << 24);
+}
+
+static uint64_t GetLE64(const unsigned char *p) {
+  return (uint64_t)GetLE32(p) | ((uint64_t)GetLE32(p + 4) << 32);
+}
+
+static void PutLE32(unsigned char *p, uint32_t value) {
+  p[0] = (unsigned char)value;
+  p[1] = (unsigned char)(value >> 8);
+  p[2] = (unsigned char)(value >> 16);
+  p[3] = (unsigned char)(value >> 24);
+}
+
+static void PutLE64(unsigned char *p, uint64_t value) {
+  PutLE32(p, (uint32_t)value);
+  PutLE32(p + 4, (uint32_t)(value >> 32));
+}
+
+/**
+ * Check whether a file name has an image extension
+ */
+static int IsImageName(const char *name) {
+  const char *dot = strrchr(name, '.');
+
+  return dot && (strcasecmp(dot, ".adf") == 0 || strcasecmp(dot, ".hdf") == 0 ||
+    strcasecmp(dot, ".adz") == 0 || strcasecmp(dot, ".hdz") == 0 ||
+    strcasecmp(dot, ".gz") == 0);
+}
+
+/**
+ * Add an image to the list
+ *
+ * @return 0, or -1 when out of memory
+ */
+static int AddImage(ImageList *list, const char *path, const struct stat *st) {
+  Image *grown;
+  Image *image;
+
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    grown = realloc(list->images, list->capacity * sizeof(Image));
+    if (!grown) {
+      return -1;
+    }
+    list->images = grown;
+  }
+
+  image = &list->images[list->count];
+  memset(image, 0, sizeof(Image));
+  image->path = strdup(path);
+  if (!image->path) {
+    return -1;
+  }
+  image->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 +
+    st->st_mtim.tv_nsec;
+  image->size = (uint64_t)st->st_size;
+  list->count++;
+
+  return 0;
+}
+
+/**
+ * Collect the images in a directory tree, or a single image
+ *
+ * @return 0, or -1 when out of memory
+ */
+static int CollectImages(ImageList *list, const char *path) {
+  struct stat st;
+  struct dirent *entry;
+  DIR *dir;
+  char *child;
+  size_t len;
+  int rc = 0;
+
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "%s: cannot read\n", path);
+    return 0;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    return AddImage(list, path, &st);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return 0;
+  }
+
+  dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "%s: cannot read\n", path);
+    return 0;
+  }
+
+  while (rc == 0 && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    len = strlen(path) + strlen(entry->d_name) + 2;
+    child = malloc(len);
+    if (!child) {
+      rc = -1;
+      break;
+    }
+    snprintf(child, len, "%s/%s", path, entry->d_name);
+
+    if (stat(child, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        rc = CollectImages(list, child);
+      }
+      else if (S_ISREG(st.st_mode) && IsImageName(entry->d_name)) {
+        rc = AddImage(list, child, &st);
+      }
+    }
+    free(child);
+  }
+
+  closedir(dir);
+
+  return rc;
+}
+
+static int CompareImagePaths(const void *a, const void *b) {
+  return strcmp(((const Image *)a)->path, ((const Image *)b)->path);
+}
+
+/**
+ * Compare volume names as the index is sorted: ASCII case insensitive
+ */
+static int CompareNames(const char *a, const char *b, size_t length) {
+  size_t i;
+  int ca;
+  int cb;
+
+  for (i = 0; i < length; i++) {
+    ca = tolower((unsigned char)a[i]);
+    cb = tolower((unsigned char)b[i]);
+    if (ca != cb || !ca) {
+      return ca - cb;
+    }
+  }
+
+  return 0;
+}
+
+static int CompareSortVolumes(const void *a, const void *b) {
+  const SortVolume *va = a;
+  const SortVolume *vb = b;
+  int cmp = CompareNames(va->volume->name, vb->volume->name, IMG_NAME_SIZE);
+
+  if (cmp) {
+    return cmp;
+  }
+  return va->file < vb->file ? -1 : va->file > vb->file;
+}
+
+/**
+ * Map an index file
+ *
+ * @return 0, or -1 if it is missing or not a valid index
+ */
+static int OpenIndex(const char *path, Index *index) {
+  struct stat st;
+  uint32_t filesOffset;
+  uint32_t volumesOffset;
+  uint32_t stringsOffset;
+  int fd;
+
+  memset(index, 0, sizeof(Index));
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < INDEX_HEADER_SIZE) {
+    close(fd);
+    return -1;
+  }
+
+  index->size = (size_t)st.st_size;
+  index->data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (index->data == MAP_FAILED) {
+    index->data = NULL;
+    return -1;
+  }
+
+  index->fileCount = GetLE32(&index->data[8]);
+  index->volumeCount = GetLE32(&index->data[12]);
+  filesOffset = GetLE32(&index->data[16]);
+  volumesOffset = GetLE32(&index->data[20]);
+  stringsOffset = GetLE32(&index->data[24]);
+  index->stringsSize = GetLE32(&index->data[28]);
+
+  if (GetLE32(index->data) != INDEX_MAGIC ||
+      GetLE32(&index->data[4]) != INDEX_VERSION ||
+      filesOffset + (uint64_t)index->fileCount * INDEX_FILE_SIZE >
+        index->size ||
+      volumesOffset + (uint64_t)index->volumeCount * INDEX_VOLUME_SIZE >
+        index->size ||
+      stringsOffset + (uint64_t)index->stringsSize > index->size ||
+      (index->stringsSize && index->data[stringsOffset +
+        index->stringsSize - 1] != '\0')) {
+    munmap(index->data, index->size);
+    index->data = NULL;
+    return -1;
+  }
+
+  index->files = &index->data[filesOffset];
+  index->volumes = &index->data[volumesOffset];
+  index->strings = (const char *)&index->data[stringsOffset];
+
+  return 0;
+}
+
+static void CloseIndex(Index *index) {
+  if (index->data) {
+    munmap(index->data, index->size);
+    index->data = NULL;
+  }
+}
+
+/**
+ * Path of a file record, or "" if its offset is out of range
+ */
+static const char *IndexPath(const Index *index, uint32_t file) {
+  uint32_t offset;
+
+  if (file >= index->fileCount) {
+    return "";
+  }
+  offset = GetLE32(&index->files[file * INDEX_FILE_SIZE + FILE_PATH]);
+
+  return offset < index->stringsSize ? &index->strings[offset] : "";
+}
+
+/**
+ * Unpack a volume record
+ */
+static void IndexVolume(const Index *index, uint32_t i, ImgVolume *volume,
+    uint32_t *file) {
+  const unsigned char *record = &index->volumes[i * INDEX_VOLUME_SIZE];
+
+  memset(volume, 0, sizeof(ImgVolume));
+  memcpy(volume->name, &record[VOL_NAME], IMG_NAME_SIZE - 1);
+  memcpy(volume->partition, &record[VOL_PARTITION], IMG_NAME_SIZE - 1);
+  volume->dosType = GetLE32(&record[VOL_DOSTYPE]);
+  volume->days = (int32_t)GetLE32(&record[VOL_DAYS]);
+  volume->minute = (int32_t)GetLE32(&record[VOL_MINUTE]);
+  volume->tick = (int32_t)GetLE32(&record[VOL_TICK]);
+  volume->blockSize = GetLE32(&record[VOL_BLOCKSIZE]);
+  *file = GetLE32(&record[VOL_FILE]);
+}
+
+/**
+ * Take the volumes of unchanged images over from the previous index
+ *
+ * Both file tables are sorted by path, so one merge pass pairs them.
+ *
+ * @return Number of images reused, -1 when out of memory
+ */
+static int ReuseVolumes(ImageList *list, const Index *old) {
+  int *oldToNew;
+  ImgVolume volume;
+  Image *image;
+  const unsigned char *record;
+  uint32_t file;
+  uint32_t i;
+  int reused = 0;
+  int n = 0;
+  int cmp = 1;
+
+  oldToNew = malloc((old->fileCount ? old->fileCount : 1) * sizeof(int));
+  if (!oldToNew) {
+    return -1;
+  }
+
+  for (i = 0; i < old->fileCount; i++) {
+    oldToNew[i] = -1;
+    while (n < list->count &&
+        (cmp = strcmp(list->images[n].path, IndexPath(old, i))) < 0) {
+      n++;
+    }
+    if (n == list->count || cmp != 0) {
+      continue;
+    }
+
+    record = &old->files[i * INDEX_FILE_SIZE];
+    image = &list->images[n];
+    if ((int64_t)GetLE64(&record[FILE_MTIME]) == image->mtime &&
+        GetLE64(&record[FILE_SIZE]) == image->size) {
+      image->volumeCount = 0;
+      image->volumes = calloc(GetLE32(&record[FILE_VOLUMES]) + 1,
+        sizeof(ImgVolume));
+      if (!image->volumes) {
+        free(oldToNew);
+        return -1;
+      }
+      oldToNew[i] = n;
+      reused++;
+    }
+  }
+
+  for (i = 0; i < old->volumeCount; i++) {
+    IndexVolume(old, i, &volume, &file);
+    if (file < old->fileCount && oldToNew[file] >= 0) {
+      image = &list->images[oldToNew[file]];
+      image->volumes[image->volumeCount++] = volume;
+    }
+  }
+
+  free(oldToNew);
+
+  return reused;
+}
+
+/**
+ * Write the index to a temporary file and rename it into place
+ *
+ * @return 0, or -1 on errors
+ */
+static int WriteIndex(const char *path, const ImageList *list) {
+  unsigned char header[INDEX_HEADER_SIZE];
+  unsigned char record[INDEX_VOLUME_SIZE];
+  SortVolume *sorted;
+  char *tmpPath;
+  FILE *file;
+  uint32_t volumeCount = 0;
+  uint32_t stringsSize = 0;
+  uint32_t filesOffset = INDEX_HEADER_SIZE;
+  uint32_t volumesOffset;
+  uint32_t n = 0;
+  int i;
+  int v;
+  int ok = 1;
+
+  for (i = 0; i < list->count; i++) {
+    volumeCount += list->images[i].volumeCount;
+    stringsSize += strlen(list->images[i].path) + 1;
+  }
+  volumesOffset = filesOffset + list->count * INDEX_FILE_SIZE;
+
+  sorted = malloc((volumeCount ? volumeCount : 1) * sizeof(SortVolume));
+  tmpPath = malloc(strlen(path) + 5);
+  if (!sorted || !tmpPath) {
+    free(sorted);
+    free(tmpPath);
+    return -1;
+  }
+  for (i = 0; i < list->count; i++) {
+    for (v = 0; v < list->images[i].volumeCount; v++) {
+      sorted[n].volume = &list->images[i].volumes[v];
+      sorted[n].file = i;
+      n++;
+    }
+  }
+  qsort(sorted, volumeCount, sizeof(SortVolume), CompareSortVolumes);
+
+  sprintf(tmpPath, "%s.tmp", path);
+  file = fopen(tmpPath, "wb");
+  if (!file) {
+    free(sorted);
+    free(tmpPath);
+    return -1;
+  }
+
+  PutLE32(&header[0], INDEX_MAGIC);
+  PutLE32(&header[4], INDEX_VERSION);
+  PutLE32(&header[8], list->count);
+  PutLE32(&header[12], volumeCount);
+  PutLE32(&header[16], filesOffset);
+  PutLE32(&header[20], volumesOffset);
+  PutLE32(&header[24], volumesOffset + volumeCount * INDEX_VOLUME_SIZE);
+  PutLE32(&header[28], stringsSize);
+  ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+  stringsSize = 0;
+  for (i = 0; ok && i < list->count; i++) {
+    memset(record, 0, INDEX_FILE_SIZE);
+    PutLE32(&record[FILE_PATH], stringsSize);
+    PutLE32(&record[FILE_VOLUMES], list->images[i].volumeCount);
+    PutLE64(&record[FILE_MTIME], (uint64_t)list->images[i].mtime);
+    PutLE64(&record[FILE_SIZE], list->images[i].size);
+    ok = fwrite(record, INDEX_FILE_SIZE, 1, file) == 1;
+    stringsSize += strlen(list->images[i].path) + 1;
+  }
+
+  for (n = 0; ok && n < volumeCount; n++) {
+    memset(record, 0, sizeof(record));
+    memcpy(&record[VOL_NAME], sorted[n].volume->name, IMG_NAME_SIZE);
+    memcpy(&record[VOL_PARTITION], sorted[n].volume->partition, IMG_NAME_SIZE);
+    PutLE32(&record[VOL_DOSTYPE], sorted[n].volume->dosType);
+    PutLE32(&record[VOL_DAYS], (uint32_t)sorted[n].volume->days);
+    PutLE32(&record[VOL_MINUTE], (uint32_t)sorted[n].volume->minute);
+    PutLE32(&record[VOL_TICK], (uint32_t)sorted[n].volume->tick);
+    PutLE32(&record[VOL_BLOCKSIZE], sorted[n].volume->blockSize);
+    PutLE32(&record[VOL_FILE], sorted[n].file);
+    ok = fwrite(record, sizeof(record), 1, file) == 1;
+  }
+
+  for (i = 0; ok && i < list->count; i++) {
+    ok = fwrite(list->images[i].path, strlen(list->images[i].path) + 1, 1,
+      file) == 1;
+  }
+
+  if (fclose(file) != 0) {
+    ok = 0;
+  }
+  if (ok && rename(tmpPath, path) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    remove(tmpPath);
+  }
+
+  free(sorted);
+  free(tmpPath);
+
+  return ok ? 0 : -1;
+}
+
+/**
+ * Scan the given directories and write an index, reusing the volumes of
+ * images that did not change since the previous index
+ */
+static int Build(const char *indexPath, char **paths, int pathCount) {
+  ImageList list;
+  Index old;
+  ImgBatchOptions options;
+  ImgBatchStats stats;
+  ImgJob *jobs;
+  ImgJob *job;
+  Image *image;
+  uint32_t totalVolumes = 0;
+  uint64_t inflated = 0;
+  uint64_t consumed = 0;
+  uint64_t imageBytes = 0;
+  int compressed = 0;
+  int reused = 0;
+  int scanned = 0;
+  int failed = 0;
+  int count;
+  int i;
+  int rc = 0;
+
+  memset(&list, 0, sizeof(list));
+  for (i = 0; i < pathCount && rc == 0; i++) {
+    rc = CollectImages(&list, paths[i]);
+  }
+  if (rc != 0) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  qsort(list.images, list.count, sizeof(Image), CompareImagePaths);
+
+  if (OpenIndex(indexPath, &old) == 0) {
+    reused = ReuseVolumes(&list, &old);
+    CloseIndex(&old);
+    if (reused < 0) {
+      fprintf(stderr, "Out of memory\n");
+      return 2;
+    }
+  }
+
+  jobs = calloc(list.count + 1, sizeof(ImgJob));
+  if (!jobs) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  for (i = 0; i < list.count; i++) {
+    image = &list.images[i];
+    if (!image->volumes) {
+      jobs[scanned].path = image->path;
+      jobs[scanned].size = image->size;
+      scanned++;
+    }
+  }
+
+  memset(&options, 0, sizeof(options));
+  options.engine = IMG_ENGINE_AUTO;
+  if (ImgInspectBatch(jobs, scanned, &options, &stats) != IMG_OK) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+
+  job = jobs;
+  for (i = 0; i < list.count; i++) {
+    image = &list.images[i];
+    if (!image->volumes) {
+      count = job->count;
+      if (job->compressed) {
+        compressed++;
+        inflated += job->inflated;
+        consumed += job->consumed;
+        imageBytes += image->size;
+      }
+      if (count < 0) {
+        fprintf(stderr, "%s: %s\n", image->path, ImgErrorString(count));
+        failed++;
+        count = 0;
+      }
+
+      /* Unreadable images are indexed empty so they are not rescanned */
+      image->volumes = calloc(count + 1, sizeof(ImgVolume));
+      if (!image->volumes) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+      }
+      memcpy(image->volumes, job->volumes, count * sizeof(ImgVolume));
+      image->volumeCount = count;
+      job++;
+    }
+    totalVolumes += image->volumeCount;
+  }
+  free(jobs);
+
+  if (WriteIndex(indexPath, &list) != 0) {
+    fprintf(stderr, "%s: cannot write index\n", indexPath);
+    rc = 2;
+  }
+  else {
+    printf("Indexed %d images (%d unchanged, %d scanned, %d unreadable), "
+      "%u volumes\n", list.count, reused, scanned, failed, totalVolumes);
+    if (scanned) {
+      printf("Read %llu blocks (%llu KB) with %s in %d rounds\n",
+        (unsigned long long)stats.reads,
+        (unsigned long long)(stats.bytes / 1024),
+        ImgEngineName(stats.engine), stats.rounds);
+    }
+    if (compressed) {
+      printf("%d compressed images: read %llu of %llu KB, inflated %llu KB\n",
+        compressed, (unsigned long long)(consumed / 1024),
+        (unsigned long long)(imageBytes / 1024),
+        (unsigned long long)(inflated / 1024));
+    }
+  }
+
+  for (i = 0; i < list.count; i++) {
+    free(list.images[i].path);
+    free(list.images[i].volumes);
+  }
+  free(list.images);
+
+  return rc;
+}
+
+/**
+ * Drop the page cache of every image, so the next scan reads the disk
+ *
+ * Only clean pages of local files are dropped; a file server may still
+ * answer from its own cache.
+ */
+static void EvictImages(const ImageList *list) {
+  int fd;
+  int i;
+
+  for (i = 0; i < list->count; i++) {
+    fd = open(list->images[i].path, O_RDONLY);
+    if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+}
+
+static double NowMs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Check whether two scans of an image found the same volumes
+ */
+static int SameJob(const ImgJob *a, const ImgJob *b) {
+  const ImgVolume *va;
+  const ImgVolume *vb;
+  int i;
+
+  if (a->count != b->count) {
+    return 0;
+  }
+  for (i = 0; i < a->count; i++) {
+    va = &a->volumes[i];
+    vb = &b->volumes[i];
+    if (strcmp(va->name, vb->name) != 0 ||
+        strcmp(va->partition, vb->partition) != 0 ||
+        va->dosType != vb->dosType || va->days != vb->days ||
+        va->minute != vb->minute || va->tick != vb->tick ||
+        va->blockSize != vb->blockSize || va->offset != vb->offset) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Time scanning the images one at a time, with the pread() pool and with
+ * io_uring, each from a cold page cache, and check all three agree
+ */
+static int Bench(char **paths, int pathCount, int threads, int depth) {
+  static const int engines[] = { IMG_ENGINE_THREADS, IMG_ENGINE_URING };
+  ImageList list;
+  ImgBatchOptions options;
+  ImgBatchStats stats;
+  ImgFile img;
+  ImgJob *serial;
+  ImgJob *jobs;
+  double startMs;
+  double ms;
+  int mismatches = 0;
+  int e;
+  int i;
+  int rc = 0;
+
+  memset(&list, 0, sizeof(list));
+  for (i = 0; i < pathCount && rc == 0; i++) {
+    rc = CollectImages(&list, paths[i]);
+  }
+  if (rc == 0 && list.count == 0) {
+    fprintf(stderr, "No images found\n");
+    return 2;
+  }
+  serial = calloc(list.count, sizeof(ImgJob));
+  jobs = calloc(list.count, sizeof(ImgJob));
+  if (rc != 0 || !serial || !jobs) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  qsort(list.images, list.count, sizeof(Image), CompareImagePaths);
+
+  EvictImages(&list);
+  startMs = NowMs();
+  for (i = 0; i < list.count; i++) {
+    serial[i].path = list.images[i].path;
+    if (ImgOpen(serial[i].path, &img) != IMG_OK) {
+      serial[i].count = IMG_ERR_IO;
+      continue;
+    }
+    serial[i].count = ImgInspect(&img, serial[i].volumes, IMG_MAX_VOLUMES);
+    ImgClose(&img);
+  }
+  ms = NowMs() - startMs;
+  printf("%-9s %9.1f ms %10.1f images/s\n", "serial", ms,
+    list.count * 1e3 / ms);
+
+  for (e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+    for (i = 0; i < list.count; i++) {
+      jobs[i].path = list.images[i].path;
+      jobs[i].size = list.images[i].size;
+    }
+    options.engine = engines[e];
+    options.depth = depth;
+    options.threads = threads;
+
+    EvictImages(&list);
+    startMs = NowMs();
+    if (ImgInspectBatch(jobs, list.count, &options, &stats) != IMG_OK) {
+      fprintf(stderr, "Out of memory\n");
+      return 2;
+    }
+    ms = NowMs() - startMs;
+
+    if (stats.engine != engines[e]) {
+      printf("%-9s not available\n", ImgEngineName(engines[e]));
+      continue;
+    }
+    printf("%-9s %9.1f ms %10.1f images/s %8llu reads %3d rounds\n",
+      ImgEngineName(stats.engine), ms, list.count * 1e3 / ms,
+      (unsigned long long)stats.reads, stats.rounds);
+
+    for (i = 0; i < list.count; i++) {
+      if (!SameJob(&serial[i], &jobs[i])) {
+        fprintf(stderr, "%s: %s scan differs from serial scan\n",
+          jobs[i].path, ImgEngineName(stats.engine));
+        mismatches++;
+      }
+    }
+  }
+
+  printf("%d images, %s\n", list.count,
+    mismatches ? "scans disagree" : "all scans agree");
+
+  for (i = 0; i < list.count; i++) {
+    free(list.images[i].path);
+    free(list.images[i].volumes);
+  }
+  free(list.images);
+  free(serial);
+  free(jobs);
+
+  return mismatches ? 1 : 0;
+}
+
+/**
+ * Print one indexed volume
+ */
+static void PrintVolume(const Index *index, uint32_t i) {
+  ImgVolume volume;
+  uint32_t file;
+  char dosType[16];
+  char date[32];
+  time_t when;
+  struct tm *tm;
+
+  IndexVolume(index, i, &volume, &file);
+  ImgDosTypeName(volume.dosType, dosType, sizeof(dosType));
+
+  when = (time_t)volume.days * 86400 + volume.minute * 60 + volume.tick / 50 +
+    AMIGA_EPOCH;
+  tm = gmtime(&when);
+  if (tm && (volume.days || volume.minute)) {
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", tm);
+  }
+  else {
+    strcpy(date, "-");
+  }
+
+  printf("%-30s %-10s %-5s %-16s %s%s%s\n",
+    volume.name[0] ? volume.name : "(no name)", dosType,
+    ImgDosTypeFamily(volume.dosType), date, IndexPath(index, file),
+    volume.partition[0] ? " " : "", volume.partition);
+}
+
+/**
+ * Find volumes by name, or by prefix when the name ends in '*'
+ */
+static int QueryVolume(const Index *index, const char *name) {
+  const unsigned char *record;
+  size_t length = strlen(name);
+  uint32_t low = 0;
+  uint32_t high = index->volumeCount;
+  uint32_t mid;
+  uint32_t i;
+  int prefix = length > 0 && name[length - 1] == '*';
+  int found = 0;
+
+  if (prefix) {
+    length--;
+  }
+  else {
+    length++;                           /* Compare the terminator too */
+  }
+  if (length > IMG_NAME_SIZE) {
+    return 1;
+  }
+
+  /* First record not below the name */
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    record = &index->volumes[mid * INDEX_VOLUME_SIZE + VOL_NAME];
+    if (CompareNames((const char *)record, name, length) < 0) {
+      low = mid + 1;
+    }
+    else {
+      high = mid;
+    }
+  }
+
+  for (i = low; i < index->volumeCount; i++) {
+    record = &index->volumes[i * INDEX_VOLUME_SIZE + VOL_NAME];
+    if (CompareNames((const char *)record, name, length) != 0) {
+      break;
+    }
+    PrintVolume(index, i);
+    found++;
+  }
+
+  return found ? 0 : 1;
+}
+
+/**
+ * Find volumes by file system family or exact DosType
+ */
+static int QueryDosType(const Index *index, const char *query) {
+  static const char *families[] = { "OFS", "FFS", "PFS", "SFS", "muFS" };
+  uint32_t dosType = 0;
+  uint32_t value;
+  uint32_t i;
+  int exact = 1;
+  int found = 0;
+
+  /* PFS3 is how people name it; its DosTypes are PFS\1 to PDS\3 */
+  if (strcasecmp(query, "PFS3") == 0) {
+    query = "PFS";
+  }
+  for (i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+    if (strcasecmp(query, families[i]) == 0) {
+      exact = 0;
+    }
+  }
+  if (exact && ImgParseDosType(query, &dosType) != IMG_OK) {
+    fprintf(stderr, "Unknown DosType \"%s\"\n", query);
+    return 2;
+  }
+
+  for (i = 0; i < index->volumeCount; i++) {
+    value = GetLE32(&index->volumes[i * INDEX_VOLUME_SIZE + VOL_DOSTYPE]);
+    if (exact ? value == dosType :
+        strcasecmp(ImgDosTypeFamily(value), query) == 0) {
+      PrintVolume(index, i);
+      found++;
+    }
+  }
+
+  return found ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  Index index;
+  uint32_t i;
+  int threads = IMG_BATCH_THREADS;
+  int depth = IMG_BATCH_DEPTH;
+  int first;
+  int rc;
+
+  if (argc >= 4 && strcmp(argv[1], "build") == 0) {
+    return Build(argv[2], &argv[3], argc - 3);
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "bench") == 0) {
+    for (first = 2; first + 1 < argc; first += 2) {
+      if (strcmp(argv[first], "-j") == 0) {
+        threads = atoi(argv[first + 1]);
+      }
+      else if (strcmp(argv[first], "-q") == 0) {
+        depth = atoi(argv[first + 1]);
+      }
+      else {
+        break;
+      }
+    }
+    if (first < argc && threads > 0 && depth > 0) {
+      return Bench(&argv[first], argc - first, threads, depth);
+    }
+  }
+
+  if (argc < 3 || (strcmp(argv[1], "list") != 0 && argc < 4) ||
+      (strcmp(argv[1], "list") != 0 && strcmp(argv[1], "volume") != 0 &&
+       strcmp(argv[1], "dostype") != 0)) {
+    fprintf(stderr,
+      "Usage: imgindex build <index> <directory or image>...\n"
+      "       imgindex volume <index> <name or prefix*>\n"
+      "       imgindex dostype <index> <OFS|FFS|PFS|SFS|muFS|DOS\\3|0x...>\n"
+      "       imgindex list <index>\n"
+      "       imgindex bench [-j threads] [-q depth] <directory or image>...\n");
+    return 2;
+  }
+
+  if (OpenIndex(argv[2], &index) != 0) {
+    fprintf(stderr, "%s: not a valid index\n", argv[2]);
+    return 2;
+  }
+
+  if (strcmp(argv[1], "volume") == 0) {
+    rc = QueryVolume(&index, argv[3]);
+  }
+  else if (strcmp(argv[1], "dostype") == 0) {
+    rc = QueryDosType(&index, argv[3]);
+  }
+  else {
+    for (i = 0; i < index.volumeCount; i++) {
+      PrintVolume(&index, i);
+    }
+    rc = index.volumeCount ? 0 : 1;
+  }
+
+  CloseIndex(&index);
+
+  return rc;
+}
@@ -0,0 +1,753 @@
+/**
+ * imgscan.c - Read volume facts from ADF and HDF images on the host
+ *
+ * Block layouts follow the ones the Amiga side reads: the Rigid Disk
+ * Block and partition blocks of devices/hardblocks.h, the OFS/FFS root
+ * block (name and dates counted from the end of the block) and the PFS
+ * root block at sector 2 of the partition.
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#include "imgscan.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <zlib.h>
+
+/* Block ids */
+#define ID_RDSK             0x5244534B /* 'RDSK' */
+#define ID_PART             0x50415254 /* 'PART' */
+#define T_HEADER            2
+#define ST_ROOT             1
+
+/* Partition chain guard, against loops in broken RDBs */
+#define MAX_PARTITIONS      64
+
+/* Offsets in the partition block, see struct PartitionBlock */
+#define PART_NEXT           16
+#define PART_DRIVENAME      36
+#define PART_ENVIRONMENT    128
+
+/* DosEnvec indices (DE_* in dos/filehandler.h) */
+#define ENV_TABLESIZE       0
+#define ENV_SIZEBLOCK       1
+#define ENV_SURFACES        3
+#define ENV_SECPERBLK       4
+#define ENV_BLKSPERTRACK    5
+#define ENV_RESERVED        6
+#define ENV_LOWCYL          9
+#define ENV_HIGHCYL         10
+#define ENV_DOSTYPE         16
+
+/* PFS root block: disktype, options, datestamp, then these */
+#define PFS_ROOTBLOCK       2
+#define PFS_CREATIONDAY     12
+#define PFS_DISKNAME        20
+
+static uint32_t GetBE32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+    ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t GetBE16(const unsigned char *p) {
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/**
+ * Check a block whose longwords must sum to zero
+ *
+ * @param block Block data
+ * @param longs Number of longwords summed
+ * @return 1 if the checksum is right
+ */
+static int ChecksumOK(const unsigned char *block, uint32_t longs) {
+  uint32_t sum = 0;
+  uint32_t i;
+
+  for (i = 0; i < longs; i++) {
+    sum += GetBE32(&block[i * 4]);
+  }
+
+  return sum == 0;
+}
+
+/**
+ * Copy a BCPL string out of a block, replacing unprintable characters
+ *
+ * @param bstr Length byte followed by characters
+ * @param maxLength Most characters the field can hold
+ * @param buffer Receives the C string, IMG_NAME_SIZE bytes
+ */
+static void CopyName(const unsigned char *bstr, int maxLength, char *buffer) {
+  int len = bstr[0];
+  int i;
+
+  if (len > maxLength) {
+    len = maxLength;
+  }
+  if (len > IMG_NAME_SIZE - 1) {
+    len = IMG_NAME_SIZE - 1;
+  }
+  for (i = 0; i < len; i++) {
+    buffer[i] = isprint(bstr[i + 1]) ? (char)bstr[i + 1] : '?';
+  }
+  buffer[len] = '\0';
+}
+
+/**
+ * Set up streaming decompression of a gzip image
+ *
+ * The uncompressed size comes from the gzip trailer, which holds it
+ * modulo 4 GiB; that is only relied on for images without an RDB.
+ *
+ * @param img Image with file open
+ * @return IMG_OK, IMG_ERR_IO or IMG_ERR_MEMORY
+ */
+static int OpenCompressed(ImgFile *img) {
+  unsigned char trailer[4];
+  z_stream *stream;
+
+  if (fseeko(img->file, -4, SEEK_END) != 0 ||
+      fread(trailer, 1, 4, img->file) != 4 ||
+      fseeko(img->file, 0, SEEK_SET) != 0) {
+    return IMG_ERR_IO;
+  }
+  img->size = (uint32_t)trailer[0] | ((uint32_t)trailer[1] << 8) |
+    ((uint32_t)trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+
+  stream = calloc(1, sizeof(z_stream));
+  img->input = malloc(IMG_INPUT_SIZE);
+  img->skip = malloc(IMG_SKIP_SIZE);
+  img->head = malloc(IMG_HEAD_SIZE);
+  if (!stream || !img->input || !img->skip || !img->head) {
+    free(stream);
+    return IMG_ERR_MEMORY;
+  }
+
+  /* 16 + MAX_WBITS: expect a gzip header */
+  if (inflateInit2(stream, 16 + MAX_WBITS) != Z_OK) {
+    free(stream);
+    return IMG_ERR_MEMORY;
+  }
+  img->stream = stream;
+  img->compressed = 1;
+
+  return IMG_OK;
+}
+
+/**
+ * Open an image for block reads, compressed or not
+ *
+ * @param path Image file
+ * @param img Receives the open image
+ * @return IMG_OK, IMG_ERR_IO or IMG_ERR_MEMORY
+ */
+int ImgOpen(const char *path, ImgFile *img) {
+  unsigned char magic[2];
+  long long size;
+  int rc;
+
+  memset(img, 0, sizeof(ImgFile));
+
+  img->file = fopen(path, "rb");
+  if (!img->file) {
+    return IMG_ERR_IO;
+  }
+
+  if (fread(magic, 1, 2, img->file) == 2 && magic[0] == 0x1F &&
+      magic[1] == 0x8B) {
+    rc = OpenCompressed(img);
+    if (rc != IMG_OK) {
+      ImgClose(img);
+    }
+    return rc;
+  }
+
+  if (fseeko(img->file, 0, SEEK_END) != 0 ||
+      (size = ftello(img->file)) < 0) {
+    ImgClose(img);
+    return IMG_ERR_IO;
+  }
+  img->size = (uint64_t)size;
+
+  return IMG_OK;
+}
+
+/**
+ * Set up an image whose reads come from extents read beforehand
+ *
+ * @param img Receives the image
+ * @param size Image size
+ * @param extents Bytes already read
+ * @param extentCount Number of extents
+ */
+void ImgOpenCached(
+  ImgFile *img,
+  uint64_t size,
+  const ImgExtent *extents,
+  int extentCount
+) {
+  memset(img, 0, sizeof(ImgFile));
+  img->size = size;
+  img->cached = 1;
+  img->extents = extents;
+  img->extentCount = extentCount;
+}
+
+/**
+ * Close an image
+ */
+void ImgClose(ImgFile *img) {
+  if (img->stream) {
+    inflateEnd(img->stream);
+    free(img->stream);
+    img->stream = NULL;
+  }
+  free(img->input);
+  free(img->skip);
+  free(img->head);
+  img->input = NULL;
+  img->skip = NULL;
+  img->head = NULL;
+
+  if (img->file) {
+    fclose(img->file);
+    img->file = NULL;
+  }
+}
+
+/**
+ * Inflate the next bytes of a compressed image
+ *
+ * Everything that passes below IMG_HEAD_SIZE is also kept in the head,
+ * so rereading the RDB area never restarts the stream.
+ *
+ * @param img Compressed image
+ * @param out Receives the data
+ * @param length Bytes wanted
+ * @return Bytes produced; fewer than length at the end of the data
+ */
+static uint32_t InflateNext(ImgFile *img, unsigned char *out, uint32_t length) {
+  z_stream *stream = img->stream;
+  uint32_t produced;
+  size_t got;
+  int zrc;
+
+  stream->next_out = out;
+  stream->avail_out = length;
+
+  while (stream->avail_out) {
+    if (!stream->avail_in) {
+      got = fread(img->input, 1, IMG_INPUT_SIZE, img->file);
+      if (!got) {
+        break;
+      }
+      img->consumed += got;
+      stream->next_in = img->input;
+      stream->avail_in = (uInt)got;
+    }
+
+    zrc = inflate(stream, Z_NO_FLUSH);
+    if (zrc == Z_STREAM_END) {
+      /* Concatenated gzip members continue the data */
+      if (inflateReset(stream) != Z_OK) {
+        break;
+      }
+    }
+    else if (zrc != Z_OK && zrc != Z_BUF_ERROR) {
+      break;
+    }
+  }
+
+  produced = length - stream->avail_out;
+  if (img->position < IMG_HEAD_SIZE) {
+    memcpy(&img->head[img->position], out,
+      img->position + produced > IMG_HEAD_SIZE ?
+        IMG_HEAD_SIZE - img->position : produced);
+  }
+  img->position += produced;
+  img->inflated += produced;
+
+  return produced;
+}
+
+/**
+ * Read bytes from a compressed image
+ *
+ * Reads within the head are served from memory. Reads further on inflate
+ * forward to them, discarding what lies between through the skip buffer;
+ * a read behind the stream starts it over.
+ */
+static int ReadCompressed(
+  ImgFile *img,
+  uint64_t offset,
+  unsigned char *buffer,
+  uint32_t length
+) {
+  uint64_t gap;
+
+  if (offset + length <= IMG_HEAD_SIZE && offset + length <= img->position) {
+    memcpy(buffer, &img->head[offset], length);
+    return IMG_OK;
+  }
+
+  if (offset < img->position) {
+    if (inflateReset(img->stream) != Z_OK ||
+        fseeko(img->file, 0, SEEK_SET) != 0) {
+      return IMG_ERR_IO;
+    }
+    ((z_stream *)img->stream)->avail_in = 0;
+    img->position = 0;
+    img->restarts++;
+  }
+
+  while (img->position < offset) {
+    gap = offset - img->position;
+    if (gap > IMG_SKIP_SIZE) {
+      gap = IMG_SKIP_SIZE;
+    }
+    if (InflateNext(img, img->skip, (uint32_t)gap) != gap) {
+      return IMG_ERR_FORMAT;
+    }
+  }
+
+  return InflateNext(img, buffer, length) == length ? IMG_OK : IMG_ERR_FORMAT;
+}
+
+/**
+ * Read bytes from a cached image
+ *
+ * A read no extent covers is recorded in misses, once, and fails.
+ */
+static int ReadCached(
+  ImgFile *img,
+  uint64_t offset,
+  unsigned char *buffer,
+  uint32_t length
+) {
+  const ImgExtent *extent;
+  int i;
+
+  for (i = 0; i < img->extentCount; i++) {
+    extent = &img->extents[i];
+    if (offset >= extent->offset &&
+        offset + length <= extent->offset + extent->length) {
+      if (extent->error != IMG_OK) {
+        return extent->error;
+      }
+      memcpy(buffer, &extent->data[offset - extent->offset], length);
+      return IMG_OK;
+    }
+  }
+
+  for (i = 0; i < img->missCount; i++) {
+    if (img->misses[i].offset == offset && img->misses[i].length == length) {
+      return IMG_ERR_IO;
+    }
+  }
+  if (img->missCount < IMG_MAX_MISSES) {
+    img->misses[img->missCount].offset = offset;
+    img->misses[img->missCount].length = length;
+    img->missCount++;
+  }
+
+  return IMG_ERR_IO;
+}
+
+/**
+ * Read bytes from an image
+ *
+ * @param img Open image
+ * @param offset Byte offset
+ * @param buffer Receives the data
+ * @param length Bytes to read
+ * @return IMG_OK, IMG_ERR_FORMAT if the range lies outside the image,
+ *         IMG_ERR_IO on read errors
+ */
+int ImgRead(ImgFile *img, uint64_t offset, void *buffer, uint32_t length) {
+  if (img->compressed) {
+    return ReadCompressed(img, offset, buffer, length);
+  }
+
+  if (offset > img->size || length > img->size - offset) {
+    return IMG_ERR_FORMAT;
+  }
+
+  if (img->cached) {
+    return ReadCached(img, offset, buffer, length);
+  }
+
+  if (fseeko(img->file, (off_t)offset, SEEK_SET) != 0 ||
+      fread(buffer, 1, length, img->file) != length) {
+    return IMG_ERR_IO;
+  }
+
+  return IMG_OK;
+}
+
+/**
+ * Read the name and creation date from an OFS/FFS root block
+ *
+ * The root lies in the middle of the partition, at (reserved + last) / 2;
+ * the pointer in the boot block is tried when that is not a root block.
+ *
+ * @param img Open image
+ * @param volume Volume with offset and blockSize set
+ * @param length Partition size in bytes
+ * @param reserved Reserved blocks at the start of the partition
+ * @param boot Boot block of the partition
+ * @return IMG_OK if a root block was found
+ */
+static int ReadFFSRoot(
+  ImgFile *img,
+  ImgVolume *volume,
+  uint64_t length,
+  uint32_t reserved,
+  const unsigned char *boot
+) {
+  unsigned char *block;
+  uint32_t size = volume->blockSize;
+  uint64_t numBlocks = length / size;
+  uint64_t candidates[2];
+  int found = 0;
+  int i;
+
+  if (numBlocks < 2 || size < 512 || size > 65536) {
+    return IMG_ERR_FORMAT;
+  }
+
+  block = malloc(size);
+  if (!block) {
+    return IMG_ERR_MEMORY;
+  }
+
+  candidates[0] = (reserved + numBlocks - 1) / 2;
+  candidates[1] = GetBE32(&boot[8]);
+
+  for (i = 0; i < 2 && !found; i++) {
+    if (!candidates[i] || candidates[i] >= numBlocks ||
+        ImgRead(img, volume->offset + candidates[i] * size, block, size) !=
+          IMG_OK) {
+      continue;
+    }
+    if (GetBE32(block) != T_HEADER || GetBE32(&block[size - 4]) != ST_ROOT ||
+        !ChecksumOK(block, size / 4)) {
+      continue;
+    }
+
+    CopyName(&block[size - 80], 30, volume->name);
+    volume->days = (int32_t)GetBE32(&block[size - 28]);
+    volume->minute = (int32_t)GetBE32(&block[size - 24]);
+    volume->tick = (int32_t)GetBE32(&block[size - 20]);
+    found = 1;
+  }
+
+  free(block);
+
+  return found ? IMG_OK : IMG_ERR_FORMAT;
+}
+
+/**
+ * Read the name and creation date from a PFS root block
+ *
+ * @param img Open image
+ * @param volume Volume with offset set
+ * @return IMG_OK if a root block was found
+ */
+static int ReadPFSRoot(ImgFile *img, ImgVolume *volume) {
+  unsigned char block[IMG_SECTOR_SIZE];
+
+  if (ImgRead(img, volume->offset + PFS_ROOTBLOCK * IMG_SECTOR_SIZE, block,
+      sizeof(block)) != IMG_OK ||
+      (GetBE32(block) >> 8) != (volume->dosType >> 8)) {
+    return IMG_ERR_FORMAT;
+  }
+
+  CopyName(&block[PFS_DISKNAME], 31, volume->name);
+  volume->days = GetBE16(&block[PFS_CREATIONDAY]);
+  volume->minute = GetBE16(&block[PFS_CREATIONDAY + 2]);
+  volume->tick = GetBE16(&block[PFS_CREATIONDAY + 4]);
+
+  return IMG_OK;
+}
+
+/**
+ * Fill in a volume from the boot and root blocks of its partition
+ *
+ * @param img Open image
+ * @param volume Volume with offset, blockSize and the RDB DosType set
+ * @param length Partition size in bytes
+ * @param reserved Reserved blocks at the start of the partition
+ * @return IMG_OK if the partition holds a known file system
+ */
+static int InspectPartition(
+  ImgFile *img,
+  ImgVolume *volume,
+  uint64_t length,
+  uint32_t reserved
+) {
+  unsigned char boot[IMG_SECTOR_SIZE];
+  uint32_t bootType;
+  uint32_t family;
+
+  if (ImgRead(img, volume->offset, boot, sizeof(boot)) != IMG_OK) {
+    return IMG_ERR_FORMAT;
+  }
+
+  /* The boot block says what the partition was formatted with */
+  bootType = GetBE32(boot);
+  family = bootType >> 8;
+  if (family == 0x444F53 || family == 0x504653 || family == 0x504453 ||
+      family == 0x534653 || family == 0x6D7546) {
+    volume->dosType = bootType;
+  }
+  else if (!volume->dosType) {
+    return IMG_ERR_FORMAT;
+  }
+
+  switch (volume->dosType >> 8) {
+    case 0x444F53:                      /* DOS, OFS and FFS */
+    case 0x6D7546:                      /* muF, multiuser FFS */
+      ReadFFSRoot(img, volume, length, reserved, boot);
+      break;
+    case 0x504653:                      /* PFS */
+    case 0x504453:                      /* PDS, PFS with direct SCSI */
+      ReadPFSRoot(img, volume);
+      break;
+  }
+
+  return IMG_OK;
+}
+
+/**
+ * Find the volumes in an image
+ *
+ * A Rigid Disk Block in the first IMG_RDB_LIMIT sectors makes it a disk
+ * image whose partitions are each inspected; otherwise the whole image is
+ * taken as one partition with 512 byte blocks (ADF or partition HDF).
+ * Partitions are inspected in disk order whatever the order of the RDB
+ * chain, so a compressed image is inflated in one forward pass.
+ *
+ * @param img Open image
+ * @param volumes Receives the volumes found
+ * @param maxVolumes Size of volumes
+ * @return Number of volumes, or an IMG_ERR_* code
+ */
+int ImgInspect(ImgFile *img, ImgVolume *volumes, int maxVolumes) {
+  unsigned char block[IMG_SECTOR_SIZE];
+  ImgVolume *volume;
+  uint32_t blockBytes = IMG_SECTOR_SIZE;
+  uint32_t partition = 0xFFFFFFFF;
+  uint32_t env[ENV_DOSTYPE + 1];
+  uint32_t tableSize;
+  uint32_t sectorSize;
+  uint32_t secPerBlock;
+  uint64_t cylinderBytes;
+  uint64_t lengths[MAX_PARTITIONS];
+  uint32_t reserved[MAX_PARTITIONS];
+  int order[MAX_PARTITIONS];
+  uint32_t longs;
+  int found = 0;
+  int count = 0;
+  int i;
+  int j;
+  int k;
+
+  /* Search for the RDB as the boot ROM does */
+  for (i = 0; i < IMG_RDB_LIMIT && !found; i++) {
+    if (ImgRead(img, (uint64_t)i * IMG_SECTOR_SIZE, block, sizeof(block)) !=
+        IMG_OK) {
+      break;
+    }
+    longs = GetBE32(&block[4]);
+    if (GetBE32(block) == ID_RDSK && longs >= 64 &&
+        longs <= IMG_SECTOR_SIZE / 4 && ChecksumOK(block, longs)) {
+      blockBytes = GetBE32(&block[16]);
+      partition = GetBE32(&block[28]);
+      found = 1;
+    }
+  }
+
+  if (!found) {
+    if (maxVolumes < 1) {
+      return 0;
+    }
+    memset(volumes, 0, sizeof(ImgVolume));
+    volumes->blockSize = IMG_SECTOR_SIZE;
+    return InspectPartition(img, volumes, img->size, 2) == IMG_OK ? 1 : 0;
+  }
+
+  if (blockBytes != IMG_SECTOR_SIZE) {
+    return IMG_ERR_FORMAT;
+  }
+
+  if (maxVolumes > MAX_PARTITIONS) {
+    maxVolumes = MAX_PARTITIONS;
+  }
+
+  for (i = 0; partition != 0xFFFFFFFF && i < MAX_PARTITIONS &&
+      count < maxVolumes; i++) {
+    if (ImgRead(img, (uint64_t)partition * blockBytes, block, sizeof(block)) !=
+        IMG_OK) {
+      break;
+    }
+    longs = GetBE32(&block[4]);
+    if (GetBE32(block) != ID_PART || longs > IMG_SECTOR_SIZE / 4 ||
+        !ChecksumOK(block, longs)) {
+      break;
+    }
+    partition = GetBE32(&block[PART_NEXT]);
+
+    memset(env, 0, sizeof(env));
+    tableSize = GetBE32(&block[PART_ENVIRONMENT]);
+    for (longs = 0; longs <= ENV_DOSTYPE && longs <= tableSize; longs++) {
+      env[longs] = GetBE32(&block[PART_ENVIRONMENT + longs * 4]);
+    }
+    if (tableSize < ENV_HIGHCYL || env[ENV_HIGHCYL] < env[ENV_LOWCYL]) {
+      continue;
+    }
+
+    volume = &volumes[count];
+    memset(volume, 0, sizeof(ImgVolume));
+    CopyName(&block[PART_DRIVENAME], 31, volume->partition);
+
+    sectorSize = env[ENV_SIZEBLOCK] * 4;
+    secPerBlock = tableSize >= ENV_SECPERBLK && env[ENV_SECPERBLK] ?
+      env[ENV_SECPERBLK] : 1;
+    cylinderBytes = (uint64_t)env[ENV_SURFACES] * env[ENV_BLKSPERTRACK] *
+      sectorSize;
+    volume->offset = env[ENV_LOWCYL] * cylinderBytes;
+    volume->blockSize = sectorSize * secPerBlock;
+    volume->dosType = tableSize >= ENV_DOSTYPE ? env[ENV_DOSTYPE] : 0;
+    lengths[count] = (env[ENV_HIGHCYL] - env[ENV_LOWCYL] + 1) * cylinderBytes;
+    reserved[count] = env[ENV_RESERVED];
+    count++;
+  }
+
+  /* Insertion sort by start; RDBs rarely hold more than a few */
+  for (i = 0; i < count; i++) {
+    for (j = i; j > 0 && volumes[order[j - 1]].offset > volumes[i].offset; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+  for (i = 0; i < count; i++) {
+    k = order[i];
+    InspectPartition(img, &volumes[k], lengths[k], reserved[k]);
+  }
+
+  return count;
+}
+
+/**
+ * Describe an IMG_ERR_* code
+ */
+const char *ImgErrorString(int error) {
+  switch (error) {
+    case IMG_OK:         return "ok";
+    case IMG_ERR_IO:     return "cannot read image";
+    case IMG_ERR_FORMAT: return "not an Amiga disk image";
+    case IMG_ERR_MEMORY: return "out of memory";
+    default:             return "unknown error";
+  }
+}
+
+/**
+ * Format a DosType the way Amiga tools show it, e.g. "DOS\3"
+ *
+ * @param dosType DosType
+ * @param buffer Receives the text, at least 16 bytes
+ * @param bufSize Buffer size
+ */
+void ImgDosTypeName(uint32_t dosType, char *buffer, int bufSize) {
+  unsigned char c[4];
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    c[i] = (unsigned char)(dosType >> (24 - i * 8));
+  }
+
+  for (i = 0; i < 3; i++) {
+    if (!isprint(c[i])) {
+      snprintf(buffer, bufSize, "0x%08x", dosType);
+      return;
+    }
+  }
+
+  if (isprint(c[3]) && !isdigit(c[3])) {
+    snprintf(buffer, bufSize, "%c%c%c%c", c[0], c[1], c[2], c[3]);
+  }
+  else {
+    snprintf(buffer, bufSize, "%c%c%c\\%d", c[0], c[1], c[2], c[3]);
+  }
+}
+
+/**
+ * Name the file system family of a DosType
+ *
+ * @param dosType DosType
+ * @return "OFS", "FFS", "PFS", "SFS", "muFS" or "unknown"
+ */
+const char *ImgDosTypeFamily(uint32_t dosType) {
+  switch (dosType >> 8) {
+    case 0x444F53:
+      return (dosType & 0xFF) <= 7 ? ((dosType & 1) ? "FFS" : "OFS") :
+        "unknown";
+    case 0x504653:
+    case 0x504453:
+      return "PFS";
+    case 0x534653:
+      return "SFS";
+    case 0x6D7546:
+      return "muFS";
+    default:
+      return "unknown";
+  }
+}
+
+/**
+ * Parse a DosType written as "DOS\3", "DOS3" or "0x444f5303"
+ *
+ * @param text Text to parse
+ * @param dosType Receives the DosType
+ * @return IMG_OK or IMG_ERR_FORMAT
+ */
+int ImgParseDosType(const char *text, uint32_t *dosType) {
+  char *end;
+  const char *last;
+  unsigned long value;
+
+  if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+    value = strtoul(text + 2, &end, 16);
+    if (*end || end == text + 2) {
+      return IMG_ERR_FORMAT;
+    }
+    *dosType = (uint32_t)value;
+    return IMG_OK;
+  }
+
+  if (strlen(text) < 4) {
+    return IMG_ERR_FORMAT;
+  }
+  last = text[3] == '\\' ? &text[4] : &text[3];
+  if (isdigit((unsigned char)*last)) {
+    value = strtoul(last, &end, 10);
+    if (*end || value > 255) {
+      return IMG_ERR_FORMAT;
+    }
+  }
+  else if (*last && !last[1]) {
+    value = (unsigned char)*last;
+  }
+  else {
+    return IMG_ERR_FORMAT;
+  }
+
+  *dosType = ((uint32_t)(unsigned char)text[0] << 24) |
+    ((uint32_t)(unsigned char)text[1] << 16) |
+    ((uint32_t)(unsigned char)text[2] << 8) | (uint32_t)value;
+
+  return IMG_OK;
+}
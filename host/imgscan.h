@@ -0,0 +1,109 @@
+/**
+ * imgscan.h - Read volume facts from ADF and HDF images on the host
+ *
+ * Finds the volumes in a floppy image (ADF), a partition image (HDF
+ * without RDB) or a whole disk image (HDF with a Rigid Disk Block) and
+ * reads each one's DosType, volume name and creation date from its boot
+ * and root blocks. Only those few blocks are read, never the whole image.
+ *
+ * Gzip compressed images (.adz, .hdz, .gz) are inflated as a stream
+ * through fixed size buffers, and only as far as the last block needed.
+ *
+ * A cached image reads only from extents the caller has already read.
+ * Reads that miss are recorded instead, so the caller can fetch them,
+ * for many images at once, and inspect again (see imgbatch.h).
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#ifndef IMGSCAN_H
+#define IMGSCAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Errors */
+#define IMG_OK              0
+#define IMG_ERR_IO          (-1)
+#define IMG_ERR_FORMAT      (-2)
+#define IMG_ERR_MEMORY      (-3)
+
+/* Most partitions read from one RDB */
+#define IMG_MAX_VOLUMES     32
+
+/* Volume name, BCPL limit of 30 characters plus terminator */
+#define IMG_NAME_SIZE       32
+
+/* Sector size of images; RDB, boot and PFS root blocks use it */
+#define IMG_SECTOR_SIZE     512
+
+/* Where a Rigid Disk Block may be, as the boot ROM searches */
+#define IMG_RDB_LIMIT       16
+
+/* Compressed images: input and skip buffers, and the kept head, which
+   covers the RDB, the partition blocks and the first boot blocks */
+#define IMG_INPUT_SIZE      16384
+#define IMG_SKIP_SIZE       16384
+#define IMG_HEAD_SIZE       65536
+
+/* Missed reads a cached image records per inspection */
+#define IMG_MAX_MISSES      8
+
+/**
+ * Bytes of an image read ahead of time, for cached images
+ */
+typedef struct ImgExtent {
+  uint64_t offset;
+  uint32_t length;
+  int error;                          /* IMG_OK, or IMG_ERR_IO if not read */
+  unsigned char *data;
+} ImgExtent;
+
+/**
+ * An open image; reads go through ImgRead()
+ */
+typedef struct ImgFile {
+  FILE *file;
+  uint64_t size;                      /* Gzip: from the trailer, mod 4 GiB */
+  int compressed;
+  void *stream;                       /* z_stream of a compressed image */
+  unsigned char *input;               /* IMG_INPUT_SIZE */
+  unsigned char *skip;                /* IMG_SKIP_SIZE */
+  unsigned char *head;                /* First IMG_HEAD_SIZE bytes */
+  uint64_t position;                  /* Uncompressed offset of the stream */
+  uint64_t inflated;                  /* Bytes inflated in total */
+  uint64_t consumed;                  /* Compressed bytes read in total */
+  uint32_t restarts;                  /* Backward reads past the head */
+  int cached;                         /* Reads come from extents only */
+  const ImgExtent *extents;
+  int extentCount;
+  ImgExtent misses[IMG_MAX_MISSES];   /* Reads not in extents, no data */
+  int missCount;
+} ImgFile;
+
+/**
+ * One volume found in an image
+ */
+typedef struct ImgVolume {
+  char name[IMG_NAME_SIZE];           /* Empty if the root was not readable */
+  char partition[IMG_NAME_SIZE];      /* RDB drive name, empty otherwise */
+  uint32_t dosType;                   /* Boot block, else RDB de_DosType */
+  int32_t days;                       /* Volume creation DateStamp */
+  int32_t minute;
+  int32_t tick;
+  uint32_t blockSize;                 /* File system block size */
+  uint64_t offset;                    /* Partition start in the image */
+} ImgVolume;
+
+int ImgOpen(const char *path, ImgFile *img);
+void ImgOpenCached(ImgFile *img, uint64_t size, const ImgExtent *extents,
+  int extentCount);
+void ImgClose(ImgFile *img);
+int ImgRead(ImgFile *img, uint64_t offset, void *buffer, uint32_t length);
+int ImgInspect(ImgFile *img, ImgVolume *volumes, int maxVolumes);
+const char *ImgErrorString(int error);
+void ImgDosTypeName(uint32_t dosType, char *buffer, int bufSize);
+const char *ImgDosTypeFamily(uint32_t dosType);
+int ImgParseDosType(const char *text, uint32_t *dosType);
+
+#endif
@@ -0,0 +1,613 @@
+/**
+ * scanbench - Model of the PATTERN scan under slow or hung handlers
+ *
+ * Replays the scheduling of the PATTERN scan of CheckDosDevice against a
+ * simulated DOS list in which handlers are given injected latency,
+ * failures or hangs, and reports how long the scan would take for each
+ * MAXINFLIGHT setting and which handlers TIMEOUT would abandon.
+ *
+ * This is a model, not the scan code: it mirrors ProbeScanItems() and
+ * WaitDiskInfo() with threads and a condition variable. Up to MAXINFLIGHT
+ * probes are outstanding, TIMEOUT counts from when the oldest outstanding
+ * probe was sent, and the first wait that times out abandons every
+ * outstanding probe and ends the scan. Each probe is a thread calling
+ * SimCheckDeviceStatus(), the stand-in for the ACTION_DISK_INFO round
+ * trip. It says nothing about whether the Amiga code times out correctly.
+ *
+ * Every scan is also replayed in virtual time from the latencies drawn
+ * for it. The handlers that replay abandons must be the ones the threaded
+ * scan abandoned. Scans where a reply and a deadline fall within
+ * CHECK_MARGIN_MS of each other could go either way and are not checked.
+ *
+ * Usage: scanbench [options] [snapshot]
+ *   -d N        Add N synthetic devices SIM100.. (default: 16 without a
+ *               snapshot)
+ *   -L PAT=SPEC Inject handler behaviour into devices matching PAT, e.g.
+ *               "SIM*=uniform:5-40" or "SIM103=hang" (repeatable, later
+ *               ones win; see SimParseLatency() for SPEC)
+ *   -j LIST     MAXINFLIGHT values to compare (default: 1,4,0; 0 = all)
+ *   -t MS       TIMEOUT per probe in milliseconds (default: 500, 0 = none)
+ *   -r N        Scans per setting (default: 5)
+ *   -s SEED     Random seed (default: 1)
+ *
+ * Returns 0, 1 if a scan abandoned other handlers than its replay, 2 on
+ * errors.
+ *
+ * Compile with:
+ *   cc -O2 -Wall -pthread -o scanbench scanbench.c simdos.c -lm
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#include "simdos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MAX_SETTINGS        8
+#define MAX_INJECTIONS      16
+
+/* Replies this close to a deadline may land on either side of it */
+#define CHECK_MARGIN_MS     5
+
+/* Item states, as ScanItem status in CheckDosDevice.c */
+#define ITEM_UNPROBED       0   /* Scan ended before it was sent */
+#define ITEM_SENT           1
+#define ITEM_REPLIED        2   /* Reply arrived, not yet collected */
+#define ITEM_COLLECTED      3
+#define ITEM_ABANDONED      4
+
+typedef struct Scan Scan;
+
+/**
+ * One device being probed
+ */
+typedef struct Item {
+  Scan *scan;
+  char name[108];
+  int state;                          /* ITEM_* */
+  int status;                         /* SimCheckDeviceStatus() result */
+  uint32_t seed;
+  double drawnNs;                     /* Reply time the seed will draw */
+  int drawnHung;                      /* The seed will draw a hang */
+  int expected;                       /* ITEM_* the replay ends in */
+  double replaySentNs;                /* Virtual send time in the replay */
+  double sentNs;
+  double repliedNs;
+  pthread_t thread;
+} Item;
+
+/**
+ * One scan, the host counterpart of the reply port and its items
+ */
+struct Scan {
+  const SimDosList *list;
+  Item *items;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t reply;
+  volatile int cancel;                /* Releases hung handlers */
+};
+
+/**
+ * Results of all scans with one setting
+ */
+typedef struct Totals {
+  double totalNs;
+  double worstNs;
+  long mounted;
+  long noDisk;
+  long failed;
+  long abandoned;
+  long unprobed;
+  long abandonedHung;
+  long abandonedSlow;                 /* Would have replied, after TIMEOUT */
+  long checked;                       /* Scans compared with their replay */
+  long mismatched;                    /* Items whose end differs */
+} Totals;
+
+static double NowNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Probe thread, stands in for a handler answering ACTION_DISK_INFO
+ */
+static void *ProbeThread(void *data) {
+  Item *item = data;
+  Scan *scan = item->scan;
+  char volume[256];
+  int status;
+
+  status = SimCheckDeviceStatus(scan->list, item->name, volume,
+    sizeof(volume), &item->seed, &scan->cancel);
+
+  pthread_mutex_lock(&scan->lock);
+  item->status = status;
+  item->repliedNs = NowNs();
+  if (item->state == ITEM_SENT) {
+    item->state = ITEM_REPLIED;
+    pthread_cond_signal(&scan->reply);
+  }
+  pthread_mutex_unlock(&scan->lock);
+
+  return NULL;
+}
+
+/**
+ * Wait for one reply like WaitDiskInfo(); called with the lock held
+ *
+ * @param scan Scan
+ * @param timeoutMs Timeout per probe, 0 for none
+ * @return 1 if a reply was collected, 0 on timeout
+ */
+static int WaitReply(Scan *scan, long timeoutMs) {
+  struct timespec deadline;
+  double oldestNs = 0;
+  double deadlineNs;
+  int i;
+
+  /* The timeout runs from the oldest outstanding probe */
+  for (i = 0; i < scan->count; i++) {
+    if (scan->items[i].state == ITEM_SENT &&
+        (!oldestNs || scan->items[i].sentNs < oldestNs)) {
+      oldestNs = scan->items[i].sentNs;
+    }
+  }
+  deadlineNs = oldestNs + timeoutMs * 1e6;
+  deadline.tv_sec = (time_t)(deadlineNs / 1e9);
+  deadline.tv_nsec = (long)(deadlineNs - deadline.tv_sec * 1e9);
+
+  for (;;) {
+    for (i = 0; i < scan->count; i++) {
+      if (scan->items[i].state == ITEM_REPLIED) {
+        scan->items[i].state = ITEM_COLLECTED;
+        return 1;
+      }
+    }
+
+    if (!timeoutMs) {
+      pthread_cond_wait(&scan->reply, &scan->lock);
+    }
+    else if (pthread_cond_timedwait(&scan->reply, &scan->lock,
+        &deadline) == ETIMEDOUT) {
+      /* A reply may have raced the timer */
+      for (i = 0; i < scan->count; i++) {
+        if (scan->items[i].state == ITEM_REPLIED) {
+          scan->items[i].state = ITEM_COLLECTED;
+          return 1;
+        }
+      }
+      return 0;
+    }
+  }
+}
+
+/**
+ * Replay a scan in virtual time from the drawn latencies
+ *
+ * Follows the same rules as RunScan() and WaitReply(), with every reply
+ * arriving exactly its drawn time after it was sent, and leaves the end
+ * state of each item in its expected field.
+ *
+ * @param scan Scan with drawn latencies
+ * @param maxInFlight Probes outstanding at once
+ * @param timeoutMs TIMEOUT per probe, 0 for none
+ * @return 1 if the replay is certain, 0 if a reply came within
+ *         CHECK_MARGIN_MS of a deadline
+ */
+static int ReplayScan(Scan *scan, int maxInFlight, long timeoutMs) {
+  double nowNs = 0;
+  double oldestNs;
+  double deadlineNs;
+  double replyNs;
+  Item *first;
+  Item *item;
+  int inFlight = 0;
+  int certain = 1;
+  int next = 0;
+  int i;
+
+  for (i = 0; i < scan->count; i++) {
+    scan->items[i].expected = ITEM_UNPROBED;
+  }
+
+  for (;;) {
+    if (next < scan->count && inFlight < maxInFlight) {
+      scan->items[next].expected = ITEM_SENT;
+      scan->items[next++].replaySentNs = nowNs;
+      inFlight++;
+      continue;
+    }
+    if (!inFlight) {
+      break;
+    }
+
+    /* The earliest reply against the oldest outstanding probe */
+    first = NULL;
+    replyNs = 0;
+    oldestNs = -1;
+    for (i = 0; i < next; i++) {
+      item = &scan->items[i];
+      if (item->expected != ITEM_SENT) {
+        continue;
+      }
+      if (oldestNs < 0 || item->replaySentNs < oldestNs) {
+        oldestNs = item->replaySentNs;
+      }
+      if (!item->drawnHung &&
+          (!first || item->replaySentNs + item->drawnNs < replyNs)) {
+        replyNs = item->replaySentNs + item->drawnNs;
+        first = item;
+      }
+    }
+
+    if (!timeoutMs) {
+      if (!first) {
+        break;  /* Only hangs left; main() rules this out */
+      }
+      first->expected = ITEM_COLLECTED;
+      nowNs = replyNs;
+      inFlight--;
+      continue;
+    }
+
+    deadlineNs = oldestNs + timeoutMs * 1e6;
+    if (first && replyNs > deadlineNs - CHECK_MARGIN_MS * 1e6 &&
+        replyNs < deadlineNs + CHECK_MARGIN_MS * 1e6) {
+      certain = 0;
+    }
+    if (first && replyNs <= deadlineNs) {
+      first->expected = ITEM_COLLECTED;
+      nowNs = replyNs;
+      inFlight--;
+      continue;
+    }
+
+    for (i = 0; i < next; i++) {
+      if (scan->items[i].expected == ITEM_SENT) {
+        scan->items[i].expected = ITEM_ABANDONED;
+      }
+    }
+    break;
+  }
+
+  return certain;
+}
+
+/**
+ * Scan every device once and add the outcome to the totals
+ *
+ * @param list Simulated list with injected latency
+ * @param maxInFlight Probes outstanding at once, 0 for all
+ * @param timeoutMs TIMEOUT per probe, 0 for none
+ * @param seed Seed for this scan
+ * @param totals Updated with the results
+ * @return 0, or -1 if threads could not be started
+ */
+static int RunScan(
+  const SimDosList *list,
+  int maxInFlight,
+  long timeoutMs,
+  uint32_t seed,
+  Totals *totals
+) {
+  Scan scan;
+  SimEntry *entry;
+  Item *item;
+  pthread_condattr_t attr;
+  uint32_t state;
+  uint32_t us;
+  int outcome;
+  int certain;
+  double startNs;
+  double endNs;
+  int inFlight = 0;
+  int sent = 0;
+  int timedOut = 0;
+  int next;
+  int i;
+
+  memset(&scan, 0, sizeof(scan));
+  scan.list = list;
+  scan.items = calloc(list->count ? list->count : 1, sizeof(Item));
+  if (!scan.items) {
+    return -1;
+  }
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);  /* As NowNs() */
+  pthread_cond_init(&scan.reply, &attr);
+  pthread_condattr_destroy(&attr);
+
+  for (entry = list->head; entry; entry = entry->next) {
+    if (entry->type != SIM_DLT_DEVICE || !entry->name[0]) {
+      continue;
+    }
+    item = &scan.items[scan.count++];
+    item->scan = &scan;
+    SimEntryName(entry, item->name, sizeof(item->name));
+    item->seed = (seed * 2654435761u) ^ (uint32_t)(scan.count * 40503u);
+    if (!item->seed) {
+      item->seed = 1;
+    }
+
+    /* The probe thread will draw the same from its own copy of the seed */
+    state = item->seed;
+    us = SimDrawLatency(&entry->latency, &state, &outcome);
+    item->drawnNs = us * 1e3;
+    item->drawnHung = outcome == SIM_STATUS_HUNG;
+  }
+
+  if (maxInFlight <= 0) {
+    maxInFlight = scan.count;
+  }
+  certain = ReplayScan(&scan, maxInFlight, timeoutMs);
+
+  startNs = NowNs();
+  pthread_mutex_lock(&scan.lock);
+
+  for (next = 0; next < scan.count && !timedOut; next++) {
+    while (inFlight >= maxInFlight) {
+      if (!WaitReply(&scan, timeoutMs)) {
+        timedOut = 1;
+        break;
+      }
+      inFlight--;
+    }
+    if (timedOut) {
+      break;
+    }
+
+    item = &scan.items[next];
+    item->state = ITEM_SENT;
+    item->sentNs = NowNs();
+    if (pthread_create(&item->thread, NULL, ProbeThread, item) != 0) {
+      item->state = ITEM_UNPROBED;
+      break;
+    }
+    sent = next + 1;
+    inFlight++;
+  }
+
+  while (inFlight > 0 && !timedOut) {
+    if (!WaitReply(&scan, timeoutMs)) {
+      timedOut = 1;
+      break;
+    }
+    inFlight--;
+  }
+
+  /* AbandonDiskInfo(): give up on everything still outstanding */
+  endNs = NowNs();
+  if (timedOut) {
+    for (i = 0; i < sent; i++) {
+      item = &scan.items[i];
+      if (item->state == ITEM_SENT) {
+        item->state = ITEM_ABANDONED;
+      }
+    }
+  }
+  scan.cancel = 1;
+  pthread_mutex_unlock(&scan.lock);
+
+  totals->totalNs += endNs - startNs;
+  if (endNs - startNs > totals->worstNs) {
+    totals->worstNs = endNs - startNs;
+  }
+
+  /* Released hung handlers and slow ones finish here, outside the timing */
+  for (i = 0; i < sent; i++) {
+    pthread_join(scan.items[i].thread, NULL);
+  }
+
+  if (certain) {
+    totals->checked++;
+    for (i = 0; i < scan.count; i++) {
+      item = &scan.items[i];
+      if ((item->state == ITEM_ABANDONED) !=
+          (item->expected == ITEM_ABANDONED) ||
+          (item->state == ITEM_UNPROBED) !=
+          (item->expected == ITEM_UNPROBED)) {
+        totals->mismatched++;
+      }
+    }
+  }
+
+  for (i = 0; i < scan.count; i++) {
+    item = &scan.items[i];
+    switch (item->state) {
+      case ITEM_UNPROBED:
+        totals->unprobed++;
+        break;
+      case ITEM_ABANDONED:
+        totals->abandoned++;
+        if (item->status == SIM_STATUS_HUNG) {
+          totals->abandonedHung++;
+        }
+        else {
+          totals->abandonedSlow++;
+        }
+        break;
+      default:
+        if (item->status == 0) {
+          totals->mounted++;
+        }
+        else if (item->status == 1) {
+          totals->noDisk++;
+        }
+        else {
+          totals->failed++;
+        }
+        break;
+    }
+  }
+
+  pthread_cond_destroy(&scan.reply);
+  pthread_mutex_destroy(&scan.lock);
+  free(scan.items);
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  SimDosList list;
+  SimLatency latency;
+  Totals totals;
+  const char *path = NULL;
+  const char *injections[MAX_INJECTIONS];
+  const char *p;
+  char pattern[108];
+  int settings[MAX_SETTINGS] = { 1, 4, 0 };
+  int settingCount = 3;
+  int injectionCount = 0;
+  int synthetic = -1;
+  int runs = 5;
+  long timeoutMs = 500;
+  uint32_t seed = 1;
+  int hangs = 0;
+  int mismatches = 0;
+  int result;
+  int matched;
+  int len;
+  int s;
+  int r;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      synthetic = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc &&
+        injectionCount < MAX_INJECTIONS) {
+      injections[injectionCount++] = argv[++i];
+    }
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      settingCount = 0;
+      for (p = argv[++i]; *p && settingCount < MAX_SETTINGS; ) {
+        settings[settingCount++] = atoi(p);
+        p = strchr(p, ',');
+        if (!p) {
+          break;
+        }
+        p++;
+      }
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      timeoutMs = atol(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+    }
+    else if (argv[i][0] != '-' && !path) {
+      path = argv[i];
+    }
+    else {
+      path = NULL;
+      runs = 0;
+      break;
+    }
+  }
+
+  if (runs <= 0 || timeoutMs < 0 || !settingCount) {
+    fprintf(stderr, "Usage: scanbench [-d devices] [-L pattern=spec]... "
+      "[-j maxinflight,...] [-t ms] [-r runs] [-s seed] [snapshot]\n");
+    return 2;
+  }
+
+  if (path) {
+    result = SimLoadSnapshot(path, &list);
+    if (result != SIM_OK) {
+      fprintf(stderr, "%s: %s\n", path, SimErrorString(result));
+      return 2;
+    }
+  }
+  else {
+    memset(&list, 0, sizeof(list));
+    if (synthetic < 0) {
+      synthetic = 16;
+    }
+  }
+  if (synthetic > 0 &&
+      SimAddDevices(&list, "SIM", "sim.device", 100, synthetic) != SIM_OK) {
+    fprintf(stderr, "Out of memory\n");
+    SimFreeList(&list);
+    return 2;
+  }
+
+  for (i = 0; i < injectionCount; i++) {
+    p = strchr(injections[i], '=');
+    len = p ? (int)(p - injections[i]) : 0;
+    if (!p || len == 0 || len >= (int)sizeof(pattern) ||
+        SimParseLatency(p + 1, &latency) != SIM_OK) {
+      fprintf(stderr, "Bad injection \"%s\"\n", injections[i]);
+      SimFreeList(&list);
+      return 2;
+    }
+    memcpy(pattern, injections[i], len);
+    pattern[len] = '\0';
+    matched = SimSetLatency(&list, pattern, &latency);
+    printf("%-20s %3d devices  %s\n", pattern, matched, p + 1);
+    if (latency.hangPercent) {
+      hangs = 1;
+    }
+  }
+
+  if (hangs && !timeoutMs) {
+    fprintf(stderr, "Injected hangs need a timeout (-t)\n");
+    SimFreeList(&list);
+    return 2;
+  }
+
+  printf("%u entries, timeout %ld ms, %d scans per setting\n\n", list.count,
+    timeoutMs, runs);
+  printf("Model of the scan's scheduling, not the scan code itself\n");
+  printf("%11s %9s %9s %7s %7s %6s %7s %8s %6s\n", "MaxInFlight",
+    "mean ms", "worst ms", "mounted", "nodisk", "failed", "hung",
+    "too slow", "unsent");
+
+  for (s = 0; s < settingCount; s++) {
+    memset(&totals, 0, sizeof(totals));
+    for (r = 0; r < runs; r++) {
+      if (RunScan(&list, settings[s], timeoutMs, seed + r, &totals) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        SimFreeList(&list);
+        return 2;
+      }
+    }
+
+    if (settings[s] > 0) {
+      printf("%11d", settings[s]);
+    }
+    else {
+      printf("%11s", "all");
+    }
+    printf(" %9.1f %9.1f %7ld %7ld %6ld %7ld %8ld %6ld\n",
+      totals.totalNs / runs / 1e6, totals.worstNs / 1e6, totals.mounted,
+      totals.noDisk, totals.failed, totals.abandonedHung,
+      totals.abandonedSlow, totals.unprobed);
+    if (totals.mismatched) {
+      printf("%11s %ld handlers abandoned other than the drawn latencies "
+        "say\n", "", totals.mismatched);
+      mismatches = 1;
+    }
+    else if (totals.checked < runs) {
+      printf("%11s %ld of %d scans too close to call, not checked\n", "",
+        runs - totals.checked, runs);
+    }
+  }
+
+  SimFreeList(&list);
+
+  return mismatches ? 1 : 0;
+}
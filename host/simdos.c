@@ -0,0 +1,790 @@
+/**
+ * simdos.c - Simulated AmigaDOS device list for offline replay
+ *
+ * The lookups deliberately follow the same steps as their counterparts
+ * in CheckDosDevice.c (walk the list, convert each BCPL name, compare)
+ * so timings reflect the Amiga code paths rather than a host-optimized
+ * data structure.
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#include "simdos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+
+/**
+ * Bounds checked big endian reader over a loaded file
+ */
+typedef struct Reader {
+  const unsigned char *data;
+  size_t size;
+  size_t pos;
+  int error;
+} Reader;
+
+static uint8_t GetByte(Reader *r) {
+  if (r->pos + 1 > r->size) {
+    r->error = 1;
+    return 0;
+  }
+  return r->data[r->pos++];
+}
+
+static uint16_t GetWord(Reader *r) {
+  uint16_t hi = GetByte(r);
+  return (uint16_t)((hi << 8) | GetByte(r));
+}
+
+static uint32_t GetLong(Reader *r) {
+  uint32_t hi = GetWord(r);
+  return (hi << 16) | GetWord(r);
+}
+
+/**
+ * Read a length prefixed string
+ *
+ * @param r Reader
+ * @param buffer Output buffer of 256 bytes
+ * @param bcpl Keep the length byte (BCPL layout) instead of terminating
+ */
+static void GetString(Reader *r, void *buffer, int bcpl) {
+  unsigned char *out = buffer;
+  uint8_t len = GetByte(r);
+
+  if (r->pos + len > r->size) {
+    r->error = 1;
+    len = 0;
+  }
+
+  if (bcpl) {
+    out[0] = len;
+    memcpy(&out[1], &r->data[r->pos], len);
+  }
+  else {
+    memcpy(out, &r->data[r->pos], len);
+    out[len] = '\0';
+  }
+  r->pos += len;
+}
+
+/**
+ * Unpack one record into an entry
+ *
+ * @param r Reader positioned after the record length
+ * @param entry Entry to fill
+ * @param end Offset of the end of the record
+ */
+static void ReadRecord(Reader *r, SimEntry *entry, size_t end) {
+  int i;
+
+  entry->type = GetByte(r);
+  entry->flags = GetByte(r);
+  entry->unit = -1;
+  entry->status = -1;
+  GetString(r, entry->name, 1);
+
+  switch (entry->type) {
+    case SIM_DLT_DEVICE:
+      GetString(r, entry->handler, 0);
+      entry->stackSize = (int32_t)GetLong(r);
+      entry->priority = (int32_t)GetLong(r);
+
+      if (entry->flags & SIM_CAPF_STARTUP) {
+        GetString(r, entry->driver, 1);
+        entry->unit = (int32_t)GetLong(r);
+        entry->startupFlags = GetLong(r);
+        entry->envecLongs = GetByte(r);
+        if (entry->envecLongs > SIM_ENVEC_LONGS) {
+          r->error = 1;
+          return;
+        }
+        for (i = 0; i < entry->envecLongs; i++) {
+          entry->envec[i] = GetLong(r);
+        }
+      }
+
+      if (entry->flags & SIM_CAPF_PROBED) {
+        entry->status = (int8_t)GetByte(r);
+        entry->diskType = (int32_t)GetLong(r);
+        entry->numBlocks = GetLong(r);
+        entry->numBlocksUsed = GetLong(r);
+        entry->bytesPerBlock = GetLong(r);
+        GetString(r, entry->volume, 0);
+      }
+      break;
+
+    case SIM_DLT_VOLUME:
+      entry->volumeDays = (int32_t)GetLong(r);
+      entry->volumeMinute = (int32_t)GetLong(r);
+      entry->volumeTick = (int32_t)GetLong(r);
+      entry->diskType = (int32_t)GetLong(r);
+      break;
+
+    default:
+      GetString(r, entry->target, 0);
+      break;
+  }
+
+  /* Later versions may append fields; skip them */
+  if (r->pos > end) {
+    r->error = 1;
+  }
+  r->pos = end;
+}
+
+/**
+ * Load a snapshot file into a simulated DOS list
+ *
+ * @param path File written by CheckDosDevice SNAPSHOT=<file>
+ * @param list Receives the entries in capture order
+ * @return SIM_OK or a SIM_ERR_* code
+ */
+int SimLoadSnapshot(const char *path, SimDosList *list) {
+  FILE *file;
+  long size;
+  unsigned char *data;
+  Reader r;
+  uint16_t version;
+  uint16_t headerSize;
+  uint32_t count;
+  uint32_t i;
+  uint16_t recordSize;
+  SimEntry *entry;
+  SimEntry *tail = NULL;
+
+  memset(list, 0, sizeof(SimDosList));
+
+  file = fopen(path, "rb");
+  if (!file) {
+    return SIM_ERR_IO;
+  }
+
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  data = malloc(size > 0 ? size : 1);
+  if (!data) {
+    fclose(file);
+    return SIM_ERR_MEMORY;
+  }
+
+  if (fread(data, 1, size, file) != (size_t)size) {
+    free(data);
+    fclose(file);
+    return SIM_ERR_IO;
+  }
+  fclose(file);
+
+  r.data = data;
+  r.size = size;
+  r.pos = 0;
+  r.error = 0;
+
+  if (GetLong(&r) != SIM_CAPTURE_MAGIC) {
+    free(data);
+    return SIM_ERR_FORMAT;
+  }
+
+  version = GetWord(&r);
+  headerSize = GetWord(&r);
+  if (version != SIM_CAPTURE_VERSION) {
+    free(data);
+    return SIM_ERR_VERSION;
+  }
+
+  count = GetLong(&r);
+  list->days = (int32_t)GetLong(&r);
+  list->minute = (int32_t)GetLong(&r);
+  list->tick = (int32_t)GetLong(&r);
+  r.pos = headerSize;
+
+  for (i = 0; i < count && !r.error; i++) {
+    recordSize = GetWord(&r);
+    if (r.error || r.pos + recordSize > r.size) {
+      r.error = 1;
+      break;
+    }
+
+    entry = calloc(1, sizeof(SimEntry));
+    if (!entry) {
+      free(data);
+      SimFreeList(list);
+      return SIM_ERR_MEMORY;
+    }
+
+    ReadRecord(&r, entry, r.pos + recordSize);
+
+    if (tail) {
+      tail->next = entry;
+    }
+    else {
+      list->head = entry;
+    }
+    tail = entry;
+    list->count++;
+  }
+
+  free(data);
+
+  if (r.error) {
+    SimFreeList(list);
+    return SIM_ERR_FORMAT;
+  }
+
+  return SIM_OK;
+}
+
+/**
+ * Free all entries of a simulated list
+ *
+ * @param list List to free
+ */
+void SimFreeList(SimDosList *list) {
+  SimEntry *entry = list->head;
+  SimEntry *next;
+
+  while (entry) {
+    next = entry->next;
+    free(entry);
+    entry = next;
+  }
+
+  list->head = NULL;
+  list->count = 0;
+}
+
+/**
+ * Describe a SimLoadSnapshot() error
+ *
+ * @param error SIM_ERR_* code
+ * @return Static description
+ */
+const char *SimErrorString(int error) {
+  switch (error) {
+    case SIM_OK:          return "ok";
+    case SIM_ERR_IO:      return "cannot read file";
+    case SIM_ERR_FORMAT:  return "not a CheckDosDevice snapshot or truncated";
+    case SIM_ERR_VERSION: return "unsupported snapshot version";
+    case SIM_ERR_MEMORY:  return "out of memory";
+    default:              return "unknown error";
+  }
+}
+
+/**
+ * Copy an entry's BCPL name into a C string
+ */
+void SimEntryName(const SimEntry *entry, char *buffer, int bufSize) {
+  int len = entry->name[0];
+
+  if (len >= bufSize) {
+    len = bufSize - 1;
+  }
+  memcpy(buffer, &entry->name[1], len);
+  buffer[len] = '\0';
+}
+
+/**
+ * Copy an entry's BCPL driver name into a C string
+ */
+void SimEntryDriver(const SimEntry *entry, char *buffer, int bufSize) {
+  int len = entry->driver[0];
+
+  if (len >= bufSize) {
+    len = bufSize - 1;
+  }
+  memcpy(buffer, &entry->driver[1], len);
+  buffer[len] = '\0';
+}
+
+/**
+ * Host counterpart of FindDosDevice()
+ *
+ * @param list Simulated list
+ * @param deviceName Name without colon
+ * @return Entry or NULL
+ */
+SimEntry *SimFindDosDevice(const SimDosList *list, const char *deviceName) {
+  SimEntry *entry;
+  char devName[108];
+  int len;
+
+  for (entry = list->head; entry; entry = entry->next) {
+    len = entry->name[0];
+    if (len > 0 && len < (int)sizeof(devName) - 1) {
+      memcpy(devName, &entry->name[1], len);
+      devName[len] = '\0';
+
+      if (strcasecmp(devName, deviceName) == 0) {
+        return entry;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Host counterpart of FindDeviceByDriverAndUnit() walking the list
+ *
+ * @param list Simulated list
+ * @param driverName Device driver name
+ * @param unitNum Unit number
+ * @return Entry or NULL
+ */
+SimEntry *SimFindDeviceByDriverAndUnit(
+  const SimDosList *list,
+  const char *driverName,
+  int32_t unitNum
+) {
+  SimEntry *entry;
+  char devName[108];
+  int len;
+
+  for (entry = list->head; entry; entry = entry->next) {
+    if (!(entry->flags & SIM_CAPF_STARTUP)) {
+      continue;
+    }
+
+    len = entry->driver[0];
+    if (len > 0 && len < (int)sizeof(devName) - 1) {
+      memcpy(devName, &entry->driver[1], len);
+      devName[len] = '\0';
+
+      if (strcasecmp(devName, driverName) == 0 && entry->unit == unitNum &&
+          entry->name[0] > 0) {
+        return entry;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Host counterpart of FindMatchingDevices() prefix matching
+ *
+ * @param list Simulated list
+ * @param pattern Pattern ending in '*'
+ * @return Number of matching entries
+ */
+int SimFindMatchingDevices(const SimDosList *list, const char *pattern) {
+  SimEntry *entry;
+  char devName[108];
+  int patLen = strlen(pattern);
+  int len;
+  int matches = 0;
+
+  if (patLen == 0 || pattern[patLen - 1] != '*') {
+    return 0;
+  }
+
+  for (entry = list->head; entry; entry = entry->next) {
+    len = entry->name[0];
+    if (len > 0 && len < (int)sizeof(devName) - 1) {
+      memcpy(devName, &entry->name[1], len);
+      devName[len] = '\0';
+
+      if (strncasecmp(devName, pattern, patLen - 1) == 0) {
+        matches++;
+      }
+    }
+  }
+
+  return matches;
+}
+
+/**
+ * Build the flat name table used by the shared snapshot lookups
+ *
+ * @param list Simulated list
+ * @param snapshot Receives the table
+ * @return SIM_OK or SIM_ERR_MEMORY
+ */
+int SimBuildSnapshot(const SimDosList *list, SimSnapshot *snapshot) {
+  SimEntry *entry;
+  SimSnapshotEntry *out;
+
+  snapshot->count = 0;
+  snapshot->entries = calloc(list->count ? list->count : 1,
+    sizeof(SimSnapshotEntry));
+  if (!snapshot->entries) {
+    return SIM_ERR_MEMORY;
+  }
+
+  for (entry = list->head; entry; entry = entry->next) {
+    out = &snapshot->entries[snapshot->count++];
+    SimEntryName(entry, out->name, sizeof(out->name));
+    SimEntryDriver(entry, out->driver, sizeof(out->driver));
+    out->unit = (entry->flags & SIM_CAPF_STARTUP) ? entry->unit : -1;
+    out->type = entry->type;
+    out->source = entry;
+  }
+
+  return SIM_OK;
+}
+
+/**
+ * Free a flat name table
+ */
+void SimFreeSnapshot(SimSnapshot *snapshot) {
+  free(snapshot->entries);
+  snapshot->entries = NULL;
+  snapshot->count = 0;
+}
+
+/**
+ * Host counterpart of SnapshotFindName()
+ */
+SimSnapshotEntry *SimSnapshotFindName(
+  const SimSnapshot *snapshot,
+  const char *name
+) {
+  uint32_t i;
+
+  for (i = 0; i < snapshot->count; i++) {
+    if (strcasecmp(snapshot->entries[i].name, name) == 0) {
+      return &snapshot->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Host counterpart of SnapshotFindUnit()
+ */
+SimSnapshotEntry *SimSnapshotFindUnit(
+  const SimSnapshot *snapshot,
+  const char *driverName,
+  int32_t unitNum
+) {
+  uint32_t i;
+  SimSnapshotEntry *entry;
+
+  for (i = 0; i < snapshot->count; i++) {
+    entry = &snapshot->entries[i];
+    if (entry->type == SIM_DLT_DEVICE && entry->unit == unitNum &&
+        strcasecmp(entry->driver, driverName) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Append synthetic devices, for runs without a captured snapshot
+ *
+ * Devices are named <prefix><unit>, use units firstUnit and up and have
+ * a mounted volume of the same name.
+ *
+ * @param list List to extend
+ * @param prefix Device name prefix, e.g. "SIM"
+ * @param driverName Driver of every device
+ * @param firstUnit Unit of the first device
+ * @param count Number of devices
+ * @return SIM_OK or SIM_ERR_MEMORY
+ */
+int SimAddDevices(
+  SimDosList *list,
+  const char *prefix,
+  const char *driverName,
+  int32_t firstUnit,
+  int count
+) {
+  SimEntry *tail = list->head;
+  SimEntry *entry;
+  char name[108];
+  int len;
+  int i;
+
+  while (tail && tail->next) {
+    tail = tail->next;
+  }
+
+  for (i = 0; i < count; i++) {
+    entry = calloc(1, sizeof(SimEntry));
+    if (!entry) {
+      return SIM_ERR_MEMORY;
+    }
+
+    snprintf(name, sizeof(name), "%s%d", prefix, (int)(firstUnit + i));
+    len = strlen(name);
+    entry->name[0] = (unsigned char)len;
+    memcpy(&entry->name[1], name, len);
+
+    len = strlen(driverName);
+    if (len > 255) {
+      len = 255;
+    }
+    entry->driver[0] = (unsigned char)len;
+    memcpy(&entry->driver[1], driverName, len);
+
+    entry->type = SIM_DLT_DEVICE;
+    entry->flags = SIM_CAPF_STARTUP | SIM_CAPF_PROBED;
+    entry->unit = firstUnit + i;
+    entry->status = 0;
+    entry->bytesPerBlock = 512;
+    strcpy(entry->volume, name);
+
+    if (tail) {
+      tail->next = entry;
+    }
+    else {
+      list->head = entry;
+    }
+    tail = entry;
+    list->count++;
+  }
+
+  return SIM_OK;
+}
+
+/**
+ * Parse an injected latency such as "uniform:2-40,fail:5,hang:1"
+ *
+ * Parts, all times in milliseconds:
+ *   fixed:MS         Every reply takes MS
+ *   uniform:MIN-MAX  Evenly spread between MIN and MAX
+ *   exp:MEAN[-CAP]   Exponential with mean MEAN, optionally capped
+ *   fail:PERCENT     Info() fails this often
+ *   hang[:PERCENT]   Never replies, always or this often
+ *
+ * @param spec Specification
+ * @param latency Receives the parsed values
+ * @return SIM_OK or SIM_ERR_FORMAT
+ */
+int SimParseLatency(const char *spec, SimLatency *latency) {
+  const char *p = spec;
+  char *end;
+  unsigned long a;
+  unsigned long b;
+
+  memset(latency, 0, sizeof(SimLatency));
+
+  while (*p) {
+    if (strncmp(p, "fixed:", 6) == 0) {
+      a = strtoul(p + 6, &end, 10);
+      latency->kind = SIM_LAT_FIXED;
+      latency->minUs = a * 1000;
+    }
+    else if (strncmp(p, "uniform:", 8) == 0) {
+      a = strtoul(p + 8, &end, 10);
+      if (*end != '-') {
+        return SIM_ERR_FORMAT;
+      }
+      b = strtoul(end + 1, &end, 10);
+      if (b < a) {
+        return SIM_ERR_FORMAT;
+      }
+      latency->kind = SIM_LAT_UNIFORM;
+      latency->minUs = a * 1000;
+      latency->maxUs = b * 1000;
+    }
+    else if (strncmp(p, "exp:", 4) == 0) {
+      a = strtoul(p + 4, &end, 10);
+      b = 0;
+      if (*end == '-') {
+        b = strtoul(end + 1, &end, 10);
+      }
+      latency->kind = SIM_LAT_EXP;
+      latency->minUs = a * 1000;
+      latency->maxUs = b * 1000;
+    }
+    else if (strncmp(p, "fail:", 5) == 0) {
+      latency->failPercent = strtoul(p + 5, &end, 10);
+    }
+    else if (strncmp(p, "hang", 4) == 0) {
+      end = (char *)p + 4;
+      latency->hangPercent = 100;
+      if (*end == ':') {
+        latency->hangPercent = strtoul(end + 1, &end, 10);
+      }
+    }
+    else {
+      return SIM_ERR_FORMAT;
+    }
+
+    if (*end == ',') {
+      end++;
+    }
+    else if (*end) {
+      return SIM_ERR_FORMAT;
+    }
+    p = end;
+  }
+
+  if (latency->failPercent > 100 || latency->hangPercent > 100) {
+    return SIM_ERR_FORMAT;
+  }
+
+  return SIM_OK;
+}
+
+/**
+ * Give every device matching a pattern the same handler behaviour
+ *
+ * @param list Simulated list
+ * @param pattern Device name, or prefix ending in '*'
+ * @param latency Behaviour to inject
+ * @return Number of devices changed
+ */
+int SimSetLatency(
+  SimDosList *list,
+  const char *pattern,
+  const SimLatency *latency
+) {
+  SimEntry *entry;
+  char devName[108];
+  int patLen = strlen(pattern);
+  int matches = 0;
+
+  for (entry = list->head; entry; entry = entry->next) {
+    if (entry->type != SIM_DLT_DEVICE) {
+      continue;
+    }
+    SimEntryName(entry, devName, sizeof(devName));
+
+    if (patLen > 0 && pattern[patLen - 1] == '*' ?
+        strncasecmp(devName, pattern, patLen - 1) == 0 :
+        strcasecmp(devName, pattern) == 0) {
+      entry->latency = *latency;
+      matches++;
+    }
+  }
+
+  return matches;
+}
+
+/**
+ * xorshift32; one state per probing thread keeps runs reproducible
+ *
+ * @param state Generator state, must not be 0
+ * @return Next value
+ */
+uint32_t SimRandom(uint32_t *state) {
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+
+  return x;
+}
+
+/**
+ * Draw one handler reply time and outcome
+ *
+ * @param latency Device behaviour
+ * @param state Generator state
+ * @param outcome Receives 0 for a normal reply, -1 for a failed Info()
+ *        or SIM_STATUS_HUNG
+ * @return Reply time in microseconds
+ */
+uint32_t SimDrawLatency(const SimLatency *latency, uint32_t *state, int *outcome) {
+  double u;
+  double us;
+
+  *outcome = 0;
+  if (latency->hangPercent && SimRandom(state) % 100 < latency->hangPercent) {
+    *outcome = SIM_STATUS_HUNG;
+    return 0;
+  }
+  if (latency->failPercent && SimRandom(state) % 100 < latency->failPercent) {
+    *outcome = -1;
+  }
+
+  switch (latency->kind) {
+    case SIM_LAT_FIXED:
+      return latency->minUs;
+    case SIM_LAT_UNIFORM:
+      return latency->minUs +
+        SimRandom(state) % (latency->maxUs - latency->minUs + 1);
+    case SIM_LAT_EXP:
+      u = (SimRandom(state) >> 8) / 16777216.0;
+      us = -log(1.0 - u) * latency->minUs;
+      if (latency->maxUs && us > latency->maxUs) {
+        us = latency->maxUs;
+      }
+      return (uint32_t)us;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Host counterpart of CheckDeviceStatus() with injected handler latency
+ *
+ * Blocks for the drawn reply time like the Lock()/Info() round trip
+ * would. A hung handler blocks until *cancel is set, which stands in for
+ * the caller abandoning the packet.
+ *
+ * @param list Simulated list
+ * @param deviceName Name without colon
+ * @param volumeName Receives the volume name
+ * @param volumeNameSize Buffer size
+ * @param state Generator state of the calling thread
+ * @param cancel Set by the caller to release a hung handler
+ * @return 0 volume, 1 no disk, -1 not found or Info() failed,
+ *         SIM_STATUS_HUNG if released through cancel
+ */
+int SimCheckDeviceStatus(
+  const SimDosList *list,
+  const char *deviceName,
+  char *volumeName,
+  int volumeNameSize,
+  uint32_t *state,
+  volatile int *cancel
+) {
+  SimEntry *entry;
+  struct timespec delay;
+  uint32_t us;
+  int outcome;
+
+  if (volumeName && volumeNameSize > 0) {
+    volumeName[0] = '\0';
+  }
+
+  entry = SimFindDosDevice(list, deviceName);
+  if (!entry || entry->type != SIM_DLT_DEVICE) {
+    return -1;
+  }
+
+  us = SimDrawLatency(&entry->latency, state, &outcome);
+
+  if (outcome == SIM_STATUS_HUNG) {
+    delay.tv_sec = 0;
+    delay.tv_nsec = 1000000;
+    while (!*cancel) {
+      nanosleep(&delay, NULL);
+    }
+    return SIM_STATUS_HUNG;
+  }
+
+  if (us) {
+    delay.tv_sec = us / 1000000;
+    delay.tv_nsec = (long)(us % 1000000) * 1000;
+    nanosleep(&delay, NULL);
+  }
+
+  if (outcome < 0) {
+    return -1;
+  }
+
+  if ((entry->flags & SIM_CAPF_PROBED) && entry->status != 0) {
+    return 1;
+  }
+  if (volumeName && volumeNameSize > 0) {
+    snprintf(volumeName, volumeNameSize, "%s", entry->volume);
+  }
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * simdos.h - Simulated AmigaDOS device list for offline replay
+ *
+ * Loads files written by "CheckDosDevice SNAPSHOT=<file>" into a linked
+ * list shaped like the DOS device list, with names kept as BCPL strings,
+ * and provides host versions of the CheckDosDevice lookups so their cost
+ * and results can be measured against real configurations.
+ *
+ * Each device can be given a handler latency distribution, failure rate
+ * or hang, which SimCheckDeviceStatus() applies in place of the Lock()
+ * and Info() round trip, to exercise timeouts and parallel probing.
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#ifndef SIMDOS_H
+#define SIMDOS_H
+
+#include <stdint.h>
+
+/* dn_Type values */
+#define SIM_DLT_DEVICE      0
+#define SIM_DLT_DIRECTORY   1
+#define SIM_DLT_VOLUME      2
+#define SIM_DLT_LATE        3
+#define SIM_DLT_NONBINDING  4
+
+/* Capture format, see WriteSnapshotFile() in CheckDosDevice.c */
+#define SIM_CAPTURE_MAGIC   0x43444453 /* 'CDDS' */
+#define SIM_CAPTURE_VERSION 1
+#define SIM_ENVEC_LONGS     20
+
+/* Record flags */
+#define SIM_CAPF_STARTUP    0x01
+#define SIM_CAPF_PROBED     0x02
+
+/* Load errors */
+#define SIM_OK              0
+#define SIM_ERR_IO          (-1)
+#define SIM_ERR_FORMAT      (-2)
+#define SIM_ERR_VERSION     (-3)
+#define SIM_ERR_MEMORY      (-4)
+
+/* Envec indices (DE_* in dos/filehandler.h) */
+#define SIM_DE_TABLESIZE    0
+#define SIM_DE_SIZEBLOCK    1
+#define SIM_DE_NUMHEADS     3
+#define SIM_DE_BLKSPERTRACK 5
+#define SIM_DE_RESERVEDBLKS 6
+#define SIM_DE_LOWCYL       9
+#define SIM_DE_UPPERCYL     10
+#define SIM_DE_NUMBUFFERS   11
+#define SIM_DE_MAXTRANSFER  13
+#define SIM_DE_DOSTYPE      16
+
+/* Injected handler latency distributions */
+#define SIM_LAT_NONE        0
+#define SIM_LAT_FIXED       1
+#define SIM_LAT_UNIFORM     2
+#define SIM_LAT_EXP         3
+
+/* SimCheckDeviceStatus() result when the handler never replied */
+#define SIM_STATUS_HUNG     2
+
+/**
+ * How a simulated handler answers Lock()/Info()
+ */
+typedef struct SimLatency {
+  int kind;                           /* SIM_LAT_* */
+  uint32_t minUs;                     /* Fixed, uniform low end, exp mean */
+  uint32_t maxUs;                     /* Uniform high end, exp cap (0: none) */
+  uint32_t failPercent;               /* Info() fails */
+  uint32_t hangPercent;               /* Handler never replies */
+} SimLatency;
+
+/**
+ * One simulated DOS list entry
+ */
+typedef struct SimEntry {
+  struct SimEntry *next;
+  uint32_t type;                      /* SIM_DLT_* */
+  uint8_t flags;                      /* SIM_CAPF_* */
+  unsigned char name[256];            /* BCPL: length byte + characters */
+  /* Devices */
+  char handler[256];
+  int32_t stackSize;
+  int32_t priority;
+  unsigned char driver[256];          /* BCPL, like fssm_Device */
+  int32_t unit;
+  uint32_t startupFlags;
+  uint8_t envecLongs;
+  uint32_t envec[SIM_ENVEC_LONGS];
+  int8_t status;                      /* 0 = volume, 1 = no disk, -1 = n/a */
+  int32_t diskType;
+  uint32_t numBlocks;
+  uint32_t numBlocksUsed;
+  uint32_t bytesPerBlock;
+  char volume[256];
+  /* Volumes */
+  int32_t volumeDays;
+  int32_t volumeMinute;
+  int32_t volumeTick;
+  /* Assigns */
+  char target[256];
+  /* Injected behaviour, see SimSetLatency() */
+  SimLatency latency;
+} SimEntry;
+
+/**
+ * Simulated DOS list as loaded from a snapshot file
+ */
+typedef struct SimDosList {
+  SimEntry *head;
+  uint32_t count;
+  int32_t days;                       /* When it was captured */
+  int32_t minute;
+  int32_t tick;
+} SimDosList;
+
+/**
+ * Flat name table, the host counterpart of the shared DeviceSnapshot
+ */
+typedef struct SimSnapshotEntry {
+  char name[32];
+  char driver[32];
+  int32_t unit;
+  uint32_t type;
+  SimEntry *source;
+} SimSnapshotEntry;
+
+typedef struct SimSnapshot {
+  uint32_t count;
+  SimSnapshotEntry *entries;
+} SimSnapshot;
+
+int SimLoadSnapshot(const char *path, SimDosList *list);
+void SimFreeList(SimDosList *list);
+const char *SimErrorString(int error);
+void SimEntryName(const SimEntry *entry, char *buffer, int bufSize);
+void SimEntryDriver(const SimEntry *entry, char *buffer, int bufSize);
+
+SimEntry *SimFindDosDevice(const SimDosList *list, const char *deviceName);
+SimEntry *SimFindDeviceByDriverAndUnit(const SimDosList *list, const char *driverName, int32_t unitNum);
+int SimFindMatchingDevices(const SimDosList *list, const char *pattern);
+
+int SimBuildSnapshot(const SimDosList *list, SimSnapshot *snapshot);
+void SimFreeSnapshot(SimSnapshot *snapshot);
+SimSnapshotEntry *SimSnapshotFindName(const SimSnapshot *snapshot, const char *name);
+SimSnapshotEntry *SimSnapshotFindUnit(const SimSnapshot *snapshot, const char *driverName, int32_t unitNum);
+
+int SimAddDevices(SimDosList *list, const char *prefix, const char *driverName, int32_t firstUnit, int count);
+int SimParseLatency(const char *spec, SimLatency *latency);
+int SimSetLatency(SimDosList *list, const char *pattern, const SimLatency *latency);
+uint32_t SimRandom(uint32_t *state);
+uint32_t SimDrawLatency(const SimLatency *latency, uint32_t *state, int *outcome);
+int SimCheckDeviceStatus(const SimDosList *list, const char *deviceName, char *volumeName, int volumeNameSize, uint32_t *state, volatile int *cancel);
+
+#endif
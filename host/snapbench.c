@@ -0,0 +1,251 @@
+/**
+ * snapbench - Replay a CheckDosDevice snapshot and benchmark the lookups
+ *
+ * Loads a file written by "CheckDosDevice SNAPSHOT=<file>" into the
+ * simulated DOS list, checks that every lookup mode agrees on every
+ * entry, and reports the time per lookup for each mode.
+ *
+ * Usage: snapbench [-l] <snapshot> [iterations]
+ *   -l          List the replayed entries before benchmarking
+ *   iterations  Passes over all entries per mode (default: 1000)
+ *
+ * Returns 0 when all lookup modes agree, 1 on a mismatch, 2 on errors.
+ *
+ * Compile with:
+ *   cc -O2 -Wall -o snapbench snapbench.c simdos.c -lm
+ *
+ * @author Brielle Harrison <nyteshade@gmail.com>
+ */
+
+#include "simdos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Lookup modes measured */
+#define MODE_NAME_WALK      0   /* FindDosDevice() */
+#define MODE_UNIT_WALK      1   /* FindDeviceByDriverAndUnit() */
+#define MODE_NAME_SNAPSHOT  2   /* SnapshotFindName() */
+#define MODE_UNIT_SNAPSHOT  3   /* SnapshotFindUnit() */
+#define MODE_PATTERN        4   /* FindMatchingDevices() prefix */
+#define MODE_COUNT          5
+
+static const char *modeNames[MODE_COUNT] = {
+  "name (list walk)",
+  "driver+unit (list walk)",
+  "name (snapshot)",
+  "driver+unit (snapshot)",
+  "pattern prefix"
+};
+
+static double NowNs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *TypeName(uint32_t type) {
+  switch (type) {
+    case SIM_DLT_DEVICE:     return "device";
+    case SIM_DLT_DIRECTORY:  return "assign";
+    case SIM_DLT_VOLUME:     return "volume";
+    case SIM_DLT_LATE:       return "late";
+    case SIM_DLT_NONBINDING: return "nonbinding";
+    default:                 return "unknown";
+  }
+}
+
+/**
+ * Print the replayed list
+ */
+static void ListEntries(const SimDosList *list) {
+  SimEntry *entry;
+  char name[256];
+  char driver[256];
+
+  for (entry = list->head; entry; entry = entry->next) {
+    SimEntryName(entry, name, sizeof(name));
+    printf("%-10s %-20s", TypeName(entry->type), name);
+
+    if (entry->flags & SIM_CAPF_STARTUP) {
+      SimEntryDriver(entry, driver, sizeof(driver));
+      printf(" %s unit %d", driver, entry->unit);
+      if (entry->envecLongs > SIM_DE_DOSTYPE) {
+        printf(" dostype 0x%08x", entry->envec[SIM_DE_DOSTYPE]);
+      }
+    }
+    if (entry->flags & SIM_CAPF_PROBED) {
+      printf(entry->status == 0 ? " mounted \"%s\"" : " no disk", entry->volume);
+    }
+    if (entry->type != SIM_DLT_DEVICE && entry->type != SIM_DLT_VOLUME) {
+      printf(" -> %s", entry->target);
+    }
+    printf("\n");
+  }
+}
+
+/**
+ * Check that every lookup mode agrees with the plain list walk
+ *
+ * @return Number of mismatches
+ */
+static int Verify(const SimDosList *list, const SimSnapshot *snapshot) {
+  SimEntry *entry;
+  SimEntry *walk;
+  SimSnapshotEntry *snap;
+  char name[256];
+  char driver[256];
+  int mismatches = 0;
+
+  for (entry = list->head; entry; entry = entry->next) {
+    SimEntryName(entry, name, sizeof(name));
+    if (!name[0]) {
+      continue;
+    }
+
+    walk = SimFindDosDevice(list, name);
+    snap = SimSnapshotFindName(snapshot, name);
+    if (!walk || !snap || snap->source != walk) {
+      printf("MISMATCH name lookup for %s\n", name);
+      mismatches++;
+    }
+
+    if (entry->type == SIM_DLT_DEVICE && (entry->flags & SIM_CAPF_STARTUP)) {
+      SimEntryDriver(entry, driver, sizeof(driver));
+      walk = SimFindDeviceByDriverAndUnit(list, driver, entry->unit);
+      snap = SimSnapshotFindUnit(snapshot, driver, entry->unit);
+      if (!walk || !snap || snap->source != walk) {
+        printf("MISMATCH unit lookup for %s unit %d\n", driver, entry->unit);
+        mismatches++;
+      }
+    }
+  }
+
+  return mismatches;
+}
+
+/**
+ * Run one lookup mode over every entry
+ *
+ * @return Number of lookups performed
+ */
+static long RunMode(
+  int mode,
+  const SimDosList *list,
+  const SimSnapshot *snapshot,
+  long iterations,
+  volatile long *sink
+) {
+  SimEntry *entry;
+  char name[256];
+  char driver[256];
+  char pattern[8];
+  long lookups = 0;
+  long i;
+
+  for (i = 0; i < iterations; i++) {
+    for (entry = list->head; entry; entry = entry->next) {
+      SimEntryName(entry, name, sizeof(name));
+      SimEntryDriver(entry, driver, sizeof(driver));
+
+      switch (mode) {
+        case MODE_NAME_WALK:
+          *sink += SimFindDosDevice(list, name) != NULL;
+          break;
+        case MODE_UNIT_WALK:
+          if (!(entry->flags & SIM_CAPF_STARTUP)) {
+            continue;
+          }
+          *sink += SimFindDeviceByDriverAndUnit(list, driver,
+            entry->unit) != NULL;
+          break;
+        case MODE_NAME_SNAPSHOT:
+          *sink += SimSnapshotFindName(snapshot, name) != NULL;
+          break;
+        case MODE_UNIT_SNAPSHOT:
+          if (!(entry->flags & SIM_CAPF_STARTUP)) {
+            continue;
+          }
+          *sink += SimSnapshotFindUnit(snapshot, driver, entry->unit) != NULL;
+          break;
+        case MODE_PATTERN:
+          snprintf(pattern, sizeof(pattern), "%.3s*", name);
+          *sink += SimFindMatchingDevices(list, pattern);
+          break;
+      }
+      lookups++;
+    }
+  }
+
+  return lookups;
+}
+
+int main(int argc, char **argv) {
+  SimDosList list;
+  SimSnapshot snapshot;
+  const char *path = NULL;
+  long iterations = 1000;
+  int listEntries = 0;
+  int mismatches;
+  int result;
+  int mode;
+  int i;
+  long lookups;
+  double start;
+  double elapsed;
+  volatile long sink = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0) {
+      listEntries = 1;
+    }
+    else if (!path) {
+      path = argv[i];
+    }
+    else {
+      iterations = atol(argv[i]);
+    }
+  }
+
+  if (!path || iterations <= 0) {
+    fprintf(stderr, "Usage: snapbench [-l] <snapshot> [iterations]\n");
+    return 2;
+  }
+
+  result = SimLoadSnapshot(path, &list);
+  if (result != SIM_OK) {
+    fprintf(stderr, "%s: %s\n", path, SimErrorString(result));
+    return 2;
+  }
+
+  if (SimBuildSnapshot(&list, &snapshot) != SIM_OK) {
+    fprintf(stderr, "Out of memory\n");
+    SimFreeList(&list);
+    return 2;
+  }
+
+  printf("Replayed %u DOS list entries from %s\n", list.count, path);
+  if (listEntries) {
+    ListEntries(&list);
+  }
+
+  mismatches = Verify(&list, &snapshot);
+  printf("Verification: %s\n", mismatches ? "FAILED" : "all lookup modes agree");
+
+  printf("\n%-26s %12s %12s\n", "Lookup mode", "lookups", "ns/lookup");
+  for (mode = 0; mode < MODE_COUNT; mode++) {
+    start = NowNs();
+    lookups = RunMode(mode, &list, &snapshot, iterations, &sink);
+    elapsed = NowNs() - start;
+    printf("%-26s %12ld %12.1f\n", modeNames[mode], lookups,
+      lookups ? elapsed / lookups : 0.0);
+  }
+
+  SimFreeSnapshot(&snapshot);
+  SimFreeList(&list);
+
+  return mismatches ? 1 : 0;
+}
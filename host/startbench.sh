@@ -0,0 +1,296 @@
+#!/bin/sh
+#
+# startbench.sh - Launch-to-exit latency of CheckDosDevice under emulation
+#
+# Runs each given binary N times under the vamos AmigaOS emulator (from
+# amitools) and reports mean, p95 and minimum wall time per launch.
+# Most of a script's per-call cost is process startup, so this catches
+# regressions that the in-process BENCH option cannot see. A "floor" row
+# comes first: an empty program without C library or startup code,
+# written by this script, so the share of a launch spent in the C
+# library and the tool itself shows up next to it.
+#
+# Usage: startbench.sh [options] binary[=label] ...
+#   -n N        Runs per binary (default: 50)
+#   -a ARGS     Arguments passed to CheckDosDevice (default: none, which
+#               exercises startup, ReadArgs and the usage text only)
+#   -C CPU      vamos CPU type, e.g. 68000, 68020, 68060 (default: 68000)
+#   -o FILE     Write results as tab separated label/mean/p95/min in ms
+#   -c FILE     Compare means with an earlier -o file and exit 1 when
+#               any label got slower than the threshold
+#   -t PERCENT  Regression threshold for -c (default: 10)
+#   -U SYSDIR   Also time each binary loaded from disk and made resident
+#               under FS-UAE, booting SYSDIR (a Workbench 2.04+ directory
+#               tree) as Sys: next to a generated boot volume
+#   -K ROM      Kickstart ROM for -U
+#   -M MODEL    FS-UAE amiga_model for -U (default: A1200)
+#   -Q COMMAND  Amiga command that ends the boot script by quitting the
+#               emulator, C: being Sys:C (default: C:UAEquit)
+#
+# Examples:
+#   host/startbench.sh CheckDosDevice
+#   host/startbench.sh -C 68020 CheckDosDevice=dispatch \
+#     CheckDosDevice.020=direct
+#   host/startbench.sh -o release.tsv CheckDosDevice
+#   host/startbench.sh -c release.tsv CheckDosDevice
+#   host/startbench.sh -n 200 -U ~/Amiga/WB31 -K ~/Amiga/kick31.rom \
+#     CheckDosDevice
+#
+# Every timed vamos launch must end with the return code of the warm-up
+# launch, which must be 0, 5, 10 or 20; otherwise the binary is reported
+# as failed and the script exits 2. Timing needs nanoseconds from GNU
+# date (gdate from coreutils on BSD and macOS).
+#
+# vamos has no resident list, hence -U. FS-UAE is timed from the host as
+# a whole boot, so its rows give the mean only: a boot that runs the
+# binary N times, minus a boot that runs it never, divided by N. Use a
+# large N there; the boot itself varies by tens of milliseconds.
+#
+# @author Brielle Harrison <nyteshade@gmail.com>
+
+RUNS=50
+ARGS=""
+CPU=68000
+OUTFILE=""
+COMPARE=""
+THRESHOLD=10
+SYSDIR=""
+KICKSTART=""
+MODEL=A1200
+QUIT="C:UAEquit"
+
+usage() {
+  sed -n '3,48p' "$0" | sed 's/^# \{0,1\}//'
+  exit 2
+}
+
+while getopts "n:a:C:o:c:t:U:K:M:Q:" opt; do
+  case $opt in
+    n) RUNS=$OPTARG ;;
+    a) ARGS=$OPTARG ;;
+    C) CPU=$OPTARG ;;
+    o) OUTFILE=$OPTARG ;;
+    c) COMPARE=$OPTARG ;;
+    t) THRESHOLD=$OPTARG ;;
+    U) SYSDIR=$OPTARG ;;
+    K) KICKSTART=$OPTARG ;;
+    M) MODEL=$OPTARG ;;
+    Q) QUIT=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+[ $# -eq 0 ] && usage
+
+if ! command -v vamos >/dev/null 2>&1; then
+  echo "vamos not found; install amitools (pip install amitools)" >&2
+  exit 2
+fi
+
+if [ -n "$SYSDIR" ]; then
+  if ! command -v fs-uae >/dev/null 2>&1; then
+    echo "fs-uae not found; -U needs FS-UAE" >&2
+    exit 2
+  fi
+  if [ ! -d "$SYSDIR" ] || [ ! -f "$KICKSTART" ]; then
+    echo "-U needs a system directory and -K a Kickstart ROM" >&2
+    exit 2
+  fi
+  SYSDIR=$(cd "$SYSDIR" && pwd)
+  KICKSTART=$(cd "$(dirname "$KICKSTART")" && pwd)/$(basename "$KICKSTART")
+fi
+
+# BSD and macOS date print %N literally
+DATE=""
+for d in date gdate; do
+  case $($d +%s%N 2>/dev/null) in
+    ""|*[!0-9]*) ;;
+    *) DATE=$d; break ;;
+  esac
+done
+if [ -z "$DATE" ]; then
+  echo "date +%s%N does not give nanoseconds; install GNU coreutils" >&2
+  exit 2
+fi
+
+now_ns() {
+  $DATE +%s%N
+}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+[ -n "$OUTFILE" ] && : > "$OUTFILE"
+REGRESSED=0
+FAILED=0
+
+# The floor: HUNK_HEADER, one HUNK_CODE of "moveq #0,d0; rts", HUNK_END
+mkdir "$TMP/floor"
+printf '\0\0\3\363\0\0\0\0\0\0\0\1\0\0\0\0\0\0\0\0\0\0\0\1' \
+  > "$TMP/floor/floor"
+printf '\0\0\3\351\0\0\0\1\160\0\116\165\0\0\3\362' >> "$TMP/floor/floor"
+
+# report label mean p95 min: print a row, save it and compare it
+report() {
+  printf "%-24s %6d %10s %10s %10s\n" "$1" "$RUNS" "$2" "$3" "$4"
+  [ -n "$OUTFILE" ] &&
+    printf "%s\t%s\t%s\t%s\n" "$1" "$2" "$3" "$4" >> "$OUTFILE"
+
+  if [ -n "$COMPARE" ]; then
+    before=$(awk -F '\t' -v l="$1" '$1 == l { print $2 }' "$COMPARE")
+    if [ -n "$before" ]; then
+      verdict=$(awk -v a="$before" -v b="$2" -v t="$THRESHOLD" 'BEGIN {
+        d = (b - a) * 100 / a
+        printf "%+.1f%% %s", d, (d > t ? "REGRESSION" : "ok")
+      }')
+      echo "  vs $COMPARE: $before ms -> $2 ms ($verdict)"
+      case $verdict in
+        *REGRESSION) REGRESSED=1 ;;
+      esac
+    fi
+  fi
+}
+
+# bench_vamos dir name label: time RUNS launches of dir/name
+bench_vamos() {
+  samples="$TMP/$3.samples"
+  : > "$samples"
+
+  # One warm-up launch so host file caches do not skew the first sample;
+  # anything but a CheckDosDevice return code means vamos itself failed
+  (cd "$1" && vamos -C "$CPU" "$2" $ARGS >/dev/null 2>&1)
+  expected=$?
+  case $expected in
+    0|5|10|20) ;;
+    *)
+      printf "%-24s failed: exit status %d, run vamos by hand to see why\n" \
+        "$3" "$expected"
+      FAILED=1
+      return
+      ;;
+  esac
+
+  i=0
+  rc=$expected
+  while [ $i -lt "$RUNS" ]; do
+    start=$(now_ns)
+    (cd "$1" && vamos -C "$CPU" "$2" $ARGS >/dev/null 2>&1)
+    rc=$?
+    end=$(now_ns)
+    [ $rc -ne "$expected" ] && break
+    echo $(( (end - start) / 1000 )) >> "$samples"
+    i=$((i + 1))
+  done
+  if [ $rc -ne "$expected" ]; then
+    printf "%-24s failed: run %d exited with %d, warm-up with %d\n" \
+      "$3" $((i + 1)) "$rc" "$expected"
+    FAILED=1
+    return
+  fi
+
+  stats=$(sort -n "$samples" | awk '
+    { v[NR] = $1; sum += $1 }
+    END {
+      p = int(NR * 0.95 + 0.999); if (p < 1) p = 1; if (p > NR) p = NR
+      printf "%.2f %.2f %.2f", sum / NR / 1000, v[p] / 1000, v[1] / 1000
+    }')
+  report "$3" $stats
+}
+
+# boot_uae dir name runs resident: boot FS-UAE, run the binary runs
+# times, print the wall time in microseconds, or nothing if the boot
+# did not get to the end of its script
+boot_uae() {
+  boot="$TMP/boot"
+  rm -rf "$boot"
+  mkdir -p "$boot/S"
+  for f in "$1/$2" "$1/$2.020" "$1/$2.060"; do
+    [ -f "$f" ] && cp "$f" "$boot/"
+  done
+
+  {
+    echo "FailAt 21"
+    echo "Assign C: Sys:C"
+    echo "Assign L: Sys:L"
+    echo "Assign LIBS: Sys:Libs"
+    echo "Assign DEVS: Sys:Devs"
+    echo "Assign T: RAM:"
+    echo "CD Bench:"
+    [ "$4" = 1 ] && echo "Resident Bench:$2 PURE"
+    n=0
+    while [ $n -lt "$3" ]; do
+      echo "$2 $ARGS >NIL:"
+      n=$((n + 1))
+    done
+    echo "Echo >Bench:done \"done\""
+    echo "$QUIT"
+  } > "$boot/S/Startup-Sequence"
+
+  cat > "$TMP/bench.fs-uae" <<EOF
+[fs-uae]
+amiga_model = $MODEL
+kickstart_file = $KICKSTART
+hard_drive_0 = $boot
+hard_drive_0_label = Bench
+hard_drive_1 = $SYSDIR
+hard_drive_1_label = Sys
+hard_drive_1_priority = -1
+floppy_drive_volume = 0
+automatic_input_grab = 0
+EOF
+
+  start=$(now_ns)
+  fs-uae "$TMP/bench.fs-uae" >/dev/null 2>&1
+  end=$(now_ns)
+  [ -f "$boot/done" ] && echo $(( (end - start) / 1000 ))
+}
+
+# bench_uae dir name label: mean launch time loaded from disk and resident
+bench_uae() {
+  base=$(boot_uae "$1" "$2" 0 0)
+  if [ -z "$base" ]; then
+    printf "%-24s failed: FS-UAE did not finish its boot script\n" "$3 (uae)"
+    FAILED=1
+    return
+  fi
+  for resident in 0 1; do
+    label="$3 (uae disk)"
+    [ $resident = 1 ] && label="$3 (uae resident)"
+    total=$(boot_uae "$1" "$2" "$RUNS" $resident)
+    if [ -z "$total" ]; then
+      printf "%-24s failed: FS-UAE did not finish its boot script\n" "$label"
+      FAILED=1
+      continue
+    fi
+    mean=$(awk -v t="$total" -v b="$base" -v n="$RUNS" \
+      'BEGIN { printf "%.2f", (t - b) / n / 1000 }')
+    report "$label" "$mean" - -
+  done
+}
+
+printf "%-24s %6s %10s %10s %10s\n" "Binary" "runs" "mean ms" "p95 ms" "min ms"
+
+bench_vamos "$TMP/floor" floor floor
+
+for spec in "$@"; do
+  binary=${spec%%=*}
+  label=${spec#*=}
+  [ "$label" = "$spec" ] && label=$(basename "$binary")
+
+  if [ ! -f "$binary" ]; then
+    echo "$binary: not found" >&2
+    exit 2
+  fi
+
+  # vamos maps the binary's directory to PROGDIR:, so variants next to
+  # it are found by the dispatcher exactly as on a real machine
+  dir=$(cd "$(dirname "$binary")" && pwd)
+  name=$(basename "$binary")
+
+  bench_vamos "$dir" "$name" "$label"
+  [ -n "$SYSDIR" ] && bench_uae "$dir" "$name" "$label"
+done
+
+[ $FAILED -ne 0 ] && exit 2
+exit $REGRESSED